@@ -4,6 +4,38 @@
 #include "ns3/internet-module.h"
 #include "ns3/applications-module.h"
 #include "ns3/ipv4-global-routing-helper.h"
+#include "resultsStore.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <condition_variable>
+#include <deque>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <random>
+#include <set>
+#include <sstream>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <execinfo.h>
+#include <linux/perf_event.h>
+#include <malloc.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/un.h>
+#include <sys/wait.h>
 
 using namespace ns3;
 
@@ -27,9 +59,127 @@ using namespace ns3;
             Server       Server            Server       Server
  */
 
+/**
+ *  Use of one direction of a link, counted at the PHY of the device sending on it (see
+ *  traceTreeCounters): bytes and time spent transmitting frames. With --linkInterval the busy
+ *  time is also kept per interval of simulated time, buckets[i] for interval i.
+ */
+struct LinkDirectionUsage {
+  uint64_t bytes;
+  int64_t busy;      // nanoseconds
+  int64_t txStart;   // start of the frame being sent in nanoseconds, -1 if none
+  std::vector<uint64_t> buckets;
+
+  LinkDirectionUsage () : bytes (0), busy (0), txStart (-1) {}
+};
+
+/**
+ *  What networkTree() builds for one node: where it sits in the tree and the net devices
+ *  connecting it to its parent and to its leaves.
+ *
+ *  The depth is counted from the top, the client (root) is depth 0 and the server nodes are
+ *  at depth = levels. Nodes are referred to by their ns-3 node id.
+ */
+struct TreeNodeInfo {
+  Ptr<Node> node;
+  int depth;      // 0 for the root, levels for the server nodes
+  int parent;     // node id of the parent, -1 for the root
+  int leafIndex;  // position of this node among the leaves of its parent
+  Ptr<CsmaNetDevice> upDevice;                   // device towards the parent (0 for the root)
+  std::vector<Ptr<CsmaNetDevice> > downDevices;  // devices towards the leaves, in leaf order
+  std::vector<int> children;                     // node ids of the leaves, in leaf order
+  LinkDirectionUsage linkUsage[2];               // link to the parent, [0] down to this node and [1] up
+
+  TreeNodeInfo () : depth (-1), parent (-1), leafIndex (-1) {}
+};
+
+/**
+ *  The whole tree built by networkTree(), indexed by node id. Anything that needs to know
+ *  the level of a queue or the position of a node (metrics, tracing, ...) looks it up here
+ *  instead of walking the ns-3 objects again.
+ */
+struct TreeTopology {
+  int levels;     // number of levels below the root
+  int numLeaves;  // leaves per node
+  std::vector<TreeNodeInfo> nodes;
+
+  TreeTopology () : levels (0), numLeaves (0) {}
+
+  // Node id of the node at this position in the tree, -1 if there is no such node.
+  // A position is the leaf index at every level from the root, separated by dots ("2.0.1"),
+  // the root itself is "root" (or an empty position)
+  int Find (std::string position) const {
+    int id = 0;
+    if (position == "root" || position.empty ()) return id;
+    std::istringstream in (position);
+    std::string leaf;
+    while (std::getline (in, leaf, '.')) {
+      int index = atoi (leaf.c_str ());
+      if (leaf.empty () || index < 0 || index >= (int) nodes[id].children.size ()) return -1;
+      id = nodes[id].children[index];
+    }
+    return id;
+  }
+
+  // Position of a node in the tree, as understood by Find()
+  std::string PositionOf (int id) const {
+    if (nodes[id].parent < 0) return "root";
+    std::string position;
+    for (; nodes[id].parent >= 0; id = nodes[id].parent) {
+      std::ostringstream leaf;
+      leaf << nodes[id].leafIndex;
+      position = position.empty () ? leaf.str () : leaf.str () + "." + position;
+    }
+    return position;
+  }
+
+  // Record a node, parent = -1 for the root
+  TreeNodeInfo& Add (Ptr<Node> node, int parent, int leafIndex) {
+    uint32_t id = node->GetId ();
+    if (id >= nodes.size ()) nodes.resize (id + 1);
+    TreeNodeInfo& info = nodes[id];
+    info.node = node;
+    info.parent = parent;
+    info.leafIndex = leafIndex;
+    info.depth = parent < 0 ? 0 : nodes[parent].depth + 1;
+    if (parent >= 0) nodes[parent].children.push_back (id);
+    return info;
+  }
+};
+
+/**
+ *  One parent node and the leaves created under it, what one step of the recursion of
+ *  networkTree() builds, with the subnet of every parent-leaf link. The plan of a tree is a
+ *  list of these.
+ */
+struct TreeGroupPlan {
+  uint32_t parent;                   // node id of the parent
+  uint32_t firstLeaf;                // node id of the first leaf, the other leaves follow
+  int level;                         // 1 for the leaves being the server nodes
+  std::vector<std::string> subnets;  // subnet of the link to every leaf, "a.b.c.0" (/24)
+  std::vector<int> leafGroups;       // group (index in the plan) below every leaf, -1 if none
+};
+
+// A route computed from the plan, network 0.0.0.0 is the default route
+struct TreeRoutePlan {
+  uint32_t node;
+  Ipv4Address network;
+  Ipv4Address gateway;
+  uint32_t interface;
+};
+
+/**
+ *  Everything needed to build the tree, worked out before creating any ns-3 object: node ids,
+ *  subnets and (for --routing=tree) the routing tables. groups[0] is the group of the root.
+ */
+struct TreeBuildPlan {
+  std::vector<TreeGroupPlan> groups;
+  std::vector<TreeRoutePlan> routes;
+};
+
 /**
  *  Function to generate network topology as shown above, with an arbitrary number of
- *  levels or leave nodes. This function is recursive.
+ *  levels or leave nodes.
  *
  *  Ptr<Node> parent is the node to the network topology, it is equivalent to the motherNode
  *  illustrated above
@@ -40,8 +190,37 @@ using namespace ns3;
  *
  *  int level is the level of the network topology, level = 1 would be a parent node connected with
  *  numLeaves
+ *
+ *  TreeTopology* topology records every node created and the devices connecting it to its
+ *  parent and leaves, so the nodes can be found by their place in the tree afterwards
+ *
+ *  The tree is planned first (planTree()), then built in the order the nodes were always
+ *  created, one subtree after the other.
+ *
+ *  bool treeRoutes installs the static routes of the plan, routes to every subnet below a node
+ *  through the leaf leading to it and a default route to the parent, instead of leaving it to
+ *  Ipv4GlobalRoutingHelper::PopulateRoutingTables ()
+ *
+ *  std::string queueClasses is the class configuration of the device queues (a TreeClassQueue
+ *  on every port), empty keeps the single DropTail FIFO
+ *
+ *  Returns false, without building anything, if the tree does not fit in its addressing scheme
+ */
+bool networkTree(Ptr<Node> parent, int numLeaves, Ipv4InterfaceContainer* ipInterfaces, int level,
+                 TreeTopology* topology, bool treeRoutes, std::string queueClasses);
+
+/**
+ *  Function to plan the tree built by networkTree(): which node ids every group of leaves
+ *  gets, the subnet of every link and the routes of every node.
+ *
+ *  uint32_t parent and firstInterface are the node id of the parent and the index of the
+ *  IPv4 interface its first leaf link will get.
+ *
+ *  Returns false if an octet of the subnets "9 + level . branch . leaf + 1 . 0" would go past
+ *  255 (the branch octet counts the groups of leaves, so it is what runs out first), the
+ *  subnets would alias each other.
  */
-void networkTree(Ptr<Node> parent, int numLeaves, Ipv4InterfaceContainer* ipInterfaces, int level);
+bool planTree(uint32_t parent, uint32_t firstInterface, int numLeaves, int level, TreeBuildPlan* plan);
 
 /**
  *  Function to install a UDP server application on each server node that echo's back the
@@ -71,140 +250,7556 @@ void installUdpEchoServers(NodeContainer* leaves, int port, float start, float e
 void installUdpEchoClient(Ptr<Node> node, int port, Ipv4InterfaceContainer* ipInterfaces,
                           float start, float end);
 
-// Since this code uses recursion, using a global variable to specify a branch was useful
-static int branch = 1;
+/**
+ *  Compact description of a traffic pattern between the server nodes: which server the k-th
+ *  packet of a server goes to is computed when it is sent, so a pattern costs the same memory
+ *  (the list of server addresses, shared by everyone) whatever the number of pairs.
+ *
+ *    all-to-all   every server sends to every other server in turn, (source + 1 + k) mod N
+ *    permutation  every server sends to one other server, a random permutation of the servers
+ *                 (a single cycle, so nobody sends to itself) computed with a Feistel network
+ *    stride       every server sends to (source + stride) mod N
+ *    hotspot      a packet goes to the hotspot server with probability hotFraction, otherwise
+ *                 to a random server
+ */
+struct TrafficPattern {
+  enum Kind { ALL_TO_ALL, PERMUTATION, STRIDE, HOTSPOT };
+  Kind kind;
+  std::vector<Ipv4Address> servers;
+  uint32_t stride;
+  uint32_t hotspot;
+  double hotFraction;
+  uint64_t seed;
 
+  // Parse "all-to-all", "permutation", "stride" or "hotspot", false if it is none of them
+  bool SetKind (std::string name);
+  // Index of the server the k-th packet of server source goes to, random is in [0, 1)
+  uint32_t Destination (uint32_t source, uint64_t k, double random) const;
+  // Packets a server sends for one round of the pattern
+  uint32_t PacketsPerRound () const { return kind == ALL_TO_ALL ? servers.size () - 1 : 1; }
 
-NS_LOG_COMPONENT_DEFINE ("networkTree"); // Naming this script to enable logging (debugging)
+private:
+  uint64_t Permute (uint64_t x, bool inverse) const;
+};
 
-int main (int argc, char *argv[])
-{
-  LogComponentEnable ("networkTree", LOG_LEVEL_INFO); // Enable logging or debugging at the info level
+/**
+ *  Application sending the packets of a traffic pattern from one server node to the echo
+ *  servers of the others, and measuring the RTT of the echo replies. One is installed per
+ *  server, whatever the pattern, and it only keeps a packet counter: destinations come from
+ *  the shared TrafficPattern, the send time travels in the packet (SeqTsHeader).
+ */
+class PatternClient : public Application {
+public:
+  static TypeId GetTypeId (void);
+  PatternClient ();
 
-  NS_LOG_INFO ("Testing"); // Code reached here, should output "testing" on the shell
+  // The pattern (shared by all the clients) and the index of this server in it
+  void Setup (const TrafficPattern* pattern, uint32_t index);
+  // Use another random stream from now on, so clones of a simulation take different paths
+  void Reseed (int64_t stream) { m_random->SetStream (stream); }
 
-  // We need to log packet info of client node, which contains a UDP application
-  LogComponentEnable ("UdpEchoClientApplication", LOG_LEVEL_INFO);
+private:
+  virtual void StartApplication (void);
+  virtual void StopApplication (void);
+  void Send (void);
+  void HandleRead (Ptr<Socket> socket);
 
-  // uncomment line below to log server applications listening to packets and echoing them back
-  //LogComponentEnable ("UdpEchoServerApplication", LOG_LEVEL_INFO);
+  const TrafficPattern* m_pattern;
+  uint32_t m_index;
+  uint16_t m_port;
+  uint32_t m_size;
+  uint32_t m_rounds;
+  Time m_interval;
+  bool m_poisson;
+  uint64_t m_sent;
+  Ptr<Socket> m_socket;
+  Ptr<UniformRandomVariable> m_random;
+  EventId m_sendEvent;
+};
 
-  // There is a lot of congestion in this network topology, we need to increase the buffer size,
-  // otherwise packets will be dropped, we need to do this at the IP layer and the link layer,
-  // below increases buffer size to 1000 at the IP layer, as in, 1000 packets can be queued up
-  Config::SetDefault("ns3::ArpCache::PendingQueueSize", UintegerValue(1000));
+/**
+ *  Function to install a PatternClient on every server node.
+ *
+ *  TrafficPattern* pattern is the pattern to follow, its list of servers is filled here from
+ *  ipInterfaces (the server addresses, as for installUdpEchoClient())
+ *
+ *  int port is the port of the echo servers, rounds is how many times every client goes
+ *  through the pattern, with a packet every interval
+ *
+ *  float start, end is the start and end of the applications
+ *
+ *  Returns false (nothing installed) if the pattern cannot be followed with these servers: a
+ *  stride that is a multiple of their number, or a hotspot that is not one of them
+ */
+bool installPatternClients(TrafficPattern* pattern, Ipv4InterfaceContainer* ipInterfaces, int port,
+                           uint32_t rounds, Time interval, float start, float end);
 
-  Ptr<Node> client = CreateObject<Node> ();
+/**
+ *  sFlow-like monitoring agent of a router of the tree (--sflow). Every packet the router
+ *  receives is sampled with probability 1/rate, with random skips of mean rate counted per
+ *  interface as sFlow does, and the counters of every interface are polled every interval.
+ *  The records are text lines batched into datagrams of at most 1400 bytes, sent (UDP) to an
+ *  SflowCollector or written straight to a file (out of band), in the same format:
+ *
+ *    datagram <time ns> agent <address> seq <n> records <k>
+ *    flow if <i> rate <rate> pool <packets seen on i> src <a> dst <b> proto <p> sport <x> dport <y> length <bytes>
+ *    counters if <i> inOctets <n> inPackets <n> outOctets <n> outPackets <n> outDiscards <n>
+ *
+ *  The agent also counts exactly what it sees, per interface and per flow (source,
+ *  destination, protocol), as the ground truth to check an analysis of the records against
+ *  (see WriteTruth).
+ */
+class SflowAgent : public Application {
+public:
+  static TypeId GetTypeId (void);
+  SflowAgent ();
 
-  InternetStackHelper stack;
-  stack.Install (client);
+  // Send the datagrams to this collector, or write them to out when it is 0.0.0.0
+  void Setup (Ipv4Address agent, Ipv4Address collector, std::ostream* out);
+  // A packet the queue of an interface dropped, counted as an output discard
+  void CountDiscard (uint32_t interface) { m_interfaces[interface].outDiscards++; }
+  // Exact counts of the interfaces and flows, one line each, as "interface ..." and "flow ..."
+  void WriteTruth (std::ostream& out) const;
+  uint64_t GetSamples (void) const { return m_samples; }
+  uint64_t GetDatagrams (void) const { return m_datagrams; }
 
-  // We need to keep track of the IP addresses of the server nodes for the client to send
-  // packets to them, this can be done using a Ipv4InterfaceContainer var. The var ipInterfaces
-  // will be used to contain all the IP addresses of the server nodes.
-  Ipv4InterfaceContainer ipInterfaces;
+private:
+  virtual void StartApplication (void);
+  virtual void StopApplication (void);
+  void Received (Ptr<const Packet> packet, Ptr<Ipv4> ipv4, uint32_t interface);
+  void Sent (Ptr<const Packet> packet, Ptr<Ipv4> ipv4, uint32_t interface);
+  void PollCounters (void);
+  void Record (const std::string& record);
+  void Flush (void);
+  uint32_t NextSkip (void);
 
-  // Generate the topology with connections and IPv4 addresses
-  // here, each node has 3 leaves, and it is 2 levels long, so there should be 3*2 = 6 server nodes
-  // at the bottom, modify them to create the appropriate topology
-  networkTree(client, 3, &ipInterfaces, 2);
+  struct Interface {
+    uint64_t inOctets, inPackets, outOctets, outPackets, outDiscards;
+    uint32_t skip;   // packets until the next sample
+  };
+  struct Flow {
+    uint64_t packets, bytes;
+  };
 
-  // Install the UDP application on the client node and have these applications send a packet to
-  // all the server nodes
-  installUdpEchoClient(client, 9, &ipInterfaces, 2.0, 2000.0);
+  uint32_t m_rate;
+  Time m_interval;
+  uint16_t m_port;
+  Ipv4Address m_agent;
+  Ipv4Address m_collector;
+  std::ostream* m_out;
+  bool m_running;
+  std::vector<Interface> m_interfaces;
+  // (source << 32 | destination, protocol) -> exact counts
+  std::map<std::pair<uint64_t, uint8_t>, Flow> m_flows;
+  std::string m_records;   // records of the next datagram
+  uint32_t m_recordCount;
+  uint64_t m_samples;
+  uint64_t m_datagrams;
+  Ptr<Socket> m_socket;
+  Ptr<UniformRandomVariable> m_random;
+  EventId m_pollEvent;
+};
 
-  // Since this is dynamic routing and with a large network topology, populating the routing tables
-  // can take quite a long time. To simulate topology with 2 levels and 32 leaves at each level,
-  // there would be 32*32 = 1024 server nodes, it takes about 30 minutes to populate the tables.
-  NS_LOG_INFO ("Populating table");
-  Ipv4GlobalRoutingHelper::PopulateRoutingTables ();
-  NS_LOG_INFO ("Populating table done");
+/**
+ *  Application receiving the datagrams of the SflowAgents (UDP), written to a file as they
+ *  arrive, as the collector of a real network would get them.
+ */
+class SflowCollector : public Application {
+public:
+  static TypeId GetTypeId (void);
+  SflowCollector ();
 
-  Simulator::Stop (Seconds (200));
-  NS_LOG_INFO ("Simulation begins now");
-  Simulator::Run ();
-  NS_LOG_INFO ("Simulation ends");
-  Simulator::Destroy ();
-  return 0;
-}
+  void Setup (std::ostream* out) { m_out = out; }
+  uint64_t GetDatagrams (void) const { return m_datagrams; }
 
-void networkTree(Ptr<Node> parent, int numLeaves, Ipv4InterfaceContainer* ipInterfaces, int level) {
-  if (level > 0) { // Base case, only recursively create more connections if level > 0
-    // Create the nodes to be connected as leaves
-    NodeContainer leaves;
-    leaves.Create(numLeaves);
+private:
+  virtual void StartApplication (void);
+  virtual void StopApplication (void);
+  void HandleRead (Ptr<Socket> socket);
 
-    // Create the net devices on the nodes and a network channel connecting them
-    // according to the topology
-    // Create the variable to help create the net devices and connect nodes to channels
-    CsmaHelper csma;
-    // Increase the buffer size at the link layer
-    csma.SetQueue ("ns3::DropTailQueue", "MaxPackets", UintegerValue(1000));
-    // Set the typical Data Centre standard values
-    csma.SetChannelAttribute ("DataRate", StringValue ("1Gbps"));
-    csma.SetChannelAttribute ("Delay", StringValue ("1ms"));
+  uint16_t m_port;
+  std::ostream* m_out;
+  uint64_t m_datagrams;
+  Ptr<Socket> m_socket;
+};
 
-    // Connect the parent node to its leave nodes
-    std::vector<NetDeviceContainer> netC; // save them to assign IP addresses
-    for (int leaf = 0; leaf < leaves.GetN(); leaf++) {
-      netC.push_back( csma.Install( NodeContainer( parent, leaves.Get(leaf) ) ) );
-    }
+/**
+ *  Function to install an SflowAgent on every router of the tree (the nodes between the
+ *  client and the servers) and, unless collector is empty, an SflowCollector on the node at
+ *  that position (see TreeTopology::Find). Records go to out either way, through the
+ *  collector or directly.
+ *
+ *  uint32_t rate is the sampling rate (1 in rate packets), interval the time between two
+ *  counter polls, float start, end is the start and end of the applications.
+ *  Returns false if there is no node at the collector position, agents gets the agents
+ *  installed and collectorApp the collector (0 without one).
+ */
+bool installSflow(TreeTopology* topology, uint32_t rate, Time interval, std::string collector, std::ostream* out,
+                  float start, float end, std::vector<Ptr<SflowAgent> >* agents, Ptr<SflowCollector>* collectorApp);
 
-    // Set up the IP addresses to the leaves
-    InternetStackHelper stack;
-    stack.Install (leaves);
-    // Make sure level == 1 to ensure server nodes are installed at the bottom of the topology
-    if (level == 1) installUdpEchoServers(&leaves, 9, 1.0, 2000.0);
+/**
+ *  In-band network telemetry of the packets of an HpccSender (--hpcc). Every TreeClassQueue
+ *  a packet leaves stamps a hop with its queue length, the bytes it sent so far and the
+ *  time. The HpccReceiver echoes the hops back in the ACK, marked as a reply so nothing
+ *  stamps it again. The hops travel in a packet tag; the packets carry HeaderBytes () of
+ *  padding instead, so the wire sees the overhead of a real INT header.
+ */
+class IntTag : public Tag {
+public:
+  static const uint32_t MAX_HOPS = 8;
+  struct Hop {
+    uint64_t time;      // nanoseconds
+    uint64_t txBytes;   // bytes sent by the port so far, this packet included
+    uint32_t queue;     // bytes left in the queue behind this packet
+  };
 
-    // Assign IP addresses to the leaves
-    char buffer [15];
-    Ipv4AddressHelper address;
-    for (int netDev = 0; netDev < netC.size(); netDev++) {
-      // Specify the address using string formating
-      sprintf (buffer, "%d.%d.%d.0", 9 + level, branch, netDev + 1);
-      address.SetBase (buffer, "255.255.255.0");
-      Ipv4InterfaceContainer tempContainer = address.Assign( netC.at(netDev) );
+  IntTag () : reply (false), hops (0) {}
+  static TypeId GetTypeId (void);
+  virtual TypeId GetInstanceTypeId (void) const;
+  virtual uint32_t GetSerializedSize (void) const { return 2 + hops * 20; }
+  virtual void Serialize (TagBuffer buffer) const;
+  virtual void Deserialize (TagBuffer buffer);
+  virtual void Print (std::ostream& os) const { os << "hops=" << (int) hops << (reply ? " reply" : ""); }
 
-      // Make sure we only obtain the addresses of the leaves nodes at the bottom of the topology
-      if (level == 1) ipInterfaces->Add(tempContainer);
+  // Size of a real INT header with this many hops: 2 bytes, and 8 per hop as in HPCC
+  static uint32_t HeaderBytes (uint32_t hops) { return 2 + 8 * hops; }
 
-      // Recursion, connect each leaf to more nodes
-      int leaf = netDev;
-      networkTree(leaves.Get(leaf), numLeaves, ipInterfaces, level - 1);
-    }
-    branch++; // next branch in topology
-  }
-}
+  bool reply;
+  uint8_t hops;
+  Hop hop[MAX_HOPS];
+};
 
-void installUdpEchoServers(NodeContainer* leaves, int port, float start, float end) {
-  for (int leaf = 0; leaf < leaves->GetN(); leaf++) {
-    Ptr<UdpEchoServer> serverApp = CreateObject<UdpEchoServer>();
-    serverApp->SetAttribute("Port", UintegerValue(port)); // server apps listen to this port
+/**
+ *  HPCC sender (--hpcc), see Li et al., "HPCC: High Precision Congestion Control", SIGCOMM
+ *  2019. It sends Bytes to an HpccReceiver with at most a window W in flight, paced at
+ *  W / BaseRtt. Every ACK brings back the INT hops of its packet. From them the sender gets
+ *  the utilization of the most loaded hop: its queue, plus its transmit rate since the
+ *  previous ACK. That utilization is smoothed over an RTT. The window is then cut
+ *  multiplicatively to bring it back to Eta, or grows by Wai bytes, for up to MaxStage RTTs
+ *  before the reference window moves.
+ *
+ *  HPCC expects a lossless network, so nothing is sent again. The paths of the tree keep
+ *  packets in order, so a gap below the highest ACK is counted as lost. The flow ends at its
+ *  last ACK, or after 10 RTTs without any ACK.
+ */
+class HpccSender : public Application {
+public:
+  static TypeId GetTypeId (void);
+  HpccSender ();
 
-    leaves->Get(leaf)->AddApplication(serverApp);
+  // Receiver of the flow and the hops of the path to it (queues crossed, for the INT header)
+  void Setup (Ipv4Address receiver, uint32_t hops);
+  bool IsDone (void) const { return m_done; }
+  // Time from the first packet to the last ACK
+  Time GetCompletionTime (void) const { return m_lastAck - m_firstSend; }
+  uint64_t GetAckedBytes (void) const { return m_ackedBytes; }
+  uint64_t GetLost (void) const { return m_lost; }
+  uint32_t GetMaxQueue (void) const { return m_maxQueue; }
 
-    serverApp->SetStartTime (Seconds (start));
-    serverApp->SetStopTime (Seconds (end));
-  }
-}
+private:
+  virtual void StartApplication (void);
+  virtual void StopApplication (void);
+  void Send (void);
+  void HandleRead (Ptr<Socket> socket);
+  void NewAck (uint32_t seq, const IntTag& tag);
+  double MeasureInflight (const IntTag& tag);
+  double ComputeWindow (double utilization, bool updateReference);
+  void Finish (void);
 
-void installUdpEchoClient(Ptr<Node> node, int port, Ipv4InterfaceContainer* ipInterfaces,
-                          float start, float end) {
-  // ipInterfaces contains the address of the net device of the server node and the
-  // address of the net device connected to the server node (parent node).
-  // In order to obtain only the server node addresses, the first address is parent
-  // second is server, so start with ip = 1, and incumbent twice to obtain only server addresses
-  for (int ip = 1; ip < ipInterfaces->GetN(); ip+=2) {
-    Ptr<UdpEchoClient> echoClient = CreateObject<UdpEchoClient>();
+  uint16_t m_port;
+  uint64_t m_bytes;
+  uint32_t m_packetSize;
+  Time m_baseRtt;
+  DataRate m_rate;
+  double m_eta;
+  uint32_t m_maxStage;
+  uint32_t m_wai;
+  Ipv4Address m_receiver;
+  uint32_t m_hops;
 
-    echoClient->SetRemote(ipInterfaces->GetAddress(ip), port);
+  Ptr<Socket> m_socket;
+  EventId m_sendEvent;
+  EventId m_idleEvent;
+  uint32_t m_packets;        // packets of the flow
+  uint32_t m_nextSeq;        // next packet to send
+  int64_t m_highestAck;      // highest packet acked, -1 before the first ACK
+  uint64_t m_ackedBytes;
+  uint64_t m_lost;
+  double m_window;           // W, bytes
+  double m_reference;        // Wc, bytes
+  double m_utilization;      // U
+  uint32_t m_stage;          // additive increases since the last cut
+  uint32_t m_lastUpdateSeq;
+  IntTag m_last;             // hops of the previous ACK
+  uint32_t m_maxQueue;
+  bool m_done;
+  Time m_firstSend;
+  Time m_lastAck;
+};
 
-    echoClient->SetAttribute ("MaxPackets", UintegerValue (1)); // send only 1 packet
-    echoClient->SetAttribute ("PacketSize", UintegerValue (1 << 10)); // 1 KB
-    node->AddApplication(echoClient);
-    // Start each application and have each send a packet with a delay of 100 micro seconds
-    int delay = 10000; // in terms of seconds, so if delay = 1 ms, it is 1000, or 1000th of a second
-    echoClient->SetStartTime (Seconds (start + (ip - 1.0)/(2*delay) )); // formula to create delay using ip
-    echoClient->SetStopTime (Seconds (end));
-  }
-}
\ No newline at end of file
+/**
+ *  Receiver of HpccSender flows: every data packet is acknowledged at once by an ACK of its
+ *  sequence number, carrying its INT hops back.
+ */
+class HpccReceiver : public Application {
+public:
+  static TypeId GetTypeId (void);
+  HpccReceiver ();
+
+private:
+  virtual void StartApplication (void);
+  virtual void StopApplication (void);
+  void HandleRead (Ptr<Socket> socket);
+
+  uint16_t m_port;
+  Ptr<Socket> m_socket;
+};
+
+/**
+ *  Function to install an incast of HPCC flows between the servers of the tree: senders
+ *  servers (every other server if 0) each send bytes to the server of index receiver, all of
+ *  them starting at start. The base RTT of every flow comes from the number of links between
+ *  its two servers.
+ *
+ *  double eta, uint32_t maxStage and wai are the HPCC parameters, wai 0 is
+ *  (1 - eta) * BDP / senders as advised in the paper.
+ *  HpccSender flows get the senders, for reportHpcc().
+ */
+void installHpccIncast(TreeTopology* topology, Ipv4InterfaceContainer* ipInterfaces, uint32_t receiver, uint32_t senders,
+                       uint64_t bytes, double eta, uint32_t maxStage, uint32_t wai, float start,
+                       std::vector<Ptr<HpccSender> >* flows);
+
+/**
+ *  Function to log the flow completion times, losses and largest queue seen by the INT of the
+ *  HPCC flows.
+ *
+ *  ResultsWriter* results gets them as metrics, 0 if --results is off
+ */
+void reportHpcc(const std::vector<Ptr<HpccSender> >& flows, ResultsWriter* results);
+
+/**
+ *  Transport header of the RoceSender and RoceReceiver packets, of the size of the base
+ *  transport header of RoCEv2 (12 bytes): what the packet is and a packet sequence number.
+ */
+class RoceHeader : public Header {
+public:
+  enum Type { DATA = 0, ACK = 1, NAK = 2, CNP = 3 };
+
+  RoceHeader () : type (DATA), psn (0) {}
+  static TypeId GetTypeId (void);
+  virtual TypeId GetInstanceTypeId (void) const;
+  virtual uint32_t GetSerializedSize (void) const { return 12; }
+  virtual void Serialize (Buffer::Iterator start) const;
+  virtual uint32_t Deserialize (Buffer::Iterator start);
+  virtual void Print (std::ostream& os) const { os << "type=" << (int) type << " psn=" << psn; }
+
+  uint8_t type;
+  uint32_t psn;   // DATA its sequence number, ACK every packet below it arrived, NAK the one expected
+};
+
+/**
+ *  RoCE-like reliable sender (--roce): sends Bytes to a RoceReceiver in packets paced at the
+ *  current rate Rc, recovering from losses with go-back-N (a NAK or RTO sends again from the
+ *  first packet not acknowledged). Packets are ECN capable and Rc follows DCQCN (Zhu et al.,
+ *  SIGCOMM 2015) driven by the CNPs of the receiver:
+ *    CNP               Rt = Rc, Rc = Rc (1 - alpha / 2), alpha = (1 - G) alpha + G
+ *    AlphaInterval     without a CNP alpha = (1 - G) alpha
+ *    IncreaseInterval  or every ByteCounter bytes sent, one more increase stage:
+ *                      fast recovery for the first Stages (Rc = (Rt + Rc) / 2), then additive
+ *                      (Rt += Rai), then hyper increase (Rt += i Rhai) once both counters are
+ *                      past Stages
+ *  Every change of Rc is kept, see GetRates().
+ */
+class RoceSender : public Application {
+public:
+  static TypeId GetTypeId (void);
+  RoceSender ();
+
+  void Setup (Ipv4Address receiver);
+  bool IsDone (void) const { return m_done; }
+  Ipv4Address GetReceiver (void) const { return m_receiver; }
+  uint64_t GetBytes (void) const { return m_bytes; }
+  // Time from the first packet to the last ACK
+  Time GetCompletionTime (void) const { return m_lastAck - m_firstSend; }
+  uint64_t GetCnps (void) const { return m_cnps; }
+  uint64_t GetResent (void) const { return m_resent; }
+  uint64_t GetTimeouts (void) const { return m_timeouts; }
+  // (time in ns, Rc in bps) at the start and after every change
+  const std::vector<std::pair<int64_t, double> >& GetRates (void) const { return m_rates; }
+
+private:
+  virtual void StartApplication (void);
+  virtual void StopApplication (void);
+  void Send (void);
+  void HandleRead (Ptr<Socket> socket);
+  void GoBack (uint32_t psn);
+  void Timeout (void);
+  void CutRate (void);
+  void UpdateAlpha (void);
+  void IncreaseTimer (void);
+  void IncreaseRate (void);
+  void SetRate (double rate);
+
+  uint16_t m_port;
+  uint64_t m_bytes;
+  uint32_t m_packetSize;
+  DataRate m_lineRate;
+  Time m_rto;
+  double m_g;
+  Time m_alphaInterval;
+  Time m_increaseInterval;
+  uint32_t m_byteCounter;
+  uint32_t m_stages;
+  DataRate m_rai;
+  DataRate m_rhai;
+  DataRate m_minRate;
+  Ipv4Address m_receiver;
+
+  Ptr<Socket> m_socket;
+  EventId m_sendEvent;
+  EventId m_rtoEvent;
+  EventId m_alphaEvent;
+  EventId m_increaseEvent;
+  uint32_t m_packets;          // packets of the flow
+  uint32_t m_psn;              // next packet to send
+  uint32_t m_unacked;          // first packet not acknowledged
+  double m_rc;                 // current rate, bps
+  double m_rt;                 // target rate, bps
+  double m_alpha;
+  bool m_cnpSinceAlpha;
+  uint32_t m_timerStage;       // increases by the timer since the last cut
+  uint32_t m_byteStage;        // increases by the byte counter since the last cut
+  uint64_t m_bytesCounted;     // bytes sent towards the next byte counter increase
+  uint64_t m_cnps;
+  uint64_t m_resent;
+  uint64_t m_timeouts;
+  bool m_done;
+  Time m_firstSend;
+  Time m_lastAck;
+  std::vector<std::pair<int64_t, double> > m_rates;
+};
+
+/**
+ *  Receiver of RoceSender flows: ACKs every packet received in order, NAKs the first packet
+ *  out of order (once, until the expected packet comes) and drops it, and answers ECN marked
+ *  packets with a CNP, at most one every CnpInterval per sender.
+ */
+class RoceReceiver : public Application {
+public:
+  static TypeId GetTypeId (void);
+  RoceReceiver ();
+
+private:
+  virtual void StartApplication (void);
+  virtual void StopApplication (void);
+  void HandleRead (Ptr<Socket> socket);
+  void Reply (const Address& to, uint8_t type, uint32_t psn);
+
+  struct Peer {
+    uint32_t expected;
+    bool nakSent;
+    Time lastCnp;
+  };
+
+  uint16_t m_port;
+  Time m_cnpInterval;
+  Ptr<Socket> m_socket;
+  std::map<std::pair<uint32_t, uint16_t>, Peer> m_peers;   // by address and port of the sender
+};
+
+/**
+ *  Function to install an incast of RoCE flows between the servers of the tree, like
+ *  installHpccIncast(): senders servers (every other server if 0) each send bytes to the
+ *  server of index receiver from start. The RTO of every flow is 4 times its base RTT.
+ */
+void installRoceIncast(TreeTopology* topology, Ipv4InterfaceContainer* ipInterfaces, uint32_t receiver, uint32_t senders,
+                       uint64_t bytes, float start, std::vector<Ptr<RoceSender> >* flows);
+
+/**
+ *  Function to log the completion time, throughput and DCQCN activity of the RoCE flows, and
+ *  write every flow and its rate changes to a file:
+ *    flow <i> dst <address> bytes <n> fct <s> throughput <bps> cnps <n> resent <n> timeouts <n>
+ *    rate <i> <time s> <Rc bps>
+ *
+ *  ResultsWriter* results gets the summary as metrics, 0 if --results is off
+ */
+void reportRoce(const std::vector<Ptr<RoceSender> >& flows, std::string path, ResultsWriter* results);
+
+/**
+ *  Hierarchical timer wheel holding the request timeouts of an RpcEchoClient, so timeouts
+ *  cost no simulator events of their own: the wheel keeps a single event, at the start of
+ *  the next slot with something in it.
+ *
+ *  Time is counted in ticks (the resolution of the timeouts). Level l has 64 slots of 64^l
+ *  ticks, an entry sits in the lowest level whose 64 slots ahead of the current tick cover its
+ *  expiry, and is moved one level down (cascaded) when the wheel reaches the start of its
+ *  slot. 4 levels cover 2^24 ticks, later expiries wait in the last slot of the top level.
+ *  Entries are never removed before they expire, the owner ignores the stale ones.
+ */
+class TimerWheel {
+public:
+  TimerWheel ();
+
+  // Add an entry expiring at tick expiry (at least the tick after the current one), now is the
+  // current tick of the caller, an empty wheel jumps there instead of catching up later
+  void Insert (uint64_t now, uint64_t expiry, uint64_t id);
+  // Next tick something has to be done at, UINT64_MAX if the wheel is empty. It may be before
+  // the current simulation time if the wheel was left behind, Advance () then catches up.
+  uint64_t NextTick (void) const;
+  // Process every slot starting at or before tick, appending the ids that expired
+  void Advance (uint64_t tick, std::vector<uint64_t>* expired);
+  uint64_t GetSize (void) const { return m_size; }
+
+private:
+  static const int LEVELS = 4;
+  static const int SLOTS = 64;
+  struct Entry {
+    uint64_t expiry;
+    uint64_t id;
+  };
+  void Place (const Entry& entry, std::vector<uint64_t>* expired);
+
+  uint64_t m_now;
+  uint64_t m_size;
+  std::vector<Entry> m_slots[LEVELS][SLOTS];
+  uint64_t m_occupied[LEVELS]; // bit s is set when slot s of the level has entries
+};
+
+/**
+ *  RPC-style echo client: every request has a timeout and is sent again, with an exponential
+ *  backoff, when no echo comes back in time, where UdpEchoClient would silently lose it.
+ *  Timeouts live in a TimerWheel, so outstanding requests (there can be 100k of them) do not
+ *  each put a timer event in the simulator scheduler.
+ *
+ *  Requests go to the servers in turn, one every Interval, Requests times to each server. The
+ *  request number travels in a SeqTsHeader and comes back with the echo.
+ */
+class RpcEchoClient : public Application {
+public:
+  static TypeId GetTypeId (void);
+  RpcEchoClient ();
+
+  void AddServer (Ipv4Address server) { m_servers.push_back (server); }
+  uint64_t GetSuccesses (void) const { return m_successes; }
+  uint64_t GetRetries (void) const { return m_retries; }
+  uint64_t GetTimeouts (void) const { return m_timeouts; }
+
+private:
+  virtual void StartApplication (void);
+  virtual void StopApplication (void);
+  void SendNext (void);
+  void Transmit (uint32_t request);
+  void HandleRead (Ptr<Socket> socket);
+  // Wake up of the wheel: expire the due timeouts and schedule the next wake up
+  void Tick (void);
+  void ScheduleTick (void);
+
+  struct Request {
+    uint32_t server;
+    uint32_t attempt;     // 0 for the first transmission
+    uint64_t deadline;    // tick of the current timeout, stale wheel entries have another one
+    bool done;
+  };
+
+  std::vector<Ipv4Address> m_servers;
+  std::vector<Request> m_requests;
+  uint16_t m_port;
+  uint32_t m_size;
+  uint32_t m_count;
+  uint32_t m_maxRetries;
+  Time m_interval;
+  Time m_timeout;
+  Time m_resolution;
+  Ptr<Socket> m_socket;
+  EventId m_sendEvent;
+  EventId m_tickEvent;
+  uint64_t m_tickAt;      // tick m_tickEvent is for
+  TimerWheel m_wheel;
+  uint64_t m_successes;
+  uint64_t m_retries;
+  uint64_t m_timeouts;
+};
+
+/**
+ *  Function to install an RpcEchoClient on the client node, sending to all the server nodes
+ *  like installUdpEchoClient () but with timeouts and retries.
+ *
+ *  uint32_t requests is the number of requests per server, one request leaves every interval
+ *  Time timeout is the timeout of the first transmission, doubled at every retry, and
+ *  retries is the number of retries before a request counts as timed out
+ *
+ *  Returns the application, to report its counts at the end of the run
+ */
+Ptr<RpcEchoClient> installRpcEchoClient(Ptr<Node> node, int port, Ipv4InterfaceContainer* ipInterfaces,
+                                        uint32_t requests, Time interval, Time timeout, uint32_t retries,
+                                        float start, float end);
+
+/**
+ *  One class of a TreeClassQueue: which packets belong to it and how it is served.
+ */
+struct TreeQueueClass {
+  std::string name;
+  bool strict;          // strict priority, served before every DRR class (in the order given)
+  uint32_t weight;      // DRR weight, the class gets weight * 1500 bytes per round
+  int dscp;             // packets with this DSCP, -1 = any
+  int port;             // UDP or TCP packets from or to this port, -1 = any
+};
+
+/**
+ *  Device queue with several classes of traffic, so echo probes or RPCs can ride a high
+ *  priority class over the same ports as bulk transfers, like they do in production.
+ *
+ *  Classes are given as "name:scheduling:match" separated by ';', the first matching class
+ *  takes the packet and packets matching none go to the last class:
+ *    scheduling  "prio" for strict priority, or a DRR weight
+ *    match       "dscp=N", "port=N" (source or destination UDP/TCP port) or "*"
+ *  e.g. "probe:prio:port=9;bulk:4:dscp=10;rest:1:*".
+ *
+ *  MaxPackets is shared by all the classes, as with the DropTailQueue it replaces, and every
+ *  class counts its packets, bytes, drops and the time its packets spent in the queue.
+ *  With IntStamp the packets carrying an IntTag get a hop stamped as they leave (--hpcc).
+ *  With EcnKmax the ECN capable packets are marked as they come in, as RED does for DCQCN:
+ *  never below EcnKmin bytes queued, with a probability growing to EcnPmax at EcnKmax, always
+ *  above it (--roce).
+ */
+class TreeClassQueue : public Queue {
+public:
+  static TypeId GetTypeId (void);
+  TreeClassQueue ();
+
+  // Parse a class configuration, false (and a log message) if it is not valid
+  static bool ParseClasses (std::string spec, std::vector<TreeQueueClass>* classes);
+
+  struct ClassStats {
+    uint64_t packets;   // dequeued
+    uint64_t bytes;
+    uint64_t drops;
+    Time delay;         // sum of the queueing delays of the dequeued packets
+    Time maxDelay;
+    uint64_t marks;     // ECN marked
+  };
+  const std::vector<TreeQueueClass>& GetClasses (void);
+  const ClassStats& GetStats (uint32_t c) const { return m_stats[c]; }
+
+private:
+  virtual bool DoEnqueue (Ptr<QueueItem> item);
+  virtual Ptr<QueueItem> DoDequeue (void);
+  virtual Ptr<const QueueItem> DoPeek (void) const;
+
+  // Class of a packet (Ethernet frame as queued by the CSMA device)
+  uint32_t Classify (Ptr<const Packet> packet) const;
+  // Set CE in the IP header of a frame, false if it is not ECN capable
+  bool MarkCe (Ptr<Packet> packet) const;
+  // Class served next, and the DRR state after serving it (the members, or copies for a peek)
+  int Select (std::deque<uint32_t>& active, std::vector<uint32_t>& deficit, std::vector<bool>& visited) const;
+
+  std::string m_spec;
+  uint32_t m_maxPackets;
+  bool m_intStamp;
+  uint64_t m_txBytes;   // bytes dequeued, all classes together
+  uint32_t m_ecnKmin;
+  uint32_t m_ecnKmax;
+  double m_ecnPmax;
+  Ptr<UniformRandomVariable> m_random;
+  std::vector<TreeQueueClass> m_classes;
+  std::vector<std::deque<std::pair<Ptr<QueueItem>, Time> > > m_items;
+  std::vector<ClassStats> m_stats;
+  // DRR state: backlogged DRR classes in round robin order, their deficit and whether the
+  // class at the front already got its quantum for this round
+  std::deque<uint32_t> m_active;
+  std::vector<uint32_t> m_deficit;
+  std::vector<bool> m_visited;
+};
+
+/**
+ *  Function to log the statistics of every queue class, summed over the ports of each level
+ *  of the tree (only if the tree has TreeClassQueues).
+ *
+ *  TreeTopology* topology is the tree built by networkTree()
+ */
+void reportQueueClasses(TreeTopology* topology);
+
+/**
+ *  Histogram of round trip times, used to report RTT quantiles while the simulation runs.
+ *
+ *  Buckets are log-linear (16 buckets per power of two nanoseconds) so quantiles are within
+ *  about 6% of the real value, and every bucket is an atomic so another thread can read the
+ *  histogram while the simulation thread keeps recording into it.
+ */
+class RttHistogram {
+public:
+  void Record (Time rtt);
+  uint64_t GetCount () const { return m_count.load (std::memory_order_relaxed); }
+  double GetSumSeconds () const { return m_sumNs.load (std::memory_order_relaxed) * 1e-9; }
+  // Quantile q (0 < q <= 1) in seconds, 0 if nothing was recorded yet
+  double Quantile (double q) const;
+
+  // Bucketing, shared with SteadyStateStats
+  static const int SUB_BUCKETS = 16;
+  static const int BUCKETS = (64 - 3) * SUB_BUCKETS;
+  static int BucketOf (uint64_t ns);
+  static uint64_t BucketStart (int bucket);
+
+private:
+  std::atomic<uint64_t> m_buckets[BUCKETS];
+  std::atomic<uint64_t> m_count;
+  std::atomic<uint64_t> m_sumNs;
+};
+
+// Deepest tree that gets its own per-level counters, deeper levels are added to the last one
+static const int MAX_TREE_LEVELS = 16;
+
+/**
+ *  Counters describing the running simulation. They are written by the simulation thread
+ *  (trace sinks and the scheduler) and read by the metrics exporter thread, so they are all
+ *  atomics and reading them never stops the simulation.
+ *
+ *  Per-level counters are indexed by the depth of the node owning the queue (see TreeNodeInfo),
+ *  or by the kind of port on a jellyfish or a dragonfly (see traceJellyfishCounters()).
+ */
+struct SimulationCounters {
+  std::atomic<uint64_t> events;         // events executed so far
+  std::atomic<int64_t> pendingEvents;   // events waiting in the scheduler
+  std::atomic<int64_t> simTime;         // timestamp of the last event, in ns-3 time steps
+  std::atomic<uint64_t> packetsForwarded;
+  std::atomic<uint64_t> ipDrops;
+  std::atomic<uint64_t> echoRequests;   // echo requests sent by the client, see also rtt.GetCount()
+  std::atomic<int64_t> queuePackets[MAX_TREE_LEVELS + 1];
+  std::atomic<uint64_t> queueDrops[MAX_TREE_LEVELS + 1];
+  std::atomic<uint64_t> queueBytes[MAX_TREE_LEVELS + 1];   // bytes sent out of the queues
+  // Queues traced per level and levels with any queue, set up before the run whatever was built
+  uint64_t queuePorts[MAX_TREE_LEVELS + 1];
+  int queueLevels;
+  std::atomic<uint64_t> packetHops;     // packets sent out of any queue, one per link crossed
+  RttHistogram rtt;
+};
+
+// Zero initialised since it is static, so no constructor is needed for the atomics
+static SimulationCounters counters;
+
+/**
+ *  What SteadyStateStats found: where the warmup ends and the statistics after it.
+ */
+struct SteadyStateResult {
+  uint64_t warmupSamples;   // samples discarded as the transient
+  Time warmupEnd;           // time of the first sample kept
+  uint64_t samples;         // samples kept
+  double mean;              // mean of the samples kept, in seconds
+  double halfWidth;         // half width of the 95% confidence interval of the mean (batch means)
+  double p50;               // quantiles of the samples kept, in seconds
+  double p99;
+};
+
+/**
+ *  Delays (RTTs) collected with automatic detection of the warmup transient, so the ARP and
+ *  queue fill at the start of a run do not bias the statistics and runs need not be padded.
+ *
+ *  The truncation point is found with MSER-5: samples are averaged in batches of 5 and the
+ *  number of leading batches d dropped is the one minimising the variance of the mean of the
+ *  batches left, sum over j > d of (Y_j - mean)^2 / (n - d)^2, looking at d <= n / 2.
+ *
+ *  Memory is bounded whatever the length of the run: at most 512 batch means are kept, when
+ *  they are all used adjacent pairs are merged and batches hold twice as many samples from
+ *  then on. Quantiles come from 16 histograms of consecutive segments of the run, merged the
+ *  same way, and only the segments starting after the truncation point are counted (so up to
+ *  one more segment than needed is dropped).
+ */
+class SteadyStateStats {
+public:
+  SteadyStateStats ();
+  void Add (Time value);
+  // False if there are too few batches yet to tell a transient from the steady state
+  bool Analyse (SteadyStateResult* result) const;
+
+private:
+  static const int MAX_BATCHES = 512;
+  static const int SEGMENTS = 16;
+
+  uint64_t m_count;
+  uint64_t m_batchSize;                   // samples per batch, 5 at first
+  double m_partialSum;                    // batch being filled
+  uint64_t m_partialCount;
+  Time m_partialStart;
+  std::vector<double> m_means;
+  std::vector<Time> m_starts;             // time of the first sample of each batch
+  std::vector<std::vector<uint64_t> > m_segments;
+};
+
+// Steady state statistics of all the RTTs measured, see recordRtt()
+static SteadyStateStats steadyRtt;
+
+/**
+ *  Function to record a round trip time measured by any of the clients, in the RTT histogram
+ *  of the counters and in the steady state statistics.
+ */
+void recordRtt(Time rtt);
+
+/**
+ *  The default ns-3 scheduler (a std::map of events), that also counts the events going
+ *  through it. This is how the exporter learns the number of events executed, the scheduler
+ *  size and the simulation time without touching the simulator from another thread.
+ */
+class CountingMapScheduler : public MapScheduler {
+public:
+  static TypeId GetTypeId (void);
+  virtual void Insert (const Event &ev);
+  virtual Event RemoveNext (void);
+  virtual void Remove (const Event &ev);
+};
+
+/**
+ *  Serves the simulation counters in the Prometheus text format, on a localhost port (so
+ *  existing dashboards can scrape a run while it is going) and/or by rewriting a file every
+ *  interval seconds. All the work happens on a separate thread reading the atomic counters.
+ *
+ *  TreeTopology* topology is only used to know how many levels to report
+ */
+class MetricsExporter {
+public:
+  MetricsExporter (TreeTopology* topology);
+  ~MetricsExporter ();
+
+  // Start the exporter thread, port = 0 disables the endpoint and an empty path disables the file
+  bool Start (uint16_t port, std::string path, double interval);
+  void Stop ();
+
+  // Current value of all the metrics in the Prometheus text format
+  std::string Render ();
+
+  // In a forked child the exporter thread does not exist, drop it without joining
+  void ForgetAfterFork ();
+
+private:
+  void Loop ();
+  void WriteFile ();
+  void Serve (int connection);
+
+  TreeTopology* m_topology;
+  std::atomic<bool> m_running;
+  std::unique_ptr<std::thread> m_thread;
+  int m_listenFd;
+  std::string m_path;
+  double m_interval;
+
+  // Used to turn the events counter into events per second
+  uint64_t m_lastEvents;
+  std::chrono::steady_clock::time_point m_lastSample;
+  double m_eventRate;
+};
+
+/**
+ *  Samples the time series stored with the results of a run (--results) every interval of
+ *  simulated time: queue occupancy and link utilisation per level, RTT quantiles and events.
+ *  Utilisation is the share of the 1Gbps of the ports of a level used since the last sample.
+ */
+class ResultsSampler {
+public:
+  ResultsSampler (ResultsWriter* writer, TreeTopology* topology, Time interval);
+  void Start (void);
+
+private:
+  void Sample (void);
+
+  ResultsWriter* m_writer;
+  TreeTopology* m_topology;
+  Time m_interval;
+  std::vector<uint64_t> m_ports;       // ports owned by the nodes of each level
+  std::vector<uint64_t> m_lastBytes;   // counters.queueBytes at the last sample
+};
+
+/**
+ *  Hardware performance counters (perf_event_open) read at the boundaries of the phases of a
+ *  run, to tell whether big trees are bound by the caches and the TLB rather than by the work
+ *  itself. Only this process is counted, in user space, including the threads it starts.
+ *
+ *  Counters the kernel or the CPU will not give us (no PMU in a VM, perf_event_paranoid too
+ *  high...) are left out and reported as n/a, the phase timings are reported anyway.
+ */
+class PerfCounters {
+public:
+  PerfCounters ();
+  ~PerfCounters ();
+
+  // Open the counters, false if none of them could be opened (timings still work)
+  bool Open (void);
+  // End the current phase, if any, and start counting the next one
+  void Phase (std::string name);
+  // End the current phase
+  void Stop (void);
+  // Log every phase, events is the number of events of the "run" phase (0 if unknown)
+  void Report (uint64_t events);
+  // Store the phases in the results of the run
+  void AddResults (ResultsWriter* writer);
+
+  static const int COUNTERS = 6;
+
+private:
+  struct PhaseSample {
+    std::string name;
+    double seconds;
+    double values[COUNTERS];   // -1 if the counter is not available
+  };
+  // Current value of every counter, scaled up if the kernel had to multiplex them
+  void Read (double* values);
+
+  int m_fds[COUNTERS];
+  std::vector<PhaseSample> m_phases;
+  bool m_running;
+  double m_start[COUNTERS];
+  std::chrono::steady_clock::time_point m_startTime;
+};
+
+/**
+ *  Phases of a run, for the hardware counters and the allocation profile. Allocations made
+ *  outside of these (parsing options, reporting...) count as "other".
+ */
+enum RunPhase { PHASE_OTHER, PHASE_BUILD, PHASE_APPS, PHASE_ROUTING, PHASE_RUN, PHASES };
+static const char* phaseNames[PHASES] = { "other", "build", "apps", "routing", "run" };
+
+// Phase the process is in, read by the allocation hooks from any thread
+static std::atomic<int> currentPhase;
+
+/**
+ *  Function to move the run to another phase, PHASE_OTHER ends the current one.
+ *
+ *  PerfCounters* perf gets a phase of its own for each of them, 0 if --perf is off
+ */
+void enterPhase(RunPhase phase, PerfCounters* perf);
+
+/**
+ *  Allocation profile of the process: the global operator new and delete of this program
+ *  count every allocation, per phase and per size class, and every sampleEvery allocations
+ *  (per thread) the call stack of one of them is recorded, to find the hot call sites.
+ *
+ *  It is off unless --allocProfile is given, the hooks then only cost a test of a flag. Hooks
+ *  run on any thread (the jellyfish path threads allocate too), so everything is atomic,
+ *  except the call stack table which is only touched by sampled allocations, under a mutex.
+ *
+ *  The live bytes are the growth of the heap since Enable (): a free cannot tell whether its
+ *  block was allocated before, so frees of blocks from before profiling started (static
+ *  initialisation, option parsing) are subtracted too. The live bytes can then go below zero
+ *  and the peak is a lower bound of the growth, off by at most what was live at Enable ().
+ */
+class AllocProfile {
+public:
+  static const int SIZE_CLASSES = 10;   // <= 16 bytes, <= 32, ... <= 4096, more
+  static const int STACK_DEPTH = 12;
+  static const int STACK_SLOTS = 4096;
+
+  // Start counting, sampling one call stack every sampleEvery allocations (0 = no stacks)
+  static void Enable (uint32_t sampleEvery);
+  static bool IsEnabled (void) { return enabled.load (std::memory_order_relaxed); }
+  // Allocations so far, all phases together
+  static uint64_t Total (void);
+
+  // Hooks of operator new and delete
+  static void Allocated (void* pointer, size_t size);
+  static void Freed (void* pointer);
+
+  // Called every interval of simulated time during the run, to find the steady state
+  static void Sample (Time interval);
+  // Log the counts per phase, per size class, per event and packet hop, and the top call sites
+  static void Report (uint64_t events, uint64_t hops);
+
+private:
+  static int SizeClass (size_t size);
+  static void RecordStack (size_t size);
+
+  struct Stack {
+    uint64_t hash;
+    uint64_t samples;
+    uint64_t bytes;
+    void* frames[STACK_DEPTH];
+    int depth;
+  };
+
+  static std::atomic<bool> enabled;
+  static uint32_t sampleEvery;
+  static std::atomic<uint64_t> allocations[PHASES][SIZE_CLASSES];
+  static std::atomic<uint64_t> bytes[PHASES];
+  static std::atomic<uint64_t> frees[PHASES];
+  static std::atomic<int64_t> liveBytes;
+  static std::atomic<int64_t> peakBytes;
+  static std::mutex stackMutex;
+  static Stack stacks[STACK_SLOTS];
+  // (allocations, packet hops) during the run, every interval of simulated time
+  static std::vector<std::pair<uint64_t, uint64_t> > samples;
+};
+
+/**
+ *  Function to run the forwarding micro-benchmark (--bench=forward) instead of a tree: a
+ *  single router between the client and one server, built by networkTree() like any other
+ *  tree (same CSMA devices, queues and stack), so a change to one layer can be measured in
+ *  seconds. The client sends packets echo requests to the server, the router forwards them
+ *  and the echoes, and the server goes through the UDP receive and echo path for each one.
+ *
+ *  The links are half duplex and carry every packet twice (request and echo), so line rate
+ *  here is one request every two frame times at 1Gbps. Costs are measured after the ARP
+ *  exchanges, from the 100th forwarded packet to the end of the run.
+ *
+ *  uint32_t size is the size of the UDP payload, queueClasses, treeRoutes and batch (the
+ *  router takes the batched receive path) are the same options as for a tree
+ *
+ *  ResultsWriter* results gets the figures as metrics, 0 if --results is off
+ */
+int runForwardBench(uint32_t packets, uint32_t size, std::string queueClasses, bool treeRoutes, bool batch,
+                    ResultsWriter* results);
+
+/**
+ *  Function to connect the simulation counters to the trace sources of the tree: the queues
+ *  of every device (occupancy and drops per level), the IPv4 layer of every node (forwarded
+ *  and dropped packets) and the client node (echo replies, for the RTT).
+ *
+ *  TreeTopology* topology is the tree built by networkTree()
+ */
+void traceTreeCounters(TreeTopology* topology);
+
+/**
+ *  Function to log the utilization of the links of the tree over seconds of simulated time,
+ *  rolled up per level (min, mean, max and p95 over the links of the level, each direction
+ *  counted as a link), to tell which level saturates. The links of level L are the ones
+ *  between the nodes at depth L and their leaves.
+ *
+ *  ResultsWriter* results gets the rollups as metrics, and with --linkInterval the p95 and max
+ *  of every interval as series, 0 if --results is off
+ */
+void reportLinkUsage(TreeTopology* topology, double seconds, ResultsWriter* results);
+
+/**
+ *  Control interface of a running simulation on a local Unix socket, so a run that behaves
+ *  oddly can be paused and inspected instead of killed and rerun with more logging.
+ *
+ *  One command per line, each gets a one or more line answer ending with an empty line:
+ *    status                     simulation time, events, paused or not
+ *    pause / resume             stop / restart the event loop between two events
+ *    node <position>            addresses, devices and queues of a node
+ *    queue <position> <device>  one queue of a node, device is "up" or a leaf index
+ *    trace on|off <position>    log every packet sent or received in a subtree
+ *    log <component> on|off     toggle an ns-3 log component (info level)
+ *    checkpoint                 fork a stopped copy of the simulation, see forkSimulation()
+ *    stop                       end the simulation after the current event
+ *  Positions are tree positions as understood by TreeTopology::Find ().
+ *
+ *  Commands are read by a separate thread and handed to the simulation thread, which looks
+ *  at an atomic flag between two events (from the scheduler) and never makes a syscall unless
+ *  a command is actually waiting.
+ */
+class ControlServer {
+public:
+  ControlServer (TreeTopology* topology);
+  ~ControlServer ();
+
+  bool Start (std::string path);
+  void Stop ();
+
+  // Called between two events, cheap unless a command is waiting
+  void Poll () {
+    if (m_pending.load (std::memory_order_acquire)) HandleCommands ();
+  }
+
+  // In a forked child the socket thread does not exist, drop it without joining
+  void ForgetAfterFork ();
+
+private:
+  struct Command {
+    std::string line;
+    std::string reply;
+    bool done;
+  };
+
+  void Loop ();
+  void Serve (int connection);
+  void HandleCommands ();
+  std::string Execute (std::string line);
+  std::string DescribeNode (int id);
+  std::string DescribeQueue (Ptr<CsmaNetDevice> device);
+  std::string Checkpoint ();
+
+  TreeTopology* m_topology;
+  std::string m_path;
+  int m_listenFd;
+  std::unique_ptr<std::thread> m_thread;
+  std::atomic<bool> m_running;
+  std::atomic<bool> m_pending;  // a command is waiting for the simulation thread
+  bool m_paused;                // only used by the simulation thread
+  bool m_forgotten;             // set in a forked child, nothing of this object can be used
+  std::mutex m_mutex;
+  std::condition_variable m_changed;
+  std::deque<Command*> m_commands;
+};
+
+/**
+ *  Function to fork the simulation, the child process is an exact copy of the simulation
+ *  at this point in time and carries on from there. This is the checkpoint mechanism: a
+ *  forked copy costs nothing until memory is written to (copy on write), and it can be
+ *  stopped and resumed later.
+ *
+ *  Only the calling thread exists in the child, so the metrics exporter and control server
+ *  threads are forgotten there. Returns what fork() returns.
+ */
+pid_t forkSimulation();
+
+/**
+ *  Function to set the size of the queues of every level of the tree, at the link layer
+ *  (MaxPackets of the device queues) and at the IP layer (PendingQueueSize of the ARP caches),
+ *  replacing the 1000 packets every queue gets by default.
+ *
+ *  std::vector<uint32_t> sizes has the size for each depth, sizes[0] for the root (client) and
+ *  sizes[levels] for the server nodes
+ */
+void applyQueuePlan(TreeTopology* topology, const std::vector<uint32_t>& sizes);
+
+/**
+ *  Function to turn a comma separated list of queue sizes, root first ("1000,200,50"), into
+ *  one size per depth of the tree. Missing levels get the last size of the list.
+ */
+std::vector<uint32_t> parseQueuePlan(std::string plan, int levels);
+
+/**
+ *  Function to search, for every level of the tree, the smallest queue size that still meets
+ *  a target, either a drop rate of the echo requests or a p99 RTT of the echo replies.
+ *
+ *  Each candidate is a full run of the simulation in a forked process (forkSimulation()), so the
+ *  topology and routing tables built once are reused by every run, and up to workers runs go in
+ *  parallel. Every level is binary searched (more precisely, searched with as many probes per
+ *  round as there are workers) with the other levels at maxSize, assuming that a bigger queue
+ *  never makes things worse. The plan found is then checked with one more run of all the levels
+ *  together.
+ *
+ *  std::string target is "drop" or "rtt", targetValue the maximum drop rate (0 .. 1) or p99 RTT
+ *  (in seconds). The latency/drop curve of every run is written to curvesFile, as a CSV.
+ *
+ *  Returns the exit code of the program.
+ */
+int searchQueuePlan(TreeTopology* topology, std::string target, double targetValue, uint32_t maxSize,
+                    int workers, std::string curvesFile);
+
+/**
+ *  Function to estimate the probability that a packet is dropped by the queues of one level of
+ *  the tree (the leaf routers by default), when it is far too small to be seen in a plain run,
+ *  with importance splitting (RESTART).
+ *
+ *  The importance of the state is the highest of the thresholds reached by any queue of the
+ *  level. When a trajectory crosses threshold k upwards, it is cloned (forkSimulation()) into
+ *  retrials trajectories, the clones run with other random streams and end as soon as the
+ *  importance falls back below threshold k, while the trajectory that was there goes on. Each
+ *  drop then counts 1 / retrials^k, with k the thresholds it happened above, and the weighted
+ *  drops of all the trajectories divided by the packets queued in the main trajectory are an
+ *  unbiased estimate of the drop probability, with a lot more trajectories looking at drops.
+ *
+ *  Confidence bounds come from the cycles of the main trajectory (from one crossing of the
+ *  first threshold to the next), taken as independent: the weighted drops of all the clones
+ *  of a cycle are added up, and the variance of the cycle totals gives the 95% interval. The
+ *  speedup is the number of packets a plain run would need for the same relative precision
+ *  over the packets simulated by all the trajectories together.
+ *
+ *  The traffic has to be random (--pattern with --patternPoisson) for clones to differ. At most
+ *  as many trajectories as there are hardware threads run at once, a clone waits (stopped at
+ *  the crossing it was made at) for a running trajectory to end before it goes on.
+ *
+ *  int level is the depth of the nodes owning the queues, thresholds are increasing queue
+ *  occupancies (packets), all below the size of the queues
+ */
+int splitOverflow(TreeTopology* topology, int level, std::vector<uint32_t> thresholds, uint32_t retrials);
+
+/**
+ *  Graph handed to partitionGraph(): a weight per node (its expected event load) and the links
+ *  between nodes, each listed from both ends with the traffic it carries and its delay.
+ */
+struct PartitionGraph {
+  struct Edge {
+    int to;
+    double traffic;  // packets over the link, both directions
+    double delay;    // seconds, the lookahead a parallel run gets when the link is cut
+  };
+  std::vector<double> weights;
+  std::vector<std::vector<Edge> > edges;
+};
+
+/**
+ *  Function to split a graph into parts of about the same weight cutting as little as possible,
+ *  with the multilevel scheme of METIS: the graph is coarsened by merging the ends of its
+ *  heaviest edges (heavy edge matching) until it is small, the coarsest graph is split by
+ *  growing the parts one after the other from a seed node (greedy graph growing), and the
+ *  parts are projected back level by level, improved at every level by moving boundary nodes
+ *  to the part they are most connected to (Fiduccia-Mattheyses passes, without hill climbing).
+ *
+ *  The cost of cutting a link is (1 + traffic) * maxDelay / delay, so short links, which would
+ *  shrink the lookahead of every system, are the last ones cut.
+ *
+ *  uint32_t parts is the number of parts, tolerance how much heavier than the mean a part may
+ *  get (0.03 = 3%). Returns the part of every node.
+ */
+std::vector<uint32_t> partitionGraph(const PartitionGraph& graph, uint32_t parts, double tolerance);
+
+/**
+ *  Function to assign the nodes of the tree to simulator instances (system ids) for a
+ *  distributed run, balancing their expected event load instead of cutting the tree by
+ *  subtrees, which is only balanced when the traffic is uniform.
+ *
+ *  The load of a node and of a link is either computed from the traffic spec (weights
+ *  "traffic": every packet of the pattern, or of the root client, walked along its path in
+ *  the tree and back) or counted by a short profiling run of the simulation (weights
+ *  "profile": packets sent and received by the devices of every node during the first
+ *  profileSeconds, in a forked process). Every node also weighs 1, for its fixed costs.
+ *
+ *  The assignment is written to file, one "node-id system-id" line per node, and the
+ *  predicted load imbalance (heaviest system over the mean), cut links and lookahead (the
+ *  shortest delay of a cut link) are logged.
+ *
+ *  TrafficPattern* pattern is the pattern of the servers, 0 for the root client,
+ *  ipInterfaces the server addresses (see installUdpEchoClient())
+ */
+int partitionTree(TreeTopology* topology, const TrafficPattern* pattern, Ipv4InterfaceContainer* ipInterfaces,
+                  uint32_t systems, std::string weights, double profileSeconds, std::string file);
+
+/**
+ *  A random regular graph of switches with hosts attached (Jellyfish), the alternative to the
+ *  tree built by buildJellyfish(). Switch s is switches[s], host h is hosts[h] and hangs off
+ *  switch hostSwitch[h]; the servers come first, the client is the last host.
+ *
+ *  paths holds the k shortest switch paths between every pair of switches, the i-th path
+ *  from s to d at (s * switches + d) * k + i (empty when there are fewer than k of them),
+ *  which is also the path id a KspRouting switch tags packets with.
+ */
+struct JellyfishTopology {
+  struct Port {
+    int neighbour;              // switch at the other end of the link
+    Ptr<CsmaNetDevice> device;  // device of this switch
+    Ipv4Address gateway;        // address of the neighbour on the link
+  };
+  std::vector<Ptr<Node> > switches;
+  std::vector<Ptr<Node> > hosts;
+  std::vector<int> hostSwitch;
+  std::vector<Ptr<CsmaNetDevice> > hostPorts;    // device of the switch towards every host
+  std::vector<Ptr<CsmaNetDevice> > hostDevices;  // device of every host
+  std::map<uint32_t, int> hostAddresses;         // host of every host address
+  std::vector<std::vector<Port> > ports;         // switch links of every switch
+  std::vector<std::vector<int> > paths;
+  uint32_t k;
+
+  JellyfishTopology () : k (0) {}
+};
+
+/**
+ *  Function to build a Jellyfish topology next to the client, for comparisons with the tree
+ *  of networkTree() with the same equipment: same links (CSMA, 1Gbps, 1ms), queues, stacks,
+ *  echo servers and address layout (a /24 per link, the switch gets .1 and the host or second
+ *  switch .2, host links in 30.x.y.0, switch links in 40.x.y.0, the client link 29.0.0.0), and
+ *  ipInterfaces filled the same way, so every traffic helper works on it unchanged.
+ *
+ *  The switch links are a random matching of the free ports of the switches (ports less the
+ *  hosts of the switch), seeded by seed: the ports are shuffled and paired, and a pair that
+ *  would make a loop or a second link between two switches takes the place of a random link
+ *  x-y instead, as a-x and b-y (the incremental construction of the Jellyfish paper), so the
+ *  graph is built in O(links). Servers are spread round robin over the switches, the client
+ *  goes on the switch with the most free ports. A graph that is not connected (one search
+ *  from switch 0 does not reach every switch) is drawn again with the next seed.
+ *
+ *  uint32_t k is the number of shortest paths computed between every pair of switches for
+ *  KspRouting (Yen's algorithm, the source switches shared by threads workers), 0 leaves the
+ *  switches to Ipv4GlobalRoutingHelper. Returns 0, or 1 (and a log message) if the switches
+ *  do not have ports enough to be connected.
+ */
+int buildJellyfish(Ptr<Node> client, uint32_t switches, uint32_t ports, uint32_t servers, uint32_t seed, uint32_t k,
+                   int threads, std::string queueClasses, Ipv4InterfaceContainer* ipInterfaces, JellyfishTopology* topology);
+
+/**
+ *  Tag of a packet following one of the k shortest paths of a JellyfishTopology, set by the
+ *  first switch of the path.
+ */
+class KspPathTag : public Tag {
+public:
+  static TypeId GetTypeId (void);
+  virtual TypeId GetInstanceTypeId (void) const;
+  virtual uint32_t GetSerializedSize (void) const { return 4; }
+  virtual void Serialize (TagBuffer buffer) const { buffer.WriteU32 (path); }
+  virtual void Deserialize (TagBuffer buffer) { path = buffer.ReadU32 (); }
+  virtual void Print (std::ostream& os) const { os << "path=" << path; }
+
+  uint32_t path;  // index in JellyfishTopology::paths
+};
+
+/**
+ *  Routing of a Jellyfish switch over the k shortest paths between the switches. The switch a
+ *  packet comes in from a host picks one of the paths to the switch of the destination by a
+ *  hash of the addresses and ports (so a flow keeps to one path and the flows spread over all
+ *  of them) and tags the packet with it, the switches after it follow the tag. Added to the
+ *  list routing of the switch above static and global routing, it only answers for packets
+ *  to hosts, local delivery is left to the list routing.
+ */
+class KspRouting : public Ipv4RoutingProtocol {
+public:
+  static TypeId GetTypeId (void);
+  KspRouting ();
+
+  // The topology (paths and ports) and the index of this switch in it
+  void Setup (const JellyfishTopology* topology, int index);
+
+  virtual Ptr<Ipv4Route> RouteOutput (Ptr<Packet> p, const Ipv4Header &header, Ptr<NetDevice> oif,
+                                      Socket::SocketErrno &sockerr);
+  virtual bool RouteInput (Ptr<const Packet> p, const Ipv4Header &header, Ptr<const NetDevice> idev,
+                           UnicastForwardCallback ucb, MulticastForwardCallback mcb,
+                           LocalDeliverCallback lcb, ErrorCallback ecb);
+  virtual void NotifyInterfaceUp (uint32_t interface) {}
+  virtual void NotifyInterfaceDown (uint32_t interface) {}
+  virtual void NotifyAddAddress (uint32_t interface, Ipv4InterfaceAddress address) {}
+  virtual void NotifyRemoveAddress (uint32_t interface, Ipv4InterfaceAddress address) {}
+  virtual void SetIpv4 (Ptr<Ipv4> ipv4) { m_ipv4 = ipv4; }
+  virtual void PrintRoutingTable (Ptr<OutputStreamWrapper> stream) const;
+
+private:
+  // Hash of the addresses, protocol and UDP ports of a packet, to pick its path
+  static uint64_t FlowHash (Ptr<const Packet> p, const Ipv4Header &header);
+
+  const JellyfishTopology* m_topology;
+  int m_index;
+  Ptr<Ipv4> m_ipv4;
+};
+
+/**
+ *  Function to connect the simulation counters to a Jellyfish topology, as traceTreeCounters()
+ *  does for the tree: queues of the switch links are level 0, of the switch ports towards the
+ *  hosts level 1 and of the hosts level 2. The client is left to traceTreeCounters().
+ */
+void traceJellyfishCounters(JellyfishTopology* topology);
+
+/**
+ *  A dragonfly built by buildDragonfly(): groups of a routers linked all to all inside the
+ *  group, h global links per router and p hosts per router. There are a * h + 1 groups, so
+ *  every pair of groups has exactly one global link, and everything about the topology follows
+ *  from the indexes (router r of group g is routers[g * a + r], host i of router R is
+ *  hosts[R * p + i], the client is the last host, on router 0):
+ *    global port k = r * h + j of group g (port j of router r) leads to group (g + k + 1) mod groups
+ *    host i has the address 50.(i / 256).(i % 256).2, the client 29.0.0.2
+ *  so routing needs no tables, see DragonflyRouting.
+ */
+struct DragonflyTopology {
+  struct Port {
+    Ptr<CsmaNetDevice> device;  // device of this router
+    Ipv4Address gateway;        // address of the router at the other end
+  };
+  uint32_t a, p, h, groups;
+  std::vector<Ptr<Node> > routers;
+  std::vector<Ptr<Node> > hosts;
+  std::vector<Ptr<CsmaNetDevice> > hostPorts;    // device of the router towards every host
+  std::vector<Ptr<CsmaNetDevice> > hostDevices;  // device of every host
+  std::vector<std::vector<Port> > localPorts;    // towards every router of the group, by its index r
+  std::vector<std::vector<Port> > globalPorts;   // the h global ports of every router
+  std::vector<uint64_t> globalBytes;             // frame bytes sent through every global port (router * h + j)
+  std::vector<uint64_t> globalPackets;
+
+  DragonflyTopology () : a (0), p (0), h (0), groups (0) {}
+
+  // Global port of group from leading to group to
+  uint32_t GlobalPort (uint32_t from, uint32_t to) const { return (to + groups - from - 1) % groups; }
+  // Router of group from owning the global link to group to
+  uint32_t Gateway (uint32_t from, uint32_t to) const { return from * a + GlobalPort (from, to) / h; }
+  // Host of an address, -1 if the address is no host
+  int HostOf (Ipv4Address address) const;
+  // Router of a host
+  uint32_t RouterOf (int host) const { return host + 1 == (int) hosts.size () ? 0 : host / p; }
+  // Router hops of a minimal path between two routers
+  uint32_t MinimalHops (uint32_t from, uint32_t to) const;
+};
+
+/**
+ *  Function to build a dragonfly next to the client, with the links, queues, stacks, echo
+ *  servers and address layout of the tree (see buildJellyfish()): host links in 50.x.y.0,
+ *  local links in 51.x.y.0, global links in 52.x.y.0, the client link 29.0.0.0.
+ *
+ *  uint32_t a, p, h are the routers per group, hosts per router and global links per router,
+ *  routing is minimal, valiant or ugal (see DragonflyRouting) and ugalThreshold the bias of
+ *  UGAL towards minimal paths, in packets. Every router gets a DragonflyRouting, hosts a
+ *  default route, so no global routing is needed: a, p, h = 16, 8, 8 (129 groups, 16512 hosts)
+ *  is built without any route computation. Returns 0, or 1 if routing is unknown.
+ */
+int buildDragonfly(Ptr<Node> client, uint32_t a, uint32_t p, uint32_t h, std::string routing, uint32_t ugalThreshold,
+                   std::string queueClasses, Ipv4InterfaceContainer* ipInterfaces, DragonflyTopology* topology);
+
+/**
+ *  Tag of a packet sent through an intermediate group by Valiant routing, set by the first
+ *  router of its path.
+ */
+class DragonflyTag : public Tag {
+public:
+  static TypeId GetTypeId (void);
+  virtual TypeId GetInstanceTypeId (void) const;
+  virtual uint32_t GetSerializedSize (void) const { return 4; }
+  virtual void Serialize (TagBuffer buffer) const { buffer.WriteU32 (intermediate); }
+  virtual void Deserialize (TagBuffer buffer) { intermediate = buffer.ReadU32 (); }
+  virtual void Print (std::ostream& os) const { os << "intermediate=" << intermediate; }
+
+  uint32_t intermediate;  // group the packet goes through
+};
+
+/**
+ *  Routing of a dragonfly router, computed from the structure of the topology:
+ *    minimal  to the router of the group owning the global link to the destination group, over
+ *             it, then to the router of the destination (at most local, global, local)
+ *    valiant  minimally to a random intermediate group first, then minimally to the
+ *             destination, which spreads adversarial traffic over all the global links
+ *    ugal     per packet, valiant when the queue of the first hop of the minimal path times its
+ *             hops is longer than for a random intermediate group (plus a threshold), minimal
+ *             otherwise, looking only at the queues of this router (UGAL-L)
+ *  The first router decides and tags the packets going through an intermediate group, the
+ *  others route minimally to the intermediate group while in the source group, and to the
+ *  destination from the intermediate group on. Like KspRouting, it only answers for packets to
+ *  hosts and is added to the list routing of the router.
+ */
+class DragonflyRouting : public Ipv4RoutingProtocol {
+public:
+  enum Mode { MINIMAL, VALIANT, UGAL };
+  static TypeId GetTypeId (void);
+  DragonflyRouting ();
+
+  // The topology, the index of this router in it and how to route
+  void Setup (const DragonflyTopology* topology, uint32_t router, Mode mode, uint32_t ugalThreshold);
+
+  Mode GetMode (void) const { return m_mode; }
+
+  // How validateTopology() has the router route its probes: as configured, minimally, or through
+  // a Valiant intermediate group picked from the destination host. Probes draw nothing from
+  // the routing stream, so validating does not change the random groups of the run
+  enum Probe { PROBE_OFF, PROBE_MINIMAL, PROBE_VALIANT };
+  void SetProbe (Probe probe) { m_probe = probe; }
+
+  virtual Ptr<Ipv4Route> RouteOutput (Ptr<Packet> p, const Ipv4Header &header, Ptr<NetDevice> oif,
+                                      Socket::SocketErrno &sockerr);
+  virtual bool RouteInput (Ptr<const Packet> p, const Ipv4Header &header, Ptr<const NetDevice> idev,
+                           UnicastForwardCallback ucb, MulticastForwardCallback mcb,
+                           LocalDeliverCallback lcb, ErrorCallback ecb);
+  virtual void NotifyInterfaceUp (uint32_t interface) {}
+  virtual void NotifyInterfaceDown (uint32_t interface) {}
+  virtual void NotifyAddAddress (uint32_t interface, Ipv4InterfaceAddress address) {}
+  virtual void NotifyRemoveAddress (uint32_t interface, Ipv4InterfaceAddress address) {}
+  virtual void SetIpv4 (Ptr<Ipv4> ipv4) { m_ipv4 = ipv4; }
+  virtual void PrintRoutingTable (Ptr<OutputStreamWrapper> stream) const;
+
+private:
+  // Port of this router towards a router of the same group or towards another group
+  const DragonflyTopology::Port& NextPort (uint32_t group, uint32_t router) const;
+
+  const DragonflyTopology* m_topology;
+  uint32_t m_router;
+  Mode m_mode;
+  uint32_t m_ugalThreshold;
+  Probe m_probe;
+  Ptr<Ipv4> m_ipv4;
+  Ptr<UniformRandomVariable> m_random;
+};
+
+/**
+ *  Function to connect the simulation counters to a dragonfly: queues of the global ports are
+ *  level 0, local ports level 1, router ports towards the hosts level 2 and hosts level 3. The
+ *  packets and bytes sent through every global port are counted too.
+ */
+void traceDragonflyCounters(DragonflyTopology* topology);
+
+/**
+ *  Function to log the utilization of the global links of a dragonfly over seconds of
+ *  simulated time: mean, max and the busiest link, both directions counted separately.
+ *
+ *  ResultsWriter* results gets the mean and max as metrics, 0 if --results is off
+ */
+void reportDragonflyLinks(DragonflyTopology* topology, double seconds, ResultsWriter* results);
+
+/**
+ *  Path of a source routed packet (--routing=source) as a vector of ports, bits bits per hop:
+ *  port 0 is the link to the parent, port i + 1 the link to leaf i. Entry h is used by the
+ *  h-th node of the path, the sender being node 0. The routers find their entry from the
+ *  TTL, ttl - TTL + 1, so the tag is never rewritten on the way.
+ *
+ *  The path travels in the tag; the packet carries WireBytes () of padding instead, so the
+ *  wire sees the overhead of a real source route header popped at every hop: the whole path
+ *  leaves the sender, and each router pops its entry (the first one the sender's too).
+ */
+class SourceRouteTag : public Tag {
+public:
+  SourceRouteTag () : ports (0), bits (0), hops (0), ttl (0) {}
+  static TypeId GetTypeId (void);
+  virtual TypeId GetInstanceTypeId (void) const;
+  virtual uint32_t GetSerializedSize (void) const { return 11; }
+  virtual void Serialize (TagBuffer buffer) const;
+  virtual void Deserialize (TagBuffer buffer);
+  virtual void Print (std::ostream& os) const { os << "hops=" << (int) hops << " ports=" << ports; }
+
+  uint32_t Port (uint32_t hop) const { return (ports >> (hop * bits)) & ((1u << bits) - 1); }
+  // Bytes of route the packet carries when it leaves the node of entry hop
+  uint32_t WireBytes (uint32_t hop) const { return ((hop == 0 ? hops : hops - hop - 1) * bits + 7) / 8; }
+
+  uint64_t ports;
+  uint8_t bits;
+  uint8_t hops;
+  uint8_t ttl;    // TTL the packet was sent with
+};
+
+/**
+ *  What the senders of a source routed tree share: the tree and the node of every address.
+ *  Routers only keep the next hop of each of their ports.
+ */
+struct SourceRoutePlan {
+  TreeTopology* topology;
+  uint8_t bits;                                // per hop, enough for numLeaves + 1 ports
+  std::unordered_map<uint32_t, int> nodeOf;    // address -> node id
+
+  // Path between two nodes of the tree into tag, false if it does not fit in 64 bits
+  bool Path (int from, int to, SourceRouteTag* tag) const;
+};
+
+/**
+ *  Source routing of a node of the tree (--routing=source). RouteOutput computes the path to
+ *  the destination from the positions of the two nodes in the tree and tags the packet with
+ *  it. RouteInput forwards a tagged packet through the port of its entry, in constant time
+ *  and without any table. Added to the list routing of the node above static and global
+ *  routing; local delivery is left to the list routing.
+ */
+class SourceRouting : public Ipv4RoutingProtocol {
+public:
+  static TypeId GetTypeId (void);
+  SourceRouting ();
+
+  // The shared plan and the node id of this node in the tree
+  void Setup (const SourceRoutePlan* plan, int id);
+
+  virtual Ptr<Ipv4Route> RouteOutput (Ptr<Packet> p, const Ipv4Header &header, Ptr<NetDevice> oif,
+                                      Socket::SocketErrno &sockerr);
+  virtual bool RouteInput (Ptr<const Packet> p, const Ipv4Header &header, Ptr<const NetDevice> idev,
+                           UnicastForwardCallback ucb, MulticastForwardCallback mcb,
+                           LocalDeliverCallback lcb, ErrorCallback ecb);
+  virtual void NotifyInterfaceUp (uint32_t interface) {}
+  virtual void NotifyInterfaceDown (uint32_t interface) {}
+  virtual void NotifyAddAddress (uint32_t interface, Ipv4InterfaceAddress address) {}
+  virtual void NotifyRemoveAddress (uint32_t interface, Ipv4InterfaceAddress address) {}
+  virtual void SetIpv4 (Ptr<Ipv4> ipv4) { m_ipv4 = ipv4; }
+  virtual void PrintRoutingTable (Ptr<OutputStreamWrapper> stream) const;
+
+private:
+  const SourceRoutePlan* m_plan;
+  int m_id;
+  uint8_t m_ttl;
+  std::vector<Ptr<Ipv4Route> > m_ports;   // next hop through each port, 0 for a missing port
+  Ptr<Ipv4> m_ipv4;
+};
+
+/**
+ *  Function to switch the tree to source routing: fills the plan (node of every address) and
+ *  adds a SourceRouting to every node. No routing table is computed.
+ *  Returns false if the paths of the tree do not fit in a SourceRouteTag, or if checksums are
+ *  on (popping the route bytes would break them).
+ */
+bool installSourceRouting(TreeTopology* topology, SourceRoutePlan* plan);
+
+/**
+ *  Node id of every address of the tree (key is the address as an integer), what source
+ *  routing and cut-through switching look destinations up in.
+ */
+void treeAddresses(TreeTopology* topology, std::unordered_map<uint32_t, int>* nodeOf);
+
+struct CutThrough;
+
+// One direction of a link towards a router, with cut-through switching
+struct CutThroughPort {
+  CutThrough* model;
+  int node;                      // the router receiving on this port
+  Ptr<CsmaChannel> channel;
+  Time delay;                    // propagation delay of the channel
+  double bitsPerSecond;
+  uint32_t headers;              // bytes the router needs before it can forward
+  bool early;                    // the delay of the channel is cut for the frame on it
+};
+
+/**
+ *  Cut-through switching of the routers of the tree (--cutThrough). Every frame a router will
+ *  forward is delivered to it as soon as its Ethernet and IPv4 headers are in, instead of
+ *  after its last bit: the propagation delay of the channel is cut by the time of the rest of
+ *  the frame for that frame only, set at PhyTxBegin and put back at PhyTxEnd, so no event is
+ *  added to the hop. The router then decides at header time, on its own state: through the
+ *  port at once if it is idle (counted as cut through), otherwise the frame waits in the
+ *  queue of the port. Every link runs at the same rate, so a frame never leaves faster than
+ *  it arrives.
+ *
+ *  Unlike a switch that stores a frame when its port is busy, a queued frame may leave before
+ *  its last bit is in, if the port frees up by then, and the half duplex channel is free again
+ *  as early as the frame is delivered.
+ */
+struct CutThrough {
+  TreeTopology* topology;
+  std::unordered_map<uint32_t, int> nodeOf;  // address -> node id
+  std::deque<CutThroughPort> ports;          // bound to the traces, must not move
+  uint64_t early;                            // frames that found their port idle at header time
+  uint64_t stored;                           // frames that waited in the queue of their port
+
+  CutThrough () : topology (0), early (0), stored (0) {}
+};
+
+/**
+ *  Function to switch the routers of the tree to cut-through, every server and the client
+ *  still wait for whole frames.
+ */
+void installCutThrough(TreeTopology* topology, CutThrough* model);
+
+/**
+ *  Function to report how many frames found their port idle when their headers came in, and
+ *  were forwarded at once. Adds the metrics cut_through_frames and cut_through_fraction to
+ *  results (if not 0).
+ */
+void reportCutThrough(const CutThrough& model, ResultsWriter* results);
+
+/**
+ *  Batched receive path of a router (--batch), VPP style. The receiver is the IPv4 protocol
+ *  handler of the CSMA devices of the router, in place of the traffic control layer, so the
+ *  devices receive as usual (FCS check, MacRx, sniffers) and hand it the frames without their
+ *  Ethernet header and trailer. The IPv4 frames received at the same time are processed
+ *  together once every event of that time has run, one layer at a time over the whole batch:
+ *  the route lookups (one per ingress device and destination in the batch), then the queues
+ *  of the egress devices. Whatever is not plainly forwarded (local delivery, TTL expiring,
+ *  bad checksum, no route, ARP not resolved, too big) goes to the traffic control layer as
+ *  received. The IPv4 Rx, Tx and UnicastForward traces do not see the packets forwarded by
+ *  the batch, the forwarded packets counter does, so a node traced from the control socket
+ *  is switched to the regular path (SetRegular).
+ */
+class BatchReceiver : public Object {
+public:
+  static TypeId GetTypeId (void);
+  BatchReceiver ();
+
+  // Takes the IPv4 frames of the CSMA devices of the node
+  void Setup (Ptr<Node> node);
+
+  // Protocol handler of the devices: keeps a frame for this node for the batch, gives the
+  // others to the traffic control layer
+  void Receive (Ptr<NetDevice> device, Ptr<const Packet> p, uint16_t protocol, const Address& from,
+                const Address& to, NetDevice::PacketType type);
+
+  // Every frame through the traffic control layer, for the IPv4 traces to see them
+  void SetRegular (bool regular) { m_regularOnly = regular; }
+
+  uint64_t GetBatches () const { return m_batches; }
+  uint64_t GetFrames () const { return m_frames; }
+  uint64_t GetLargest () const { return m_largest; }
+  uint64_t GetRegular () const { return m_regular; }
+
+protected:
+  virtual void DoDispose (void);
+
+private:
+  struct Frame {
+    uint32_t port;                // interface index of the ingress device
+    Ptr<const Packet> received;   // as the device gave it, for the regular path
+    Ptr<Packet> packet;           // copy without ip, 0 until its checksum is checked
+    Address from;
+    Address to;
+    Ipv4Header ip;
+    Ptr<Ipv4Route> route;         // 0 for the regular path
+  };
+
+  void Drain (void);
+  Ptr<Ipv4Route> Lookup (const Frame& frame);
+  bool Forward (Frame* frame);
+
+  // What the routing protocol answers a lookup with, only forwarding is kept
+  void Forwarded (Ptr<Ipv4Route> route, Ptr<const Packet> p, const Ipv4Header& header) { m_lookup = route; }
+  void Multicast (Ptr<Ipv4MulticastRoute> route, Ptr<const Packet> p, const Ipv4Header& header) {}
+  void Local (Ptr<const Packet> p, const Ipv4Header& header, uint32_t interface) {}
+  void Failed (Ptr<const Packet> p, const Ipv4Header& header, Socket::SocketErrno error) {}
+
+  Ptr<Ipv4L3Protocol> m_ipv4;
+  Node::ProtocolHandler m_regularHandler;   // the traffic control layer
+  std::vector<Ptr<NetDevice> > m_devices;   // by port, 0 for a device not batched
+  std::vector<Frame> m_batch;
+  std::vector<Frame> m_draining;            // kept to reuse its storage
+  std::unordered_map<uint64_t, Ptr<Ipv4Route> > m_routes;  // of the batch, by ingress port and destination
+  Ptr<Ipv4Route> m_lookup;
+  // Built once, not for every lookup
+  Ipv4RoutingProtocol::UnicastForwardCallback m_forwarded;
+  Ipv4RoutingProtocol::MulticastForwardCallback m_multicast;
+  Ipv4RoutingProtocol::LocalDeliverCallback m_local;
+  Ipv4RoutingProtocol::ErrorCallback m_failed;
+  bool m_regularOnly;
+  uint64_t m_batches;
+  uint64_t m_frames;
+  uint64_t m_largest;
+  uint64_t m_regular;
+};
+
+/**
+ *  Function to give every router of the tree a BatchReceiver (--batch), receivers gets them.
+ */
+void installBatching(TreeTopology* topology, std::vector<Ptr<BatchReceiver> >* receivers);
+
+/**
+ *  Function to report the batches of the routers: how many, their mean and largest size and
+ *  how many frames took the regular path. Adds the metrics batch_count, batch_mean_frames
+ *  and batch_regular_frames to results (if not 0).
+ */
+void reportBatching(const std::vector<Ptr<BatchReceiver> >& receivers, ResultsWriter* results);
+
+/**
+ *  Function to check what was built before running it, so a mistake in the construction (a
+ *  subnet given twice, a missing route, ...) is reported now and not as missing echo replies
+ *  at the end of a long run. Every node, device and address is looked at a constant number of
+ *  times:
+ *    connectivity  every node can be reached from the client through the links
+ *    addresses     no IPv4 address is given twice
+ *    subnets       the interfaces of a link are in one subnet that no other link uses, at any
+ *                  of the prefix lengths in use
+ *    MTU           the devices of a link have the same MTU
+ *    routes        every server can be reached from every client and back, by walking the
+ *                  routing protocols of the nodes as the IPv4 layer would (RouteOutput at the
+ *                  sender, RouteInput at every hop) without sending anything. Where a node
+ *                  goes next for a destination is remembered, so each node is walked once per
+ *                  destination (unless the packet carries a tag of its routing protocol).
+ *                  Dragonfly routers walk every kind of path they route on (minimal, and
+ *                  Valiant through an intermediate group picked from the destination)
+ *
+ *  Ptr<Node> client is the root client, bool serversSend is true when the servers send to each
+ *  other (a traffic pattern) instead of replying to the client, TreeTopology* topology names
+ *  the nodes by their position in the tree when they are in it.
+ *  Returns the number of problems found, the first few of each check are logged.
+ */
+uint64_t validateTopology(Ptr<Node> client, Ipv4InterfaceContainer* ipInterfaces, bool serversSend, TreeTopology* topology);
+
+/**
+ *  Everything networkTree() and the rest of the setup will create for a tree of a given size,
+ *  and what it is expected to cost, computed before creating anything.
+ */
+struct TreeEstimate {
+  uint64_t nodes;         // client, routers and servers
+  uint64_t channels;      // one CSMA channel per parent-leaf link
+  uint64_t devices;       // two CSMA devices (and queues) per channel
+  uint64_t interfaces;    // IPv4 interfaces, including the loopback of every node
+  uint64_t routes;        // routing table entries
+  uint64_t applications;  // one echo server per server node and one echo client for each of them
+  double memory;          // peak resident memory in bytes
+  double buildSeconds;    // creating the nodes, devices, stacks, addresses and applications
+  double routingSeconds;  // Ipv4GlobalRoutingHelper::PopulateRoutingTables()
+};
+
+/**
+ *  Function to estimate the object counts, memory and setup time of a tree of the given
+ *  number of levels and leaves per node, from per-object costs measured on small trees (see
+ *  the constants in the function), so a run that would not fit in memory is never started.
+ *
+ *  bool treeRoutes is true for --routing=tree, every node only has routes to the subnets
+ *  below it and a default route, instead of a global route to every subnet
+ */
+TreeEstimate estimateTree(int levels, int numLeaves, bool treeRoutes);
+
+// Memory available to this run in bytes, from /proc/meminfo (0 if unknown)
+uint64_t availableMemory();
+
+// Resident set size of this process in bytes, 0 if /proc is not available
+uint64_t residentMemory();
+
+// Length of the intervals of LinkDirectionUsage::buckets in nanoseconds, 0 = not kept
+static int64_t linkInterval = 0;
+
+// Live metrics exporter and control server of this run, if enabled (0 otherwise)
+static MetricsExporter* metricsExporter = 0;
+static ControlServer* controlServer = 0;
+
+
+NS_LOG_COMPONENT_DEFINE ("networkTree"); // Naming this script to enable logging (debugging)
+
+int main (int argc, char *argv[])
+{
+  LogComponentEnable ("networkTree", LOG_LEVEL_INFO); // Enable logging or debugging at the info level
+
+  // Optional live metrics, e.g. ./waf --run "networkTree --metricsPort=9464" and point Prometheus
+  // at http://localhost:9464/metrics, or --metricsFile=run.prom to get a file rewritten periodically
+  uint32_t metricsPort = 0;
+  std::string metricsFile = "";
+  double metricsInterval = 5.0;
+  CommandLine cmd;
+  cmd.AddValue ("metricsPort", "Serve live metrics in Prometheus format on this localhost port (0 = off)", metricsPort);
+  cmd.AddValue ("metricsFile", "Rewrite live metrics in Prometheus format to this file (empty = off)", metricsFile);
+  cmd.AddValue ("metricsInterval", "Seconds (wall clock) between two writes of metricsFile", metricsInterval);
+  // Optional control socket, e.g. --controlSocket=/tmp/tree.sock then "echo pause | nc -U /tmp/tree.sock"
+  std::string controlSocket = "";
+  cmd.AddValue ("controlSocket", "Unix socket to pause, inspect and reconfigure the running simulation (empty = off)", controlSocket);
+  // Queue sizes per level, and the search for the smallest ones meeting a target, e.g.
+  // --searchQueues=drop --searchTarget=0.001 prints a plan to give back with --queueSizes
+  std::string queueSizes = "";
+  std::string searchQueues = "";
+  double searchTarget = 0.001;
+  uint32_t searchMax = 1000;
+  uint32_t searchWorkers = std::max (1u, std::thread::hardware_concurrency ());
+  std::string searchCurves = "queue-search.csv";
+  cmd.AddValue ("queueSizes", "Queue size (packets) per level, root first, comma separated (empty = 1000 everywhere)", queueSizes);
+  cmd.AddValue ("searchQueues", "Search the smallest queue size per level meeting a target: drop or rtt (empty = off)", searchQueues);
+  cmd.AddValue ("searchTarget", "Maximum echo drop rate (0..1) or p99 RTT (seconds) for searchQueues", searchTarget);
+  cmd.AddValue ("searchMax", "Largest queue size tried by searchQueues", searchMax);
+  cmd.AddValue ("searchWorkers", "Simulations run in parallel by searchQueues", searchWorkers);
+  cmd.AddValue ("searchCurves", "CSV file for the drop rate and RTT of every run of searchQueues", searchCurves);
+  // Size of the tree, and the pre-flight check that it fits in memory before building it
+  int levels = 2;
+  int numLeaves = 3;
+  double memoryLimit = availableMemory () / 1048576.0; // 0 if unknown, then there is no check
+  bool force = false;
+  bool estimateOnly = false;
+  cmd.AddValue ("levels", "Levels of routers/servers below the client", levels);
+  cmd.AddValue ("leaves", "Leaves connected to every node", numLeaves);
+  cmd.AddValue ("memoryLimit", "Refuse to build a tree estimated to need more memory than this (MB)", memoryLimit);
+  cmd.AddValue ("force", "Build the tree even if it is estimated not to fit in memoryLimit", force);
+  cmd.AddValue ("estimate", "Only print the pre-flight estimate of the tree and exit", estimateOnly);
+  // Building and routing the tree
+  uint32_t buildThreads = std::max (1u, std::thread::hardware_concurrency ());
+  std::string routing = "global";
+  cmd.AddValue ("buildThreads", "Worker threads computing the paths of a jellyfish", buildThreads);
+  cmd.AddValue ("routing", "global (Ipv4GlobalRoutingHelper), tree (static routes computed from the tree) or source (paths in the packets)", routing);
+  // A Jellyfish (random regular graph of switches) instead of the tree, by default with as many
+  // switches and ports as the routers of the tree and the same servers
+  std::string topologyKind = "tree";
+  uint32_t jellyfishSwitches = 0;
+  uint32_t jellyfishPorts = 0;
+  uint32_t jellyfishSeed = 1;
+  uint32_t jellyfishPaths = 8;
+  cmd.AddValue ("topology", "tree, jellyfish for random links between switches, or dragonfly", topologyKind);
+  cmd.AddValue ("jellyfishSwitches", "Switches of the jellyfish (0 = the routers of the tree, root included)", jellyfishSwitches);
+  cmd.AddValue ("jellyfishPorts", "Ports of every jellyfish switch (0 = leaves + 1 as a router of the tree, at least 3 left for switch links)", jellyfishPorts);
+  cmd.AddValue ("jellyfishSeed", "Seed of the random links of the jellyfish", jellyfishSeed);
+  cmd.AddValue ("jellyfishPaths", "Shortest paths used between every pair of jellyfish switches (0 = global routing)", jellyfishPaths);
+  // Or a dragonfly, a * h + 1 groups of a routers with p hosts and h global links each
+  uint32_t dragonflyA = 4;
+  uint32_t dragonflyP = 2;
+  uint32_t dragonflyH = 2;
+  std::string dragonflyRouting = "minimal";
+  uint32_t ugalThreshold = 2;
+  cmd.AddValue ("dragonflyA", "Routers per dragonfly group", dragonflyA);
+  cmd.AddValue ("dragonflyP", "Hosts per dragonfly router", dragonflyP);
+  cmd.AddValue ("dragonflyH", "Global links per dragonfly router", dragonflyH);
+  cmd.AddValue ("dragonflyRouting", "minimal, valiant or ugal", dragonflyRouting);
+  cmd.AddValue ("ugalThreshold", "Packets UGAL favours the minimal path by", ugalThreshold);
+  // Traffic: the client sending to every server (root), or the servers sending to each other
+  std::string pattern = "root";
+  uint32_t patternRounds = 1;
+  double patternInterval = 0.001;
+  uint32_t patternStride = 1;
+  uint32_t hotspot = 0;
+  double hotFraction = 0.5;
+  uint32_t patternSeed = 1;
+  cmd.AddValue ("pattern", "root, all-to-all, permutation, stride or hotspot", pattern);
+  cmd.AddValue ("patternRounds", "Times every server goes through the pattern", patternRounds);
+  cmd.AddValue ("patternInterval", "Seconds between two packets of a server", patternInterval);
+  cmd.AddValue ("patternStride", "Distance to the destination for the stride pattern", patternStride);
+  cmd.AddValue ("hotspot", "Index of the hot server for the hotspot pattern", hotspot);
+  cmd.AddValue ("hotFraction", "Fraction of the packets going to the hotspot", hotFraction);
+  cmd.AddValue ("patternSeed", "Seed of the permutation pattern", patternSeed);
+  // Device queues: a single DropTail FIFO, or classes (see TreeClassQueue)
+  std::string queueClasses = "";
+  cmd.AddValue ("queueClasses", "Traffic classes of the device queues, e.g. probe:prio:port=9;rest:1:* (empty = FIFO)", queueClasses);
+  // Root client: UdpEchoClient, or an RPC client with timeouts and retries
+  bool rpc = false;
+  uint32_t rpcRequests = 1;
+  double rpcInterval = 0.0001;
+  double rpcTimeout = 0.05;
+  uint32_t rpcRetries = 3;
+  cmd.AddValue ("rpc", "Send the echo requests of the root with timeouts and retries", rpc);
+  cmd.AddValue ("rpcRequests", "RPC requests per server", rpcRequests);
+  cmd.AddValue ("rpcInterval", "Seconds between two RPC requests", rpcInterval);
+  cmd.AddValue ("rpcTimeout", "Seconds before the first retry of a request, doubled at every retry", rpcTimeout);
+  cmd.AddValue ("rpcRetries", "Retries before a request times out", rpcRetries);
+  // Results of the run, appended to a results file (see resultsStore.h and resultsQuery.cc)
+  std::string results = "";
+  double resultsInterval = 0.1;
+  cmd.AddValue ("results", "Append the summary and time series of the run to this results file (empty = off)", results);
+  cmd.AddValue ("resultsInterval", "Simulated seconds between two samples of the time series", resultsInterval);
+  double linkSeconds = 0;
+  cmd.AddValue ("linkInterval", "Simulated seconds between two samples of the link busy time series (0 = off)", linkSeconds);
+  // sFlow-like sampling on the routers of the tree (see SflowAgent)
+  uint32_t sflow = 0;
+  double sflowInterval = 1.0;
+  std::string sflowCollector = "";
+  std::string sflowFile = "sflow.txt";
+  cmd.AddValue ("sflow", "Sample 1 in this many packets received by the routers (0 = off)", sflow);
+  cmd.AddValue ("sflowInterval", "Seconds between two polls of the interface counters by --sflow", sflowInterval);
+  cmd.AddValue ("sflowCollector", "Position of the node collecting the sFlow datagrams, e.g. root (empty = out of band)", sflowCollector);
+  cmd.AddValue ("sflowFile", "File of the sFlow records, the exact counts go to the same name with .truth", sflowFile);
+  // HPCC incast between the servers, the queues stamp in-band telemetry (see HpccSender)
+  bool hpcc = false;
+  uint32_t hpccReceiver = 0;
+  uint32_t hpccSenders = 0;
+  uint64_t hpccBytes = 1000000;
+  double hpccEta = 0.95;
+  uint32_t hpccMaxStage = 5;
+  uint32_t hpccWai = 0;
+  cmd.AddValue ("hpcc", "Run an incast of HPCC flows between the servers", hpcc);
+  cmd.AddValue ("hpccReceiver", "Index of the server receiving the HPCC incast", hpccReceiver);
+  cmd.AddValue ("hpccSenders", "Servers sending to the receiver (0 = all the others)", hpccSenders);
+  cmd.AddValue ("hpccBytes", "Size of every HPCC flow", hpccBytes);
+  cmd.AddValue ("hpccEta", "Target utilization of HPCC", hpccEta);
+  cmd.AddValue ("hpccMaxStage", "Additive increases of HPCC before its reference window moves", hpccMaxStage);
+  cmd.AddValue ("hpccWai", "Additive increase of HPCC in bytes (0 = (1 - eta) BDP / senders)", hpccWai);
+  // RoCE incast between the servers with DCQCN, the queues mark ECN (see RoceSender)
+  bool roce = false;
+  uint32_t roceReceiver = 0;
+  uint32_t roceSenders = 0;
+  uint64_t roceBytes = 1000000;
+  std::string roceFile = "roce.txt";
+  uint32_t ecnKmin = 5000;
+  uint32_t ecnKmax = 200000;
+  double ecnPmax = 0.01;
+  cmd.AddValue ("roce", "Run an incast of RoCE flows with DCQCN between the servers", roce);
+  cmd.AddValue ("roceReceiver", "Index of the server receiving the RoCE incast", roceReceiver);
+  cmd.AddValue ("roceSenders", "Servers sending to the receiver (0 = all the others)", roceSenders);
+  cmd.AddValue ("roceBytes", "Size of every RoCE flow", roceBytes);
+  cmd.AddValue ("roceFile", "File of the completion time, throughput and rate changes of every RoCE flow", roceFile);
+  cmd.AddValue ("ecnKmin", "Bytes queued below which --roce marks nothing", ecnKmin);
+  cmd.AddValue ("ecnKmax", "Bytes queued above which --roce marks everything", ecnKmax);
+  cmd.AddValue ("ecnPmax", "Marking probability of --roce at ecnKmax", ecnPmax);
+  // Cut-through switching of the routers (see CutThrough)
+  bool cutThrough = false;
+  cmd.AddValue ("cutThrough", "Routers get frames once their headers are in, and forward them at once if their port is idle", cutThrough);
+  // Batched receive path of the routers (see BatchReceiver)
+  bool batch = false;
+  cmd.AddValue ("batch", "Routers process the frames received at the same time as a batch, one layer at a time", batch);
+  // Hardware counters per phase of the run
+  bool perf = false;
+  cmd.AddValue ("perf", "Read hardware performance counters for each phase of the run", perf);
+  // Allocation profile per phase (see AllocProfile)
+  bool allocProfile = false;
+  uint32_t allocSample = 4096;
+  cmd.AddValue ("allocProfile", "Count allocations per phase and size class, and sample their call stacks", allocProfile);
+  cmd.AddValue ("allocSample", "Record the call stack of one allocation in this many (0 = no stacks)", allocSample);
+  // Micro-benchmarks instead of a tree
+  std::string bench = "";
+  uint32_t benchPackets = 100000;
+  uint32_t benchSize = 1024;
+  cmd.AddValue ("bench", "Run a micro-benchmark instead of a tree: forward (empty = off)", bench);
+  cmd.AddValue ("benchPackets", "Packets sent through the router by the forward benchmark", benchPackets);
+  cmd.AddValue ("benchSize", "UDP payload of the forward benchmark packets", benchSize);
+  // Rare drop probabilities with importance splitting (see splitOverflow)
+  std::string split = "";
+  int splitLevel = -1;
+  uint32_t splitRetrials = 4;
+  bool patternPoisson = false;
+  cmd.AddValue ("split", "Estimate the drop probability with splitting at these queue thresholds, e.g. 100,200,400 (empty = off)", split);
+  cmd.AddValue ("splitLevel", "Level of the queues for --split (-1 = the leaf routers)", splitLevel);
+  cmd.AddValue ("splitRetrials", "Clones made at each threshold crossing by --split", splitRetrials);
+  cmd.AddValue ("patternPoisson", "Exponential times between the packets of the pattern clients", patternPoisson);
+  // Assignment of the nodes to the systems of a distributed run (see partitionTree)
+  uint32_t partition = 0;
+  std::string partitionWeights = "traffic";
+  double partitionProfile = 10.0;
+  std::string partitionFile = "partition.txt";
+  cmd.AddValue ("partition", "Split the nodes between this many systems for a distributed run and exit (0 = off)", partition);
+  cmd.AddValue ("partitionWeights", "Load of the nodes for --partition: traffic (from the pattern) or profile (a short run)", partitionWeights);
+  cmd.AddValue ("partitionProfile", "Simulated seconds of the profiling run of --partitionWeights=profile", partitionProfile);
+  cmd.AddValue ("partitionFile", "File for the node-id system-id lines of --partition", partitionFile);
+  // Checks of the topology before running it (see validateTopology)
+  bool validate = true;
+  cmd.AddValue ("validate", "Check links, addresses, subnets, MTUs and routes before running", validate);
+  cmd.Parse (argc, argv);
+  bool treeRoutes = routing == "tree";
+  bool sourceRoutes = routing == "source";
+  if (!treeRoutes && !sourceRoutes && routing != "global") {
+    NS_LOG_ERROR ("Unknown routing " << routing);
+    return 1;
+  }
+  linkInterval = (int64_t) (linkSeconds * 1e9);
+  if (patternPoisson) Config::SetDefault ("ns3::PatternClient::Poisson", BooleanValue (true));
+  if (!bench.empty () && bench != "forward") {
+    NS_LOG_ERROR ("Unknown benchmark " << bench);
+    return 1;
+  }
+  if (allocProfile) AllocProfile::Enable (allocSample);
+  bool jellyfish = topologyKind == "jellyfish";
+  bool dragonfly = topologyKind == "dragonfly";
+  if (!jellyfish && !dragonfly && topologyKind != "tree") {
+    NS_LOG_ERROR ("Unknown topology " << topologyKind);
+    return 1;
+  }
+  // What only makes sense for the levels of a tree
+  if ((jellyfish || dragonfly) && (treeRoutes || sourceRoutes || partition > 0 || !split.empty () || !searchQueues.empty ()
+                                   || sflow > 0 || hpcc || roce || cutThrough || batch)) {
+    NS_LOG_ERROR ("--routing=tree|source, --partition, --split, --searchQueues, --sflow, --hpcc, --roce, --cutThrough"
+                  " and --batch only work on the tree");
+    return 1;
+  }
+  // sFlow samples what the IPv4 layer receives, which the batches skip
+  if (batch && sflow > 0) {
+    NS_LOG_ERROR ("--batch does not work with --sflow");
+    return 1;
+  }
+  // The INT stamps are done by the class queues, a single class behaves as a drop tail queue
+  if (hpcc) {
+    if (queueClasses.empty ()) queueClasses = "default:1:*";
+    Config::SetDefault ("ns3::TreeClassQueue::IntStamp", BooleanValue (true));
+  }
+  // So are the ECN marks
+  if (roce) {
+    if (queueClasses.empty ()) queueClasses = "default:1:*";
+    if (ecnKmax <= ecnKmin) {
+      NS_LOG_ERROR ("--ecnKmax must be above --ecnKmin");
+      return 1;
+    }
+    Config::SetDefault ("ns3::TreeClassQueue::EcnKmin", UintegerValue (ecnKmin));
+    Config::SetDefault ("ns3::TreeClassQueue::EcnKmax", UintegerValue (ecnKmax));
+    Config::SetDefault ("ns3::TreeClassQueue::EcnPmax", DoubleValue (ecnPmax));
+  }
+  std::vector<TreeQueueClass> classes;
+  if (!queueClasses.empty () && !TreeClassQueue::ParseClasses (queueClasses, &classes)) return 1;
+  TrafficPattern trafficPattern;
+  if (pattern != "root" && !trafficPattern.SetKind (pattern)) {
+    NS_LOG_ERROR ("Unknown traffic pattern " << pattern);
+    return 1;
+  }
+
+  // Pre-flight: a 32 leaves, 3 levels tree needs far more memory than most machines have, find
+  // out now rather than after building half of it (or after bringing a shared machine down)
+  TreeEstimate estimate = estimateTree (levels, numLeaves, treeRoutes || sourceRoutes);
+  NS_LOG_INFO ("Tree of " << levels << " levels, " << numLeaves << " leaves: " << estimate.nodes << " nodes, "
+               << estimate.channels << " channels, " << estimate.devices << " devices, " << estimate.interfaces
+               << " interfaces, " << estimate.routes << " routes, " << estimate.applications << " applications");
+  NS_LOG_INFO ("Estimated peak memory " << (uint64_t) (estimate.memory / 1048576) << " MB (limit "
+               << (uint64_t) memoryLimit << " MB), build " << estimate.buildSeconds << "s, routing "
+               << estimate.routingSeconds << "s");
+  if (estimateOnly) return 0;
+  if (memoryLimit > 0 && estimate.memory > memoryLimit * 1048576.0 && !force) {
+    // Suggest the cheaper routing first, then the biggest tree with as many levels that fits
+    if (!treeRoutes && !sourceRoutes && estimateTree (levels, numLeaves, true).memory <= memoryLimit * 1048576.0) {
+      NS_LOG_ERROR ("Not starting, the tree would not fit in memory with global routing, it would with --routing=tree"
+                    " (or use --force to try anyway)");
+      return 1;
+    }
+    int fits = numLeaves;
+    while (fits > 1 && estimateTree (levels, fits, treeRoutes || sourceRoutes).memory > memoryLimit * 1048576.0) fits--;
+    NS_LOG_ERROR ("Not starting, the tree would not fit in memory. A tree of " << levels << " levels and "
+                  << fits << " leaves would, or use --force to try anyway");
+    return 1;
+  }
+  bool metrics = metricsPort != 0 || !metricsFile.empty ();
+
+  // The counting scheduler is what tells the exporter about events and what looks for control
+  // commands between events, so swap it in before anything gets scheduled (creating nodes
+  // already schedules their initialisation)
+  if (metrics || !controlSocket.empty () || !results.empty () || perf || allocProfile || !bench.empty ()) {
+    ObjectFactory scheduler;
+    scheduler.SetTypeId ("ns3::CountingMapScheduler");
+    Simulator::SetScheduler (scheduler);
+  }
+
+  NS_LOG_INFO ("Testing"); // Code reached here, should output "testing" on the shell
+
+  // We need to log packet info of client node, which contains a UDP application
+  LogComponentEnable ("UdpEchoClientApplication", LOG_LEVEL_INFO);
+
+  // uncomment line below to log server applications listening to packets and echoing them back
+  //LogComponentEnable ("UdpEchoServerApplication", LOG_LEVEL_INFO);
+
+  // There is a lot of congestion in this network topology, we need to increase the buffer size,
+  // otherwise packets will be dropped, we need to do this at the IP layer and the link layer,
+  // below increases buffer size to 1000 at the IP layer, as in, 1000 packets can be queued up
+  Config::SetDefault("ns3::ArpCache::PendingQueueSize", UintegerValue(1000));
+
+  if (bench == "forward") {
+    ResultsWriter benchResults;
+    int status = runForwardBench (benchPackets, benchSize, queueClasses, treeRoutes, batch, results.empty () ? 0 : &benchResults);
+    if (!results.empty ()) {
+      benchResults.SetParameter ("bench", bench);
+      if (!benchResults.Append (results)) NS_LOG_ERROR ("Could not write the results to " << results);
+    }
+    return status;
+  }
+
+  PerfCounters perfCounters;
+  if (perf && !perfCounters.Open ()) NS_LOG_WARN ("No hardware counters available, only timing the phases");
+  std::chrono::steady_clock::time_point setupStart = std::chrono::steady_clock::now ();
+  enterPhase (PHASE_BUILD, perf ? &perfCounters : 0);
+  Ptr<Node> client = CreateObject<Node> ();
+
+  InternetStackHelper stack;
+  stack.Install (client);
+
+  // We need to keep track of the IP addresses of the server nodes for the client to send
+  // packets to them, this can be done using a Ipv4InterfaceContainer var. The var ipInterfaces
+  // will be used to contain all the IP addresses of the server nodes.
+  Ipv4InterfaceContainer ipInterfaces;
+
+  // Keep track of what is built, so the nodes and queues can be found by their level later on
+  TreeTopology topology;
+  topology.numLeaves = numLeaves;
+  topology.levels = levels;
+  SourceRoutePlan sourcePlan;  // shared by the SourceRouting of every node with --routing=source
+  CutThrough cutThroughModel;
+  std::vector<Ptr<BatchReceiver> > batchReceivers;
+  topology.Add (client, -1, -1);
+
+  // Generate the topology with connections and IPv4 addresses
+  // by default, each node has 3 leaves, and it is 2 levels long, so there should be 3*3 = 9 server
+  // nodes at the bottom, use --leaves and --levels to create the appropriate topology
+  JellyfishTopology jellyfishTopology;
+  DragonflyTopology dragonflyTopology;
+  if (jellyfish) {
+    // Same equipment as the tree: its routers (root included) and their ports, its servers
+    uint32_t routers = 0, servers = 1;
+    for (int level = 0; level < levels; level++) {
+      routers += servers;
+      servers *= numLeaves;
+    }
+    if (jellyfishSwitches == 0) jellyfishSwitches = routers;
+    // A router of the tree has a single link up, a jellyfish switch needs a few to be connected
+    uint32_t hostsPerSwitch = (servers + 1 + jellyfishSwitches - 1) / jellyfishSwitches;
+    if (jellyfishPorts == 0) jellyfishPorts = std::max ((uint32_t) numLeaves + 1, hostsPerSwitch + 3);
+    if (buildJellyfish (client, jellyfishSwitches, jellyfishPorts, servers, jellyfishSeed, jellyfishPaths, buildThreads,
+                        queueClasses, &ipInterfaces, &jellyfishTopology) != 0) return 1;
+  } else if (dragonfly) {
+    if (buildDragonfly (client, dragonflyA, dragonflyP, dragonflyH, dragonflyRouting, ugalThreshold, queueClasses,
+                        &ipInterfaces, &dragonflyTopology) != 0) return 1;
+  } else {
+    if (!networkTree(client, topology.numLeaves, &ipInterfaces, topology.levels, &topology, treeRoutes, queueClasses)) return 1;
+    if (sourceRoutes && !installSourceRouting (&topology, &sourcePlan)) return 1;
+    if (cutThrough) installCutThrough (&topology, &cutThroughModel);
+    if (batch) installBatching (&topology, &batchReceivers);
+  }
+
+  // Install the UDP application on the client node and have these applications send a packet to
+  // all the server nodes, or have the servers send to each other following a pattern
+  enterPhase (PHASE_APPS, perf ? &perfCounters : 0);
+  Ptr<RpcEchoClient> rpcClient;
+  if (pattern == "root" && rpc) {
+    rpcClient = installRpcEchoClient(client, 9, &ipInterfaces, rpcRequests, Seconds (rpcInterval),
+                                     Seconds (rpcTimeout), rpcRetries, 2.0, 2000.0);
+  } else if (pattern == "root") {
+    installUdpEchoClient(client, 9, &ipInterfaces, 2.0, 2000.0);
+  } else {
+    trafficPattern.stride = patternStride;
+    trafficPattern.hotspot = hotspot;
+    trafficPattern.hotFraction = hotFraction;
+    trafficPattern.seed = patternSeed;
+    if (!installPatternClients(&trafficPattern, &ipInterfaces, 9, patternRounds, Seconds (patternInterval), 2.0, 2000.0)) {
+      return 1;
+    }
+  }
+  std::vector<Ptr<HpccSender> > hpccFlows;
+  if (hpcc) {
+    installHpccIncast(&topology, &ipInterfaces, hpccReceiver, hpccSenders, hpccBytes, hpccEta, hpccMaxStage, hpccWai,
+                      2.0, &hpccFlows);
+  }
+  std::vector<Ptr<RoceSender> > roceFlows;
+  if (roce) installRoceIncast(&topology, &ipInterfaces, roceReceiver, roceSenders, roceBytes, 2.0, &roceFlows);
+  std::ofstream sflowOut;
+  std::vector<Ptr<SflowAgent> > sflowAgents;
+  Ptr<SflowCollector> sflowCollectorApp;
+  if (sflow > 0) {
+    sflowOut.open (sflowFile.c_str ());
+    if (!sflowOut) {
+      NS_LOG_ERROR ("Cannot write the sFlow records to " << sflowFile);
+      return 1;
+    }
+    if (!installSflow (&topology, sflow, Seconds (sflowInterval), sflowCollector, &sflowOut, 2.0, 2000.0,
+                       &sflowAgents, &sflowCollectorApp)) return 1;
+  }
+
+  // Since this is dynamic routing and with a large network topology, populating the routing tables
+  // can take quite a long time. To simulate topology with 2 levels and 32 leaves at each level,
+  // there would be 32*32 = 1024 server nodes, it takes about 30 minutes to populate the tables.
+  // With --routing=tree the routes were already installed by networkTree(), computed from the
+  // structure of the tree, which takes no time at all, and --routing=source needs no tables.
+  enterPhase (PHASE_ROUTING, perf ? &perfCounters : 0);
+  if (!treeRoutes && !sourceRoutes && !(jellyfish && jellyfishPaths > 0) && !dragonfly) {
+    NS_LOG_INFO ("Populating table");
+    Ipv4GlobalRoutingHelper::PopulateRoutingTables ();
+    NS_LOG_INFO ("Populating table done");
+  }
+  enterPhase (PHASE_OTHER, perf ? &perfCounters : 0);
+  // What the estimate should have said, to keep the per-object costs of estimateTree() calibrated
+  double setupSeconds = std::chrono::duration<double> (std::chrono::steady_clock::now () - setupStart).count ();
+  NS_LOG_INFO ("Setup took " << setupSeconds
+               << "s (estimated " << estimate.buildSeconds + estimate.routingSeconds << "s), resident memory "
+               << residentMemory () / 1048576 << " MB (estimated " << (uint64_t) (estimate.memory / 1048576) << " MB)");
+
+  // Queue occupancy, drops, forwarded packets and RTT of the echo replies
+  traceTreeCounters (&topology);
+  if (jellyfish) traceJellyfishCounters (&jellyfishTopology);
+  if (dragonfly) traceDragonflyCounters (&dragonflyTopology);
+  if (!queueSizes.empty ()) applyQueuePlan (&topology, parseQueuePlan (queueSizes, topology.levels));
+  if (validate) {
+    uint64_t problems = validateTopology (client, &ipInterfaces, pattern != "root", &topology);
+    if (problems > 0) {
+      NS_LOG_ERROR ("Not running, " << problems << " problems in the topology (--validate=false to run anyway)");
+      return 1;
+    }
+  }
+
+  Simulator::Stop (Seconds (200));
+  // Everything is built, each run of the search is a fork of this process from here on
+  if (!searchQueues.empty ()) {
+    return searchQueuePlan (&topology, searchQueues, searchTarget, searchMax, searchWorkers, searchCurves);
+  }
+  if (!split.empty ()) {
+    if (pattern == "root" || !patternPoisson) {
+      NS_LOG_ERROR ("--split needs random traffic, use --pattern with --patternPoisson");
+      return 1;
+    }
+    std::vector<uint32_t> thresholds;
+    std::istringstream in (split);
+    std::string threshold;
+    while (std::getline (in, threshold, ',')) thresholds.push_back (atoi (threshold.c_str ()));
+    return splitOverflow (&topology, splitLevel < 0 ? topology.levels - 1 : splitLevel, thresholds, splitRetrials);
+  }
+
+  if (partition > 0) {
+    return partitionTree (&topology, pattern == "root" ? 0 : &trafficPattern, &ipInterfaces, partition,
+                          partitionWeights, partitionProfile, partitionFile);
+  }
+
+  MetricsExporter exporter (&topology);
+  if (metrics && !exporter.Start (metricsPort, metricsFile, metricsInterval)) return 1;
+  metricsExporter = &exporter;
+  // Allocated, not on the stack, since a checkpoint (forked child) has to leave it behind
+  if (!controlSocket.empty ()) {
+    controlServer = new ControlServer (&topology);
+    if (!controlServer->Start (controlSocket)) return 1;
+  }
+
+  ResultsWriter resultsWriter;
+  ResultsSampler resultsSampler (&resultsWriter, &topology, Seconds (resultsInterval));
+  if (!results.empty ()) resultsSampler.Start ();
+
+  NS_LOG_INFO ("Simulation begins now");
+  std::chrono::steady_clock::time_point runStart = std::chrono::steady_clock::now ();
+  if (allocProfile) Simulator::Schedule (Seconds (0.1), &AllocProfile::Sample, Seconds (0.1));
+  enterPhase (PHASE_RUN, perf ? &perfCounters : 0);
+  Simulator::Run ();
+  enterPhase (PHASE_OTHER, perf ? &perfCounters : 0);
+  double runSeconds = std::chrono::duration<double> (std::chrono::steady_clock::now () - runStart).count ();
+  NS_LOG_INFO ("Simulation ends");
+  exporter.Stop ();
+  if (controlServer != 0) controlServer->Stop ();
+  NS_LOG_INFO ("Packets forwarded: " << counters.packetsForwarded << ", IP drops: " << counters.ipDrops
+               << ", echo replies: " << counters.rtt.GetCount () << ", RTT p50/p99: "
+               << counters.rtt.Quantile (0.5) << "s/" << counters.rtt.Quantile (0.99) << "s");
+  SteadyStateResult steady;
+  bool steadyKnown = steadyRtt.Analyse (&steady);
+  if (steadyKnown) {
+    NS_LOG_INFO ("Steady state RTT after a warmup of " << steady.warmupSamples << " samples (until "
+                 << steady.warmupEnd.GetSeconds () << "s): mean " << steady.mean << "s +- " << steady.halfWidth
+                 << "s, p50/p99 " << steady.p50 << "s/" << steady.p99 << "s over " << steady.samples << " samples");
+  }
+  if (rpcClient != 0) {
+    NS_LOG_INFO ("RPC requests answered: " << rpcClient->GetSuccesses () << ", retries: " << rpcClient->GetRetries ()
+                 << ", timed out: " << rpcClient->GetTimeouts ());
+  }
+  if (!queueClasses.empty ()) reportQueueClasses (&topology);
+  if (!jellyfish && !dragonfly) reportLinkUsage (&topology, Simulator::Now ().GetSeconds (), results.empty () ? 0 : &resultsWriter);
+  reportHpcc (hpccFlows, results.empty () ? 0 : &resultsWriter);
+  reportRoce (roceFlows, roceFile, results.empty () ? 0 : &resultsWriter);
+  if (cutThrough) reportCutThrough (cutThroughModel, results.empty () ? 0 : &resultsWriter);
+  if (batch) reportBatching (batchReceivers, results.empty () ? 0 : &resultsWriter);
+  if (sflow > 0) {
+    std::string truthFile = sflowFile + ".truth";
+    std::ofstream truth (truthFile.c_str ());
+    uint64_t samples = 0, datagrams = 0;
+    for (size_t a = 0; a < sflowAgents.size (); a++) {
+      sflowAgents[a]->WriteTruth (truth);
+      samples += sflowAgents[a]->GetSamples ();
+      datagrams += sflowAgents[a]->GetDatagrams ();
+    }
+    std::ostringstream received;
+    if (sflowCollectorApp != 0) received << " (" << sflowCollectorApp->GetDatagrams () << " received by the collector)";
+    NS_LOG_INFO ("sFlow: " << samples << " packets sampled by " << sflowAgents.size () << " agents, " << datagrams
+                 << " datagrams" << received.str () << ", records in " << sflowFile << ", exact counts in " << truthFile);
+  }
+  if (dragonfly) reportDragonflyLinks (&dragonflyTopology, Simulator::Now ().GetSeconds (), results.empty () ? 0 : &resultsWriter);
+  if (perf) perfCounters.Report (counters.events);
+  if (allocProfile) AllocProfile::Report (counters.events, counters.packetHops);
+
+  if (!results.empty ()) {
+    std::ostringstream args;
+    for (int arg = 1; arg < argc; arg++) args << (arg > 1 ? " " : "") << argv[arg];
+    std::ostringstream sizes;
+    sizes << levels;
+    resultsWriter.SetParameter ("levels", sizes.str ());
+    sizes.str ("");
+    sizes << numLeaves;
+    resultsWriter.SetParameter ("leaves", sizes.str ());
+    resultsWriter.SetParameter ("pattern", rpc && pattern == "root" ? "rpc" : pattern);
+    resultsWriter.SetParameter ("routing", jellyfish ? (jellyfishPaths > 0 ? "ksp" : "global") : dragonfly ? dragonflyRouting : routing);
+    resultsWriter.SetParameter ("topology", topologyKind);
+    resultsWriter.SetParameter ("queueClasses", queueClasses);
+    resultsWriter.SetParameter ("queueSizes", queueSizes);
+    resultsWriter.SetParameter ("args", args.str ());
+    resultsWriter.SetMetric ("setup_seconds", setupSeconds);
+    resultsWriter.SetMetric ("run_seconds", runSeconds);
+    resultsWriter.SetMetric ("resident_memory_bytes", residentMemory ());
+    resultsWriter.SetMetric ("sim_seconds", Simulator::Now ().GetSeconds ());
+    resultsWriter.SetMetric ("events", counters.events);
+    resultsWriter.SetMetric ("packets_forwarded", counters.packetsForwarded);
+    resultsWriter.SetMetric ("ip_drops", counters.ipDrops);
+    resultsWriter.SetMetric ("echo_requests", counters.echoRequests);
+    resultsWriter.SetMetric ("echo_replies", counters.rtt.GetCount ());
+    resultsWriter.SetMetric ("rtt_p50", counters.rtt.Quantile (0.5));
+    resultsWriter.SetMetric ("rtt_p99", counters.rtt.Quantile (0.99));
+    resultsWriter.SetMetric ("rtt_p999", counters.rtt.Quantile (0.999));
+    if (steadyKnown) {
+      resultsWriter.SetMetric ("rtt_warmup_samples", steady.warmupSamples);
+      resultsWriter.SetMetric ("rtt_warmup_seconds", steady.warmupEnd.GetSeconds ());
+      resultsWriter.SetMetric ("rtt_steady_mean", steady.mean);
+      resultsWriter.SetMetric ("rtt_steady_mean_halfwidth", steady.halfWidth);
+      resultsWriter.SetMetric ("rtt_steady_p50", steady.p50);
+      resultsWriter.SetMetric ("rtt_steady_p99", steady.p99);
+    }
+    if (rpcClient != 0) {
+      resultsWriter.SetMetric ("rpc_successes", rpcClient->GetSuccesses ());
+      resultsWriter.SetMetric ("rpc_retries", rpcClient->GetRetries ());
+      resultsWriter.SetMetric ("rpc_timeouts", rpcClient->GetTimeouts ());
+    }
+    if (perf) perfCounters.AddResults (&resultsWriter);
+    if (!resultsWriter.Append (results)) NS_LOG_ERROR ("Could not write the results to " << results);
+  }
+  Simulator::Destroy ();
+  return 0;
+}
+
+// Nodes created below a parent by networkTree() at this level: its leaves and everything below them
+static uint64_t subtreeNodes(int numLeaves, int level) {
+  return level <= 0 ? 0 : numLeaves * (1 + subtreeNodes (numLeaves, level - 1));
+}
+
+// Branch numbers used below a parent at this level, one per group of leaves
+static uint64_t subtreeBranches(int numLeaves, int level) {
+  return level <= 0 ? 0 : 1 + numLeaves * subtreeBranches (numLeaves, level - 1);
+}
+
+// Highest branch number used below a parent at this level, the groups below its last leaf go furthest
+static uint64_t lastBranch(int numLeaves, int level, uint64_t branch) {
+  if (level <= 1) return branch;
+  return lastBranch (numLeaves, level - 1, branch + (numLeaves - 1) * subtreeBranches (numLeaves, level - 1));
+}
+
+/**
+ *  Plan the group of leaves below one parent and, recursively, the groups below its leaves,
+ *  appending them to plan.
+ *
+ *  firstLeaf is the first node id of this subtree and branch the first branch number, the
+ *  subnet of the link to a leaf is "9 + level . branch . leaf + 1 . 0", where the branch
+ *  number goes up by one after every group (the numbering the recursive construction always
+ *  used). firstInterface is the IPv4 interface of the parent for the link to its first leaf.
+ *
+ *  Returns the subnets of every link of the subtree, for the routes of the nodes above it.
+ */
+static std::vector<Ipv4Address> planGroup(TreeBuildPlan* plan, uint32_t parent, uint32_t firstInterface,
+                                          int numLeaves, int level, uint32_t firstLeaf, uint64_t branch) {
+  std::vector<Ipv4Address> below;
+  if (level <= 0) return below; // Base case, only recursively create more connections if level > 0
+
+  int group = plan->groups.size ();
+  plan->groups.push_back (TreeGroupPlan ());
+  plan->groups[group].parent = parent;
+  plan->groups[group].firstLeaf = firstLeaf;
+  plan->groups[group].level = level;
+
+  uint64_t leafNodes = subtreeNodes (numLeaves, level - 1);
+  uint64_t leafBranches = subtreeBranches (numLeaves, level - 1);
+  for (int leaf = 0; leaf < numLeaves; leaf++) {
+    // The subtree of every leaf before this one is complete by the time its link gets its
+    // address, which moves the branch number on by as many groups as there are in one subtree
+    char subnet [32];
+    sprintf (subnet, "%d.%d.%d.0", 9 + level, (int) (branch + leaf * leafBranches), leaf + 1);
+    plan->groups[group].subnets.push_back (subnet);
+
+    // The parent gets .1 of the subnet and the leaf .2
+    uint32_t leafId = firstLeaf + leaf;
+    Ipv4Address network (subnet);
+    Ipv4Address parentAddress (network.Get () + 1);
+    Ipv4Address leafAddress (network.Get () + 2);
+    TreeRoutePlan up = { leafId, Ipv4Address::GetZero (), parentAddress, 1 }; // interface 0 is the loopback
+    plan->routes.push_back (up);
+
+    // Leaves of this leaf, they come after all the leaves of this group
+    int leafGroup = level > 1 ? plan->groups.size () : -1;
+    std::vector<Ipv4Address> leafBelow = planGroup (plan, leafId, 2, numLeaves, level - 1,
+                                                    firstLeaf + numLeaves + leaf * leafNodes,
+                                                    branch + leaf * leafBranches);
+    plan->groups[group].leafGroups.push_back (leafGroup);
+    for (size_t net = 0; net < leafBelow.size (); net++) {
+      TreeRoutePlan down = { parent, leafBelow[net], leafAddress, firstInterface + leaf };
+      plan->routes.push_back (down);
+    }
+    below.push_back (network);
+    below.insert (below.end (), leafBelow.begin (), leafBelow.end ());
+  }
+  return below;
+}
+
+bool planTree(uint32_t parent, uint32_t firstInterface, int numLeaves, int level, TreeBuildPlan* plan) {
+  plan->groups.clear ();
+  plan->routes.clear ();
+  if (level <= 0) return true;
+  uint64_t branches = lastBranch (numLeaves, level, 1);
+  if (numLeaves > 255 || branches > 255 || 9 + level > 255) {
+    NS_LOG_ERROR ("A tree of " << level << " levels and " << numLeaves << " leaves needs subnets up to "
+                  << 9 + level << "." << branches << "." << numLeaves << ".0, past the 255 of an octet");
+    return false;
+  }
+  planGroup (plan, parent, firstInterface, numLeaves, level, NodeList::GetNNodes (), 1);
+  return true;
+}
+
+/**
+ *  Create the ns-3 objects of one group of the plan, and recursively of the groups below its
+ *  leaves, in the order the recursive construction always created them: the leaves, their
+ *  links, their stack, their server applications, then the address of every link followed by
+ *  the subtree below that leaf.
+ */
+static void buildGroup(const TreeBuildPlan& plan, int g, Ipv4InterfaceContainer* ipInterfaces,
+                       TreeTopology* topology, CsmaHelper& csma, InternetStackHelper& stack) {
+  const TreeGroupPlan& group = plan.groups[g];
+  Ptr<Node> parent = NodeList::GetNode (group.parent);
+  int level = group.level;
+
+  // Create the nodes to be connected as leaves
+  NodeContainer leaves;
+  leaves.Create(group.subnets.size());
+  NS_ASSERT (leaves.Get(0)->GetId() == group.firstLeaf);
+  for (int leaf = 0; leaf < leaves.GetN(); leaf++) {
+    topology->Add (leaves.Get(leaf), parent->GetId(), leaf);
+  }
+
+  // Connect the parent node to its leave nodes
+  std::vector<NetDeviceContainer> netC; // save them to assign IP addresses
+  for (int leaf = 0; leaf < leaves.GetN(); leaf++) {
+    netC.push_back( csma.Install( NodeContainer( parent, leaves.Get(leaf) ) ) );
+    // first device is on the parent, second on the leaf
+    topology->nodes[parent->GetId()].downDevices.push_back (DynamicCast<CsmaNetDevice> (netC.back().Get(0)));
+    topology->nodes[leaves.Get(leaf)->GetId()].upDevice = DynamicCast<CsmaNetDevice> (netC.back().Get(1));
+  }
+
+  // Set up the IP addresses to the leaves
+  stack.Install (leaves);
+  // Make sure level == 1 to ensure server nodes are installed at the bottom of the topology
+  if (level == 1) installUdpEchoServers(&leaves, 9, 1.0, 2000.0);
+
+  // Assign IP addresses to the leaves
+  Ipv4AddressHelper address;
+  for (int netDev = 0; netDev < netC.size(); netDev++) {
+    address.SetBase (group.subnets[netDev].c_str(), "255.255.255.0");
+    Ipv4InterfaceContainer tempContainer = address.Assign( netC.at(netDev) );
+
+    // Make sure we only obtain the addresses of the leaves nodes at the bottom of the topology
+    if (level == 1) ipInterfaces->Add(tempContainer);
+
+    // Connect each leaf to more nodes
+    if (group.leafGroups[netDev] >= 0) {
+      buildGroup (plan, group.leafGroups[netDev], ipInterfaces, topology, csma, stack);
+    }
+  }
+}
+
+// The links of the topologies: CSMA channels with the typical data centre values and the device
+// queues asked for
+static CsmaHelper linkHelper(std::string queueClasses) {
+  // Create the variable to help create the net devices and connect nodes to channels
+  CsmaHelper csma;
+  // Increase the buffer size at the link layer
+  if (queueClasses.empty ()) csma.SetQueue ("ns3::DropTailQueue", "MaxPackets", UintegerValue(1000));
+  else csma.SetQueue ("ns3::TreeClassQueue", "MaxPackets", UintegerValue(1000), "Classes", StringValue (queueClasses));
+  // Set the typical Data Centre standard values
+  csma.SetChannelAttribute ("DataRate", StringValue ("1Gbps"));
+  csma.SetChannelAttribute ("Delay", StringValue ("1ms"));
+  return csma;
+}
+
+bool networkTree(Ptr<Node> parent, int numLeaves, Ipv4InterfaceContainer* ipInterfaces, int level,
+                 TreeTopology* topology, bool treeRoutes, std::string queueClasses) {
+  if (level <= 0) return true;
+  Ptr<Ipv4> parentIpv4 = parent->GetObject<Ipv4> ();
+  TreeBuildPlan plan;
+  if (!planTree (parent->GetId (), parentIpv4->GetNInterfaces (), numLeaves, level, &plan)) return false;
+
+  CsmaHelper csma = linkHelper (queueClasses);
+  InternetStackHelper stack;
+  buildGroup (plan, 0, ipInterfaces, topology, csma, stack);
+
+  if (!treeRoutes) return true;
+  Ipv4StaticRoutingHelper routing;
+  for (size_t r = 0; r < plan.routes.size (); r++) {
+    const TreeRoutePlan& route = plan.routes[r];
+    Ptr<Ipv4StaticRouting> table = routing.GetStaticRouting (NodeList::GetNode (route.node)->GetObject<Ipv4> ());
+    if (route.network == Ipv4Address::GetZero ()) table->SetDefaultRoute (route.gateway, route.interface);
+    else table->AddNetworkRouteTo (route.network, Ipv4Mask ("255.255.255.0"), route.gateway, route.interface);
+  }
+  return true;
+}
+
+void installUdpEchoServers(NodeContainer* leaves, int port, float start, float end) {
+  for (int leaf = 0; leaf < leaves->GetN(); leaf++) {
+    Ptr<UdpEchoServer> serverApp = CreateObject<UdpEchoServer>();
+    serverApp->SetAttribute("Port", UintegerValue(port)); // server apps listen to this port
+
+    leaves->Get(leaf)->AddApplication(serverApp);
+
+    serverApp->SetStartTime (Seconds (start));
+    serverApp->SetStopTime (Seconds (end));
+  }
+}
+
+// Key of the link between two switches, whichever end it is seen from
+static uint64_t linkKey(int a, int b) {
+  return ((uint64_t) std::min (a, b) << 32) | (uint32_t) std::max (a, b);
+}
+
+// Random links using up the free ports of every switch, without loops or parallel links
+static std::vector<std::pair<int, int> > randomLinks(const std::vector<int>& freePorts, uint64_t seed) {
+  std::mt19937_64 random (seed);
+  std::vector<int> stubs;
+  for (size_t s = 0; s < freePorts.size (); s++) stubs.insert (stubs.end (), freePorts[s], s);
+  std::shuffle (stubs.begin (), stubs.end (), random);
+
+  std::vector<std::pair<int, int> > links, bad;
+  std::unordered_set<uint64_t> linked;
+  for (size_t i = 0; i + 1 < stubs.size (); i += 2) {
+    int a = stubs[i], b = stubs[i + 1];
+    if (a != b && linked.insert (linkKey (a, b)).second) links.push_back (std::make_pair (a, b));
+    else bad.push_back (std::make_pair (a, b));
+  }
+  // A pair that cannot be linked takes the place of a random link x-y, as a-x and b-y. Few
+  // pairs are bad and a few tries are enough for each, so this stays O(links).
+  for (size_t i = 0; i < bad.size () && !links.empty (); i++) {
+    int a = bad[i].first, b = bad[i].second;
+    for (int attempt = 0; attempt < 64; attempt++) {
+      size_t e = random () % links.size ();
+      int x = links[e].first, y = links[e].second;
+      if (random () & 1) std::swap (x, y);
+      if (a == x || b == y || linked.count (linkKey (a, x)) || linked.count (linkKey (b, y))) continue;
+      if (linkKey (a, x) == linkKey (b, y)) continue;
+      linked.erase (linkKey (x, y));
+      linked.insert (linkKey (a, x));
+      linked.insert (linkKey (b, y));
+      links[e] = std::make_pair (a, x);
+      links.push_back (std::make_pair (b, y));
+      break;
+    }
+  }
+  return links;
+}
+
+// Shortest path (fewest hops) between two switches avoiding some switches and links, empty if none
+static std::vector<int> shortestPath(const std::vector<std::vector<int> >& neighbours, int from, int to,
+                                     const std::vector<bool>& avoided, const std::set<uint64_t>& avoidedLinks) {
+  std::vector<int> previous (neighbours.size (), -1);
+  std::deque<int> queue (1, from);
+  previous[from] = from;
+  while (!queue.empty () && previous[to] < 0) {
+    int s = queue.front ();
+    queue.pop_front ();
+    for (size_t n = 0; n < neighbours[s].size (); n++) {
+      int next = neighbours[s][n];
+      if (previous[next] >= 0 || avoided[next] || avoidedLinks.count (linkKey (s, next))) continue;
+      previous[next] = s;
+      queue.push_back (next);
+    }
+  }
+  std::vector<int> path;
+  if (previous[to] < 0) return path;
+  for (int s = to; s != from; s = previous[s]) path.push_back (s);
+  path.push_back (from);
+  std::reverse (path.begin (), path.end ());
+  return path;
+}
+
+// The k shortest loop free paths between two switches (Yen's algorithm), shortest first
+static std::vector<std::vector<int> > kShortestPaths(const std::vector<std::vector<int> >& neighbours, int from, int to,
+                                                     uint32_t k) {
+  std::vector<std::vector<int> > found;
+  std::vector<bool> avoided (neighbours.size (), false);
+  std::set<uint64_t> avoidedLinks;
+  std::vector<int> first = shortestPath (neighbours, from, to, avoided, avoidedLinks);
+  if (first.empty ()) return found;
+  found.push_back (first);
+  std::set<std::pair<size_t, std::vector<int> > > candidates;
+  while (found.size () < k) {
+    const std::vector<int> last = found.back ();
+    // Leave the last path at every switch but the destination, through a link no path
+    // sharing the same beginning took, without going back through that beginning
+    for (size_t spur = 0; spur + 1 < last.size (); spur++) {
+      avoidedLinks.clear ();
+      for (size_t p = 0; p < found.size (); p++) {
+        if (found[p].size () > spur + 1 && std::equal (last.begin (), last.begin () + spur + 1, found[p].begin ())) {
+          avoidedLinks.insert (linkKey (found[p][spur], found[p][spur + 1]));
+        }
+      }
+      for (size_t s = 0; s < spur; s++) avoided[last[s]] = true;
+      std::vector<int> rest = shortestPath (neighbours, last[spur], to, avoided, avoidedLinks);
+      for (size_t s = 0; s < spur; s++) avoided[last[s]] = false;
+      if (rest.empty ()) continue;
+      std::vector<int> path (last.begin (), last.begin () + spur);
+      path.insert (path.end (), rest.begin (), rest.end ());
+      if (std::find (found.begin (), found.end (), path) == found.end ()) {
+        candidates.insert (std::make_pair (path.size (), path));
+      }
+    }
+    if (candidates.empty ()) break;
+    found.push_back (candidates.begin ()->second);
+    candidates.erase (candidates.begin ());
+  }
+  return found;
+}
+
+int buildJellyfish(Ptr<Node> client, uint32_t switches, uint32_t ports, uint32_t servers, uint32_t seed, uint32_t k,
+                   int threads, std::string queueClasses, Ipv4InterfaceContainer* ipInterfaces, JellyfishTopology* topology) {
+  // Hosts per switch, the servers round robin and the client on the switch with the most ports left
+  std::vector<int> freePorts (switches, ports);
+  topology->hostSwitch.clear ();
+  for (uint32_t h = 0; h <= servers; h++) {
+    int s = h < servers ? h % switches : std::max_element (freePorts.begin (), freePorts.end ()) - freePorts.begin ();
+    topology->hostSwitch.push_back (s);
+    freePorts[s]--;
+  }
+  if (switches < 2 || servers > 65535 || *std::min_element (freePorts.begin (), freePorts.end ()) < 1) {
+    NS_LOG_ERROR ("A Jellyfish of " << switches << " switches of " << ports << " ports cannot take " << servers
+                  << " servers and the client and still link its switches");
+    return 1;
+  }
+
+  // Draw links until the switches are connected
+  std::vector<std::pair<int, int> > links;
+  std::vector<std::vector<int> > neighbours;
+  for (uint32_t attempt = 0; attempt < 16; attempt++) {
+    links = randomLinks (freePorts, seed + attempt);
+    neighbours.assign (switches, std::vector<int> ());
+    for (size_t l = 0; l < links.size (); l++) {
+      neighbours[links[l].first].push_back (links[l].second);
+      neighbours[links[l].second].push_back (links[l].first);
+    }
+    // Connected if a single search from switch 0 reaches every switch
+    std::vector<bool> reached (switches, false);
+    std::vector<int> frontier (1, 0);
+    reached[0] = true;
+    uint32_t reachedCount = 1;
+    while (!frontier.empty ()) {
+      int s = frontier.back ();
+      frontier.pop_back ();
+      for (size_t n = 0; n < neighbours[s].size (); n++) {
+        if (reached[neighbours[s][n]]) continue;
+        reached[neighbours[s][n]] = true;
+        reachedCount++;
+        frontier.push_back (neighbours[s][n]);
+      }
+    }
+    if (reachedCount == switches) break;
+    if (attempt == 15) {
+      NS_LOG_ERROR ("No connected Jellyfish of " << switches << " switches with " << links.size ()
+                    << " links found, give the switches more ports");
+      return 1;
+    }
+  }
+
+  CsmaHelper csma = linkHelper (queueClasses);
+  InternetStackHelper stack;
+  NodeContainer switchNodes, serverNodes;
+  switchNodes.Create (switches);
+  stack.Install (switchNodes);
+  serverNodes.Create (servers);
+  stack.Install (serverNodes);
+  installUdpEchoServers (&serverNodes, 9, 1.0, 2000.0);
+  topology->switches.clear ();
+  topology->hosts.clear ();
+  for (uint32_t s = 0; s < switches; s++) topology->switches.push_back (switchNodes.Get (s));
+  for (uint32_t h = 0; h < servers; h++) topology->hosts.push_back (serverNodes.Get (h));
+  topology->hosts.push_back (client);
+
+  // Host links, the switch gets .1 and the host .2 and a default route through it
+  Ipv4AddressHelper address;
+  Ipv4StaticRoutingHelper routing;
+  for (uint32_t h = 0; h <= servers; h++) {
+    Ptr<Node> host = topology->hosts[h];
+    NetDeviceContainer devices = csma.Install (NodeContainer (topology->switches[topology->hostSwitch[h]], host));
+    char subnet [32];
+    if (h < servers) sprintf (subnet, "30.%d.%d.0", h >> 8, h & 255);
+    else sprintf (subnet, "29.0.0.0");
+    address.SetBase (subnet, "255.255.255.0");
+    Ipv4InterfaceContainer interfaces = address.Assign (devices);
+    if (h < servers) ipInterfaces->Add (interfaces);
+    topology->hostPorts.push_back (DynamicCast<CsmaNetDevice> (devices.Get (0)));
+    topology->hostDevices.push_back (DynamicCast<CsmaNetDevice> (devices.Get (1)));
+    topology->hostAddresses[interfaces.GetAddress (1).Get ()] = h;
+    Ptr<Ipv4> ipv4 = host->GetObject<Ipv4> ();
+    routing.GetStaticRouting (ipv4)->SetDefaultRoute (interfaces.GetAddress (0), ipv4->GetInterfaceForDevice (devices.Get (1)));
+  }
+
+  // Switch links
+  topology->ports.assign (switches, std::vector<JellyfishTopology::Port> ());
+  for (size_t l = 0; l < links.size (); l++) {
+    int a = links[l].first, b = links[l].second;
+    NetDeviceContainer devices = csma.Install (NodeContainer (topology->switches[a], topology->switches[b]));
+    char subnet [32];
+    sprintf (subnet, "40.%d.%d.0", (int) (l >> 8) & 255, (int) l & 255);
+    address.SetBase (subnet, "255.255.255.0");
+    Ipv4InterfaceContainer interfaces = address.Assign (devices);
+    JellyfishTopology::Port toB = { b, DynamicCast<CsmaNetDevice> (devices.Get (0)), interfaces.GetAddress (1) };
+    JellyfishTopology::Port toA = { a, DynamicCast<CsmaNetDevice> (devices.Get (1)), interfaces.GetAddress (0) };
+    topology->ports[a].push_back (toB);
+    topology->ports[b].push_back (toA);
+  }
+  NS_LOG_INFO ("Jellyfish of " << switches << " switches of " << ports << " ports, " << links.size () << " switch links, "
+               << servers << " servers");
+
+  // k shortest paths from every switch to every other one, the source switches shared by the workers
+  topology->k = k;
+  if (k == 0) return 0;
+  topology->paths.assign ((size_t) switches * switches * k, std::vector<int> ());
+  std::atomic<uint32_t> nextSwitch (0);
+  std::vector<std::thread> workers;
+  for (int t = 0; t < std::max (1, threads); t++) {
+    workers.push_back (std::thread ([&] () {
+      for (uint32_t s = nextSwitch++; s < switches; s = nextSwitch++) {
+        for (uint32_t d = 0; d < switches; d++) {
+          if (d == s) continue;
+          std::vector<std::vector<int> > paths = kShortestPaths (neighbours, s, d, k);
+          for (size_t i = 0; i < paths.size (); i++) topology->paths[((size_t) s * switches + d) * k + i].swap (paths[i]);
+        }
+      }
+    }));
+  }
+  for (size_t t = 0; t < workers.size (); t++) workers[t].join ();
+
+  double hops = 0, shortest = 0, found = 0;
+  for (size_t p = 0; p < topology->paths.size (); p++) {
+    if (topology->paths[p].empty ()) continue;
+    hops += topology->paths[p].size () - 1;
+    found++;
+    if (p % k == 0) shortest++;
+  }
+  NS_LOG_INFO ("Switch paths: " << found / std::max (1.0, shortest) << " of " << k << " found per pair on average, "
+               << hops / std::max (1.0, found) << " hops on average");
+
+  for (uint32_t s = 0; s < switches; s++) {
+    Ptr<KspRouting> ksp = CreateObject<KspRouting> ();
+    ksp->Setup (topology, s);
+    Ptr<Ipv4ListRouting> list = DynamicCast<Ipv4ListRouting> (topology->switches[s]->GetObject<Ipv4> ()->GetRoutingProtocol ());
+    list->AddRoutingProtocol (ksp, 10);
+  }
+  return 0;
+}
+
+NS_OBJECT_ENSURE_REGISTERED (KspPathTag);
+
+TypeId KspPathTag::GetTypeId (void) {
+  static TypeId tid = TypeId ("ns3::KspPathTag")
+    .SetParent<Tag> ()
+    .AddConstructor<KspPathTag> ();
+  return tid;
+}
+
+TypeId KspPathTag::GetInstanceTypeId (void) const {
+  return GetTypeId ();
+}
+
+NS_OBJECT_ENSURE_REGISTERED (KspRouting);
+
+TypeId KspRouting::GetTypeId (void) {
+  static TypeId tid = TypeId ("ns3::KspRouting")
+    .SetParent<Ipv4RoutingProtocol> ()
+    .AddConstructor<KspRouting> ();
+  return tid;
+}
+
+KspRouting::KspRouting () : m_topology (0), m_index (-1) {
+}
+
+void KspRouting::Setup (const JellyfishTopology* topology, int index) {
+  m_topology = topology;
+  m_index = index;
+}
+
+Ptr<Ipv4Route> KspRouting::RouteOutput (Ptr<Packet> p, const Ipv4Header &header, Ptr<NetDevice> oif,
+                                        Socket::SocketErrno &sockerr) {
+  // Switches do not send packets of their own
+  sockerr = Socket::ERROR_NOROUTETOHOST;
+  return 0;
+}
+
+uint64_t KspRouting::FlowHash (Ptr<const Packet> p, const Ipv4Header &header) {
+  uint64_t hash = ((uint64_t) header.GetSource ().Get () << 32 | header.GetDestination ().Get ()) * 0x9E3779B97F4A7C15ULL;
+  hash ^= header.GetProtocol ();
+  UdpHeader udp;
+  if (header.GetProtocol () == 17 && p->PeekHeader (udp) == 8) {
+    hash ^= ((uint64_t) udp.GetSourcePort () << 16 | udp.GetDestinationPort ()) * 0xBF58476D1CE4E5B9ULL;
+  }
+  return hash ^ (hash >> 31);
+}
+
+bool KspRouting::RouteInput (Ptr<const Packet> p, const Ipv4Header &header, Ptr<const NetDevice> idev,
+                             UnicastForwardCallback ucb, MulticastForwardCallback mcb,
+                             LocalDeliverCallback lcb, ErrorCallback ecb) {
+  std::map<uint32_t, int>::const_iterator host = m_topology->hostAddresses.find (header.GetDestination ().Get ());
+  if (host == m_topology->hostAddresses.end ()) return false;
+  int destination = m_topology->hostSwitch[host->second];
+  Ptr<Ipv4Route> route = Create<Ipv4Route> ();
+  route->SetDestination (header.GetDestination ());
+  route->SetSource (header.GetSource ());
+  if (destination == m_index) {
+    route->SetGateway (header.GetDestination ());
+    route->SetOutputDevice (m_topology->hostPorts[host->second]);
+    ucb (route, p, header);
+    return true;
+  }
+
+  // From another switch the path is in the tag, from a host this switch picks it
+  const std::vector<JellyfishTopology::Port>& ports = m_topology->ports[m_index];
+  bool fromSwitch = false;
+  for (size_t port = 0; port < ports.size (); port++) fromSwitch = fromSwitch || ports[port].device == idev;
+  KspPathTag tag;
+  Ptr<const Packet> packet = p;
+  if (!fromSwitch) {
+    size_t first = ((size_t) m_index * m_topology->switches.size () + destination) * m_topology->k;
+    uint32_t paths = 0;
+    while (paths < m_topology->k && !m_topology->paths[first + paths].empty ()) paths++;
+    if (paths == 0) {
+      ecb (p, header, Socket::ERROR_NOROUTETOHOST);
+      return true;
+    }
+    Ptr<Packet> tagged = p->Copy ();
+    tagged->RemovePacketTag (tag);
+    tag.path = first + FlowHash (p, header) % paths;
+    tagged->AddPacketTag (tag);
+    packet = tagged;
+  } else if (!p->PeekPacketTag (tag) || tag.path >= m_topology->paths.size ()) {
+    ecb (p, header, Socket::ERROR_NOROUTETOHOST);
+    return true;
+  }
+
+  const std::vector<int>& path = m_topology->paths[tag.path];
+  std::vector<int>::const_iterator here = std::find (path.begin (), path.end (), m_index);
+  if (here == path.end () || here + 1 == path.end ()) {
+    ecb (p, header, Socket::ERROR_NOROUTETOHOST);
+    return true;
+  }
+  for (size_t port = 0; port < ports.size (); port++) {
+    if (ports[port].neighbour != *(here + 1)) continue;
+    route->SetGateway (ports[port].gateway);
+    route->SetOutputDevice (ports[port].device);
+    ucb (route, packet, header);
+    return true;
+  }
+  ecb (p, header, Socket::ERROR_NOROUTETOHOST);
+  return true;
+}
+
+void KspRouting::PrintRoutingTable (Ptr<OutputStreamWrapper> stream) const {
+  std::ostream* os = stream->GetStream ();
+  size_t switches = m_topology->switches.size ();
+  *os << "Switch " << m_index << ", " << m_topology->k << " shortest paths to every switch\n";
+  for (size_t d = 0; d < switches; d++) {
+    for (uint32_t i = 0; i < m_topology->k; i++) {
+      const std::vector<int>& path = m_topology->paths[(m_index * switches + d) * m_topology->k + i];
+      if (path.empty ()) break;
+      *os << "  to " << d << ":";
+      for (size_t s = 0; s < path.size (); s++) *os << " " << path[s];
+      *os << "\n";
+    }
+  }
+}
+
+int DragonflyTopology::HostOf (Ipv4Address address) const {
+  uint32_t value = address.Get ();
+  if (value == Ipv4Address ("29.0.0.2").Get ()) return hosts.size () - 1;
+  if ((value >> 24) != 50 || (value & 255) != 2) return -1;
+  uint32_t host = (value >> 8) & 0xffff;
+  return host + 1 < hosts.size () ? host : -1;
+}
+
+uint32_t DragonflyTopology::MinimalHops (uint32_t from, uint32_t to) const {
+  uint32_t fromGroup = from / a, toGroup = to / a;
+  if (from == to) return 0;
+  if (fromGroup == toGroup) return 1;
+  return (from != Gateway (fromGroup, toGroup)) + 1 + (to != Gateway (toGroup, fromGroup));
+}
+
+int buildDragonfly(Ptr<Node> client, uint32_t a, uint32_t p, uint32_t h, std::string routing, uint32_t ugalThreshold,
+                   std::string queueClasses, Ipv4InterfaceContainer* ipInterfaces, DragonflyTopology* topology) {
+  DragonflyRouting::Mode mode;
+  if (routing == "minimal") mode = DragonflyRouting::MINIMAL;
+  else if (routing == "valiant") mode = DragonflyRouting::VALIANT;
+  else if (routing == "ugal") mode = DragonflyRouting::UGAL;
+  else {
+    NS_LOG_ERROR ("Unknown dragonfly routing " << routing << ", use minimal, valiant or ugal");
+    return 1;
+  }
+  topology->a = a;
+  topology->p = p;
+  topology->h = h;
+  topology->groups = a * h + 1;
+  uint32_t routers = topology->groups * a;
+  uint32_t servers = routers * p;
+  // Servers, local links (a pair of routers of a group each) and global links get 16 bits of subnet
+  uint64_t localLinks = (uint64_t) topology->groups * a * (a - 1) / 2;
+  if (a < 1 || h < 1 || servers > 65535 || localLinks > 65535 || (uint64_t) routers * h / 2 > 65535) {
+    NS_LOG_ERROR ("A dragonfly of " << a << " routers, " << p << " hosts and " << h << " global links per router"
+                  << " does not fit the addresses");
+    return 1;
+  }
+
+  CsmaHelper csma = linkHelper (queueClasses);
+  InternetStackHelper stack;
+  NodeContainer routerNodes, serverNodes;
+  routerNodes.Create (routers);
+  stack.Install (routerNodes);
+  serverNodes.Create (servers);
+  stack.Install (serverNodes);
+  installUdpEchoServers (&serverNodes, 9, 1.0, 2000.0);
+  for (uint32_t r = 0; r < routers; r++) topology->routers.push_back (routerNodes.Get (r));
+  for (uint32_t i = 0; i < servers; i++) topology->hosts.push_back (serverNodes.Get (i));
+  topology->hosts.push_back (client);
+
+  // Host links, the router gets .1 and the host .2 and a default route through it
+  Ipv4AddressHelper address;
+  Ipv4StaticRoutingHelper staticRouting;
+  for (uint32_t i = 0; i <= servers; i++) {
+    Ptr<Node> host = topology->hosts[i];
+    NetDeviceContainer devices = csma.Install (NodeContainer (topology->routers[topology->RouterOf (i)], host));
+    char subnet [32];
+    if (i < servers) sprintf (subnet, "50.%d.%d.0", i >> 8, i & 255);
+    else sprintf (subnet, "29.0.0.0");
+    address.SetBase (subnet, "255.255.255.0");
+    Ipv4InterfaceContainer interfaces = address.Assign (devices);
+    if (i < servers) ipInterfaces->Add (interfaces);
+    topology->hostPorts.push_back (DynamicCast<CsmaNetDevice> (devices.Get (0)));
+    topology->hostDevices.push_back (DynamicCast<CsmaNetDevice> (devices.Get (1)));
+    Ptr<Ipv4> ipv4 = host->GetObject<Ipv4> ();
+    staticRouting.GetStaticRouting (ipv4)->SetDefaultRoute (interfaces.GetAddress (0), ipv4->GetInterfaceForDevice (devices.Get (1)));
+  }
+
+  // Local links, every pair of routers of a group
+  topology->localPorts.assign (routers, std::vector<DragonflyTopology::Port> (a));
+  uint32_t link = 0;
+  for (uint32_t g = 0; g < topology->groups; g++) {
+    for (uint32_t r = 0; r < a; r++) {
+      for (uint32_t other = r + 1; other < a; other++, link++) {
+        uint32_t from = g * a + r, to = g * a + other;
+        NetDeviceContainer devices = csma.Install (NodeContainer (topology->routers[from], topology->routers[to]));
+        char subnet [32];
+        sprintf (subnet, "51.%d.%d.0", (link >> 8) & 255, link & 255);
+        address.SetBase (subnet, "255.255.255.0");
+        Ipv4InterfaceContainer interfaces = address.Assign (devices);
+        DragonflyTopology::Port toOther = { DynamicCast<CsmaNetDevice> (devices.Get (0)), interfaces.GetAddress (1) };
+        DragonflyTopology::Port toR = { DynamicCast<CsmaNetDevice> (devices.Get (1)), interfaces.GetAddress (0) };
+        topology->localPorts[from][other] = toOther;
+        topology->localPorts[to][r] = toR;
+      }
+    }
+  }
+
+  // Global links, made from the group with the lower index
+  topology->globalPorts.assign (routers, std::vector<DragonflyTopology::Port> (h));
+  link = 0;
+  for (uint32_t g = 0; g < topology->groups; g++) {
+    for (uint32_t other = g + 1; other < topology->groups; other++, link++) {
+      uint32_t port = topology->GlobalPort (g, other), back = topology->GlobalPort (other, g);
+      uint32_t from = topology->Gateway (g, other), to = topology->Gateway (other, g);
+      NetDeviceContainer devices = csma.Install (NodeContainer (topology->routers[from], topology->routers[to]));
+      char subnet [32];
+      sprintf (subnet, "52.%d.%d.0", (link >> 8) & 255, link & 255);
+      address.SetBase (subnet, "255.255.255.0");
+      Ipv4InterfaceContainer interfaces = address.Assign (devices);
+      DragonflyTopology::Port out = { DynamicCast<CsmaNetDevice> (devices.Get (0)), interfaces.GetAddress (1) };
+      DragonflyTopology::Port in = { DynamicCast<CsmaNetDevice> (devices.Get (1)), interfaces.GetAddress (0) };
+      topology->globalPorts[from][port % h] = out;
+      topology->globalPorts[to][back % h] = in;
+    }
+  }
+  topology->globalBytes.assign (routers * h, 0);
+  topology->globalPackets.assign (routers * h, 0);
+
+  for (uint32_t r = 0; r < routers; r++) {
+    Ptr<DragonflyRouting> dragonflyRouting = CreateObject<DragonflyRouting> ();
+    dragonflyRouting->Setup (topology, r, mode, ugalThreshold);
+    Ptr<Ipv4ListRouting> list = DynamicCast<Ipv4ListRouting> (topology->routers[r]->GetObject<Ipv4> ()->GetRoutingProtocol ());
+    list->AddRoutingProtocol (dragonflyRouting, 10);
+  }
+  NS_LOG_INFO ("Dragonfly of " << topology->groups << " groups of " << a << " routers, " << link << " global links, "
+               << servers << " servers, " << routing << " routing");
+  return 0;
+}
+
+NS_OBJECT_ENSURE_REGISTERED (DragonflyTag);
+
+TypeId DragonflyTag::GetTypeId (void) {
+  static TypeId tid = TypeId ("ns3::DragonflyTag")
+    .SetParent<Tag> ()
+    .AddConstructor<DragonflyTag> ();
+  return tid;
+}
+
+TypeId DragonflyTag::GetInstanceTypeId (void) const {
+  return GetTypeId ();
+}
+
+NS_OBJECT_ENSURE_REGISTERED (DragonflyRouting);
+
+TypeId DragonflyRouting::GetTypeId (void) {
+  static TypeId tid = TypeId ("ns3::DragonflyRouting")
+    .SetParent<Ipv4RoutingProtocol> ()
+    .AddConstructor<DragonflyRouting> ();
+  return tid;
+}
+
+DragonflyRouting::DragonflyRouting () : m_topology (0), m_router (0), m_mode (MINIMAL), m_ugalThreshold (0),
+                                         m_probe (PROBE_OFF) {
+  m_random = CreateObject<UniformRandomVariable> ();
+}
+
+void DragonflyRouting::Setup (const DragonflyTopology* topology, uint32_t router, Mode mode, uint32_t ugalThreshold) {
+  m_topology = topology;
+  m_router = router;
+  m_mode = mode;
+  m_ugalThreshold = ugalThreshold;
+}
+
+Ptr<Ipv4Route> DragonflyRouting::RouteOutput (Ptr<Packet> p, const Ipv4Header &header, Ptr<NetDevice> oif,
+                                              Socket::SocketErrno &sockerr) {
+  // Routers do not send packets of their own
+  sockerr = Socket::ERROR_NOROUTETOHOST;
+  return 0;
+}
+
+const DragonflyTopology::Port& DragonflyRouting::NextPort (uint32_t group, uint32_t router) const {
+  uint32_t a = m_topology->a;
+  if (group == m_router / a) return m_topology->localPorts[m_router][router % a];
+  uint32_t gateway = m_topology->Gateway (m_router / a, group);
+  if (gateway != m_router) return m_topology->localPorts[m_router][gateway % a];
+  return m_topology->globalPorts[m_router][m_topology->GlobalPort (m_router / a, group) % m_topology->h];
+}
+
+bool DragonflyRouting::RouteInput (Ptr<const Packet> p, const Ipv4Header &header, Ptr<const NetDevice> idev,
+                                   UnicastForwardCallback ucb, MulticastForwardCallback mcb,
+                                   LocalDeliverCallback lcb, ErrorCallback ecb) {
+  int host = m_topology->HostOf (header.GetDestination ());
+  if (host < 0) return false;
+  uint32_t a = m_topology->a;
+  uint32_t destination = m_topology->RouterOf (host);
+  uint32_t group = m_router / a, destinationGroup = destination / a;
+  Ptr<Ipv4Route> route = Create<Ipv4Route> ();
+  route->SetDestination (header.GetDestination ());
+  route->SetSource (header.GetSource ());
+  if (destination == m_router) {
+    route->SetGateway (header.GetDestination ());
+    route->SetOutputDevice (m_topology->hostPorts[host]);
+    ucb (route, p, header);
+    return true;
+  }
+
+  // Packets from a host are this router's to route, the others may carry an intermediate group
+  bool fromRouter = false;
+  for (uint32_t r = 0; r < a && !fromRouter; r++) fromRouter = m_topology->localPorts[m_router][r].device == idev;
+  for (uint32_t j = 0; j < m_topology->h && !fromRouter; j++) fromRouter = m_topology->globalPorts[m_router][j].device == idev;
+  uint32_t target = destinationGroup;
+  Ptr<const Packet> packet = p;
+  DragonflyTag tag;
+  bool detour = m_probe == PROBE_VALIANT || (m_probe == PROBE_OFF && m_mode != MINIMAL);
+  if (!fromRouter && detour && group != destinationGroup && m_topology->groups > 2) {
+    // A group other than the source and destination groups, random unless probing, where each
+    // destination host gets its own so the probes spread over the intermediate groups
+    uint32_t intermediate = m_probe == PROBE_VALIANT ? host % (m_topology->groups - 2)
+                                                     : m_random->GetInteger (0, m_topology->groups - 3);
+    if (intermediate >= std::min (group, destinationGroup)) intermediate++;
+    if (intermediate >= std::max (group, destinationGroup)) intermediate++;
+    bool valiant = m_mode == VALIANT || m_probe == PROBE_VALIANT;
+    if (m_mode == UGAL && m_probe == PROBE_OFF) {
+      const DragonflyTopology::Port& minimal = NextPort (destinationGroup, destination);
+      const DragonflyTopology::Port& detour = NextPort (intermediate, 0);
+      uint32_t landing = m_topology->Gateway (intermediate, group);
+      uint64_t minimalCost = (uint64_t) minimal.device->GetQueue ()->GetNPackets () * m_topology->MinimalHops (m_router, destination);
+      uint64_t detourCost = (uint64_t) detour.device->GetQueue ()->GetNPackets ()
+                            * (m_topology->MinimalHops (m_router, landing) + m_topology->MinimalHops (landing, destination));
+      valiant = minimalCost > detourCost + m_ugalThreshold;
+    }
+    if (valiant) {
+      Ptr<Packet> tagged = p->Copy ();
+      tagged->RemovePacketTag (tag);
+      tag.intermediate = intermediate;
+      tagged->AddPacketTag (tag);
+      packet = tagged;
+      target = intermediate;
+    }
+  } else if (fromRouter && group != destinationGroup && p->PeekPacketTag (tag) && tag.intermediate < m_topology->groups) {
+    // Only the source, intermediate and destination groups are visited: from the source group
+    // on to the intermediate group, from there on to the destination
+    if (group != tag.intermediate) target = tag.intermediate;
+  }
+
+  const DragonflyTopology::Port& port = NextPort (target, destination);
+  route->SetGateway (port.gateway);
+  route->SetOutputDevice (port.device);
+  ucb (route, packet, header);
+  return true;
+}
+
+void DragonflyRouting::PrintRoutingTable (Ptr<OutputStreamWrapper> stream) const {
+  uint32_t a = m_topology->a, h = m_topology->h;
+  std::ostream* os = stream->GetStream ();
+  *os << "Dragonfly router " << m_router % a << " of group " << m_router / a << ", global links to groups";
+  for (uint32_t j = 0; j < h; j++) *os << " " << (m_router / a + (m_router % a) * h + j + 1) % m_topology->groups;
+  *os << "\n";
+}
+
+void reportDragonflyLinks(DragonflyTopology* topology, double seconds, ResultsWriter* results) {
+  if (topology->globalBytes.empty () || seconds <= 0) return;
+  double sum = 0, max = 0;
+  size_t busiest = 0;
+  uint64_t packets = 0;
+  for (size_t port = 0; port < topology->globalBytes.size (); port++) {
+    double utilization = topology->globalBytes[port] * 8 / (1e9 * seconds);
+    sum += utilization;
+    packets += topology->globalPackets[port];
+    if (utilization > max) {
+      max = utilization;
+      busiest = port;
+    }
+  }
+  double mean = sum / topology->globalBytes.size ();
+  uint32_t router = busiest / topology->h, group = router / topology->a;
+  uint32_t to = (group + (router % topology->a) * topology->h + busiest % topology->h + 1) % topology->groups;
+  NS_LOG_INFO ("Global links: " << packets << " packets, utilization mean " << mean << ", max " << max
+               << " (group " << group << " to group " << to << ", " << (mean > 0 ? max / mean : 0) << " times the mean)");
+  if (results != 0) {
+    results->SetMetric ("global_link_utilization_mean", mean);
+    results->SetMetric ("global_link_utilization_max", max);
+    results->SetMetric ("global_link_packets", packets);
+  }
+}
+
+NS_OBJECT_ENSURE_REGISTERED (SourceRouteTag);
+
+TypeId SourceRouteTag::GetTypeId (void) {
+  static TypeId tid = TypeId ("ns3::SourceRouteTag")
+    .SetParent<Tag> ()
+    .AddConstructor<SourceRouteTag> ();
+  return tid;
+}
+
+TypeId SourceRouteTag::GetInstanceTypeId (void) const {
+  return GetTypeId ();
+}
+
+void SourceRouteTag::Serialize (TagBuffer buffer) const {
+  buffer.WriteU64 (ports);
+  buffer.WriteU8 (bits);
+  buffer.WriteU8 (hops);
+  buffer.WriteU8 (ttl);
+}
+
+void SourceRouteTag::Deserialize (TagBuffer buffer) {
+  ports = buffer.ReadU64 ();
+  bits = buffer.ReadU8 ();
+  hops = buffer.ReadU8 ();
+  ttl = buffer.ReadU8 ();
+}
+
+bool SourceRoutePlan::Path (int from, int to, SourceRouteTag* tag) const {
+  // Up to the common ancestor, then down through the leaves towards the destination, which
+  // are found from the destination up so they are kept aside
+  uint32_t up = 0, downs = 0;
+  uint8_t down[64];
+  while (from != to) {
+    if (topology->nodes[from].depth >= topology->nodes[to].depth) {
+      from = topology->nodes[from].parent;
+      up++;
+    } else {
+      if (downs == sizeof down) return false;
+      down[downs++] = topology->nodes[to].leafIndex + 1;
+      to = topology->nodes[to].parent;
+    }
+  }
+  if ((up + downs) * bits > 64) return false;
+  tag->bits = bits;
+  tag->hops = up + downs;
+  tag->ports = 0;   // port 0 for every hop up
+  for (uint32_t d = 0; d < downs; d++) tag->ports |= (uint64_t) down[downs - 1 - d] << ((up + d) * bits);
+  return true;
+}
+
+NS_OBJECT_ENSURE_REGISTERED (SourceRouting);
+
+TypeId SourceRouting::GetTypeId (void) {
+  static TypeId tid = TypeId ("ns3::SourceRouting")
+    .SetParent<Ipv4RoutingProtocol> ()
+    .AddConstructor<SourceRouting> ();
+  return tid;
+}
+
+SourceRouting::SourceRouting () : m_plan (0), m_id (-1), m_ttl (64) {
+}
+
+void SourceRouting::Setup (const SourceRoutePlan* plan, int id) {
+  m_plan = plan;
+  m_id = id;
+  const TreeTopology* topology = plan->topology;
+  const TreeNodeInfo& info = topology->nodes[id];
+  Ptr<Ipv4> ipv4 = info.node->GetObject<Ipv4> ();
+  UintegerValue ttl;
+  info.node->GetObject<Ipv4L3Protocol> ()->GetAttribute ("DefaultTtl", ttl);
+  m_ttl = ttl.Get ();
+
+  // The gateway of a port is the address of the node at the other end of its link
+  m_ports.assign (topology->numLeaves + 1, 0);
+  for (uint32_t port = 0; port < m_ports.size (); port++) {
+    Ptr<CsmaNetDevice> device, other;
+    if (port == 0 && info.parent >= 0) {
+      device = info.upDevice;
+      other = topology->nodes[info.parent].downDevices[info.leafIndex];
+    } else if (port > 0 && port <= info.children.size ()) {
+      device = info.downDevices[port - 1];
+      other = topology->nodes[info.children[port - 1]].upDevice;
+    } else {
+      continue;
+    }
+    Ptr<Ipv4> otherIpv4 = other->GetNode ()->GetObject<Ipv4> ();
+    Ptr<Ipv4Route> route = Create<Ipv4Route> ();
+    route->SetSource (ipv4->GetAddress (ipv4->GetInterfaceForDevice (device), 0).GetLocal ());
+    route->SetGateway (otherIpv4->GetAddress (otherIpv4->GetInterfaceForDevice (other), 0).GetLocal ());
+    route->SetOutputDevice (device);
+    m_ports[port] = route;
+  }
+}
+
+Ptr<Ipv4Route> SourceRouting::RouteOutput (Ptr<Packet> p, const Ipv4Header &header, Ptr<NetDevice> oif,
+                                           Socket::SocketErrno &sockerr) {
+  std::unordered_map<uint32_t, int>::const_iterator to = m_plan->nodeOf.find (header.GetDestination ().Get ());
+  SourceRouteTag tag;
+  if (to == m_plan->nodeOf.end () || to->second == m_id || !m_plan->Path (m_id, to->second, &tag)
+      || m_ports[tag.Port (0)] == 0) {
+    sockerr = Socket::ERROR_NOROUTETOHOST;
+    return 0;
+  }
+  tag.ttl = m_ttl;
+  // Sockets also ask for a route without a packet, to pick the source address
+  if (p != 0) {
+    SourceRouteTag old;
+    p->RemovePacketTag (old);
+    p->AddPacketTag (tag);
+    p->AddPaddingAtEnd (tag.WireBytes (0));
+  }
+  sockerr = Socket::ERROR_NOTERROR;
+  return m_ports[tag.Port (0)];
+}
+
+bool SourceRouting::RouteInput (Ptr<const Packet> p, const Ipv4Header &header, Ptr<const NetDevice> idev,
+                                UnicastForwardCallback ucb, MulticastForwardCallback mcb,
+                                LocalDeliverCallback lcb, ErrorCallback ecb) {
+  SourceRouteTag tag;
+  if (!p->PeekPacketTag (tag)) return false;
+  // The TTL is only decremented once the packet is forwarded
+  uint32_t hop = tag.ttl - header.GetTtl () + 1;
+  uint32_t port = hop > 0 && hop < tag.hops ? tag.Port (hop) : m_ports.size ();
+  if (port >= m_ports.size () || m_ports[port] == 0 || p->GetSize () < tag.WireBytes (hop - 1)) {
+    ecb (p, header, Socket::ERROR_NOROUTETOHOST);
+    return true;
+  }
+  // Pop the entry of this hop: the packet goes on with the route bytes of the hops ahead
+  Ptr<Packet> packet = p->Copy ();
+  packet->RemoveAtEnd (tag.WireBytes (hop - 1));
+  packet->AddPaddingAtEnd (tag.WireBytes (hop));
+  Ipv4Header popped = header;
+  popped.SetPayloadSize (packet->GetSize ());
+  ucb (m_ports[port], packet, popped);
+  return true;
+}
+
+void SourceRouting::PrintRoutingTable (Ptr<OutputStreamWrapper> stream) const {
+  std::ostream* os = stream->GetStream ();
+  *os << "Node " << m_id << ", source routing, next hop of each port\n";
+  for (size_t port = 0; port < m_ports.size (); port++) {
+    if (m_ports[port] == 0) continue;
+    *os << "  port " << port << (port == 0 ? " (up)" : "") << ": " << m_ports[port]->GetGateway () << "\n";
+  }
+}
+
+bool installSourceRouting(TreeTopology* topology, SourceRoutePlan* plan) {
+  if (Node::ChecksumEnabled ()) {
+    NS_LOG_ERROR ("--routing=source pops its route bytes from the end of the UDP datagrams on the way, "
+                  "which checksums would reject, run it with --ChecksumEnabled=false");
+    return false;
+  }
+  plan->topology = topology;
+  plan->bits = 1;
+  while ((1u << plan->bits) < (uint32_t) topology->numLeaves + 1) plan->bits++;
+  // The longest path goes from a server up to the root and down to another server
+  if (2 * topology->levels * plan->bits > 64) {
+    NS_LOG_ERROR ("Paths of " << 2 * topology->levels << " hops of " << (int) plan->bits
+                  << " bits do not fit in the 64 bits of a source route");
+    return false;
+  }
+  treeAddresses (topology, &plan->nodeOf);
+  for (size_t id = 0; id < topology->nodes.size (); id++) {
+    if (topology->nodes[id].node == 0) continue;
+    Ptr<SourceRouting> source = CreateObject<SourceRouting> ();
+    source->Setup (plan, id);
+    Ptr<Ipv4ListRouting> list = DynamicCast<Ipv4ListRouting> (topology->nodes[id].node->GetObject<Ipv4> ()->GetRoutingProtocol ());
+    list->AddRoutingProtocol (source, 10);
+  }
+  NS_LOG_INFO ("Source routing: " << (int) plan->bits << " bits per hop, no routing tables");
+  return true;
+}
+
+void treeAddresses(TreeTopology* topology, std::unordered_map<uint32_t, int>* nodeOf) {
+  nodeOf->clear ();
+  for (size_t id = 0; id < topology->nodes.size (); id++) {
+    if (topology->nodes[id].node == 0) continue;
+    Ptr<Ipv4> ipv4 = topology->nodes[id].node->GetObject<Ipv4> ();
+    for (uint32_t i = 1; i < ipv4->GetNInterfaces (); i++) {
+      for (uint32_t a = 0; a < ipv4->GetNAddresses (i); a++) (*nodeOf)[ipv4->GetAddress (i, a).GetLocal ().Get ()] = id;
+    }
+  }
+}
+
+// Device a router forwards a frame through, 0 if it does not forward it (IPv4 only). Reads
+// the Ethernet type and IPv4 destination from the bytes, no header is parsed
+static Ptr<CsmaNetDevice> cutThroughEgress(const CutThrough* model, int id, Ptr<const Packet> frame) {
+  uint8_t bytes[34];   // Ethernet header, IPv4 header up to the destination
+  if (frame->CopyData (bytes, sizeof bytes) < sizeof bytes) return 0;
+  if ((bytes[12] << 8 | bytes[13]) != Ipv4L3Protocol::PROT_NUMBER) return 0;
+  uint32_t destination = (uint32_t) bytes[30] << 24 | bytes[31] << 16 | bytes[32] << 8 | bytes[33];
+  std::unordered_map<uint32_t, int>::const_iterator to = model->nodeOf.find (destination);
+  if (to == model->nodeOf.end () || to->second == id) return 0;
+  // Down towards the leaf the destination is below, up if it is not below this router
+  const TreeTopology* topology = model->topology;
+  int child = to->second;
+  while (child >= 0 && topology->nodes[child].parent != id) child = topology->nodes[child].parent;
+  if (child < 0) return topology->nodes[id].upDevice;
+  return topology->nodes[id].downDevices[topology->nodes[child].leafIndex];
+}
+
+static void cutThroughTxBegin(CutThroughPort* port, Ptr<const Packet> frame) {
+  if (cutThroughEgress (port->model, port->node, frame) == 0) return;
+  // The channel delivers one delay after the last bit, bring that back to the last bit of the headers
+  Time rest = Seconds ((frame->GetSize () - std::min (frame->GetSize (), port->headers)) * 8.0 / port->bitsPerSecond);
+  port->channel->SetAttribute ("Delay", TimeValue (port->delay > rest ? port->delay - rest : Seconds (0)));
+  port->early = true;
+}
+
+// End or drop of the frame on the channel, the delivery is scheduled by then
+static void cutThroughTxEnd(CutThroughPort* port, Ptr<const Packet> frame) {
+  if (!port->early) return;
+  port->channel->SetAttribute ("Delay", TimeValue (port->delay));
+  port->early = false;
+}
+
+// The headers of a frame are in at the router, which forwards it right away if its port is idle
+static void cutThroughRxEnd(CutThroughPort* port, Ptr<const Packet> frame) {
+  Ptr<CsmaNetDevice> egress = cutThroughEgress (port->model, port->node, frame);
+  if (egress == 0) return;
+  if (egress->GetQueue ()->GetNPackets () > 0 || DynamicCast<CsmaChannel> (egress->GetChannel ())->IsBusy ()) {
+    port->model->stored++;
+  } else {
+    port->model->early++;
+  }
+}
+
+void installCutThrough(TreeTopology* topology, CutThrough* model) {
+  model->topology = topology;
+  treeAddresses (topology, &model->nodeOf);
+  uint32_t headers = EthernetHeader ().GetSerializedSize () + Ipv4Header ().GetSerializedSize ();
+  for (size_t id = 0; id < topology->nodes.size (); id++) {
+    const TreeNodeInfo& info = topology->nodes[id];
+    if (info.node == 0 || info.parent < 0) continue;
+    Ptr<CsmaNetDevice> down = topology->nodes[info.parent].downDevices[info.leafIndex];
+    Ptr<CsmaChannel> channel = DynamicCast<CsmaChannel> (info.upDevice->GetChannel ());
+    // Down to this node if it is a router, up to the parent if the parent is one (not the client)
+    for (int direction = 0; direction < 2; direction++) {
+      int router = direction == 0 ? (int) id : info.parent;
+      if (topology->nodes[router].depth < 1 || topology->nodes[router].depth >= topology->levels) continue;
+      CutThroughPort port;
+      port.model = model;
+      port.node = router;
+      port.channel = channel;
+      port.delay = channel->GetDelay ();
+      port.bitsPerSecond = channel->GetDataRate ().GetBitRate ();
+      port.headers = headers;
+      port.early = false;
+      model->ports.push_back (port);
+      Ptr<CsmaNetDevice> sender = direction == 0 ? down : info.upDevice;
+      Ptr<CsmaNetDevice> receiver = direction == 0 ? info.upDevice : down;
+      sender->TraceConnectWithoutContext ("PhyTxBegin", MakeBoundCallback (&cutThroughTxBegin, &model->ports.back ()));
+      sender->TraceConnectWithoutContext ("PhyTxEnd", MakeBoundCallback (&cutThroughTxEnd, &model->ports.back ()));
+      sender->TraceConnectWithoutContext ("PhyTxDrop", MakeBoundCallback (&cutThroughTxEnd, &model->ports.back ()));
+      receiver->TraceConnectWithoutContext ("PhyRxEnd", MakeBoundCallback (&cutThroughRxEnd, &model->ports.back ()));
+    }
+  }
+  NS_LOG_INFO ("Cut-through switching on " << model->ports.size () << " router ports, forwarding after "
+               << headers << " bytes");
+}
+
+void reportCutThrough(const CutThrough& model, ResultsWriter* results) {
+  uint64_t frames = model.early + model.stored;
+  double fraction = frames > 0 ? (double) model.early / frames : 0;
+  NS_LOG_INFO ("Cut-through: " << model.early << " of " << frames << " frames through a router found their port idle "
+               << "when their headers came in (" << 100 * fraction << "%), the others waited in its queue");
+  if (results == 0) return;
+  results->SetMetric ("cut_through_frames", model.early);
+  results->SetMetric ("cut_through_fraction", fraction);
+}
+
+NS_OBJECT_ENSURE_REGISTERED (BatchReceiver);
+
+TypeId BatchReceiver::GetTypeId (void) {
+  static TypeId tid = TypeId ("ns3::BatchReceiver")
+    .SetParent<Object> ()
+    .AddConstructor<BatchReceiver> ();
+  return tid;
+}
+
+BatchReceiver::BatchReceiver () : m_regularOnly (false), m_batches (0), m_frames (0), m_largest (0), m_regular (0) {
+}
+
+void BatchReceiver::Setup (Ptr<Node> node) {
+  m_ipv4 = node->GetObject<Ipv4L3Protocol> ();
+  m_forwarded = MakeCallback (&BatchReceiver::Forwarded, this);
+  m_multicast = MakeCallback (&BatchReceiver::Multicast, this);
+  m_local = MakeCallback (&BatchReceiver::Local, this);
+  m_failed = MakeCallback (&BatchReceiver::Failed, this);
+  // Ipv4L3Protocol::AddInterface registers the traffic control layer for the IPv4 and ARP
+  // frames of each device, unregistering takes it off both, ARP is put back
+  Ptr<TrafficControlLayer> tc = node->GetObject<TrafficControlLayer> ();
+  NS_ASSERT (tc != 0);
+  m_regularHandler = MakeCallback (&TrafficControlLayer::Receive, tc);
+  node->UnregisterProtocolHandler (m_regularHandler);
+  m_devices.assign (node->GetNDevices (), 0);
+  for (uint32_t d = 0; d < node->GetNDevices (); d++) {
+    Ptr<NetDevice> device = node->GetDevice (d);
+    if (DynamicCast<LoopbackNetDevice> (device) != 0 || m_ipv4->GetInterfaceForDevice (device) < 0) continue;
+    if (DynamicCast<CsmaNetDevice> (device) != 0) {
+      node->RegisterProtocolHandler (MakeCallback (&BatchReceiver::Receive, this), Ipv4L3Protocol::PROT_NUMBER, device);
+      m_devices[d] = device;
+    } else {
+      node->RegisterProtocolHandler (m_regularHandler, Ipv4L3Protocol::PROT_NUMBER, device);
+    }
+    node->RegisterProtocolHandler (m_regularHandler, ArpL3Protocol::PROT_NUMBER, device);
+  }
+}
+
+void BatchReceiver::Receive (Ptr<NetDevice> device, Ptr<const Packet> p, uint16_t protocol, const Address& from,
+                             const Address& to, NetDevice::PacketType type) {
+  if (m_regularOnly || type != NetDevice::PACKET_HOST) {
+    m_regularHandler (device, p, protocol, from, to, type);
+    return;
+  }
+  m_batch.push_back (Frame ());
+  Frame& taken = m_batch.back ();
+  taken.port = device->GetIfIndex ();
+  taken.received = p;
+  taken.from = from;
+  taken.to = to;
+  // The first frame of this time schedules the batch, after every event already at this time
+  if (m_batch.size () == 1) Simulator::ScheduleNow (&BatchReceiver::Drain, this);
+}
+
+void BatchReceiver::Drain (void) {
+  m_draining.swap (m_batch);
+  m_batches++;
+  m_frames += m_draining.size ();
+  m_largest = std::max (m_largest, (uint64_t) m_draining.size ());
+
+  // IPv4: a lookup per ingress device and destination, the other frames reuse its route
+  m_routes.clear ();
+  for (size_t f = 0; f < m_draining.size (); f++) {
+    Frame& frame = m_draining[f];
+    if (Node::ChecksumEnabled ()) frame.ip.EnableChecksum ();
+    frame.received->PeekHeader (frame.ip);
+    if (!frame.ip.IsChecksumOk ()) continue;
+    frame.packet = frame.received->Copy ();
+    frame.packet->RemoveAtStart (frame.ip.GetSerializedSize ());
+    // Ethernet pads short frames to its minimum size
+    if (frame.packet->GetSize () > frame.ip.GetPayloadSize ()) {
+      frame.packet->RemoveAtEnd (frame.packet->GetSize () - frame.ip.GetPayloadSize ());
+    }
+    Ipv4Address destination = frame.ip.GetDestination ();
+    if (frame.ip.GetTtl () <= 1 || destination.IsBroadcast () || destination.IsMulticast ()) continue;
+    uint64_t key = (uint64_t) frame.port << 32 | destination.Get ();
+    std::unordered_map<uint64_t, Ptr<Ipv4Route> >::iterator route = m_routes.find (key);
+    if (route == m_routes.end ()) route = m_routes.insert (std::make_pair (key, Lookup (frame))).first;
+    frame.route = route->second;
+  }
+  // Egress: into the queue of the device of the route, or the regular way
+  for (size_t f = 0; f < m_draining.size (); f++) {
+    Frame& frame = m_draining[f];
+    if (frame.route != 0 && Forward (&frame)) continue;
+    m_regular++;
+    m_regularHandler (m_devices[frame.port], frame.received, Ipv4L3Protocol::PROT_NUMBER, frame.from, frame.to,
+                      NetDevice::PACKET_HOST);
+  }
+  m_draining.clear ();
+}
+
+void BatchReceiver::DoDispose (void) {
+  m_devices.clear ();
+  m_ipv4 = 0;
+  m_regularHandler.Nullify ();
+  m_batch.clear ();
+  m_draining.clear ();
+  m_routes.clear ();
+  m_lookup = 0;
+  Object::DoDispose ();
+}
+
+Ptr<Ipv4Route> BatchReceiver::Lookup (const Frame& frame) {
+  m_lookup = 0;
+  m_ipv4->GetRoutingProtocol ()->RouteInput (frame.packet, frame.ip, m_devices[frame.port], m_forwarded, m_multicast,
+                                             m_local, m_failed);
+  return m_lookup;
+}
+
+bool BatchReceiver::Forward (Frame* frame) {
+  Ptr<NetDevice> device = frame->route->GetOutputDevice ();
+  int32_t interface = m_ipv4->GetInterfaceForDevice (device);
+  if (interface < 0 || !m_ipv4->IsUp (interface)) return false;
+  if (frame->packet->GetSize () + frame->ip.GetSerializedSize () > device->GetMtu ()) return false;
+  Ipv4Address next = frame->route->GetGateway ();
+  if (next == Ipv4Address::GetZero ()) next = frame->ip.GetDestination ();
+  ArpCache::Entry* arp = m_ipv4->GetInterface (interface)->GetArpCache ()->Lookup (next);
+  if (arp == 0 || !arp->IsAlive () || arp->IsExpired ()) return false;
+
+  frame->ip.SetTtl (frame->ip.GetTtl () - 1);
+  if (Node::ChecksumEnabled ()) frame->ip.EnableChecksum ();
+  frame->packet->AddHeader (frame->ip);
+  counters.packetsForwarded.fetch_add (1, std::memory_order_relaxed);
+  // Straight to the device: the queue disc Ipv4AddressHelper puts in front of a CSMA device
+  // passes every packet through, CSMA has no flow control
+  device->Send (frame->packet, arp->GetMacAddress (), Ipv4L3Protocol::PROT_NUMBER);
+  return true;
+}
+
+void installBatching(TreeTopology* topology, std::vector<Ptr<BatchReceiver> >* receivers) {
+  for (size_t id = 0; id < topology->nodes.size (); id++) {
+    const TreeNodeInfo& info = topology->nodes[id];
+    if (info.node == 0 || info.depth < 1 || info.depth >= topology->levels) continue;
+    Ptr<BatchReceiver> receiver = CreateObject<BatchReceiver> ();
+    receiver->Setup (info.node);
+    info.node->AggregateObject (receiver);
+    receivers->push_back (receiver);
+  }
+  NS_LOG_INFO ("Batched receive path on " << receivers->size () << " routers");
+}
+
+void reportBatching(const std::vector<Ptr<BatchReceiver> >& receivers, ResultsWriter* results) {
+  uint64_t batches = 0, frames = 0, largest = 0, regular = 0;
+  for (size_t r = 0; r < receivers.size (); r++) {
+    batches += receivers[r]->GetBatches ();
+    frames += receivers[r]->GetFrames ();
+    largest = std::max (largest, receivers[r]->GetLargest ());
+    regular += receivers[r]->GetRegular ();
+  }
+  double mean = batches > 0 ? (double) frames / batches : 0;
+  NS_LOG_INFO ("Batches: " << frames << " frames received by the routers in " << batches << " batches, "
+               << mean << " frames per batch (largest " << largest << "), " << regular << " took the regular path");
+  if (results == 0) return;
+  results->SetMetric ("batch_count", batches);
+  results->SetMetric ("batch_mean_frames", mean);
+  results->SetMetric ("batch_regular_frames", regular);
+}
+
+// Node in the diagnostics of validateTopology(), with its position if it is in the tree
+static std::string describeNode(TreeTopology* topology, uint32_t id) {
+  std::ostringstream name;
+  name << "node " << id;
+  if (id < topology->nodes.size () && topology->nodes[id].node != 0) name << " (" << topology->PositionOf (id) << ")";
+  return name.str ();
+}
+
+// Log a problem found by validateTopology(), only the first 10 of each check
+static void validationProblem(std::map<std::string, uint64_t>* problems, std::string check, std::string message) {
+  if ((*problems)[check]++ < 10) NS_LOG_ERROR ("Validation, " << check << ": " << message);
+}
+
+// Where an interface address is, for validateTopology()
+struct AddressOwner {
+  uint32_t node;
+  uint32_t interface;
+  uint32_t channel;
+  uint16_t prefix;
+};
+
+// What a routing protocol did with a probe packet given to its RouteInput()
+struct RouteProbe {
+  Ptr<Ipv4Route> route;
+  Ptr<const Packet> packet;
+  bool local;
+  bool error;
+  RouteProbe () : local (false), error (false) {}
+  void Forward (Ptr<Ipv4Route> forward, Ptr<const Packet> p, const Ipv4Header& header) {
+    route = forward;
+    packet = p;
+  }
+  void Multicast (Ptr<Ipv4MulticastRoute> forward, Ptr<const Packet> p, const Ipv4Header& header) { error = true; }
+  void Local (Ptr<const Packet> p, const Ipv4Header& header, uint32_t interface) { local = true; }
+  void Error (Ptr<const Packet> p, const Ipv4Header& header, Socket::SocketErrno reason) { error = true; }
+};
+
+/**
+ *  Walk a packet from source to destination through the routing protocols. The next node of
+ *  every hop is the owner of the gateway (or of the destination on its own link), which must
+ *  be on the link of the output device.
+ *
+ *  The outcome for destination is remembered for every node crossed with an untagged packet:
+ *  state[node] is 1 if it reaches it, 2 + r if it fails with reasons[r], valid while
+ *  stamp[node] == destinationStamp. Returns an empty string when destination is reached.
+ */
+static std::string walkRoute(Ptr<Node> source, Ipv4Address from, Ipv4Address destination,
+                             const std::unordered_map<uint32_t, AddressOwner>& owners, TreeTopology* topology,
+                             std::vector<uint32_t>* stamp, std::vector<uint32_t>* state,
+                             std::vector<std::string>* reasons, uint32_t destinationStamp) {
+  uint32_t target = owners.find (destination.Get ())->second.node;
+  Ipv4Header header;
+  header.SetSource (from);
+  header.SetDestination (destination);
+  header.SetProtocol (UdpL4Protocol::PROT_NUMBER);
+  header.SetTtl (64);
+  UdpHeader udp;
+  udp.SetSourcePort (49153);
+  udp.SetDestinationPort (9);
+  Ptr<Packet> probe = Create<Packet> (64);
+  probe->AddHeader (udp);
+  Ptr<const Packet> packet = probe;
+
+  std::ostringstream reason;
+  std::vector<uint32_t> crossed; // nodes whose outcome can be remembered
+  uint32_t node = source->GetId ();
+  Socket::SocketErrno error;
+  Ptr<Ipv4Route> route = source->GetObject<Ipv4> ()->GetRoutingProtocol ()->RouteOutput (probe, header, 0, error);
+  for (int hops = 0; ; hops++) {
+    if (route == 0) {
+      reason << describeNode (topology, node) << " has no route to " << destination;
+      break;
+    }
+    // On its own link the next node is the destination itself
+    Ipv4Address gateway = route->GetGateway ();
+    Ipv4Address next = gateway == Ipv4Address::GetZero () ? destination : gateway;
+    std::unordered_map<uint32_t, AddressOwner>::const_iterator owner = owners.find (next.Get ());
+    if (owner == owners.end ()) {
+      reason << describeNode (topology, node) << " sends " << destination << " to " << next << ", which no node has";
+      break;
+    }
+    Ptr<Channel> channel = route->GetOutputDevice ()->GetChannel ();
+    if (channel == 0 || channel->GetId () != owner->second.channel) {
+      reason << describeNode (topology, node) << " sends " << destination << " to " << next << " on "
+             << describeNode (topology, owner->second.node) << ", which is not on the link of its output device";
+      break;
+    }
+    node = owner->second.node;
+    if (node == target) break;
+    bool tagged = packet->GetPacketTagIterator ().HasNext ();
+    if (!tagged && (*stamp)[node] == destinationStamp) {
+      if ((*state)[node] >= 2) reason << (*reasons)[(*state)[node] - 2];
+      break;
+    }
+    if (hops >= 64) {
+      reason << "loop towards " << destination << ", still at " << describeNode (topology, node) << " after 64 hops";
+      break;
+    }
+
+    // What the IPv4 layer of the node does with the packet coming in on that interface
+    Ptr<Ipv4> ipv4 = NodeList::GetNode (node)->GetObject<Ipv4> ();
+    RouteProbe input;
+    bool handled = ipv4->GetRoutingProtocol ()->RouteInput (packet, header, ipv4->GetNetDevice (owner->second.interface),
+                                                            MakeCallback (&RouteProbe::Forward, &input),
+                                                            MakeCallback (&RouteProbe::Multicast, &input),
+                                                            MakeCallback (&RouteProbe::Local, &input),
+                                                            MakeCallback (&RouteProbe::Error, &input));
+    if (input.local) {
+      reason << describeNode (topology, node) << " takes " << destination << " as its own address";
+      break;
+    }
+    if (!handled || input.error || input.route == 0) {
+      reason << describeNode (topology, node) << " has no route to " << destination;
+      break;
+    }
+    if (!tagged && !input.packet->GetPacketTagIterator ().HasNext ()) crossed.push_back (node);
+    route = input.route;
+    packet = input.packet;
+    header.SetTtl (header.GetTtl () - 1);
+  }
+
+  uint32_t outcome = 1;
+  if (!reason.str ().empty ()) {
+    reasons->push_back (reason.str ());
+    outcome = reasons->size () + 1;
+  }
+  for (size_t c = 0; c < crossed.size (); c++) {
+    (*stamp)[crossed[c]] = destinationStamp;
+    (*state)[crossed[c]] = outcome;
+  }
+  return reason.str ();
+}
+
+uint64_t validateTopology(Ptr<Node> client, Ipv4InterfaceContainer* ipInterfaces, bool serversSend, TreeTopology* topology) {
+  std::map<std::string, uint64_t> problems;
+  uint32_t nodes = NodeList::GetNNodes ();
+
+  // Addresses and subnets of every interface but the loopbacks. A subnet is its network address
+  // and prefix length, network << 8 | prefix
+  std::unordered_map<uint32_t, AddressOwner> owners;
+  std::unordered_map<uint64_t, uint32_t> subnetLink;    // subnet -> channel id
+  std::unordered_map<uint32_t, uint64_t> linkSubnet;    // channel id -> subnet of its first interface
+  std::set<uint16_t> prefixes;
+  for (uint32_t n = 0; n < nodes; n++) {
+    Ptr<Ipv4> ipv4 = NodeList::GetNode (n)->GetObject<Ipv4> ();
+    if (ipv4 == 0) continue;
+    for (uint32_t i = 0; i < ipv4->GetNInterfaces (); i++) {
+      Ptr<Channel> channel = ipv4->GetNetDevice (i)->GetChannel ();
+      if (channel == 0) continue;
+      for (uint32_t a = 0; a < ipv4->GetNAddresses (i); a++) {
+        Ipv4Address local = ipv4->GetAddress (i, a).GetLocal ();
+        Ipv4Mask mask = ipv4->GetAddress (i, a).GetMask ();
+        AddressOwner owner = {n, i, channel->GetId (), mask.GetPrefixLength ()};
+        std::ostringstream where;
+        where << describeNode (topology, n) << " interface " << i;
+        if (!owners.insert (std::make_pair (local.Get (), owner)).second) {
+          AddressOwner first = owners[local.Get ()];
+          std::ostringstream message;
+          message << local << " is on " << where.str () << " and " << describeNode (topology, first.node)
+                  << " interface " << first.interface;
+          validationProblem (&problems, "addresses", message.str ());
+          continue;
+        }
+        prefixes.insert (owner.prefix);
+        uint64_t subnet = (uint64_t) local.CombineMask (mask).Get () << 8 | owner.prefix;
+        std::unordered_map<uint32_t, uint64_t>::iterator link = linkSubnet.find (owner.channel);
+        if (link == linkSubnet.end ()) {
+          linkSubnet[owner.channel] = subnet;
+        } else if (link->second != subnet) {
+          std::ostringstream message;
+          message << local << "/" << owner.prefix << " of " << where.str () << " is not in the subnet "
+                  << Ipv4Address (link->second >> 8) << "/" << (link->second & 0xff) << " of the rest of its link";
+          validationProblem (&problems, "subnets", message.str ());
+        }
+        std::unordered_map<uint64_t, uint32_t>::iterator used = subnetLink.find (subnet);
+        if (used == subnetLink.end ()) {
+          subnetLink[subnet] = owner.channel;
+        } else if (used->second != owner.channel) {
+          std::ostringstream message;
+          message << "subnet " << local.CombineMask (mask) << "/" << owner.prefix << " of " << where.str ()
+                  << " is also used by link " << used->second;
+          validationProblem (&problems, "subnets", message.str ());
+        }
+      }
+    }
+  }
+  // An address inside the subnet of another link at a different prefix length (a /16 of one
+  // link covering the /24 of another) would be routed to the wrong link
+  for (std::unordered_map<uint32_t, AddressOwner>::iterator o = owners.begin (); o != owners.end (); o++) {
+    for (std::set<uint16_t>::iterator p = prefixes.begin (); p != prefixes.end (); p++) {
+      if (*p == o->second.prefix) continue;
+      uint32_t network = *p == 0 ? 0 : o->first & (0xffffffffu << (32 - *p));
+      std::unordered_map<uint64_t, uint32_t>::iterator used = subnetLink.find ((uint64_t) network << 8 | *p);
+      if (used == subnetLink.end () || used->second == o->second.channel) continue;
+      std::ostringstream message;
+      message << Ipv4Address (o->first) << " of " << describeNode (topology, o->second.node) << " interface "
+              << o->second.interface << " is inside the subnet " << Ipv4Address (network) << "/" << *p
+              << " of link " << used->second;
+      validationProblem (&problems, "subnets", message.str ());
+    }
+  }
+
+  // Nodes reachable from the client through the links, checking the MTU of each link on the way
+  std::vector<bool> reached (nodes, false);
+  std::unordered_set<uint32_t> linksSeen;
+  std::deque<uint32_t> pending;
+  uint32_t minMtu = 0;
+  reached[client->GetId ()] = true;
+  pending.push_back (client->GetId ());
+  while (!pending.empty ()) {
+    Ptr<Node> node = NodeList::GetNode (pending.front ());
+    pending.pop_front ();
+    for (uint32_t d = 0; d < node->GetNDevices (); d++) {
+      Ptr<Channel> channel = node->GetDevice (d)->GetChannel ();
+      if (channel == 0 || !linksSeen.insert (channel->GetId ()).second) continue;
+      uint16_t mtu = channel->GetDevice (0)->GetMtu ();
+      for (uint32_t c = 0; c < channel->GetNDevices (); c++) {
+        Ptr<NetDevice> device = channel->GetDevice (c);
+        uint32_t other = device->GetNode ()->GetId ();
+        if (device->GetMtu () != mtu) {
+          std::ostringstream message;
+          message << "link " << channel->GetId () << " has an MTU of " << mtu << " on "
+                  << describeNode (topology, channel->GetDevice (0)->GetNode ()->GetId ()) << " and "
+                  << device->GetMtu () << " on " << describeNode (topology, other);
+          validationProblem (&problems, "MTU", message.str ());
+        }
+        minMtu = minMtu == 0 ? device->GetMtu () : std::min (minMtu, (uint32_t) device->GetMtu ());
+        if (reached[other]) continue;
+        reached[other] = true;
+        pending.push_back (other);
+      }
+    }
+  }
+  for (uint32_t n = 0; n < nodes; n++) {
+    if (!reached[n]) validationProblem (&problems, "connectivity", describeNode (topology, n) + " cannot be reached from the client");
+  }
+
+  // Routes, only between connected nodes: from the client to every server and back, or between
+  // every pair of servers when they send to each other
+  std::vector<Ipv4Address> servers;
+  for (uint32_t ip = 1; ip < ipInterfaces->GetN (); ip += 2) servers.push_back (ipInterfaces->GetAddress (ip));
+  Ptr<Ipv4> clientIpv4 = client->GetObject<Ipv4> ();
+  Ipv4Address clientAddress = clientIpv4->GetNInterfaces () > 1 ? clientIpv4->GetAddress (1, 0).GetLocal () : Ipv4Address ();
+  std::vector<Ipv4Address> destinations = servers;
+  if (!serversSend) destinations.push_back (clientAddress);
+  std::vector<uint32_t> stamp (nodes, 0), state (nodes, 0);
+  std::vector<std::string> reasons;
+  uint64_t walks = 0;
+  // Dragonfly routers would draw their intermediate groups for the probes: every path a packet
+  // can take is walked instead, the minimal ones and (valiant, ugal) the Valiant ones through
+  // an intermediate group picked from the destination
+  std::vector<Ptr<DragonflyRouting> > dragonflyRouters;
+  for (uint32_t n = 0; n < nodes; n++) {
+    Ptr<Ipv4> ipv4 = NodeList::GetNode (n)->GetObject<Ipv4> ();
+    if (ipv4 == 0) continue;
+    Ptr<Ipv4ListRouting> list = DynamicCast<Ipv4ListRouting> (ipv4->GetRoutingProtocol ());
+    for (uint32_t r = 0; list != 0 && r < list->GetNRoutingProtocols (); r++) {
+      int16_t priority;
+      Ptr<DragonflyRouting> router = DynamicCast<DragonflyRouting> (list->GetRoutingProtocol (r, priority));
+      if (router != 0) dragonflyRouters.push_back (router);
+    }
+  }
+  std::vector<DragonflyRouting::Probe> probes (1, DragonflyRouting::PROBE_MINIMAL);
+  if (!dragonflyRouters.empty () && dragonflyRouters[0]->GetMode () == DragonflyRouting::VALIANT) {
+    probes[0] = DragonflyRouting::PROBE_VALIANT;
+  } else if (!dragonflyRouters.empty () && dragonflyRouters[0]->GetMode () == DragonflyRouting::UGAL) {
+    probes.push_back (DragonflyRouting::PROBE_VALIANT);
+  }
+  for (size_t pass = 0; pass < probes.size (); pass++) {
+    for (size_t r = 0; r < dragonflyRouters.size (); r++) dragonflyRouters[r]->SetProbe (probes[pass]);
+    for (size_t d = 0; d < destinations.size (); d++) {
+      if (owners.count (destinations[d].Get ()) == 0 || !reached[owners[destinations[d].Get ()].node]) continue;
+      // What was learned about a node in one pass does not hold for the other
+      uint32_t destinationStamp = pass * destinations.size () + d + 1;
+      std::vector<Ipv4Address> sources;
+      if (serversSend) sources = servers;
+      else if (destinations[d] == clientAddress) sources = servers;
+      else sources.push_back (clientAddress);
+      for (size_t s = 0; s < sources.size (); s++) {
+        if (sources[s] == destinations[d] || owners.count (sources[s].Get ()) == 0) continue;
+        uint32_t source = owners[sources[s].Get ()].node;
+        if (!reached[source]) continue;
+        walks++;
+        std::string reason = walkRoute (NodeList::GetNode (source), sources[s], destinations[d], owners, topology,
+                                        &stamp, &state, &reasons, destinationStamp);
+        if (reason.empty ()) continue;
+        std::ostringstream message;
+        message << sources[s] << " cannot reach " << destinations[d]
+                << (probes[pass] == DragonflyRouting::PROBE_VALIANT ? " through an intermediate group: " : ": ") << reason;
+        validationProblem (&problems, "routes", message.str ());
+      }
+    }
+  }
+  for (size_t r = 0; r < dragonflyRouters.size (); r++) dragonflyRouters[r]->SetProbe (DragonflyRouting::PROBE_OFF);
+
+  uint64_t total = 0;
+  for (std::map<std::string, uint64_t>::iterator p = problems.begin (); p != problems.end (); p++) {
+    if (p->second > 10) NS_LOG_ERROR ("Validation, " << p->first << ": ... and " << p->second - 10 << " more");
+    total += p->second;
+  }
+  NS_LOG_INFO ("Validated " << nodes << " nodes, " << owners.size () << " addresses, " << linksSeen.size ()
+               << " links (MTU " << minMtu << " or more), " << walks << " routes: "
+               << (total == 0 ? "no problems" : "problems found"));
+  return total;
+}
+
+// Time each echo request left the client, by server address, to compute the RTT of the reply
+static std::map<uint32_t, Time> echoSentAt;
+
+static void echoSent(Ipv4Address server, Ptr<const Packet> packet) {
+  echoSentAt[server.Get()] = Simulator::Now ();
+  counters.echoRequests.fetch_add (1, std::memory_order_relaxed);
+}
+
+static void echoReceived(const Ipv4Header& header, Ptr<const Packet> packet, uint32_t interface) {
+  std::map<uint32_t, Time>::iterator sent = echoSentAt.find (header.GetSource().Get());
+  if (sent == echoSentAt.end ()) return; // not an echo reply
+  recordRtt (Simulator::Now () - sent->second);
+  echoSentAt.erase (sent);
+}
+
+void installUdpEchoClient(Ptr<Node> node, int port, Ipv4InterfaceContainer* ipInterfaces,
+                          float start, float end) {
+  // ipInterfaces contains the address of the net device of the server node and the
+  // address of the net device connected to the server node (parent node).
+  // In order to obtain only the server node addresses, the first address is parent
+  // second is server, so start with ip = 1, and incumbent twice to obtain only server addresses
+  for (int ip = 1; ip < ipInterfaces->GetN(); ip+=2) {
+    Ptr<UdpEchoClient> echoClient = CreateObject<UdpEchoClient>();
+
+    echoClient->SetRemote(ipInterfaces->GetAddress(ip), port);
+    // Remember when the request to this server leaves, to get the RTT when the echo comes back
+    echoClient->TraceConnectWithoutContext ("Tx", MakeBoundCallback (&echoSent, ipInterfaces->GetAddress(ip)));
+
+    echoClient->SetAttribute ("MaxPackets", UintegerValue (1)); // send only 1 packet
+    echoClient->SetAttribute ("PacketSize", UintegerValue (1 << 10)); // 1 KB
+    node->AddApplication(echoClient);
+    // Start each application and have each send a packet with a delay of 100 micro seconds
+    int delay = 10000; // in terms of seconds, so if delay = 1 ms, it is 1000, or 1000th of a second
+    echoClient->SetStartTime (Seconds (start + (ip - 1.0)/(2*delay) )); // formula to create delay using ip
+    echoClient->SetStopTime (Seconds (end));
+  }
+}
+
+TimerWheel::TimerWheel () : m_now (0), m_size (0) {
+  for (int level = 0; level < LEVELS; level++) m_occupied[level] = 0;
+}
+
+void TimerWheel::Insert (uint64_t now, uint64_t expiry, uint64_t id) {
+  if (m_size == 0) m_now = std::max (m_now, now);
+  Entry entry = { std::max (expiry, m_now + 1), id };
+  m_size++;
+  Place (entry, 0);
+}
+
+void TimerWheel::Place (const Entry& entry, std::vector<uint64_t>* expired) {
+  if (entry.expiry <= m_now) { // reached while cascading
+    m_size--;
+    expired->push_back (entry.id);
+    return;
+  }
+  // Lowest level whose next 64 slots reach the expiry, the top level takes everything later
+  int level = 0;
+  while (level < LEVELS - 1 && (entry.expiry >> (6 * level)) - (m_now >> (6 * level)) > SLOTS) level++;
+  uint64_t slot = std::min (entry.expiry >> (6 * level), (m_now >> (6 * level)) + SLOTS);
+  m_slots[level][slot % SLOTS].push_back (entry);
+  m_occupied[level] |= (uint64_t) 1 << (slot % SLOTS);
+}
+
+uint64_t TimerWheel::NextTick (void) const {
+  uint64_t next = UINT64_MAX;
+  for (int level = 0; level < LEVELS; level++) {
+    if (m_occupied[level] == 0) continue;
+    // First occupied slot after the current one, going round the level once
+    uint64_t current = m_now >> (6 * level);
+    int from = (current + 1) % SLOTS;
+    uint64_t rotated = from == 0 ? m_occupied[level] : (m_occupied[level] >> from) | (m_occupied[level] << (SLOTS - from));
+    uint64_t slot = current + 1 + __builtin_ctzll (rotated);
+    next = std::min (next, slot << (6 * level));
+  }
+  return next;
+}
+
+void TimerWheel::Advance (uint64_t tick, std::vector<uint64_t>* expired) {
+  uint64_t next;
+  while ((next = NextTick ()) <= tick) {
+    // Nothing happens between the current tick and next, jump there and cascade the slots
+    // starting at next, from the top, then expire what is left in the level 0 slot
+    m_now = next;
+    for (int level = LEVELS - 1; level >= 0; level--) {
+      if (next & (((uint64_t) 1 << (6 * level)) - 1)) continue;
+      int slot = (next >> (6 * level)) % SLOTS;
+      if (!(m_occupied[level] & ((uint64_t) 1 << slot))) continue;
+      std::vector<Entry> entries;
+      entries.swap (m_slots[level][slot]);
+      m_occupied[level] &= ~((uint64_t) 1 << slot);
+      for (size_t e = 0; e < entries.size (); e++) Place (entries[e], expired);
+    }
+  }
+  if (m_size == 0) m_now = std::max (m_now, tick);
+}
+
+NS_OBJECT_ENSURE_REGISTERED (RpcEchoClient);
+
+TypeId RpcEchoClient::GetTypeId (void) {
+  static TypeId tid = TypeId ("ns3::RpcEchoClient")
+    .SetParent<Application> ()
+    .AddConstructor<RpcEchoClient> ()
+    .AddAttribute ("Port", "Port of the echo servers",
+                   UintegerValue (9),
+                   MakeUintegerAccessor (&RpcEchoClient::m_port),
+                   MakeUintegerChecker<uint16_t> ())
+    .AddAttribute ("PacketSize", "Size of the requests, SeqTsHeader included",
+                   UintegerValue (1 << 10),
+                   MakeUintegerAccessor (&RpcEchoClient::m_size),
+                   MakeUintegerChecker<uint32_t> (12))
+    .AddAttribute ("Requests", "Requests sent to each server",
+                   UintegerValue (1),
+                   MakeUintegerAccessor (&RpcEchoClient::m_count),
+                   MakeUintegerChecker<uint32_t> ())
+    .AddAttribute ("Interval", "Time between two requests",
+                   TimeValue (MicroSeconds (100)),
+                   MakeTimeAccessor (&RpcEchoClient::m_interval),
+                   MakeTimeChecker ())
+    .AddAttribute ("Timeout", "Timeout of the first transmission, doubled at every retry",
+                   TimeValue (MilliSeconds (50)),
+                   MakeTimeAccessor (&RpcEchoClient::m_timeout),
+                   MakeTimeChecker ())
+    .AddAttribute ("MaxRetries", "Retries before a request times out",
+                   UintegerValue (3),
+                   MakeUintegerAccessor (&RpcEchoClient::m_maxRetries),
+                   MakeUintegerChecker<uint32_t> ())
+    .AddAttribute ("Resolution", "Tick of the timer wheel, timeouts are rounded up to it",
+                   TimeValue (MilliSeconds (1)),
+                   MakeTimeAccessor (&RpcEchoClient::m_resolution),
+                   MakeTimeChecker ());
+  return tid;
+}
+
+RpcEchoClient::RpcEchoClient () : m_tickAt (UINT64_MAX), m_successes (0), m_retries (0), m_timeouts (0) {
+}
+
+void RpcEchoClient::StartApplication (void) {
+  m_socket = Socket::CreateSocket (GetNode (), UdpSocketFactory::GetTypeId ());
+  m_socket->Bind ();
+  m_socket->SetRecvCallback (MakeCallback (&RpcEchoClient::HandleRead, this));
+  m_requests.reserve ((size_t) m_count * m_servers.size ());
+  if (!m_servers.empty ()) m_sendEvent = Simulator::ScheduleNow (&RpcEchoClient::SendNext, this);
+}
+
+void RpcEchoClient::StopApplication (void) {
+  Simulator::Cancel (m_sendEvent);
+  Simulator::Cancel (m_tickEvent);
+  if (m_socket) {
+    m_socket->SetRecvCallback (MakeNullCallback<void, Ptr<Socket> > ());
+    m_socket->Close ();
+  }
+}
+
+void RpcEchoClient::SendNext (void) {
+  Request request = { (uint32_t) (m_requests.size () % m_servers.size ()), 0, 0, false };
+  m_requests.push_back (request);
+  counters.echoRequests.fetch_add (1, std::memory_order_relaxed);
+  Transmit (m_requests.size () - 1);
+  ScheduleTick ();
+  if (m_requests.size () < (size_t) m_count * m_servers.size ()) {
+    m_sendEvent = Simulator::Schedule (m_interval, &RpcEchoClient::SendNext, this);
+  }
+}
+
+void RpcEchoClient::Transmit (uint32_t id) {
+  Request& request = m_requests[id];
+  SeqTsHeader header;
+  header.SetSeq (id);
+  Ptr<Packet> packet = Create<Packet> (m_size > header.GetSerializedSize () ? m_size - header.GetSerializedSize () : 0);
+  packet->AddHeader (header);
+  m_socket->SendTo (packet, 0, InetSocketAddress (m_servers[request.server], m_port));
+
+  // Exponential backoff, the timeout doubles with every attempt, rounded up to the next tick
+  int64_t resolution = m_resolution.GetTimeStep ();
+  int64_t deadline = Simulator::Now ().GetTimeStep () + (m_timeout.GetTimeStep () << std::min<uint32_t> (request.attempt, 20));
+  request.deadline = (deadline + resolution - 1) / resolution;
+  m_wheel.Insert (Simulator::Now ().GetTimeStep () / resolution, request.deadline, id);
+}
+
+void RpcEchoClient::HandleRead (Ptr<Socket> socket) {
+  Ptr<Packet> packet;
+  Address from;
+  while ((packet = socket->RecvFrom (from))) {
+    SeqTsHeader header;
+    if (packet->GetSize () < header.GetSerializedSize ()) continue;
+    packet->RemoveHeader (header);
+    if (header.GetSeq () >= m_requests.size () || m_requests[header.GetSeq ()].done) continue; // duplicate
+    // The wheel entry stays, it is ignored when it expires
+    m_requests[header.GetSeq ()].done = true;
+    m_successes++;
+    recordRtt (Simulator::Now () - header.GetTs ());
+  }
+}
+
+void RpcEchoClient::ScheduleTick (void) {
+  // Only move the event if the wheel needs to wake up earlier than it is scheduled
+  uint64_t next = m_wheel.NextTick ();
+  if (next == UINT64_MAX || (m_tickEvent.IsRunning () && next >= m_tickAt)) return;
+  Simulator::Cancel (m_tickEvent);
+  m_tickAt = next;
+  Time at = Time (m_resolution.GetTimeStep () * (int64_t) next);
+  m_tickEvent = Simulator::Schedule (at > Simulator::Now () ? at - Simulator::Now () : Time (0), &RpcEchoClient::Tick, this);
+}
+
+void RpcEchoClient::Tick (void) {
+  std::vector<uint64_t> expired;
+  m_wheel.Advance (Simulator::Now ().GetTimeStep () / m_resolution.GetTimeStep (), &expired);
+  for (size_t e = 0; e < expired.size (); e++) {
+    Request& request = m_requests[expired[e]];
+    if (request.done) continue; // answered since
+    if (request.attempt < m_maxRetries) {
+      request.attempt++;
+      m_retries++;
+      Transmit (expired[e]);
+    } else {
+      request.done = true;
+      m_timeouts++;
+    }
+  }
+  m_tickAt = UINT64_MAX;
+  ScheduleTick ();
+}
+
+Ptr<RpcEchoClient> installRpcEchoClient(Ptr<Node> node, int port, Ipv4InterfaceContainer* ipInterfaces,
+                                        uint32_t requests, Time interval, Time timeout, uint32_t retries,
+                                        float start, float end) {
+  Ptr<RpcEchoClient> rpcClient = CreateObject<RpcEchoClient> ();
+  // Server addresses are every second address of ipInterfaces, see installUdpEchoClient()
+  for (uint32_t ip = 1; ip < ipInterfaces->GetN(); ip+=2) rpcClient->AddServer (ipInterfaces->GetAddress(ip));
+  rpcClient->SetAttribute ("Port", UintegerValue (port));
+  rpcClient->SetAttribute ("Requests", UintegerValue (requests));
+  rpcClient->SetAttribute ("Interval", TimeValue (interval));
+  rpcClient->SetAttribute ("Timeout", TimeValue (timeout));
+  rpcClient->SetAttribute ("MaxRetries", UintegerValue (retries));
+  node->AddApplication (rpcClient);
+  rpcClient->SetStartTime (Seconds (start));
+  rpcClient->SetStopTime (Seconds (end));
+  return rpcClient;
+}
+
+bool TrafficPattern::SetKind (std::string name) {
+  if (name == "all-to-all") kind = ALL_TO_ALL;
+  else if (name == "permutation") kind = PERMUTATION;
+  else if (name == "stride") kind = STRIDE;
+  else if (name == "hotspot") kind = HOTSPOT;
+  else return false;
+  return true;
+}
+
+uint64_t TrafficPattern::Permute (uint64_t x, bool inverse) const {
+  // Balanced Feistel network on the smallest even number of bits covering the servers, the
+  // values >= N are walked through again until they land in [0, N) (cycle walking), which
+  // gives a permutation of [0, N) without storing it
+  uint64_t n = servers.size ();
+  int half = 1;
+  while ((uint64_t) 1 << (2 * half) < n) half++;
+  uint64_t mask = ((uint64_t) 1 << half) - 1;
+  do {
+    uint64_t left = x >> half, right = x & mask;
+    for (int round = 0; round < 4; round++) {
+      int key = inverse ? 3 - round : round;
+      uint64_t f = (inverse ? left : right) * 0x9E3779B97F4A7C15ULL ^ (seed + key) * 0xBF58476D1CE4E5B9ULL;
+      f = (f ^ (f >> 31)) & mask;
+      if (inverse) {
+        uint64_t previous = right ^ f;
+        right = left;
+        left = previous;
+      } else {
+        uint64_t next = left ^ f;
+        left = right;
+        right = next;
+      }
+    }
+    x = (left << half) | right;
+  } while (x >= n);
+  return x;
+}
+
+uint32_t TrafficPattern::Destination (uint32_t source, uint64_t k, double random) const {
+  uint32_t n = servers.size ();
+  switch (kind) {
+  case ALL_TO_ALL:
+    return (source + 1 + k % (n - 1)) % n;
+  case PERMUTATION:
+    // Servers in the permuted order send to the next one, the last one to the first, so the
+    // permutation is a single cycle and nobody sends to itself
+    return Permute ((Permute (source, true) + 1) % n, false);
+  case STRIDE:
+    return (source + stride) % n;
+  case HOTSPOT:
+    if (source != hotspot) {
+      if (random < hotFraction) return hotspot;
+      // Otherwise any other server, reusing what is left of the random number
+      random = (random - hotFraction) / (1 - hotFraction);
+    }
+    // The hotspot itself sends to any other server with the whole random number
+    return (source + 1 + (uint32_t) (random * (n - 1))) % n;
+  }
+  return source;
+}
+
+NS_OBJECT_ENSURE_REGISTERED (PatternClient);
+
+TypeId PatternClient::GetTypeId (void) {
+  static TypeId tid = TypeId ("ns3::PatternClient")
+    .SetParent<Application> ()
+    .AddConstructor<PatternClient> ()
+    .AddAttribute ("Interval", "Time between two packets",
+                   TimeValue (MilliSeconds (1)),
+                   MakeTimeAccessor (&PatternClient::m_interval),
+                   MakeTimeChecker ())
+    .AddAttribute ("PacketSize", "Size of the packets, SeqTsHeader included",
+                   UintegerValue (1 << 10),
+                   MakeUintegerAccessor (&PatternClient::m_size),
+                   MakeUintegerChecker<uint32_t> (12))
+    .AddAttribute ("Rounds", "Times the client goes through the pattern",
+                   UintegerValue (1),
+                   MakeUintegerAccessor (&PatternClient::m_rounds),
+                   MakeUintegerChecker<uint32_t> ())
+    .AddAttribute ("Poisson", "Exponential times between packets, of mean Interval, instead of a fixed Interval",
+                   BooleanValue (false),
+                   MakeBooleanAccessor (&PatternClient::m_poisson),
+                   MakeBooleanChecker ())
+    .AddAttribute ("Port", "Port of the echo servers",
+                   UintegerValue (9),
+                   MakeUintegerAccessor (&PatternClient::m_port),
+                   MakeUintegerChecker<uint16_t> ());
+  return tid;
+}
+
+PatternClient::PatternClient () : m_pattern (0), m_index (0), m_poisson (false), m_sent (0) {
+  m_random = CreateObject<UniformRandomVariable> ();
+}
+
+void PatternClient::Setup (const TrafficPattern* pattern, uint32_t index) {
+  m_pattern = pattern;
+  m_index = index;
+}
+
+void PatternClient::StartApplication (void) {
+  m_socket = Socket::CreateSocket (GetNode (), UdpSocketFactory::GetTypeId ());
+  m_socket->Bind ();
+  m_socket->SetRecvCallback (MakeCallback (&PatternClient::HandleRead, this));
+  m_sendEvent = Simulator::ScheduleNow (&PatternClient::Send, this);
+}
+
+void PatternClient::StopApplication (void) {
+  Simulator::Cancel (m_sendEvent);
+  if (m_socket) {
+    m_socket->SetRecvCallback (MakeNullCallback<void, Ptr<Socket> > ());
+    m_socket->Close ();
+  }
+}
+
+void PatternClient::Send (void) {
+  uint32_t destination = m_pattern->Destination (m_index, m_sent, m_random->GetValue ());
+  SeqTsHeader header; // carries the send time to the echo server and back
+  header.SetSeq (m_sent);
+  Ptr<Packet> packet = Create<Packet> (m_size > header.GetSerializedSize () ? m_size - header.GetSerializedSize () : 0);
+  packet->AddHeader (header);
+  m_socket->SendTo (packet, 0, InetSocketAddress (m_pattern->servers[destination], m_port));
+  counters.echoRequests.fetch_add (1, std::memory_order_relaxed);
+  // Only the next packet of this client is ever scheduled
+  if (++m_sent < (uint64_t) m_rounds * m_pattern->PacketsPerRound ()) {
+    Time interval = m_interval;
+    if (m_poisson) interval = NanoSeconds ((int64_t) (-std::log (1 - m_random->GetValue ()) * m_interval.GetNanoSeconds ()));
+    m_sendEvent = Simulator::Schedule (interval, &PatternClient::Send, this);
+  }
+}
+
+void PatternClient::HandleRead (Ptr<Socket> socket) {
+  Ptr<Packet> packet;
+  Address from;
+  while ((packet = socket->RecvFrom (from))) {
+    SeqTsHeader header;
+    if (packet->GetSize () < header.GetSerializedSize ()) continue;
+    packet->RemoveHeader (header);
+    recordRtt (Simulator::Now () - header.GetTs ());
+  }
+}
+
+bool installPatternClients(TrafficPattern* pattern, Ipv4InterfaceContainer* ipInterfaces, int port,
+                           uint32_t rounds, Time interval, float start, float end) {
+  // Server addresses are every second address of ipInterfaces, see installUdpEchoClient()
+  std::vector<Ptr<Node> > nodes;
+  pattern->servers.clear ();
+  for (uint32_t ip = 1; ip < ipInterfaces->GetN(); ip+=2) {
+    pattern->servers.push_back (ipInterfaces->GetAddress(ip));
+    nodes.push_back (ipInterfaces->Get(ip).first->GetObject<Node> ());
+  }
+  if (pattern->servers.size () < 2) {
+    NS_LOG_WARN ("A traffic pattern needs at least 2 servers, no traffic");
+    return true;
+  }
+  if (pattern->kind == TrafficPattern::STRIDE && pattern->stride % pattern->servers.size () == 0) {
+    NS_LOG_ERROR ("--patternStride=" << pattern->stride << " is a multiple of the " << pattern->servers.size ()
+                  << " servers, every server would send to itself");
+    return false;
+  }
+  if (pattern->kind == TrafficPattern::HOTSPOT && pattern->hotspot >= pattern->servers.size ()) {
+    NS_LOG_ERROR ("--hotspot=" << pattern->hotspot << " is not a server, there are " << pattern->servers.size ());
+    return false;
+  }
+  for (uint32_t i = 0; i < nodes.size (); i++) {
+    Ptr<PatternClient> patternClient = CreateObject<PatternClient> ();
+    patternClient->Setup (pattern, i);
+    patternClient->SetAttribute ("Port", UintegerValue (port));
+    patternClient->SetAttribute ("Rounds", UintegerValue (rounds));
+    patternClient->SetAttribute ("Interval", TimeValue (interval));
+    nodes[i]->AddApplication (patternClient);
+    // Spread the first packets of the servers like the echo clients of the root
+    patternClient->SetStartTime (Seconds (start + i / 10000.0));
+    patternClient->SetStopTime (Seconds (end));
+  }
+  return true;
+}
+
+NS_OBJECT_ENSURE_REGISTERED (SflowAgent);
+
+TypeId SflowAgent::GetTypeId (void) {
+  static TypeId tid = TypeId ("ns3::SflowAgent")
+    .SetParent<Application> ()
+    .AddConstructor<SflowAgent> ()
+    .AddAttribute ("Rate", "Sampling rate, 1 in Rate packets on average",
+                   UintegerValue (1000),
+                   MakeUintegerAccessor (&SflowAgent::m_rate),
+                   MakeUintegerChecker<uint32_t> (1))
+    .AddAttribute ("Interval", "Time between two polls of the interface counters",
+                   TimeValue (Seconds (1)),
+                   MakeTimeAccessor (&SflowAgent::m_interval),
+                   MakeTimeChecker ())
+    .AddAttribute ("Port", "Port of the collector",
+                   UintegerValue (6343),
+                   MakeUintegerAccessor (&SflowAgent::m_port),
+                   MakeUintegerChecker<uint16_t> ());
+  return tid;
+}
+
+SflowAgent::SflowAgent ()
+  : m_rate (1000), m_port (6343), m_out (0), m_running (false), m_recordCount (0), m_samples (0), m_datagrams (0) {
+  m_random = CreateObject<UniformRandomVariable> ();
+}
+
+void SflowAgent::Setup (Ipv4Address agent, Ipv4Address collector, std::ostream* out) {
+  m_agent = agent;
+  m_collector = collector;
+  m_out = out;
+}
+
+// Queue drops of an interface, bound to its agent and interface index
+static void sflowDiscarded(SflowAgent* agent, uint32_t interface, Ptr<const Packet> packet) {
+  agent->CountDiscard (interface);
+}
+
+void SflowAgent::StartApplication (void) {
+  Ptr<Ipv4L3Protocol> ipv4 = GetNode ()->GetObject<Ipv4L3Protocol> ();
+  m_interfaces.assign (ipv4->GetNInterfaces (), Interface ());
+  for (uint32_t i = 0; i < m_interfaces.size (); i++) {
+    m_interfaces[i].skip = NextSkip ();
+    Ptr<CsmaNetDevice> device = DynamicCast<CsmaNetDevice> (ipv4->GetNetDevice (i));
+    if (device != 0) device->GetQueue ()->TraceConnectWithoutContext ("Drop", MakeBoundCallback (&sflowDiscarded, this, i));
+  }
+  ipv4->TraceConnectWithoutContext ("Rx", MakeCallback (&SflowAgent::Received, this));
+  ipv4->TraceConnectWithoutContext ("Tx", MakeCallback (&SflowAgent::Sent, this));
+  if (m_collector != Ipv4Address::GetZero ()) {
+    m_socket = Socket::CreateSocket (GetNode (), UdpSocketFactory::GetTypeId ());
+    m_socket->Bind ();
+    m_socket->Connect (InetSocketAddress (m_collector, m_port));
+  }
+  m_running = true;
+  m_pollEvent = Simulator::Schedule (m_interval, &SflowAgent::PollCounters, this);
+}
+
+void SflowAgent::StopApplication (void) {
+  m_running = false;
+  Simulator::Cancel (m_pollEvent);
+  Flush ();
+  if (m_socket) m_socket->Close ();
+}
+
+// Uniform between 1 and 2 rate - 1, so a sample every rate packets on average without any
+// period the traffic could line up with
+uint32_t SflowAgent::NextSkip (void) {
+  return m_rate <= 1 ? 1 : 1 + m_random->GetInteger (0, 2 * m_rate - 2);
+}
+
+void SflowAgent::Received (Ptr<const Packet> packet, Ptr<Ipv4> ipv4, uint32_t interface) {
+  if (!m_running || interface >= m_interfaces.size ()) return;
+  Interface& port = m_interfaces[interface];
+  port.inOctets += packet->GetSize ();
+  port.inPackets++;
+  Ipv4Header header;
+  packet->PeekHeader (header);
+  Flow& flow = m_flows[std::make_pair ((uint64_t) header.GetSource ().Get () << 32 | header.GetDestination ().Get (),
+                                       header.GetProtocol ())];
+  flow.packets++;
+  flow.bytes += packet->GetSize ();
+  if (--port.skip > 0) return;
+  port.skip = NextSkip ();
+
+  // Ports of the first fragment of UDP and TCP packets, both start with them
+  uint16_t sourcePort = 0, destinationPort = 0;
+  uint32_t headerSize = header.GetSerializedSize ();
+  if ((header.GetProtocol () == 6 || header.GetProtocol () == 17) && header.GetFragmentOffset () == 0
+      && packet->GetSize () >= headerSize + 4) {
+    uint8_t bytes[64];
+    packet->CopyData (bytes, std::min<uint32_t> (headerSize + 4, sizeof bytes));
+    if (headerSize + 4 <= sizeof bytes) {
+      sourcePort = bytes[headerSize] << 8 | bytes[headerSize + 1];
+      destinationPort = bytes[headerSize + 2] << 8 | bytes[headerSize + 3];
+    }
+  }
+  m_samples++;
+  std::ostringstream record;
+  record << "flow if " << interface << " rate " << m_rate << " pool " << port.inPackets << " src " << header.GetSource ()
+         << " dst " << header.GetDestination () << " proto " << (int) header.GetProtocol () << " sport " << sourcePort
+         << " dport " << destinationPort << " length " << packet->GetSize () << "\n";
+  Record (record.str ());
+}
+
+void SflowAgent::Sent (Ptr<const Packet> packet, Ptr<Ipv4> ipv4, uint32_t interface) {
+  if (!m_running || interface >= m_interfaces.size ()) return;
+  m_interfaces[interface].outOctets += packet->GetSize ();
+  m_interfaces[interface].outPackets++;
+}
+
+void SflowAgent::PollCounters (void) {
+  // The loopback is left out
+  for (uint32_t i = 1; i < m_interfaces.size (); i++) {
+    const Interface& port = m_interfaces[i];
+    std::ostringstream record;
+    record << "counters if " << i << " inOctets " << port.inOctets << " inPackets " << port.inPackets << " outOctets "
+           << port.outOctets << " outPackets " << port.outPackets << " outDiscards " << port.outDiscards << "\n";
+    Record (record.str ());
+  }
+  // Samples are never held longer than an interval
+  Flush ();
+  m_pollEvent = Simulator::Schedule (m_interval, &SflowAgent::PollCounters, this);
+}
+
+void SflowAgent::Record (const std::string& record) {
+  if (m_records.size () + record.size () > 1400 - 80) Flush ();
+  m_records += record;
+  m_recordCount++;
+}
+
+void SflowAgent::Flush (void) {
+  if (m_recordCount == 0) return;
+  std::ostringstream datagram;
+  datagram << "datagram " << Simulator::Now ().GetNanoSeconds () << " agent " << m_agent << " seq " << m_datagrams++
+           << " records " << m_recordCount << "\n" << m_records;
+  std::string text = datagram.str ();
+  if (m_socket) m_socket->Send (Create<Packet> ((const uint8_t*) text.data (), text.size ()));
+  else if (m_out != 0) *m_out << text;
+  m_records.clear ();
+  m_recordCount = 0;
+}
+
+void SflowAgent::WriteTruth (std::ostream& out) const {
+  for (uint32_t i = 1; i < m_interfaces.size (); i++) {
+    const Interface& port = m_interfaces[i];
+    out << "interface agent " << m_agent << " if " << i << " inOctets " << port.inOctets << " inPackets " << port.inPackets
+        << " outOctets " << port.outOctets << " outPackets " << port.outPackets << " outDiscards " << port.outDiscards << "\n";
+  }
+  std::map<std::pair<uint64_t, uint8_t>, Flow>::const_iterator flow;
+  for (flow = m_flows.begin (); flow != m_flows.end (); flow++) {
+    out << "flow agent " << m_agent << " src " << Ipv4Address ((uint32_t) (flow->first.first >> 32)) << " dst "
+        << Ipv4Address ((uint32_t) flow->first.first) << " proto " << (int) flow->first.second << " packets "
+        << flow->second.packets << " bytes " << flow->second.bytes << "\n";
+  }
+}
+
+NS_OBJECT_ENSURE_REGISTERED (SflowCollector);
+
+TypeId SflowCollector::GetTypeId (void) {
+  static TypeId tid = TypeId ("ns3::SflowCollector")
+    .SetParent<Application> ()
+    .AddConstructor<SflowCollector> ()
+    .AddAttribute ("Port", "Port the datagrams are received on",
+                   UintegerValue (6343),
+                   MakeUintegerAccessor (&SflowCollector::m_port),
+                   MakeUintegerChecker<uint16_t> ());
+  return tid;
+}
+
+SflowCollector::SflowCollector () : m_port (6343), m_out (0), m_datagrams (0) {
+}
+
+void SflowCollector::StartApplication (void) {
+  m_socket = Socket::CreateSocket (GetNode (), UdpSocketFactory::GetTypeId ());
+  m_socket->Bind (InetSocketAddress (Ipv4Address::GetAny (), m_port));
+  m_socket->SetRecvCallback (MakeCallback (&SflowCollector::HandleRead, this));
+}
+
+void SflowCollector::StopApplication (void) {
+  if (m_socket) {
+    m_socket->SetRecvCallback (MakeNullCallback<void, Ptr<Socket> > ());
+    m_socket->Close ();
+  }
+}
+
+void SflowCollector::HandleRead (Ptr<Socket> socket) {
+  Ptr<Packet> packet;
+  Address from;
+  while ((packet = socket->RecvFrom (from))) {
+    std::string text (packet->GetSize (), '\0');
+    packet->CopyData ((uint8_t*) &text[0], text.size ());
+    if (m_out != 0) *m_out << text;
+    m_datagrams++;
+  }
+}
+
+bool installSflow(TreeTopology* topology, uint32_t rate, Time interval, std::string collector, std::ostream* out,
+                  float start, float end, std::vector<Ptr<SflowAgent> >* agents, Ptr<SflowCollector>* collectorApp) {
+  Ipv4Address collectorAddress = Ipv4Address::GetZero ();
+  *collectorApp = 0;
+  if (!collector.empty ()) {
+    int id = topology->Find (collector);
+    if (id < 0) {
+      NS_LOG_ERROR ("No node at " << collector << " for the sFlow collector");
+      return false;
+    }
+    Ptr<Node> node = topology->nodes[id].node;
+    collectorAddress = node->GetObject<Ipv4> ()->GetAddress (1, 0).GetLocal ();
+    *collectorApp = CreateObject<SflowCollector> ();
+    (*collectorApp)->Setup (out);
+    node->AddApplication (*collectorApp);
+    (*collectorApp)->SetStartTime (Seconds (0));
+    (*collectorApp)->SetStopTime (Seconds (end));
+  }
+  for (size_t id = 0; id < topology->nodes.size (); id++) {
+    const TreeNodeInfo& info = topology->nodes[id];
+    if (info.node == 0 || info.parent < 0 || info.children.empty ()) continue;
+    // A router is named by the address of its link to the parent
+    Ptr<Ipv4> ipv4 = info.node->GetObject<Ipv4> ();
+    Ipv4Address address = ipv4->GetAddress (ipv4->GetInterfaceForDevice (info.upDevice), 0).GetLocal ();
+    Ptr<SflowAgent> agent = CreateObject<SflowAgent> ();
+    agent->SetAttribute ("Rate", UintegerValue (rate));
+    agent->SetAttribute ("Interval", TimeValue (interval));
+    agent->Setup (address, collectorAddress, out);
+    info.node->AddApplication (agent);
+    agent->SetStartTime (Seconds (start));
+    agent->SetStopTime (Seconds (end));
+    agents->push_back (agent);
+  }
+  if (agents->empty ()) NS_LOG_WARN ("No routers in the tree, nothing for --sflow to sample");
+  return true;
+}
+
+NS_OBJECT_ENSURE_REGISTERED (IntTag);
+
+TypeId IntTag::GetTypeId (void) {
+  static TypeId tid = TypeId ("ns3::IntTag")
+    .SetParent<Tag> ()
+    .AddConstructor<IntTag> ();
+  return tid;
+}
+
+TypeId IntTag::GetInstanceTypeId (void) const {
+  return GetTypeId ();
+}
+
+void IntTag::Serialize (TagBuffer buffer) const {
+  buffer.WriteU8 (reply);
+  buffer.WriteU8 (hops);
+  for (uint32_t h = 0; h < hops; h++) {
+    buffer.WriteU64 (hop[h].time);
+    buffer.WriteU64 (hop[h].txBytes);
+    buffer.WriteU32 (hop[h].queue);
+  }
+}
+
+void IntTag::Deserialize (TagBuffer buffer) {
+  reply = buffer.ReadU8 ();
+  hops = buffer.ReadU8 ();
+  for (uint32_t h = 0; h < hops; h++) {
+    hop[h].time = buffer.ReadU64 ();
+    hop[h].txBytes = buffer.ReadU64 ();
+    hop[h].queue = buffer.ReadU32 ();
+  }
+}
+
+NS_OBJECT_ENSURE_REGISTERED (HpccSender);
+
+TypeId HpccSender::GetTypeId (void) {
+  static TypeId tid = TypeId ("ns3::HpccSender")
+    .SetParent<Application> ()
+    .AddConstructor<HpccSender> ()
+    .AddAttribute ("Port", "Port of the receiver",
+                   UintegerValue (5001),
+                   MakeUintegerAccessor (&HpccSender::m_port),
+                   MakeUintegerChecker<uint16_t> ())
+    .AddAttribute ("Bytes", "Size of the flow",
+                   UintegerValue (1000000),
+                   MakeUintegerAccessor (&HpccSender::m_bytes),
+                   MakeUintegerChecker<uint64_t> (1))
+    .AddAttribute ("PacketSize", "UDP payload of the data packets, SeqTsHeader and INT header included",
+                   UintegerValue (1000),
+                   MakeUintegerAccessor (&HpccSender::m_packetSize),
+                   MakeUintegerChecker<uint32_t> (100))
+    .AddAttribute ("BaseRtt", "Round trip time of the path without queueing (T)",
+                   TimeValue (MilliSeconds (8)),
+                   MakeTimeAccessor (&HpccSender::m_baseRtt),
+                   MakeTimeChecker ())
+    .AddAttribute ("Rate", "Line rate of the links (B)",
+                   DataRateValue (DataRate ("1Gbps")),
+                   MakeDataRateAccessor (&HpccSender::m_rate),
+                   MakeDataRateChecker ())
+    .AddAttribute ("Eta", "Target utilization",
+                   DoubleValue (0.95),
+                   MakeDoubleAccessor (&HpccSender::m_eta),
+                   MakeDoubleChecker<double> (0.1, 1))
+    .AddAttribute ("MaxStage", "Additive increases before the reference window moves",
+                   UintegerValue (5),
+                   MakeUintegerAccessor (&HpccSender::m_maxStage),
+                   MakeUintegerChecker<uint32_t> ())
+    .AddAttribute ("Wai", "Additive increase of the window in bytes",
+                   UintegerValue (100),
+                   MakeUintegerAccessor (&HpccSender::m_wai),
+                   MakeUintegerChecker<uint32_t> ());
+  return tid;
+}
+
+HpccSender::HpccSender ()
+  : m_port (5001), m_bytes (1000000), m_packetSize (1000), m_eta (0.95), m_maxStage (5), m_wai (100), m_hops (0),
+    m_packets (0), m_nextSeq (0), m_highestAck (-1), m_ackedBytes (0), m_lost (0), m_window (0), m_reference (0),
+    m_utilization (0), m_stage (0), m_lastUpdateSeq (0), m_maxQueue (0), m_done (false) {
+}
+
+void HpccSender::Setup (Ipv4Address receiver, uint32_t hops) {
+  m_receiver = receiver;
+  m_hops = std::min (hops, IntTag::MAX_HOPS);
+}
+
+void HpccSender::StartApplication (void) {
+  m_socket = Socket::CreateSocket (GetNode (), UdpSocketFactory::GetTypeId ());
+  m_socket->Bind ();
+  m_socket->Connect (InetSocketAddress (m_receiver, m_port));
+  m_socket->SetRecvCallback (MakeCallback (&HpccSender::HandleRead, this));
+  uint32_t payload = m_packetSize - SeqTsHeader ().GetSerializedSize () - IntTag::HeaderBytes (m_hops);
+  m_packets = (m_bytes + payload - 1) / payload;
+  // Line rate from the first packet: W starts at one BDP
+  m_window = m_reference = m_rate.GetBitRate () / 8.0 * m_baseRtt.GetSeconds ();
+  m_firstSend = m_lastAck = Simulator::Now ();
+  m_sendEvent = Simulator::ScheduleNow (&HpccSender::Send, this);
+  // The flow gives up after 10 RTTs without an ACK (lost tail, or every ACK lost)
+  m_idleEvent = Simulator::Schedule (Seconds (10 * m_baseRtt.GetSeconds ()), &HpccSender::Finish, this);
+}
+
+void HpccSender::StopApplication (void) {
+  Simulator::Cancel (m_sendEvent);
+  Simulator::Cancel (m_idleEvent);
+  if (m_socket) {
+    m_socket->SetRecvCallback (MakeNullCallback<void, Ptr<Socket> > ());
+    m_socket->Close ();
+  }
+}
+
+void HpccSender::Send (void) {
+  if (m_done || m_nextSeq >= m_packets) return;
+  // Packets above the highest ACK are in flight, the ones below it without an ACK are lost
+  double inFlight = (double) (m_nextSeq - (m_highestAck + 1)) * m_packetSize;
+  if (inFlight + m_packetSize > m_window) return;   // the next ACK sends again
+  SeqTsHeader header;
+  header.SetSeq (m_nextSeq++);
+  Ptr<Packet> packet = Create<Packet> (m_packetSize - header.GetSerializedSize ());
+  packet->AddHeader (header);
+  packet->AddPacketTag (IntTag ());
+  m_socket->Send (packet);
+  if (m_nextSeq == m_packets) return;
+  double rate = m_window / m_baseRtt.GetSeconds ();   // bytes per second
+  m_sendEvent = Simulator::Schedule (Seconds (m_packetSize / rate), &HpccSender::Send, this);
+}
+
+void HpccSender::HandleRead (Ptr<Socket> socket) {
+  Ptr<Packet> packet;
+  while ((packet = socket->Recv ())) {
+    SeqTsHeader header;
+    IntTag tag;
+    if (packet->GetSize () < header.GetSerializedSize () || !packet->PeekPacketTag (tag)) continue;
+    packet->RemoveHeader (header);
+    NewAck (header.GetSeq (), tag);
+  }
+}
+
+void HpccSender::NewAck (uint32_t seq, const IntTag& tag) {
+  if (m_done || (int64_t) seq <= m_highestAck) return;
+  m_lost += seq - (m_highestAck + 1);
+  m_highestAck = seq;
+  m_ackedBytes += m_packetSize;
+  m_lastAck = Simulator::Now ();
+  for (uint32_t h = 0; h < tag.hops; h++) m_maxQueue = std::max (m_maxQueue, tag.hop[h].queue);
+
+  // The reference window moves once per RTT, on the first ACK of a packet sent after the last move
+  double utilization = MeasureInflight (tag);
+  bool updateReference = seq >= m_lastUpdateSeq;
+  m_window = ComputeWindow (utilization, updateReference);
+  if (updateReference) m_lastUpdateSeq = m_nextSeq;
+  m_last = tag;
+
+  if (seq + 1 == m_packets) {
+    Finish ();
+    return;
+  }
+  Simulator::Cancel (m_idleEvent);
+  m_idleEvent = Simulator::Schedule (Seconds (10 * m_baseRtt.GetSeconds ()), &HpccSender::Finish, this);
+  if (!m_sendEvent.IsRunning ()) Send ();
+}
+
+double HpccSender::MeasureInflight (const IntTag& tag) {
+  if (m_last.hops == 0 || m_last.hops != tag.hops) return m_utilization;
+  double bdp = m_rate.GetBitRate () / 8.0 * m_baseRtt.GetSeconds ();
+  double bytesPerNs = m_rate.GetBitRate () / 8e9;
+  double most = 0;
+  uint64_t tau = 0;
+  for (uint32_t h = 0; h < tag.hops; h++) {
+    const IntTag::Hop& now = tag.hop[h];
+    const IntTag::Hop& before = m_last.hop[h];
+    if (now.time <= before.time) continue;
+    double txRate = (double) (now.txBytes - before.txBytes) / (now.time - before.time);   // bytes per ns
+    double used = std::min (now.queue, before.queue) / bdp + txRate / bytesPerNs;
+    if (used > most) {
+      most = used;
+      tau = now.time - before.time;
+    }
+  }
+  double weight = std::min ((double) tau, (double) m_baseRtt.GetNanoSeconds ()) / m_baseRtt.GetNanoSeconds ();
+  m_utilization = (1 - weight) * m_utilization + weight * most;
+  return m_utilization;
+}
+
+double HpccSender::ComputeWindow (double utilization, bool updateReference) {
+  double window;
+  if (utilization >= m_eta || m_stage >= m_maxStage) {
+    window = m_reference / (utilization / m_eta) + m_wai;
+    if (updateReference) {
+      m_stage = 0;
+      m_reference = window;
+    }
+  } else {
+    window = m_reference + m_wai;
+    if (updateReference) {
+      m_stage++;
+      m_reference = window;
+    }
+  }
+  // Never more than a BDP, never less than a packet
+  double bdp = m_rate.GetBitRate () / 8.0 * m_baseRtt.GetSeconds ();
+  return std::max ((double) m_packetSize, std::min (window, bdp));
+}
+
+void HpccSender::Finish (void) {
+  if (m_done) return;
+  m_done = true;
+  m_lost += m_packets - (m_highestAck + 1);
+  Simulator::Cancel (m_sendEvent);
+  Simulator::Cancel (m_idleEvent);
+}
+
+NS_OBJECT_ENSURE_REGISTERED (HpccReceiver);
+
+TypeId HpccReceiver::GetTypeId (void) {
+  static TypeId tid = TypeId ("ns3::HpccReceiver")
+    .SetParent<Application> ()
+    .AddConstructor<HpccReceiver> ()
+    .AddAttribute ("Port", "Port the data packets are received on",
+                   UintegerValue (5001),
+                   MakeUintegerAccessor (&HpccReceiver::m_port),
+                   MakeUintegerChecker<uint16_t> ());
+  return tid;
+}
+
+HpccReceiver::HpccReceiver () : m_port (5001) {
+}
+
+void HpccReceiver::StartApplication (void) {
+  m_socket = Socket::CreateSocket (GetNode (), UdpSocketFactory::GetTypeId ());
+  m_socket->Bind (InetSocketAddress (Ipv4Address::GetAny (), m_port));
+  m_socket->SetRecvCallback (MakeCallback (&HpccReceiver::HandleRead, this));
+}
+
+void HpccReceiver::StopApplication (void) {
+  if (m_socket) {
+    m_socket->SetRecvCallback (MakeNullCallback<void, Ptr<Socket> > ());
+    m_socket->Close ();
+  }
+}
+
+void HpccReceiver::HandleRead (Ptr<Socket> socket) {
+  Ptr<Packet> packet;
+  Address from;
+  while ((packet = socket->RecvFrom (from))) {
+    SeqTsHeader header;
+    IntTag tag;
+    if (packet->GetSize () < header.GetSerializedSize () || !packet->PeekPacketTag (tag)) continue;
+    packet->RemoveHeader (header);
+    // The ACK carries the INT header back, and is not stamped on its way
+    SeqTsHeader ackHeader;
+    ackHeader.SetSeq (header.GetSeq ());
+    Ptr<Packet> ack = Create<Packet> (IntTag::HeaderBytes (tag.hops));
+    ack->AddHeader (ackHeader);
+    tag.reply = true;
+    ack->AddPacketTag (tag);
+    socket->SendTo (ack, 0, from);
+  }
+}
+
+// Links between two nodes of the tree: up to their common ancestor and down again
+static uint32_t treeHops(TreeTopology* topology, int a, int b) {
+  uint32_t hops = 0;
+  while (a != b) {
+    if (topology->nodes[a].depth >= topology->nodes[b].depth) a = topology->nodes[a].parent;
+    else b = topology->nodes[b].parent;
+    hops++;
+  }
+  return hops;
+}
+
+// Round trip time in seconds over hops links of linkHelper() (1Gbps, 1ms) without queueing:
+// propagation both ways and the transmission of a packet and its ACK (UDP payloads of
+// dataBytes and ackBytes) on every link
+static double treeBaseRtt(uint32_t hops, uint32_t dataBytes, uint32_t ackBytes) {
+  const double linkDelay = 1e-3, linkRate = 1e9;
+  const uint32_t headers = 8 + 20 + 18;   // UDP, IPv4, Ethernet
+  return hops * (2 * linkDelay + (dataBytes + ackBytes + 2 * headers) * 8 / linkRate);
+}
+
+void installHpccIncast(TreeTopology* topology, Ipv4InterfaceContainer* ipInterfaces, uint32_t receiver, uint32_t senders,
+                       uint64_t bytes, double eta, uint32_t maxStage, uint32_t wai, float start,
+                       std::vector<Ptr<HpccSender> >* flows) {
+  // Server addresses are every second address of ipInterfaces, see installUdpEchoClient()
+  std::vector<Ptr<Node> > nodes;
+  std::vector<Ipv4Address> addresses;
+  for (uint32_t ip = 1; ip < ipInterfaces->GetN(); ip+=2) {
+    addresses.push_back (ipInterfaces->GetAddress(ip));
+    nodes.push_back (ipInterfaces->Get(ip).first->GetObject<Node> ());
+  }
+  if (receiver >= nodes.size () || nodes.size () < 2) {
+    NS_LOG_WARN ("No server " << receiver << " to receive the HPCC incast, no flows");
+    return;
+  }
+  if (senders == 0 || senders > nodes.size () - 1) senders = nodes.size () - 1;
+  Ptr<HpccReceiver> sink = CreateObject<HpccReceiver> ();
+  nodes[receiver]->AddApplication (sink);
+  sink->SetStartTime (Seconds (0));
+
+  const uint32_t packetSize = 1000;
+  for (uint32_t s = 0, i = 0; s < senders; i++) {
+    if (i == receiver) continue;
+    uint32_t hops = treeHops (topology, nodes[i]->GetId (), nodes[receiver]->GetId ());
+    uint32_t intBytes = IntTag::HeaderBytes (std::min (hops, IntTag::MAX_HOPS));
+    double rtt = treeBaseRtt (hops, packetSize, SeqTsHeader ().GetSerializedSize () + intBytes);
+    double bdp = 1e9 / 8 * rtt;
+    Ptr<HpccSender> sender = CreateObject<HpccSender> ();
+    sender->Setup (addresses[receiver], hops);
+    sender->SetAttribute ("Bytes", UintegerValue (bytes));
+    sender->SetAttribute ("PacketSize", UintegerValue (packetSize));
+    sender->SetAttribute ("BaseRtt", TimeValue (Seconds (rtt)));
+    sender->SetAttribute ("Eta", DoubleValue (eta));
+    sender->SetAttribute ("MaxStage", UintegerValue (maxStage));
+    sender->SetAttribute ("Wai", UintegerValue (wai > 0 ? wai : std::max (1.0, (1 - eta) * bdp / senders)));
+    nodes[i]->AddApplication (sender);
+    sender->SetStartTime (Seconds (start));
+    flows->push_back (sender);
+    s++;
+  }
+  NS_LOG_INFO ("HPCC incast: " << senders << " flows of " << bytes << " bytes to " << addresses[receiver]);
+}
+
+void reportHpcc(const std::vector<Ptr<HpccSender> >& flows, ResultsWriter* results) {
+  if (flows.empty ()) return;
+  std::vector<double> completion;
+  uint64_t lost = 0, acked = 0;
+  uint32_t maxQueue = 0;
+  for (size_t f = 0; f < flows.size (); f++) {
+    if (flows[f]->IsDone ()) completion.push_back (flows[f]->GetCompletionTime ().GetSeconds ());
+    lost += flows[f]->GetLost ();
+    acked += flows[f]->GetAckedBytes ();
+    maxQueue = std::max (maxQueue, flows[f]->GetMaxQueue ());
+  }
+  std::sort (completion.begin (), completion.end ());
+  double sum = 0;
+  for (size_t f = 0; f < completion.size (); f++) sum += completion[f];
+  double mean = completion.empty () ? 0 : sum / completion.size ();
+  double max = completion.empty () ? 0 : completion.back ();
+  NS_LOG_INFO ("HPCC: " << completion.size () << " of " << flows.size () << " flows done, completion time mean "
+               << mean << "s, max " << max << "s, " << acked << " bytes acked, " << lost
+               << " packets lost, largest queue seen by INT " << maxQueue << " bytes");
+  if (results != 0) {
+    results->SetMetric ("hpcc_flows_done", completion.size ());
+    results->SetMetric ("hpcc_fct_mean", mean);
+    results->SetMetric ("hpcc_fct_max", max);
+    results->SetMetric ("hpcc_lost_packets", lost);
+    results->SetMetric ("hpcc_max_queue_bytes", maxQueue);
+  }
+}
+
+NS_OBJECT_ENSURE_REGISTERED (RoceHeader);
+
+TypeId RoceHeader::GetTypeId (void) {
+  static TypeId tid = TypeId ("ns3::RoceHeader")
+    .SetParent<Header> ()
+    .AddConstructor<RoceHeader> ();
+  return tid;
+}
+
+TypeId RoceHeader::GetInstanceTypeId (void) const {
+  return GetTypeId ();
+}
+
+void RoceHeader::Serialize (Buffer::Iterator start) const {
+  start.WriteU8 (type);
+  start.WriteU8 (0);
+  start.WriteU16 (0);
+  start.WriteHtonU32 (0);   // queue pair, one per flow here
+  start.WriteHtonU32 (psn);
+}
+
+uint32_t RoceHeader::Deserialize (Buffer::Iterator start) {
+  type = start.ReadU8 ();
+  start.Next (7);
+  psn = start.ReadNtohU32 ();
+  return GetSerializedSize ();
+}
+
+NS_OBJECT_ENSURE_REGISTERED (RoceSender);
+
+TypeId RoceSender::GetTypeId (void) {
+  static TypeId tid = TypeId ("ns3::RoceSender")
+    .SetParent<Application> ()
+    .AddConstructor<RoceSender> ()
+    .AddAttribute ("Port", "Port of the receiver",
+                   UintegerValue (4791),
+                   MakeUintegerAccessor (&RoceSender::m_port),
+                   MakeUintegerChecker<uint16_t> ())
+    .AddAttribute ("Bytes", "Size of the flow",
+                   UintegerValue (1000000),
+                   MakeUintegerAccessor (&RoceSender::m_bytes),
+                   MakeUintegerChecker<uint64_t> (1))
+    .AddAttribute ("PacketSize", "UDP payload of the data packets, RoceHeader included",
+                   UintegerValue (1000),
+                   MakeUintegerAccessor (&RoceSender::m_packetSize),
+                   MakeUintegerChecker<uint32_t> (13))
+    .AddAttribute ("LineRate", "Rate of the first packets, and the most Rc gets back to",
+                   DataRateValue (DataRate ("1Gbps")),
+                   MakeDataRateAccessor (&RoceSender::m_lineRate),
+                   MakeDataRateChecker ())
+    .AddAttribute ("Rto", "Time without progress before sending again from the first packet not acknowledged",
+                   TimeValue (MilliSeconds (32)),
+                   MakeTimeAccessor (&RoceSender::m_rto),
+                   MakeTimeChecker ())
+    .AddAttribute ("G", "Gain of the alpha average",
+                   DoubleValue (1.0 / 256),
+                   MakeDoubleAccessor (&RoceSender::m_g),
+                   MakeDoubleChecker<double> (0, 1))
+    .AddAttribute ("AlphaInterval", "Time without CNP before alpha decays",
+                   TimeValue (MicroSeconds (55)),
+                   MakeTimeAccessor (&RoceSender::m_alphaInterval),
+                   MakeTimeChecker ())
+    .AddAttribute ("IncreaseInterval", "Time between two increase stages of the timer",
+                   TimeValue (MicroSeconds (300)),
+                   MakeTimeAccessor (&RoceSender::m_increaseInterval),
+                   MakeTimeChecker ())
+    .AddAttribute ("ByteCounter", "Bytes sent between two increase stages of the byte counter",
+                   UintegerValue (150000),
+                   MakeUintegerAccessor (&RoceSender::m_byteCounter),
+                   MakeUintegerChecker<uint32_t> (1))
+    .AddAttribute ("Stages", "Fast recovery stages (F)",
+                   UintegerValue (5),
+                   MakeUintegerAccessor (&RoceSender::m_stages),
+                   MakeUintegerChecker<uint32_t> ())
+    .AddAttribute ("Rai", "Additive increase of the target rate",
+                   DataRateValue (DataRate ("5Mbps")),
+                   MakeDataRateAccessor (&RoceSender::m_rai),
+                   MakeDataRateChecker ())
+    .AddAttribute ("Rhai", "Hyper increase of the target rate",
+                   DataRateValue (DataRate ("50Mbps")),
+                   MakeDataRateAccessor (&RoceSender::m_rhai),
+                   MakeDataRateChecker ())
+    .AddAttribute ("MinRate", "Lowest rate a cut can bring Rc to",
+                   DataRateValue (DataRate ("10Mbps")),
+                   MakeDataRateAccessor (&RoceSender::m_minRate),
+                   MakeDataRateChecker ());
+  return tid;
+}
+
+RoceSender::RoceSender ()
+  : m_port (4791), m_bytes (1000000), m_packetSize (1000), m_g (1.0 / 256), m_byteCounter (150000), m_stages (5),
+    m_packets (0), m_psn (0), m_unacked (0), m_rc (0), m_rt (0), m_alpha (1), m_cnpSinceAlpha (false),
+    m_timerStage (0), m_byteStage (0), m_bytesCounted (0), m_cnps (0), m_resent (0), m_timeouts (0), m_done (false) {
+}
+
+void RoceSender::Setup (Ipv4Address receiver) {
+  m_receiver = receiver;
+}
+
+void RoceSender::StartApplication (void) {
+  m_socket = Socket::CreateSocket (GetNode (), UdpSocketFactory::GetTypeId ());
+  m_socket->Bind ();
+  m_socket->Connect (InetSocketAddress (m_receiver, m_port));
+  // ECT(0), so the queues mark the packets instead of waiting for them to overflow
+  m_socket->SetIpTos (Ipv4Header::ECN_ECT0);
+  m_socket->SetRecvCallback (MakeCallback (&RoceSender::HandleRead, this));
+  uint32_t payload = m_packetSize - RoceHeader ().GetSerializedSize ();
+  m_packets = (m_bytes + payload - 1) / payload;
+  m_firstSend = m_lastAck = Simulator::Now ();
+  m_rt = m_lineRate.GetBitRate ();
+  SetRate (m_rt);
+  m_sendEvent = Simulator::ScheduleNow (&RoceSender::Send, this);
+  m_alphaEvent = Simulator::Schedule (m_alphaInterval, &RoceSender::UpdateAlpha, this);
+  m_increaseEvent = Simulator::Schedule (m_increaseInterval, &RoceSender::IncreaseTimer, this);
+}
+
+void RoceSender::StopApplication (void) {
+  Simulator::Cancel (m_sendEvent);
+  Simulator::Cancel (m_rtoEvent);
+  Simulator::Cancel (m_alphaEvent);
+  Simulator::Cancel (m_increaseEvent);
+  if (m_socket) {
+    m_socket->SetRecvCallback (MakeNullCallback<void, Ptr<Socket> > ());
+    m_socket->Close ();
+  }
+}
+
+void RoceSender::SetRate (double rate) {
+  m_rc = std::max ((double) m_minRate.GetBitRate (), std::min (rate, (double) m_lineRate.GetBitRate ()));
+  m_rates.push_back (std::make_pair (Simulator::Now ().GetNanoSeconds (), m_rc));
+}
+
+void RoceSender::Send (void) {
+  // Everything is sent, the ACKs, a NAK or the RTO say what comes next
+  if (m_done || m_psn >= m_packets) return;
+  RoceHeader header;
+  header.psn = m_psn++;
+  Ptr<Packet> packet = Create<Packet> (m_packetSize - header.GetSerializedSize ());
+  packet->AddHeader (header);
+  m_socket->Send (packet);
+  if (!m_rtoEvent.IsRunning ()) m_rtoEvent = Simulator::Schedule (m_rto, &RoceSender::Timeout, this);
+  m_bytesCounted += m_packetSize;
+  if (m_bytesCounted >= m_byteCounter) {
+    m_bytesCounted = 0;
+    m_byteStage++;
+    IncreaseRate ();
+  }
+  m_sendEvent = Simulator::Schedule (Seconds (m_packetSize * 8 / m_rc), &RoceSender::Send, this);
+}
+
+void RoceSender::HandleRead (Ptr<Socket> socket) {
+  Ptr<Packet> packet;
+  while ((packet = socket->Recv ())) {
+    RoceHeader header;
+    if (m_done || packet->GetSize () < header.GetSerializedSize ()) continue;
+    packet->RemoveHeader (header);
+    if (header.type == RoceHeader::CNP) {
+      CutRate ();
+    } else if (header.type == RoceHeader::ACK && header.psn > m_unacked) {
+      m_unacked = header.psn;
+      m_lastAck = Simulator::Now ();
+      Simulator::Cancel (m_rtoEvent);
+      if (m_unacked >= m_packets) {
+        m_done = true;
+        Simulator::Cancel (m_sendEvent);
+        Simulator::Cancel (m_alphaEvent);
+        Simulator::Cancel (m_increaseEvent);
+      } else if (m_unacked < m_psn) {
+        m_rtoEvent = Simulator::Schedule (m_rto, &RoceSender::Timeout, this);
+      }
+    } else if (header.type == RoceHeader::NAK && header.psn >= m_unacked) {
+      m_unacked = header.psn;
+      m_lastAck = Simulator::Now ();
+      GoBack (header.psn);
+    }
+  }
+}
+
+void RoceSender::GoBack (uint32_t psn) {
+  if (psn < m_psn) m_resent += m_psn - psn;
+  m_psn = psn;
+  Simulator::Cancel (m_rtoEvent);
+  m_rtoEvent = Simulator::Schedule (m_rto, &RoceSender::Timeout, this);
+  if (!m_sendEvent.IsRunning ()) Send ();
+}
+
+void RoceSender::Timeout (void) {
+  if (m_done || m_unacked >= m_psn) return;
+  m_timeouts++;
+  GoBack (m_unacked);
+}
+
+void RoceSender::CutRate (void) {
+  m_cnps++;
+  m_rt = m_rc;
+  m_alpha = (1 - m_g) * m_alpha + m_g;
+  m_cnpSinceAlpha = true;
+  m_timerStage = m_byteStage = 0;
+  m_bytesCounted = 0;
+  SetRate (m_rc * (1 - m_alpha / 2));
+  // The increase timer starts over from the cut
+  Simulator::Cancel (m_increaseEvent);
+  m_increaseEvent = Simulator::Schedule (m_increaseInterval, &RoceSender::IncreaseTimer, this);
+}
+
+void RoceSender::UpdateAlpha (void) {
+  if (!m_cnpSinceAlpha) m_alpha = (1 - m_g) * m_alpha;
+  m_cnpSinceAlpha = false;
+  m_alphaEvent = Simulator::Schedule (m_alphaInterval, &RoceSender::UpdateAlpha, this);
+}
+
+void RoceSender::IncreaseTimer (void) {
+  m_timerStage++;
+  IncreaseRate ();
+  m_increaseEvent = Simulator::Schedule (m_increaseInterval, &RoceSender::IncreaseTimer, this);
+}
+
+void RoceSender::IncreaseRate (void) {
+  // Nothing to recover at line rate
+  if (m_rc >= m_lineRate.GetBitRate ()) return;
+  uint32_t most = std::max (m_timerStage, m_byteStage), least = std::min (m_timerStage, m_byteStage);
+  if (least > m_stages) m_rt += (least - m_stages) * (double) m_rhai.GetBitRate ();
+  else if (most >= m_stages) m_rt += m_rai.GetBitRate ();
+  m_rt = std::min (m_rt, (double) m_lineRate.GetBitRate ());
+  SetRate ((m_rt + m_rc) / 2);
+}
+
+NS_OBJECT_ENSURE_REGISTERED (RoceReceiver);
+
+TypeId RoceReceiver::GetTypeId (void) {
+  static TypeId tid = TypeId ("ns3::RoceReceiver")
+    .SetParent<Application> ()
+    .AddConstructor<RoceReceiver> ()
+    .AddAttribute ("Port", "Port the data packets are received on",
+                   UintegerValue (4791),
+                   MakeUintegerAccessor (&RoceReceiver::m_port),
+                   MakeUintegerChecker<uint16_t> ())
+    .AddAttribute ("CnpInterval", "Shortest time between two CNPs to the same sender",
+                   TimeValue (MicroSeconds (50)),
+                   MakeTimeAccessor (&RoceReceiver::m_cnpInterval),
+                   MakeTimeChecker ());
+  return tid;
+}
+
+RoceReceiver::RoceReceiver () : m_port (4791) {
+}
+
+void RoceReceiver::StartApplication (void) {
+  m_socket = Socket::CreateSocket (GetNode (), UdpSocketFactory::GetTypeId ());
+  m_socket->Bind (InetSocketAddress (Ipv4Address::GetAny (), m_port));
+  // The ECN bits of the packets come with the TOS
+  m_socket->SetIpRecvTos (true);
+  m_socket->SetRecvCallback (MakeCallback (&RoceReceiver::HandleRead, this));
+}
+
+void RoceReceiver::StopApplication (void) {
+  if (m_socket) {
+    m_socket->SetRecvCallback (MakeNullCallback<void, Ptr<Socket> > ());
+    m_socket->Close ();
+  }
+}
+
+void RoceReceiver::Reply (const Address& to, uint8_t type, uint32_t psn) {
+  RoceHeader header;
+  header.type = type;
+  header.psn = psn;
+  Ptr<Packet> packet = Create<Packet> ();
+  packet->AddHeader (header);
+  m_socket->SendTo (packet, 0, to);
+}
+
+void RoceReceiver::HandleRead (Ptr<Socket> socket) {
+  Ptr<Packet> packet;
+  Address from;
+  while ((packet = socket->RecvFrom (from))) {
+    RoceHeader header;
+    if (packet->GetSize () < header.GetSerializedSize ()) continue;
+    packet->RemoveHeader (header);
+    InetSocketAddress sender = InetSocketAddress::ConvertFrom (from);
+    std::pair<uint32_t, uint16_t> key (sender.GetIpv4 ().Get (), sender.GetPort ());
+    std::map<std::pair<uint32_t, uint16_t>, Peer>::iterator found = m_peers.find (key);
+    if (found == m_peers.end ()) {
+      Peer peer = {0, false, Seconds (0)};
+      found = m_peers.insert (std::make_pair (key, peer)).first;
+    }
+    Peer& peer = found->second;
+
+    SocketIpTosTag tos;
+    if (packet->PeekPacketTag (tos) && (tos.GetTos () & 3) == Ipv4Header::ECN_CE
+        && (peer.lastCnp == Seconds (0) || Simulator::Now () - peer.lastCnp >= m_cnpInterval)) {
+      peer.lastCnp = Simulator::Now ();
+      Reply (from, RoceHeader::CNP, header.psn);
+    }
+    if (header.psn == peer.expected) {
+      peer.expected++;
+      peer.nakSent = false;
+      Reply (from, RoceHeader::ACK, peer.expected);
+    } else if (header.psn > peer.expected) {
+      // Go-back-N: everything after a gap is dropped, the sender is told once where to go back
+      if (!peer.nakSent) Reply (from, RoceHeader::NAK, peer.expected);
+      peer.nakSent = true;
+    } else {
+      // Sent again after an ACK was lost
+      Reply (from, RoceHeader::ACK, peer.expected);
+    }
+  }
+}
+
+void installRoceIncast(TreeTopology* topology, Ipv4InterfaceContainer* ipInterfaces, uint32_t receiver, uint32_t senders,
+                       uint64_t bytes, float start, std::vector<Ptr<RoceSender> >* flows) {
+  // Server addresses are every second address of ipInterfaces, see installUdpEchoClient()
+  std::vector<Ptr<Node> > nodes;
+  std::vector<Ipv4Address> addresses;
+  for (uint32_t ip = 1; ip < ipInterfaces->GetN(); ip+=2) {
+    addresses.push_back (ipInterfaces->GetAddress(ip));
+    nodes.push_back (ipInterfaces->Get(ip).first->GetObject<Node> ());
+  }
+  if (receiver >= nodes.size () || nodes.size () < 2) {
+    NS_LOG_WARN ("No server " << receiver << " to receive the RoCE incast, no flows");
+    return;
+  }
+  if (senders == 0 || senders > nodes.size () - 1) senders = nodes.size () - 1;
+  Ptr<RoceReceiver> sink = CreateObject<RoceReceiver> ();
+  nodes[receiver]->AddApplication (sink);
+  sink->SetStartTime (Seconds (0));
+
+  for (uint32_t s = 0, i = 0; s < senders; i++) {
+    if (i == receiver) continue;
+    uint32_t hops = treeHops (topology, nodes[i]->GetId (), nodes[receiver]->GetId ());
+    Ptr<RoceSender> sender = CreateObject<RoceSender> ();
+    sender->Setup (addresses[receiver]);
+    sender->SetAttribute ("Bytes", UintegerValue (bytes));
+    sender->SetAttribute ("Rto", TimeValue (Seconds (4 * treeBaseRtt (hops, 1000, 12))));
+    nodes[i]->AddApplication (sender);
+    sender->SetStartTime (Seconds (start));
+    flows->push_back (sender);
+    s++;
+  }
+  NS_LOG_INFO ("RoCE incast: " << senders << " flows of " << bytes << " bytes to " << addresses[receiver]);
+}
+
+void reportRoce(const std::vector<Ptr<RoceSender> >& flows, std::string path, ResultsWriter* results) {
+  if (flows.empty ()) return;
+  std::ofstream out (path.c_str ());
+  if (!out) NS_LOG_ERROR ("Cannot write the RoCE flows to " << path);
+  std::vector<double> completion;
+  double throughput = 0, minRate = 0;
+  uint64_t cnps = 0, resent = 0, timeouts = 0;
+  for (size_t f = 0; f < flows.size (); f++) {
+    const RoceSender& flow = *flows[f];
+    double fct = flow.GetCompletionTime ().GetSeconds ();
+    double bps = flow.IsDone () && fct > 0 ? flow.GetBytes () * 8 / fct : 0;
+    if (flow.IsDone ()) {
+      completion.push_back (fct);
+      throughput += bps;
+    }
+    cnps += flow.GetCnps ();
+    resent += flow.GetResent ();
+    timeouts += flow.GetTimeouts ();
+    const std::vector<std::pair<int64_t, double> >& rates = flow.GetRates ();
+    for (size_t r = 0; r < rates.size (); r++) minRate = (f == 0 && r == 0) ? rates[r].second : std::min (minRate, rates[r].second);
+    if (!out) continue;
+    out << "flow " << f << " dst " << flow.GetReceiver () << " bytes " << flow.GetBytes () << " fct "
+        << (flow.IsDone () ? fct : -1) << " throughput " << bps << " cnps " << flow.GetCnps () << " resent "
+        << flow.GetResent () << " timeouts " << flow.GetTimeouts () << "\n";
+    for (size_t r = 0; r < rates.size (); r++) out << "rate " << f << " " << rates[r].first * 1e-9 << " " << rates[r].second << "\n";
+  }
+  std::sort (completion.begin (), completion.end ());
+  double sum = 0;
+  for (size_t f = 0; f < completion.size (); f++) sum += completion[f];
+  double mean = completion.empty () ? 0 : sum / completion.size ();
+  double max = completion.empty () ? 0 : completion.back ();
+  double meanThroughput = completion.empty () ? 0 : throughput / completion.size ();
+  NS_LOG_INFO ("RoCE: " << completion.size () << " of " << flows.size () << " flows done, completion time mean " << mean
+               << "s, max " << max << "s, throughput mean " << meanThroughput << "bps, " << cnps << " CNPs, "
+               << resent << " packets sent again (" << timeouts << " timeouts), lowest rate " << minRate
+               << "bps, flows in " << path);
+  if (results != 0) {
+    results->SetMetric ("roce_flows_done", completion.size ());
+    results->SetMetric ("roce_fct_mean", mean);
+    results->SetMetric ("roce_fct_max", max);
+    results->SetMetric ("roce_throughput_mean", meanThroughput);
+    results->SetMetric ("roce_cnps", cnps);
+    results->SetMetric ("roce_resent_packets", resent);
+    results->SetMetric ("roce_timeouts", timeouts);
+  }
+}
+static void queueEnqueued(int level, Ptr<const Packet> packet) {
+  counters.queuePackets[level].fetch_add (1, std::memory_order_relaxed);
+}
+
+static void queueDequeued(int level, Ptr<const Packet> packet) {
+  counters.queuePackets[level].fetch_sub (1, std::memory_order_relaxed);
+  counters.queueBytes[level].fetch_add (packet->GetSize (), std::memory_order_relaxed);
+  counters.packetHops.fetch_add (1, std::memory_order_relaxed);
+}
+
+static void queueDropped(int level, Ptr<const Packet> packet) {
+  counters.queueDrops[level].fetch_add (1, std::memory_order_relaxed);
+}
+
+static void packetForwarded(const Ipv4Header& header, Ptr<const Packet> packet, uint32_t interface) {
+  counters.packetsForwarded.fetch_add (1, std::memory_order_relaxed);
+}
+
+static void ipDropped(const Ipv4Header& header, Ptr<const Packet> packet,
+                      Ipv4L3Protocol::DropReason reason, Ptr<Ipv4> ipv4, uint32_t interface) {
+  counters.ipDrops.fetch_add (1, std::memory_order_relaxed);
+}
+
+ResultsSampler::ResultsSampler (ResultsWriter* writer, TreeTopology* topology, Time interval)
+  : m_writer (writer), m_topology (topology), m_interval (interval) {
+}
+
+void ResultsSampler::Start (void) {
+  // From the queues traced, the tree is only the client on a jellyfish or a dragonfly
+  m_ports.assign (counters.queuePorts, counters.queuePorts + counters.queueLevels);
+  m_lastBytes.assign (counters.queueLevels, 0);
+  Simulator::Schedule (m_interval, &ResultsSampler::Sample, this);
+}
+
+void ResultsSampler::Sample (void) {
+  int64_t now = Simulator::Now ().GetNanoSeconds ();
+  for (size_t level = 0; level < m_ports.size (); level++) {
+    std::ostringstream name;
+    name << "level" << level;
+    m_writer->Series ("queue_packets_" + name.str ())->Add (now, counters.queuePackets[level].load (std::memory_order_relaxed));
+    uint64_t bytes = counters.queueBytes[level].load (std::memory_order_relaxed);
+    double capacity = m_interval.GetSeconds () * 1e9 * m_ports[level];
+    m_writer->Series ("link_utilisation_" + name.str ())->Add (now, capacity == 0 ? 0 : (bytes - m_lastBytes[level]) * 8 / capacity);
+    m_lastBytes[level] = bytes;
+  }
+  m_writer->Series ("rtt_p50")->Add (now, counters.rtt.Quantile (0.5));
+  m_writer->Series ("rtt_p99")->Add (now, counters.rtt.Quantile (0.99));
+  m_writer->Series ("events")->Add (now, counters.events.load (std::memory_order_relaxed));
+  Simulator::Schedule (m_interval, &ResultsSampler::Sample, this);
+}
+
+// Names and perf_event_open type/config of the counters of PerfCounters
+static const char* perfNames[PerfCounters::COUNTERS] = {
+  "cycles", "instructions", "cache_misses", "llc_misses", "branch_misses", "dtlb_misses"
+};
+static const uint32_t perfTypes[PerfCounters::COUNTERS] = {
+  PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE, PERF_TYPE_HW_CACHE,
+  PERF_TYPE_HARDWARE, PERF_TYPE_HW_CACHE
+};
+static const uint64_t perfConfigs[PerfCounters::COUNTERS] = {
+  PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS, PERF_COUNT_HW_CACHE_MISSES,
+  PERF_COUNT_HW_CACHE_LL | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16),
+  PERF_COUNT_HW_BRANCH_MISSES,
+  PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16)
+};
+
+PerfCounters::PerfCounters () : m_running (false) {
+  for (int c = 0; c < COUNTERS; c++) m_fds[c] = -1;
+}
+
+PerfCounters::~PerfCounters () {
+  for (int c = 0; c < COUNTERS; c++) {
+    if (m_fds[c] >= 0) close (m_fds[c]);
+  }
+}
+
+bool PerfCounters::Open (void) {
+  // Separate counters rather than one group: a group fails as a whole if the CPU cannot
+  // count all of them at once, separate ones are multiplexed and scaled by the kernel
+  int opened = 0;
+  int error = 0;
+  for (int c = 0; c < COUNTERS; c++) {
+    struct perf_event_attr attr;
+    memset (&attr, 0, sizeof (attr));
+    attr.size = sizeof (attr);
+    attr.type = perfTypes[c];
+    attr.config = perfConfigs[c];
+    attr.exclude_kernel = 1; // allowed with the default perf_event_paranoid
+    attr.exclude_hv = 1;
+    attr.inherit = 1;        // the build and search threads too
+    attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+    m_fds[c] = syscall (__NR_perf_event_open, &attr, 0, -1, -1, 0);
+    if (m_fds[c] < 0) error = errno;
+    else opened++;
+  }
+  if (opened < COUNTERS) {
+    NS_LOG_WARN (COUNTERS - opened << " hardware counters not available: " << strerror (error)
+                 << " (see /proc/sys/kernel/perf_event_paranoid)");
+  }
+  return opened > 0;
+}
+
+void PerfCounters::Read (double* values) {
+  for (int c = 0; c < COUNTERS; c++) {
+    uint64_t data[3]; // value, time enabled, time running
+    values[c] = -1;
+    if (m_fds[c] < 0 || read (m_fds[c], data, sizeof (data)) != sizeof (data)) continue;
+    values[c] = data[2] == 0 ? 0 : (double) data[0] * data[1] / data[2];
+  }
+}
+
+void PerfCounters::Phase (std::string name) {
+  if (m_running) Stop ();
+  PhaseSample phase;
+  phase.name = name;
+  m_phases.push_back (phase);
+  m_running = true;
+  m_startTime = std::chrono::steady_clock::now ();
+  Read (m_start);
+}
+
+void PerfCounters::Stop (void) {
+  if (!m_running) return;
+  PhaseSample& phase = m_phases.back ();
+  Read (phase.values);
+  phase.seconds = std::chrono::duration<double> (std::chrono::steady_clock::now () - m_startTime).count ();
+  for (int c = 0; c < COUNTERS; c++) {
+    if (phase.values[c] >= 0) phase.values[c] -= m_start[c];
+  }
+  m_running = false;
+}
+
+void PerfCounters::Report (uint64_t events) {
+  for (size_t p = 0; p < m_phases.size (); p++) {
+    const PhaseSample& phase = m_phases[p];
+    std::ostringstream line;
+    line << "Phase " << phase.name << ": " << phase.seconds << "s";
+    for (int c = 0; c < COUNTERS; c++) {
+      line << ", " << perfNames[c] << " ";
+      if (phase.values[c] < 0) line << "n/a";
+      else line << (uint64_t) phase.values[c];
+    }
+    if (phase.values[0] > 0 && phase.values[1] >= 0) line << ", IPC " << phase.values[1] / phase.values[0];
+    // What one event costs on average, the number to watch when changing the data layout
+    if (phase.name == "run" && events > 0) {
+      line << ", per event " << phase.seconds * 1e9 / events << "ns";
+      for (int c = 0; c < COUNTERS; c++) {
+        if (phase.values[c] >= 0) line << " " << phase.values[c] / events << " " << perfNames[c];
+      }
+    }
+    NS_LOG_INFO (line.str ());
+  }
+}
+
+void PerfCounters::AddResults (ResultsWriter* writer) {
+  for (size_t p = 0; p < m_phases.size (); p++) {
+    const PhaseSample& phase = m_phases[p];
+    writer->SetMetric ("perf_" + phase.name + "_seconds", phase.seconds);
+    for (int c = 0; c < COUNTERS; c++) {
+      if (phase.values[c] >= 0) writer->SetMetric ("perf_" + phase.name + "_" + perfNames[c], phase.values[c]);
+    }
+  }
+}
+
+// Where the forward benchmark starts measuring, after the ARP exchanges
+struct BenchMark {
+  std::chrono::steady_clock::time_point time;
+  uint64_t forwarded;
+  uint64_t events;
+  uint64_t allocations;
+};
+
+static void benchMark(BenchMark* mark) {
+  mark->time = std::chrono::steady_clock::now ();
+  mark->forwarded = counters.packetsForwarded;
+  mark->events = counters.events;
+  mark->allocations = AllocProfile::Total ();
+}
+
+// The 50th echo reply is the 100th packet through the router, whichever path forwarded them
+static void benchEchoed(BenchMark* start, uint64_t* echoes, const Ipv4Header& header, Ptr<const Packet> packet,
+                        uint32_t interface) {
+  if (++(*echoes) == 50) benchMark (start);
+}
+
+int runForwardBench(uint32_t packets, uint32_t size, std::string queueClasses, bool treeRoutes, bool batch,
+                    ResultsWriter* results) {
+  // Every packet would be logged otherwise, which is all the benchmark would measure
+  LogComponentDisable ("UdpEchoClientApplication", LOG_LEVEL_ALL);
+  // Allocations are always counted here, without call stacks unless --allocProfile asked for them
+  if (!AllocProfile::IsEnabled ()) AllocProfile::Enable (0);
+
+  Ptr<Node> client = CreateObject<Node> ();
+  InternetStackHelper stack;
+  stack.Install (client);
+  Ipv4InterfaceContainer ipInterfaces;
+  TreeTopology topology;
+  topology.numLeaves = 1;
+  topology.levels = 2;
+  topology.Add (client, -1, -1);
+  // Client - router - server, the router is the only node forwarding
+  networkTree(client, 1, &ipInterfaces, 2, &topology, treeRoutes, queueClasses);
+  if (!treeRoutes) Ipv4GlobalRoutingHelper::PopulateRoutingTables ();
+  traceTreeCounters (&topology);
+  std::vector<Ptr<BatchReceiver> > receivers;
+  if (batch) installBatching (&topology, &receivers);
+
+  // Request and echo cross each half duplex link, so a request every two frame times is line rate
+  uint32_t frame = size + 8 + 20 + 14 + 4; // UDP, IP, Ethernet header and trailer
+  Time interval = NanoSeconds (2 * frame * 8);
+  Time duration = NanoSeconds ((uint64_t) 2 * frame * 8 * packets);
+  Ptr<UdpEchoClient> echoClient = CreateObject<UdpEchoClient> ();
+  echoClient->SetRemote (ipInterfaces.GetAddress (1), 9);
+  echoClient->SetAttribute ("MaxPackets", UintegerValue (packets));
+  echoClient->SetAttribute ("Interval", TimeValue (interval));
+  echoClient->SetAttribute ("PacketSize", UintegerValue (size));
+  client->AddApplication (echoClient);
+  echoClient->SetStartTime (Seconds (2.0));
+  echoClient->SetStopTime (Seconds (3.0) + duration);
+
+  BenchMark start, end;
+  start.forwarded = 0;
+  uint64_t echoes = 0;
+  client->GetObject<Ipv4L3Protocol> ()->TraceConnectWithoutContext ("LocalDeliver",
+                                                                    MakeBoundCallback (&benchEchoed, &start, &echoes));
+  Simulator::Stop (Seconds (4.0) + duration);
+  NS_LOG_INFO ("Forwarding " << packets << " packets of " << size << " bytes, one every " << interval.GetNanoSeconds () << "ns");
+  Simulator::Run ();
+  benchMark (&end);
+  Simulator::Destroy ();
+
+  if (start.forwarded == 0 || end.forwarded <= start.forwarded) {
+    NS_LOG_ERROR ("The router forwarded " << end.forwarded << " packets, not enough to measure anything");
+    return 1;
+  }
+  double forwarded = end.forwarded - start.forwarded;
+  double ns = std::chrono::duration<double, std::nano> (end.time - start.time).count ();
+  NS_LOG_INFO ("Forwarded " << (uint64_t) forwarded << " packets (" << echoes << " echo replies), "
+               << ns / forwarded << " ns, " << (end.allocations - start.allocations) / forwarded << " allocations and "
+               << (end.events - start.events) / forwarded << " events per forwarded packet (request or echo, "
+               << "including the client and server work for it), " << counters.ipDrops << " IP drops, "
+               << counters.queueDrops[0] + counters.queueDrops[1] + counters.queueDrops[2] << " queue drops");
+  if (batch) reportBatching (receivers, results);
+  if (results != 0) {
+    results->SetParameter ("queueClasses", queueClasses);
+    results->SetParameter ("batch", batch ? "true" : "false");
+    results->SetMetric ("bench_packets", forwarded);
+    results->SetMetric ("bench_ns_per_packet", ns / forwarded);
+    results->SetMetric ("bench_allocations_per_packet", (end.allocations - start.allocations) / forwarded);
+    results->SetMetric ("bench_events_per_packet", (end.events - start.events) / forwarded);
+  }
+  return 0;
+}
+
+void enterPhase(RunPhase phase, PerfCounters* perf) {
+  currentPhase.store (phase, std::memory_order_relaxed);
+  if (perf == 0) return;
+  if (phase == PHASE_OTHER) perf->Stop ();
+  else perf->Phase (phaseNames[phase]);
+}
+
+std::atomic<bool> AllocProfile::enabled;
+uint32_t AllocProfile::sampleEvery;
+std::atomic<uint64_t> AllocProfile::allocations[PHASES][SIZE_CLASSES];
+std::atomic<uint64_t> AllocProfile::bytes[PHASES];
+std::atomic<uint64_t> AllocProfile::frees[PHASES];
+std::atomic<int64_t> AllocProfile::liveBytes;
+std::atomic<int64_t> AllocProfile::peakBytes;
+std::mutex AllocProfile::stackMutex;
+AllocProfile::Stack AllocProfile::stacks[STACK_SLOTS];
+std::vector<std::pair<uint64_t, uint64_t> > AllocProfile::samples;
+
+// Set while a thread is inside the profiler, whatever it allocates then is not profiled
+static thread_local bool inAllocProfile;
+// Allocations of this thread until the next sampled one
+static thread_local uint32_t untilSample;
+
+void AllocProfile::Enable (uint32_t every) {
+  sampleEvery = every;
+  enabled.store (true);
+}
+
+uint64_t AllocProfile::Total (void) {
+  uint64_t total = 0;
+  for (int phase = 0; phase < PHASES; phase++) {
+    for (int sizeClass = 0; sizeClass < SIZE_CLASSES; sizeClass++) total += allocations[phase][sizeClass].load ();
+  }
+  return total;
+}
+
+int AllocProfile::SizeClass (size_t size) {
+  int sizeClass = 0;
+  while (sizeClass < SIZE_CLASSES - 1 && size > ((size_t) 16 << sizeClass)) sizeClass++;
+  return sizeClass;
+}
+
+void AllocProfile::Allocated (void* pointer, size_t size) {
+  if (pointer == 0 || inAllocProfile) return;
+  int phase = currentPhase.load (std::memory_order_relaxed);
+  size_t usable = malloc_usable_size (pointer);
+  allocations[phase][SizeClass (size)].fetch_add (1, std::memory_order_relaxed);
+  bytes[phase].fetch_add (size, std::memory_order_relaxed);
+  int64_t live = liveBytes.fetch_add (usable, std::memory_order_relaxed) + usable;
+  int64_t peak = peakBytes.load (std::memory_order_relaxed);
+  while (live > peak && !peakBytes.compare_exchange_weak (peak, live, std::memory_order_relaxed)) {}
+
+  if (sampleEvery == 0) return;
+  if (untilSample == 0) untilSample = sampleEvery;
+  if (--untilSample == 0) RecordStack (size);
+}
+
+void AllocProfile::Freed (void* pointer) {
+  if (pointer == 0 || inAllocProfile) return;
+  frees[currentPhase.load (std::memory_order_relaxed)].fetch_add (1, std::memory_order_relaxed);
+  liveBytes.fetch_sub (malloc_usable_size (pointer), std::memory_order_relaxed);
+}
+
+void AllocProfile::RecordStack (size_t size) {
+  // backtrace () may allocate the first time (it loads the unwinder), do not profile that
+  inAllocProfile = true;
+  void* frames[STACK_DEPTH + 2];
+  int depth = backtrace (frames, STACK_DEPTH + 2) - 2; // without RecordStack and Allocated
+  if (depth > 0) {
+    uint64_t hash = 14695981039346656037ULL; // FNV-1a of the return addresses
+    for (int f = 0; f < depth; f++) hash = (hash ^ (uintptr_t) frames[f + 2]) * 1099511628211ULL;
+    std::lock_guard<std::mutex> lock (stackMutex);
+    // Open addressing, a full table keeps counting the stacks it has and drops new ones
+    for (int probe = 0; probe < STACK_SLOTS; probe++) {
+      Stack& stack = stacks[(hash + probe) % STACK_SLOTS];
+      if (stack.samples == 0) {
+        stack.hash = hash;
+        stack.depth = depth;
+        memcpy (stack.frames, frames + 2, depth * sizeof (void*));
+      } else if (stack.hash != hash) continue;
+      stack.samples++;
+      stack.bytes += size;
+      break;
+    }
+  }
+  inAllocProfile = false;
+}
+
+void AllocProfile::Sample (Time interval) {
+  uint64_t total = 0;
+  for (int sizeClass = 0; sizeClass < SIZE_CLASSES; sizeClass++) {
+    total += allocations[PHASE_RUN][sizeClass].load (std::memory_order_relaxed);
+  }
+  samples.push_back (std::make_pair (total, counters.packetHops.load (std::memory_order_relaxed)));
+  Simulator::Schedule (interval, &AllocProfile::Sample, interval);
+}
+
+void AllocProfile::Report (uint64_t events, uint64_t hops) {
+  inAllocProfile = true;
+  for (int phase = 0; phase < PHASES; phase++) {
+    uint64_t total = 0;
+    std::ostringstream sizes;
+    for (int sizeClass = 0; sizeClass < SIZE_CLASSES; sizeClass++) {
+      uint64_t count = allocations[phase][sizeClass].load ();
+      total += count;
+      if (count == 0) continue;
+      if (sizeClass == SIZE_CLASSES - 1) sizes << " >" << (8 << sizeClass) << ":" << count;
+      else sizes << " <=" << (16 << sizeClass) << ":" << count;
+    }
+    std::ostringstream line;
+    line << "Allocations " << phaseNames[phase] << ": " << total << " (" << bytes[phase].load () << " bytes), "
+         << frees[phase].load () << " frees, by size" << sizes.str ();
+    if (phase == PHASE_RUN && events > 0) line << ", " << (double) total / events << " per event";
+    if (phase == PHASE_RUN && hops > 0) line << ", " << (double) total / hops << " per packet hop";
+    NS_LOG_INFO (line.str ());
+  }
+  NS_LOG_INFO ("Peak heap growth since profiling started " << peakBytes.load () / 1048576
+               << " MB (at least, frees of older blocks are subtracted too)");
+
+  // Steady state: between the samples where 10% and 90% of the packet hops were done, so the
+  // ARP exchanges at the start and the last stragglers are left out
+  size_t from = 0, to = 0;
+  for (size_t s = 0; s < samples.size (); s++) {
+    if (samples[s].second <= hops / 10) from = s;
+    if (samples[s].second <= hops - hops / 10) to = s;
+  }
+  if (to > from && samples[to].second > samples[from].second) {
+    NS_LOG_INFO ("Steady state allocations per packet hop: "
+                 << (double) (samples[to].first - samples[from].first) / (samples[to].second - samples[from].second)
+                 << " (" << samples[to].second - samples[from].second << " hops)");
+  }
+
+  // Top call sites by sampled allocations
+  std::vector<Stack*> top;
+  for (int slot = 0; slot < STACK_SLOTS; slot++) {
+    if (stacks[slot].samples > 0) top.push_back (&stacks[slot]);
+  }
+  std::sort (top.begin (), top.end (), [] (const Stack* a, const Stack* b) { return a->samples > b->samples; });
+  for (size_t t = 0; t < std::min<size_t> (top.size (), 10); t++) {
+    std::ostringstream line;
+    line << "Allocation site " << t + 1 << ": ~" << top[t]->samples * sampleEvery << " allocations, ~"
+         << top[t]->bytes * sampleEvery << " bytes";
+    char** symbols = backtrace_symbols (top[t]->frames, top[t]->depth);
+    for (int f = 0; symbols != 0 && f < top[t]->depth; f++) line << "\n    " << symbols[f];
+    free (symbols);
+    NS_LOG_INFO (line.str ());
+  }
+  inAllocProfile = false;
+}
+
+// Global allocation functions of the program, counted when the profile is on
+void* operator new (size_t size) {
+  void* pointer = malloc (size == 0 ? 1 : size);
+  if (pointer == 0) throw std::bad_alloc ();
+  if (AllocProfile::IsEnabled ()) AllocProfile::Allocated (pointer, size);
+  return pointer;
+}
+
+void* operator new[] (size_t size) {
+  return operator new (size);
+}
+
+void* operator new (size_t size, const std::nothrow_t&) noexcept {
+  void* pointer = malloc (size == 0 ? 1 : size);
+  if (AllocProfile::IsEnabled ()) AllocProfile::Allocated (pointer, size);
+  return pointer;
+}
+
+void* operator new[] (size_t size, const std::nothrow_t& nothrow) noexcept {
+  return operator new (size, nothrow);
+}
+
+void operator delete (void* pointer) noexcept {
+  if (AllocProfile::IsEnabled ()) AllocProfile::Freed (pointer);
+  free (pointer);
+}
+
+void operator delete[] (void* pointer) noexcept {
+  operator delete (pointer);
+}
+
+static void traceQueueCounters(Ptr<CsmaNetDevice> device, int level) {
+  counters.queuePorts[level]++;
+  counters.queueLevels = std::max (counters.queueLevels, level + 1);
+  Ptr<Queue> queue = device->GetQueue ();
+  queue->TraceConnectWithoutContext ("Enqueue", MakeBoundCallback (&queueEnqueued, level));
+  queue->TraceConnectWithoutContext ("Dequeue", MakeBoundCallback (&queueDequeued, level));
+  queue->TraceConnectWithoutContext ("Drop", MakeBoundCallback (&queueDropped, level));
+}
+
+static void traceIpCounters(Ptr<Node> node, bool client) {
+  Ptr<Ipv4L3Protocol> ipv4 = node->GetObject<Ipv4L3Protocol> ();
+  ipv4->TraceConnectWithoutContext ("UnicastForward", MakeCallback (&packetForwarded));
+  ipv4->TraceConnectWithoutContext ("Drop", MakeCallback (&ipDropped));
+  // Echo replies are delivered locally on the client
+  if (client) ipv4->TraceConnectWithoutContext ("LocalDeliver", MakeCallback (&echoReceived));
+}
+
+static void linkTxBegin(LinkDirectionUsage* usage, Ptr<const Packet> packet) {
+  usage->txStart = Simulator::Now ().GetNanoSeconds ();
+}
+
+// A frame the channel would not take, nothing was sent
+static void linkTxDropped(LinkDirectionUsage* usage, Ptr<const Packet> packet) {
+  usage->txStart = -1;
+}
+
+static void linkTxEnd(LinkDirectionUsage* usage, Ptr<const Packet> packet) {
+  if (usage->txStart < 0) return;
+  int64_t now = Simulator::Now ().GetNanoSeconds ();
+  usage->bytes += packet->GetSize ();
+  usage->busy += now - usage->txStart;
+  // A frame across the end of an interval is split between the two
+  for (int64_t from = usage->txStart; linkInterval > 0 && from < now; ) {
+    size_t bucket = from / linkInterval;
+    int64_t to = std::min (now, (int64_t) (bucket + 1) * linkInterval);
+    if (bucket >= usage->buckets.size ()) usage->buckets.resize (bucket + 1, 0);
+    usage->buckets[bucket] += to - from;
+    from = to;
+  }
+  usage->txStart = -1;
+}
+
+void traceTreeCounters(TreeTopology* topology) {
+  for (size_t id = 0; id < topology->nodes.size(); id++) {
+    TreeNodeInfo& info = topology->nodes[id];
+    if (info.node == 0) continue;
+    int level = std::min (info.depth, MAX_TREE_LEVELS);
+
+    // Every device of the node, the one towards the parent and the ones towards the leaves
+    std::vector<Ptr<CsmaNetDevice> > devices = info.downDevices;
+    if (info.upDevice != 0) devices.push_back (info.upDevice);
+    for (size_t dev = 0; dev < devices.size(); dev++) traceQueueCounters (devices[dev], level);
+    // The link to the parent, each direction at the device sending on it
+    if (info.parent >= 0) {
+      Ptr<CsmaNetDevice> senders[2] = {topology->nodes[info.parent].downDevices[info.leafIndex], info.upDevice};
+      for (int direction = 0; direction < 2; direction++) {
+        LinkDirectionUsage* usage = &info.linkUsage[direction];
+        senders[direction]->TraceConnectWithoutContext ("PhyTxBegin", MakeBoundCallback (&linkTxBegin, usage));
+        senders[direction]->TraceConnectWithoutContext ("PhyTxDrop", MakeBoundCallback (&linkTxDropped, usage));
+        senders[direction]->TraceConnectWithoutContext ("PhyTxEnd", MakeBoundCallback (&linkTxEnd, usage));
+      }
+    }
+    // The client is the root
+    traceIpCounters (info.node, info.parent < 0);
+  }
+}
+
+void traceJellyfishCounters(JellyfishTopology* topology) {
+  for (size_t s = 0; s < topology->switches.size (); s++) {
+    for (size_t port = 0; port < topology->ports[s].size (); port++) traceQueueCounters (topology->ports[s][port].device, 0);
+    traceIpCounters (topology->switches[s], false);
+  }
+  for (size_t h = 0; h < topology->hosts.size (); h++) {
+    traceQueueCounters (topology->hostPorts[h], 1);
+    traceQueueCounters (topology->hostDevices[h], 2);
+    if (h + 1 < topology->hosts.size ()) traceIpCounters (topology->hosts[h], false);
+  }
+}
+
+void reportLinkUsage(TreeTopology* topology, double seconds, ResultsWriter* results) {
+  if (topology->levels <= 0 || seconds <= 0) return;
+  std::vector<std::vector<double> > utilization (topology->levels);
+  std::vector<uint64_t> bytes (topology->levels, 0);
+  std::vector<double> busiest (topology->levels, -1);
+  std::vector<std::pair<int, int> > busiestLink (topology->levels);   // node id, direction
+  std::vector<std::vector<int> > linksOf (topology->levels);           // node ids below the links
+  size_t buckets = 0;
+  for (size_t id = 0; id < topology->nodes.size (); id++) {
+    const TreeNodeInfo& info = topology->nodes[id];
+    if (info.node == 0 || info.parent < 0) continue;
+    int level = info.depth - 1;
+    linksOf[level].push_back (id);
+    for (int direction = 0; direction < 2; direction++) {
+      const LinkDirectionUsage& usage = info.linkUsage[direction];
+      double used = usage.busy * 1e-9 / seconds;
+      utilization[level].push_back (used);
+      bytes[level] += usage.bytes;
+      buckets = std::max (buckets, usage.buckets.size ());
+      if (used > busiest[level]) {
+        busiest[level] = used;
+        busiestLink[level] = std::make_pair ((int) id, direction);
+      }
+    }
+  }
+
+  int saturated = 0;
+  std::vector<double> p95 (topology->levels, 0);
+  for (int level = 0; level < topology->levels; level++) {
+    std::vector<double>& links = utilization[level];
+    if (links.empty ()) continue;
+    std::sort (links.begin (), links.end ());
+    double sum = 0;
+    for (size_t l = 0; l < links.size (); l++) sum += links[l];
+    double mean = sum / links.size ();
+    p95[level] = links[std::min (links.size () - 1, (size_t) std::ceil (0.95 * links.size ()) - 1)];
+    if (p95[level] > p95[saturated]) saturated = level;
+    std::pair<int, int> link = busiestLink[level];
+    NS_LOG_INFO ("Links of level " << level << ": " << links.size () << " directions, " << bytes[level] << " bytes, utilization min "
+                 << links.front () << ", mean " << mean << ", max " << links.back () << ", p95 " << p95[level] << " (busiest "
+                 << (link.second == 0 ? "down to " : "up from ") << topology->PositionOf (link.first) << ")");
+    if (results != 0) {
+      std::ostringstream name;
+      name << "level" << level;
+      results->SetMetric ("link_utilisation_min_" + name.str (), links.front ());
+      results->SetMetric ("link_utilisation_mean_" + name.str (), mean);
+      results->SetMetric ("link_utilisation_max_" + name.str (), links.back ());
+      results->SetMetric ("link_utilisation_p95_" + name.str (), p95[level]);
+      results->SetMetric ("link_bytes_" + name.str (), bytes[level]);
+    }
+  }
+  NS_LOG_INFO ("Most loaded links: level " << saturated << " (p95 utilization " << p95[saturated] << ")");
+  if (results == 0 || linkInterval <= 0) return;
+
+  // Every interval: p95 and max of the busy share of the links of each level, at the end of the interval
+  std::vector<double> shares;
+  for (int level = 0; level < topology->levels; level++) {
+    std::ostringstream name;
+    name << "level" << level;
+    ResultsSeries* p95Series = results->Series ("link_busy_p95_" + name.str ());
+    ResultsSeries* maxSeries = results->Series ("link_busy_max_" + name.str ());
+    for (size_t bucket = 0; bucket < buckets; bucket++) {
+      shares.clear ();
+      for (size_t l = 0; l < linksOf[level].size (); l++) {
+        const TreeNodeInfo& info = topology->nodes[linksOf[level][l]];
+        for (int direction = 0; direction < 2; direction++) {
+          const std::vector<uint64_t>& busy = info.linkUsage[direction].buckets;
+          shares.push_back (bucket < busy.size () ? (double) busy[bucket] / linkInterval : 0);
+        }
+      }
+      if (shares.empty ()) break;
+      std::sort (shares.begin (), shares.end ());
+      int64_t end = (int64_t) (bucket + 1) * linkInterval;
+      p95Series->Add (end, shares[std::min (shares.size () - 1, (size_t) std::ceil (0.95 * shares.size ()) - 1)]);
+      maxSeries->Add (end, shares.back ());
+    }
+  }
+}
+
+static void dragonflyGlobalSent(DragonflyTopology* topology, uint32_t port, Ptr<const Packet> packet) {
+  topology->globalBytes[port] += packet->GetSize ();
+  topology->globalPackets[port]++;
+}
+
+void traceDragonflyCounters(DragonflyTopology* topology) {
+  uint32_t h = topology->h;
+  for (size_t r = 0; r < topology->routers.size (); r++) {
+    for (uint32_t j = 0; j < h; j++) {
+      Ptr<CsmaNetDevice> device = topology->globalPorts[r][j].device;
+      traceQueueCounters (device, 0);
+      // Frames on the wire, not the ones the queue may still drop (see traceTreeCounters)
+      device->TraceConnectWithoutContext ("PhyTxEnd", MakeBoundCallback (&dragonflyGlobalSent, topology, (uint32_t) (r * h + j)));
+    }
+    for (uint32_t other = 0; other < topology->a; other++) {
+      if (other != r % topology->a) traceQueueCounters (topology->localPorts[r][other].device, 1);
+    }
+    traceIpCounters (topology->routers[r], false);
+  }
+  for (size_t i = 0; i < topology->hosts.size (); i++) {
+    traceQueueCounters (topology->hostPorts[i], 2);
+    traceQueueCounters (topology->hostDevices[i], 3);
+    if (i + 1 < topology->hosts.size ()) traceIpCounters (topology->hosts[i], false);
+  }
+}
+
+int RttHistogram::BucketOf (uint64_t ns) {
+  if (ns < SUB_BUCKETS) return ns;
+  int exponent = 63 - __builtin_clzll (ns); // at least 4 here
+  int mantissa = (ns >> (exponent - 4)) - SUB_BUCKETS;
+  return (exponent - 3) * SUB_BUCKETS + mantissa;
+}
+
+uint64_t RttHistogram::BucketStart (int bucket) {
+  if (bucket < SUB_BUCKETS) return bucket;
+  int exponent = bucket / SUB_BUCKETS + 3;
+  uint64_t mantissa = bucket % SUB_BUCKETS + SUB_BUCKETS;
+  return mantissa << (exponent - 4);
+}
+
+void recordRtt(Time rtt) {
+  counters.rtt.Record (rtt);
+  steadyRtt.Add (rtt);
+}
+
+SteadyStateStats::SteadyStateStats ()
+  : m_count (0), m_batchSize (5), m_partialSum (0), m_partialCount (0) {
+}
+
+void SteadyStateStats::Add (Time value) {
+  uint64_t ns = value.GetNanoSeconds () > 0 ? value.GetNanoSeconds () : 0;
+  // Histogram of the segment of the run this sample is in, a segment is 32 batches
+  uint64_t segment = m_count / (m_batchSize * (MAX_BATCHES / SEGMENTS));
+  if (segment >= m_segments.size ()) m_segments.push_back (std::vector<uint64_t> (RttHistogram::BUCKETS, 0));
+  m_segments[segment][RttHistogram::BucketOf (ns)]++;
+  m_count++;
+
+  if (m_partialCount == 0) m_partialStart = Simulator::Now () - value;
+  m_partialSum += ns * 1e-9;
+  if (++m_partialCount < m_batchSize) return;
+  m_means.push_back (m_partialSum / m_partialCount);
+  m_starts.push_back (m_partialStart);
+  m_partialSum = 0;
+  m_partialCount = 0;
+  if (m_means.size () < (size_t) MAX_BATCHES) return;
+
+  // Full: merge adjacent batches and segments, they cover twice as many samples from now on
+  for (int b = 0; b < MAX_BATCHES / 2; b++) {
+    m_means[b] = (m_means[2 * b] + m_means[2 * b + 1]) / 2;
+    m_starts[b] = m_starts[2 * b];
+  }
+  m_means.resize (MAX_BATCHES / 2);
+  m_starts.resize (MAX_BATCHES / 2);
+  for (int s = 0; s < SEGMENTS / 2; s++) {
+    for (int bucket = 0; bucket < RttHistogram::BUCKETS; bucket++) {
+      m_segments[s][bucket] = m_segments[2 * s][bucket] + m_segments[2 * s + 1][bucket];
+    }
+  }
+  m_segments.resize (SEGMENTS / 2);
+  m_batchSize *= 2;
+}
+
+bool SteadyStateStats::Analyse (SteadyStateResult* result) const {
+  size_t n = m_means.size ();
+  if (n < 10) return false;
+  // Suffix sums of the batch means and of their squares, for every truncation d at once
+  std::vector<double> sum (n + 1, 0), squares (n + 1, 0);
+  for (size_t j = n; j-- > 0;) {
+    sum[j] = sum[j + 1] + m_means[j];
+    squares[j] = squares[j + 1] + m_means[j] * m_means[j];
+  }
+  size_t best = 0;
+  double bestMser = 0;
+  for (size_t d = 0; d <= n / 2; d++) {
+    double kept = n - d;
+    double deviation = std::max (0.0, squares[d] - sum[d] * sum[d] / kept);
+    double mser = deviation / (kept * kept);
+    if (d == 0 || mser < bestMser) {
+      best = d;
+      bestMser = mser;
+    }
+  }
+
+  double kept = n - best;
+  result->warmupSamples = best * m_batchSize;
+  result->warmupEnd = m_starts[best];
+  result->mean = sum[best] / kept;
+  double variance = std::max (0.0, squares[best] - sum[best] * sum[best] / kept) / (kept - 1);
+  result->halfWidth = 1.96 * std::sqrt (variance / kept);
+
+  // Quantiles of the segments starting at or after the truncation point
+  uint64_t segmentSamples = m_batchSize * (MAX_BATCHES / SEGMENTS);
+  size_t first = (result->warmupSamples + segmentSamples - 1) / segmentSamples;
+  std::vector<uint64_t> counts (RttHistogram::BUCKETS, 0);
+  uint64_t total = 0;
+  for (size_t s = std::min (first, m_segments.size () - 1); s < m_segments.size (); s++) {
+    for (int bucket = 0; bucket < RttHistogram::BUCKETS; bucket++) {
+      counts[bucket] += m_segments[s][bucket];
+      total += m_segments[s][bucket];
+    }
+  }
+  result->samples = m_count - result->warmupSamples;
+  const double quantiles[] = {0.5, 0.99};
+  double* values[] = {&result->p50, &result->p99};
+  for (int q = 0; q < 2; q++) {
+    uint64_t rank = std::max<uint64_t> (1, (uint64_t) std::ceil (quantiles[q] * total));
+    uint64_t seen = 0;
+    *values[q] = 0;
+    for (int bucket = 0; bucket < RttHistogram::BUCKETS && total > 0; bucket++) {
+      seen += counts[bucket];
+      if (seen < rank) continue;
+      *values[q] = 0.5e-9 * (RttHistogram::BucketStart (bucket) + RttHistogram::BucketStart (bucket + 1));
+      break;
+    }
+  }
+  return true;
+}
+
+void RttHistogram::Record (Time rtt) {
+  uint64_t ns = rtt.GetNanoSeconds () > 0 ? rtt.GetNanoSeconds () : 0;
+  m_buckets[BucketOf (ns)].fetch_add (1, std::memory_order_relaxed);
+  m_sumNs.fetch_add (ns, std::memory_order_relaxed);
+  m_count.fetch_add (1, std::memory_order_relaxed);
+}
+
+double RttHistogram::Quantile (double q) const {
+  uint64_t total = GetCount ();
+  if (total == 0) return 0;
+  uint64_t rank = std::max<uint64_t> (1, (uint64_t) std::ceil (q * total));
+  uint64_t seen = 0;
+  for (int bucket = 0; bucket < BUCKETS; bucket++) {
+    seen += m_buckets[bucket].load (std::memory_order_relaxed);
+    // Report the middle of the bucket, the buckets are narrow enough for that to be close
+    if (seen >= rank) return 0.5e-9 * (BucketStart (bucket) + BucketStart (bucket + 1));
+  }
+  return 1e-9 * BucketStart (BUCKETS - 1);
+}
+
+NS_OBJECT_ENSURE_REGISTERED (CountingMapScheduler);
+
+TypeId CountingMapScheduler::GetTypeId (void) {
+  static TypeId tid = TypeId ("ns3::CountingMapScheduler")
+    .SetParent<MapScheduler> ()
+    .AddConstructor<CountingMapScheduler> ();
+  return tid;
+}
+
+void CountingMapScheduler::Insert (const Event &ev) {
+  MapScheduler::Insert (ev);
+  counters.pendingEvents.fetch_add (1, std::memory_order_relaxed);
+}
+
+Scheduler::Event CountingMapScheduler::RemoveNext (void) {
+  Event ev = MapScheduler::RemoveNext ();
+  counters.pendingEvents.fetch_sub (1, std::memory_order_relaxed);
+  counters.events.fetch_add (1, std::memory_order_relaxed);
+  counters.simTime.store (ev.key.m_ts, std::memory_order_relaxed);
+  // Safe point: the previous event is done and this one has not started yet
+  if (controlServer != 0) controlServer->Poll ();
+  return ev;
+}
+
+void CountingMapScheduler::Remove (const Event &ev) {
+  MapScheduler::Remove (ev);
+  counters.pendingEvents.fetch_sub (1, std::memory_order_relaxed);
+}
+
+uint64_t residentMemory() {
+  std::ifstream statm ("/proc/self/statm");
+  uint64_t pages = 0, resident = 0;
+  if (!(statm >> pages >> resident)) return 0;
+  return resident * sysconf (_SC_PAGESIZE);
+}
+
+MetricsExporter::MetricsExporter (TreeTopology* topology)
+  : m_topology (topology), m_running (false), m_listenFd (-1), m_interval (5.0),
+    m_lastEvents (0), m_eventRate (0) {}
+
+MetricsExporter::~MetricsExporter () {
+  Stop ();
+}
+
+bool MetricsExporter::Start (uint16_t port, std::string path, double interval) {
+  m_path = path;
+  m_interval = interval;
+  if (port != 0) {
+    m_listenFd = socket (AF_INET, SOCK_STREAM, 0);
+    int yes = 1;
+    setsockopt (m_listenFd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof (yes));
+    sockaddr_in address = sockaddr_in ();
+    address.sin_family = AF_INET;
+    address.sin_port = htons (port);
+    address.sin_addr.s_addr = htonl (INADDR_LOOPBACK); // localhost only, this is not meant to be public
+    if (m_listenFd < 0 || bind (m_listenFd, (sockaddr*) &address, sizeof (address)) < 0
+        || listen (m_listenFd, 8) < 0) {
+      NS_LOG_ERROR ("Cannot serve metrics on port " << port << ": " << strerror (errno));
+      if (m_listenFd >= 0) close (m_listenFd);
+      m_listenFd = -1;
+      return false;
+    }
+    NS_LOG_INFO ("Serving metrics on http://localhost:" << port << "/metrics");
+  }
+  m_lastSample = std::chrono::steady_clock::now ();
+  m_running = true;
+  m_thread.reset (new std::thread (&MetricsExporter::Loop, this));
+  return true;
+}
+
+void MetricsExporter::Stop () {
+  if (!m_running) return;
+  m_running = false;
+  m_thread->join ();
+  if (!m_path.empty ()) WriteFile (); // final values of the run
+  if (m_listenFd >= 0) close (m_listenFd);
+  m_listenFd = -1;
+}
+
+void MetricsExporter::ForgetAfterFork () {
+  m_thread.release (); // leaked on purpose, joining or destroying it would abort
+  m_running = false;
+  m_path = "";
+  if (m_listenFd >= 0) close (m_listenFd); // the parent keeps serving on it
+  m_listenFd = -1;
+}
+
+void MetricsExporter::Loop () {
+  std::chrono::steady_clock::time_point nextWrite = std::chrono::steady_clock::now ();
+  while (m_running) {
+    if (!m_path.empty () && std::chrono::steady_clock::now () >= nextWrite) {
+      WriteFile ();
+      nextWrite += std::chrono::milliseconds ((int64_t) (m_interval * 1000));
+    }
+    // Wake up at least a few times a second to notice Stop() and file writes
+    if (m_listenFd < 0) {
+      std::this_thread::sleep_for (std::chrono::milliseconds (200));
+      continue;
+    }
+    pollfd listening = { m_listenFd, POLLIN, 0 };
+    if (poll (&listening, 1, 200) > 0) {
+      int connection = accept (m_listenFd, 0, 0);
+      if (connection >= 0) Serve (connection);
+    }
+  }
+}
+
+void MetricsExporter::Serve (int connection) {
+  // Whatever the request is, answer with the metrics, that is all this endpoint does
+  char request[1024];
+  if (read (connection, request, sizeof (request)) >= 0) {
+    std::string body = Render ();
+    std::ostringstream response;
+    response << "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: "
+             << body.size () << "\r\n\r\n" << body;
+    std::string text = response.str ();
+    for (size_t sent = 0; sent < text.size (); ) {
+      ssize_t n = write (connection, text.data () + sent, text.size () - sent);
+      if (n <= 0) break;
+      sent += n;
+    }
+  }
+  close (connection);
+}
+
+void MetricsExporter::WriteFile () {
+  // Write to a temporary file and rename it, so readers never see half a file
+  std::string temporary = m_path + ".tmp";
+  {
+    std::ofstream file (temporary.c_str ());
+    file << Render ();
+  }
+  rename (temporary.c_str (), m_path.c_str ());
+}
+
+std::string MetricsExporter::Render () {
+  uint64_t events = counters.events.load (std::memory_order_relaxed);
+  std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now ();
+  double elapsed = std::chrono::duration<double> (now - m_lastSample).count ();
+  if (elapsed >= 1.0) { // do not compute a rate over too short a period
+    m_eventRate = (events - m_lastEvents) / elapsed;
+    m_lastEvents = events;
+    m_lastSample = now;
+  }
+
+  std::ostringstream out;
+  out << "# TYPE networktree_events_total counter\n"
+      << "networktree_events_total " << events << "\n"
+      << "# TYPE networktree_events_per_second gauge\n"
+      << "networktree_events_per_second " << m_eventRate << "\n"
+      << "# TYPE networktree_sim_time_seconds gauge\n"
+      << "networktree_sim_time_seconds " << Time (counters.simTime.load (std::memory_order_relaxed)).GetSeconds () << "\n"
+      << "# TYPE networktree_scheduler_events gauge\n"
+      << "networktree_scheduler_events " << counters.pendingEvents.load (std::memory_order_relaxed) << "\n"
+      << "# TYPE networktree_resident_memory_bytes gauge\n"
+      << "networktree_resident_memory_bytes " << residentMemory () << "\n"
+      << "# TYPE networktree_packets_forwarded_total counter\n"
+      << "networktree_packets_forwarded_total " << counters.packetsForwarded.load (std::memory_order_relaxed) << "\n"
+      << "# TYPE networktree_ip_drops_total counter\n"
+      << "networktree_ip_drops_total " << counters.ipDrops.load (std::memory_order_relaxed) << "\n";
+
+  int levels = counters.queueLevels; // levels of queues traced, whatever the topology
+  out << "# TYPE networktree_queue_packets gauge\n";
+  for (int level = 0; level < levels; level++) {
+    out << "networktree_queue_packets{level=\"" << level << "\"} "
+        << counters.queuePackets[level].load (std::memory_order_relaxed) << "\n";
+  }
+  out << "# TYPE networktree_queue_drops_total counter\n";
+  for (int level = 0; level < levels; level++) {
+    out << "networktree_queue_drops_total{level=\"" << level << "\"} "
+        << counters.queueDrops[level].load (std::memory_order_relaxed) << "\n";
+  }
+
+  const double quantiles[] = {0.5, 0.9, 0.99, 0.999};
+  out << "# TYPE networktree_rtt_seconds summary\n";
+  for (int q = 0; q < 4; q++) {
+    out << "networktree_rtt_seconds{quantile=\"" << quantiles[q] << "\"} "
+        << counters.rtt.Quantile (quantiles[q]) << "\n";
+  }
+  out << "networktree_rtt_seconds_sum " << counters.rtt.GetSumSeconds () << "\n"
+      << "networktree_rtt_seconds_count " << counters.rtt.GetCount () << "\n";
+  return out.str ();
+}
+
+pid_t forkSimulation() {
+  std::cout.flush ();
+  std::cerr.flush ();
+  fflush (0);
+  pid_t pid = fork ();
+  if (pid == 0) {
+    if (metricsExporter != 0) metricsExporter->ForgetAfterFork ();
+    if (controlServer != 0) controlServer->ForgetAfterFork ();
+    controlServer = 0;
+  }
+  return pid;
+}
+
+// Nodes whose packets are logged, toggled with "trace on|off" on the control socket
+static std::vector<bool> tracedNodes;
+
+static void tracePacket(std::string direction, uint32_t node, Ptr<const Packet> packet,
+                        Ptr<Ipv4> ipv4, uint32_t interface) {
+  if (!tracedNodes[node]) return;
+  Ipv4Header header;
+  packet->PeekHeader (header);
+  NS_LOG_UNCOND (Simulator::Now ().GetSeconds () << "s node " << node << " " << direction
+                 << " if " << interface << " " << header.GetSource () << " > "
+                 << header.GetDestination () << " " << packet->GetSize () << " bytes");
+}
+
+ControlServer::ControlServer (TreeTopology* topology)
+  : m_topology (topology), m_listenFd (-1), m_running (false), m_pending (false),
+    m_paused (false), m_forgotten (false) {}
+
+ControlServer::~ControlServer () {
+  Stop ();
+}
+
+bool ControlServer::Start (std::string path) {
+  sockaddr_un address = sockaddr_un ();
+  address.sun_family = AF_UNIX;
+  if (path.size () >= sizeof (address.sun_path)) {
+    NS_LOG_ERROR ("Control socket path too long: " << path);
+    return false;
+  }
+  strcpy (address.sun_path, path.c_str ());
+  unlink (path.c_str ()); // left over from a previous run
+  m_listenFd = socket (AF_UNIX, SOCK_STREAM, 0);
+  if (m_listenFd < 0 || bind (m_listenFd, (sockaddr*) &address, sizeof (address)) < 0
+      || listen (m_listenFd, 4) < 0) {
+    NS_LOG_ERROR ("Cannot open control socket " << path << ": " << strerror (errno));
+    if (m_listenFd >= 0) close (m_listenFd);
+    m_listenFd = -1;
+    return false;
+  }
+  m_path = path;
+  m_running = true;
+  m_thread.reset (new std::thread (&ControlServer::Loop, this));
+  NS_LOG_INFO ("Control socket on " << path);
+  return true;
+}
+
+void ControlServer::Stop () {
+  if (!m_running || m_forgotten) return;
+  {
+    std::lock_guard<std::mutex> lock (m_mutex);
+    m_running = false;
+  }
+  m_changed.notify_all ();
+  m_thread->join ();
+  close (m_listenFd);
+  unlink (m_path.c_str ());
+}
+
+void ControlServer::ForgetAfterFork () {
+  // The mutex may have been held by the socket thread when forking, so nothing here can be
+  // touched anymore, only the listening socket is closed (the parent still owns the file)
+  m_thread.release ();
+  m_forgotten = true;
+  close (m_listenFd);
+}
+
+void ControlServer::Loop () {
+  while (m_running) {
+    pollfd listening = { m_listenFd, POLLIN, 0 };
+    if (poll (&listening, 1, 200) <= 0) continue;
+    int connection = accept (m_listenFd, 0, 0);
+    if (connection >= 0) Serve (connection);
+  }
+}
+
+void ControlServer::Serve (int connection) {
+  std::string buffered;
+  char data[512];
+  while (m_running) {
+    size_t newline = buffered.find ('\n');
+    if (newline == std::string::npos) {
+      pollfd readable = { connection, POLLIN, 0 };
+      if (poll (&readable, 1, 200) <= 0) continue;
+      ssize_t n = read (connection, data, sizeof (data));
+      if (n <= 0) break; // closed by the other side
+      buffered.append (data, n);
+      continue;
+    }
+    Command command;
+    command.line = buffered.substr (0, newline);
+    command.done = false;
+    buffered.erase (0, newline + 1);
+
+    // Hand the command to the simulation thread and wait for its answer
+    std::unique_lock<std::mutex> lock (m_mutex);
+    m_commands.push_back (&command);
+    m_pending.store (true, std::memory_order_release);
+    m_changed.notify_all (); // wakes up a paused simulation
+    while (!command.done && m_running) m_changed.wait_for (lock, std::chrono::milliseconds (200));
+    if (!command.done) { // simulation is over, the command will never be run
+      m_commands.erase (std::find (m_commands.begin (), m_commands.end (), &command));
+      command.reply = "simulation is over\n";
+    }
+    lock.unlock ();
+
+    std::string reply = command.reply + "\n";
+    if (write (connection, reply.data (), reply.size ()) < 0) break;
+  }
+  close (connection);
+}
+
+void ControlServer::HandleCommands () {
+  std::unique_lock<std::mutex> lock (m_mutex);
+  while (true) {
+    while (!m_commands.empty ()) {
+      Command* command = m_commands.front ();
+      m_commands.pop_front ();
+      lock.unlock ();
+      std::string reply = Execute (command->line);
+      if (m_forgotten) return; // resumed checkpoint, this object belongs to the parent process
+      lock.lock ();
+      command->reply = reply;
+      command->done = true;
+      m_changed.notify_all ();
+    }
+    // Paused, the simulation thread waits here for the next command
+    if (!m_paused || !m_running) break;
+    m_changed.wait (lock, [this] { return !m_commands.empty () || !m_paused || !m_running; });
+  }
+  m_pending.store (false, std::memory_order_relaxed);
+}
+
+std::string ControlServer::Execute (std::string line) {
+  std::istringstream in (line);
+  std::string command, argument, position;
+  in >> command >> argument >> position;
+  std::ostringstream reply;
+
+  if (command == "status") {
+    reply << "time " << Simulator::Now ().GetSeconds () << "s, events " << counters.events
+          << ", pending " << counters.pendingEvents << (m_paused ? ", paused" : ", running") << "\n";
+  } else if (command == "pause") {
+    m_paused = true;
+    reply << "paused at " << Simulator::Now ().GetSeconds () << "s\n";
+  } else if (command == "resume") {
+    m_paused = false;
+    reply << "resumed\n";
+  } else if (command == "node") {
+    int id = m_topology->Find (argument);
+    if (id < 0) return "no node at " + argument + "\n";
+    reply << DescribeNode (id);
+  } else if (command == "queue") {
+    int id = m_topology->Find (argument);
+    if (id < 0) return "no node at " + argument + "\n";
+    TreeNodeInfo& info = m_topology->nodes[id];
+    int leaf = atoi (position.c_str ());
+    if (position == "up" && info.upDevice != 0) reply << DescribeQueue (info.upDevice);
+    else if (!position.empty () && position != "up" && leaf >= 0 && leaf < (int) info.downDevices.size ())
+      reply << DescribeQueue (info.downDevices[leaf]);
+    else return "no device " + position + " on " + argument + "\n";
+  } else if (command == "trace" && (argument == "on" || argument == "off")) {
+    int id = m_topology->Find (position);
+    if (id < 0) return "no node at " + position + "\n";
+    if (tracedNodes.empty ()) { // connect the trace sinks the first time tracing is asked for
+      tracedNodes.assign (m_topology->nodes.size (), false);
+      for (size_t node = 0; node < m_topology->nodes.size (); node++) {
+        if (m_topology->nodes[node].node == 0) continue;
+        Ptr<Ipv4L3Protocol> ipv4 = m_topology->nodes[node].node->GetObject<Ipv4L3Protocol> ();
+        ipv4->TraceConnectWithoutContext ("Tx", MakeBoundCallback (&tracePacket, std::string ("tx"), (uint32_t) node));
+        ipv4->TraceConnectWithoutContext ("Rx", MakeBoundCallback (&tracePacket, std::string ("rx"), (uint32_t) node));
+      }
+    }
+    // Walk the subtree below the node
+    std::vector<int> subtree (1, id);
+    for (size_t next = 0; next < subtree.size (); next++) {
+      tracedNodes[subtree[next]] = argument == "on";
+      // Batched forwards do not go through the IPv4 traces
+      Ptr<BatchReceiver> batch = m_topology->nodes[subtree[next]].node->GetObject<BatchReceiver> ();
+      if (batch != 0) batch->SetRegular (argument == "on");
+      std::vector<int>& children = m_topology->nodes[subtree[next]].children;
+      subtree.insert (subtree.end (), children.begin (), children.end ());
+    }
+    reply << "tracing " << argument << " for " << subtree.size () << " nodes\n";
+  } else if (command == "log" && (position == "on" || position == "off")) {
+    // Unknown components are fatal in ns-3, check first
+    if (LogComponent::GetComponentList ()->count (argument) == 0) return "no log component " + argument + "\n";
+    if (position == "on") LogComponentEnable (argument.c_str (), LOG_LEVEL_INFO);
+    else LogComponentDisable (argument.c_str (), LOG_LEVEL_ALL);
+    reply << "log " << argument << " " << position << "\n";
+  } else if (command == "checkpoint") {
+    reply << Checkpoint ();
+  } else if (command == "stop") {
+    Simulator::Stop ();
+    m_paused = false;
+    reply << "stopping\n";
+  } else {
+    reply << "unknown command: " << line << "\n";
+  }
+  return reply.str ();
+}
+
+std::string ControlServer::DescribeNode (int id) {
+  TreeNodeInfo& info = m_topology->nodes[id];
+  std::ostringstream out;
+  out << "node " << id << " at " << m_topology->PositionOf (id) << ", depth " << info.depth
+      << ", " << info.children.size () << " leaves, " << info.node->GetNApplications () << " applications\n";
+  Ptr<Ipv4> ipv4 = info.node->GetObject<Ipv4> ();
+  for (uint32_t interface = 1; interface < ipv4->GetNInterfaces (); interface++) { // 0 is loopback
+    out << "  if " << interface << " " << ipv4->GetAddress (interface, 0).GetLocal () << "/"
+        << ipv4->GetAddress (interface, 0).GetMask ().GetPrefixLength () << " queue "
+        << DynamicCast<CsmaNetDevice> (ipv4->GetNetDevice (interface))->GetQueue ()->GetNPackets ()
+        << " packets\n";
+  }
+  return out.str ();
+}
+
+std::string ControlServer::DescribeQueue (Ptr<CsmaNetDevice> device) {
+  Ptr<Queue> queue = device->GetQueue ();
+  std::ostringstream out;
+  out << "queue of device " << device->GetIfIndex () << " on node " << device->GetNode ()->GetId ()
+      << ": " << queue->GetNPackets () << " packets, " << queue->GetNBytes () << " bytes, "
+      << queue->GetTotalReceivedPackets () << " received, " << queue->GetTotalDroppedPackets ()
+      << " dropped\n";
+  Ptr<TreeClassQueue> classQueue = DynamicCast<TreeClassQueue> (queue);
+  if (classQueue != 0) {
+    for (uint32_t c = 0; c < classQueue->GetClasses ().size (); c++) {
+      const TreeClassQueue::ClassStats& stats = classQueue->GetStats (c);
+      out << "  class " << classQueue->GetClasses ()[c].name << ": " << stats.packets << " packets, "
+          << stats.drops << " dropped, max delay " << stats.maxDelay.GetSeconds () << "s\n";
+    }
+  }
+  return out.str ();
+}
+
+std::string ControlServer::Checkpoint () {
+  std::string path = m_path;
+  pid_t pid = forkSimulation ();
+  if (pid < 0) return std::string ("checkpoint failed: ") + strerror (errno) + "\n";
+  if (pid > 0) {
+    std::ostringstream reply;
+    reply << "checkpoint " << pid << " at " << Simulator::Now ().GetSeconds () << "s, resume it with kill -CONT "
+          << pid << ", it then listens on " << path << "." << pid << "\n";
+    return reply.str ();
+  }
+
+  // Child: wait until someone wants this checkpoint, then carry on with a control socket of its own
+  raise (SIGSTOP);
+  std::ostringstream childPath;
+  childPath << path << "." << getpid ();
+  controlServer = new ControlServer (m_topology);
+  if (!controlServer->Start (childPath.str ())) controlServer = 0;
+  return "";
+}
+
+bool TreeClassQueue::ParseClasses (std::string spec, std::vector<TreeQueueClass>* classes) {
+  classes->clear ();
+  std::istringstream in (spec);
+  std::string item;
+  while (std::getline (in, item, ';')) {
+    if (item.empty ()) continue;
+    std::istringstream fields (item);
+    std::string scheduling, match;
+    TreeQueueClass queueClass;
+    std::getline (fields, queueClass.name, ':');
+    std::getline (fields, scheduling, ':');
+    std::getline (fields, match, ':');
+    queueClass.strict = scheduling == "prio";
+    queueClass.weight = queueClass.strict ? 0 : atoi (scheduling.c_str ());
+    queueClass.dscp = -1;
+    queueClass.port = -1;
+    if (match.compare (0, 5, "dscp=") == 0) queueClass.dscp = atoi (match.c_str () + 5);
+    else if (match.compare (0, 5, "port=") == 0) queueClass.port = atoi (match.c_str () + 5);
+    else if (match != "*") {
+      NS_LOG_ERROR ("Queue class " << item << " should match dscp=N, port=N or *");
+      return false;
+    }
+    if (queueClass.name.empty () || (!queueClass.strict && queueClass.weight == 0)) {
+      NS_LOG_ERROR ("Queue class " << item << " needs a name and prio or a DRR weight > 0");
+      return false;
+    }
+    classes->push_back (queueClass);
+  }
+  if (classes->empty ()) {
+    NS_LOG_ERROR ("No queue class in " << spec);
+    return false;
+  }
+  return true;
+}
+
+NS_OBJECT_ENSURE_REGISTERED (TreeClassQueue);
+
+TypeId TreeClassQueue::GetTypeId (void) {
+  static TypeId tid = TypeId ("ns3::TreeClassQueue")
+    .SetParent<Queue> ()
+    .AddConstructor<TreeClassQueue> ()
+    .AddAttribute ("MaxPackets", "Packets accepted by the queue, all classes together",
+                   UintegerValue (100),
+                   MakeUintegerAccessor (&TreeClassQueue::m_maxPackets),
+                   MakeUintegerChecker<uint32_t> ())
+    .AddAttribute ("Classes", "Traffic classes, name:prio|weight:dscp=N|port=N|* separated by ;",
+                   StringValue ("default:1:*"),
+                   MakeStringAccessor (&TreeClassQueue::m_spec),
+                   MakeStringChecker ())
+    .AddAttribute ("IntStamp", "Stamp the in-band telemetry of the packets carrying an IntTag",
+                   BooleanValue (false),
+                   MakeBooleanAccessor (&TreeClassQueue::m_intStamp),
+                   MakeBooleanChecker ())
+    .AddAttribute ("EcnKmin", "Bytes queued below which nothing is ECN marked",
+                   UintegerValue (5000),
+                   MakeUintegerAccessor (&TreeClassQueue::m_ecnKmin),
+                   MakeUintegerChecker<uint32_t> ())
+    .AddAttribute ("EcnKmax", "Bytes queued above which everything is ECN marked (0 = no marking)",
+                   UintegerValue (0),
+                   MakeUintegerAccessor (&TreeClassQueue::m_ecnKmax),
+                   MakeUintegerChecker<uint32_t> ())
+    .AddAttribute ("EcnPmax", "Marking probability at EcnKmax",
+                   DoubleValue (0.01),
+                   MakeDoubleAccessor (&TreeClassQueue::m_ecnPmax),
+                   MakeDoubleChecker<double> (0, 1));
+  return tid;
+}
+
+TreeClassQueue::TreeClassQueue ()
+  : m_maxPackets (100), m_intStamp (false), m_txBytes (0), m_ecnKmin (5000), m_ecnKmax (0), m_ecnPmax (0.01) {
+  m_random = CreateObject<UniformRandomVariable> ();
+}
+
+const std::vector<TreeQueueClass>& TreeClassQueue::GetClasses (void) {
+  // Parsed on first use, the attribute is only known once the queue is fully constructed.
+  // main() already checked the configuration, so this only fails for a bad default.
+  if (m_classes.empty ()) {
+    if (!ParseClasses (m_spec, &m_classes)) ParseClasses ("default:1:*", &m_classes);
+    ClassStats zero = ClassStats ();
+    m_items.resize (m_classes.size ());
+    m_stats.assign (m_classes.size (), zero);
+    m_deficit.assign (m_classes.size (), 0);
+    m_visited.assign (m_classes.size (), false);
+  }
+  return m_classes;
+}
+
+uint32_t TreeClassQueue::Classify (Ptr<const Packet> packet) const {
+  // The CSMA device queues whole frames, look at the IP and transport headers of a copy
+  Ptr<Packet> copy = packet->Copy ();
+  EthernetHeader ethernet (false);
+  copy->RemoveHeader (ethernet);
+  int dscp = -1, sourcePort = -1, destinationPort = -1;
+  if (ethernet.GetLengthType () == 0x0800) {
+    Ipv4Header ip;
+    copy->RemoveHeader (ip);
+    dscp = ip.GetDscp ();
+    // Only the first fragment carries the ports
+    if (ip.GetFragmentOffset () == 0 && ip.GetProtocol () == 17) {
+      UdpHeader udp;
+      copy->PeekHeader (udp);
+      sourcePort = udp.GetSourcePort ();
+      destinationPort = udp.GetDestinationPort ();
+    } else if (ip.GetFragmentOffset () == 0 && ip.GetProtocol () == 6) {
+      TcpHeader tcp;
+      copy->PeekHeader (tcp);
+      sourcePort = tcp.GetSourcePort ();
+      destinationPort = tcp.GetDestinationPort ();
+    }
+  }
+  for (uint32_t c = 0; c + 1 < m_classes.size (); c++) {
+    const TreeQueueClass& queueClass = m_classes[c];
+    if (queueClass.dscp >= 0 && queueClass.dscp != dscp) continue;
+    if (queueClass.port >= 0 && queueClass.port != sourcePort && queueClass.port != destinationPort) continue;
+    return c;
+  }
+  return m_classes.size () - 1;
+}
+
+bool TreeClassQueue::MarkCe (Ptr<Packet> packet) const {
+  EthernetHeader ethernet (false);
+  packet->RemoveHeader (ethernet);
+  bool marked = false;
+  if (ethernet.GetLengthType () == 0x0800) {
+    Ipv4Header ip;
+    packet->RemoveHeader (ip);
+    if (ip.GetEcn () != Ipv4Header::ECN_NotECT) {
+      ip.SetEcn (Ipv4Header::ECN_CE);
+      marked = true;
+    }
+    packet->AddHeader (ip);
+  }
+  packet->AddHeader (ethernet);
+  return marked;
+}
+
+bool TreeClassQueue::DoEnqueue (Ptr<QueueItem> item) {
+  GetClasses ();
+  uint32_t c = Classify (item->GetPacket ());
+  if (GetNPackets () >= m_maxPackets) {
+    m_stats[c].drops++;
+    Drop (item->GetPacket ());
+    return false;
+  }
+  if (m_ecnKmax > 0) {
+    // The frame is only taken apart when it is going to be marked
+    uint32_t queued = GetNBytes ();
+    double probability = queued <= m_ecnKmin ? 0 : queued >= m_ecnKmax ? 1
+                       : m_ecnPmax * (queued - m_ecnKmin) / (m_ecnKmax - m_ecnKmin);
+    if (probability > 0 && m_random->GetValue () < probability && MarkCe (item->GetPacket ())) m_stats[c].marks++;
+  }
+  if (m_items[c].empty () && !m_classes[c].strict) m_active.push_back (c);
+  m_items[c].push_back (std::make_pair (item, Simulator::Now ()));
+  return true;
+}
+
+int TreeClassQueue::Select (std::deque<uint32_t>& active, std::vector<uint32_t>& deficit,
+                            std::vector<bool>& visited) const {
+  for (uint32_t c = 0; c < m_classes.size (); c++) {
+    if (m_classes[c].strict && !m_items[c].empty ()) return c;
+  }
+  if (active.empty ()) return -1;
+  // Deficit round robin: the class at the front gets its quantum once per round and sends as
+  // long as its head packet fits in its deficit, then goes to the back of the round
+  while (true) {
+    uint32_t c = active.front ();
+    if (!visited[c]) {
+      deficit[c] += m_classes[c].weight * 1500;
+      visited[c] = true;
+    }
+    if (m_items[c].front ().first->GetPacketSize () <= deficit[c]) return c;
+    visited[c] = false;
+    active.pop_front ();
+    active.push_back (c);
+  }
+}
+
+Ptr<QueueItem> TreeClassQueue::DoDequeue (void) {
+  GetClasses ();
+  int c = Select (m_active, m_deficit, m_visited);
+  if (c < 0) return 0;
+  Ptr<QueueItem> item = m_items[c].front ().first;
+  Time delay = Simulator::Now () - m_items[c].front ().second;
+  m_items[c].pop_front ();
+  if (!m_classes[c].strict) {
+    m_deficit[c] -= item->GetPacketSize ();
+    // An idle class does not keep its deficit, and leaves the round
+    if (m_items[c].empty ()) {
+      m_deficit[c] = 0;
+      m_visited[c] = false;
+      m_active.pop_front ();
+    }
+  }
+  ClassStats& stats = m_stats[c];
+  stats.packets++;
+  stats.bytes += item->GetPacketSize ();
+  stats.delay += delay;
+  if (delay > stats.maxDelay) stats.maxDelay = delay;
+  m_txBytes += item->GetPacketSize ();
+  if (m_intStamp) {
+    IntTag tag;
+    Ptr<Packet> packet = item->GetPacket ();
+    if (packet->PeekPacketTag (tag) && !tag.reply && tag.hops < IntTag::MAX_HOPS) {
+      IntTag::Hop& hop = tag.hop[tag.hops++];
+      hop.time = Simulator::Now ().GetNanoSeconds ();
+      hop.txBytes = m_txBytes;
+      // The queue still counts the packet being dequeued
+      hop.queue = GetNBytes () - item->GetPacketSize ();
+      packet->ReplacePacketTag (tag);
+    }
+  }
+  return item;
+}
+
+Ptr<const QueueItem> TreeClassQueue::DoPeek (void) const {
+  if (m_classes.empty ()) return 0;
+  // Same choice as DoDequeue, on a copy of the DRR state
+  std::deque<uint32_t> active = m_active;
+  std::vector<uint32_t> deficit = m_deficit;
+  std::vector<bool> visited = m_visited;
+  int c = Select (active, deficit, visited);
+  return c < 0 ? Ptr<const QueueItem> (0) : Ptr<const QueueItem> (m_items[c].front ().first);
+}
+
+void reportQueueClasses(TreeTopology* topology) {
+  // Classes are the same on every port, sum them per level (depth of the node owning the port)
+  std::vector<std::vector<TreeClassQueue::ClassStats> > levels (topology->levels + 1);
+  std::vector<TreeQueueClass> classes;
+  for (size_t id = 0; id < topology->nodes.size(); id++) {
+    TreeNodeInfo& info = topology->nodes[id];
+    if (info.node == 0) continue;
+    std::vector<Ptr<CsmaNetDevice> > devices = info.downDevices;
+    if (info.upDevice != 0) devices.push_back (info.upDevice);
+    for (size_t dev = 0; dev < devices.size(); dev++) {
+      Ptr<TreeClassQueue> queue = DynamicCast<TreeClassQueue> (devices[dev]->GetQueue ());
+      if (queue == 0) continue;
+      classes = queue->GetClasses ();
+      std::vector<TreeClassQueue::ClassStats>& level = levels[std::min (info.depth, topology->levels)];
+      level.resize (classes.size (), TreeClassQueue::ClassStats ());
+      for (uint32_t c = 0; c < classes.size (); c++) {
+        const TreeClassQueue::ClassStats& stats = queue->GetStats (c);
+        level[c].packets += stats.packets;
+        level[c].bytes += stats.bytes;
+        level[c].drops += stats.drops;
+        level[c].delay += stats.delay;
+        level[c].maxDelay = std::max (level[c].maxDelay, stats.maxDelay);
+        level[c].marks += stats.marks;
+      }
+    }
+  }
+  for (size_t depth = 0; depth < levels.size (); depth++) {
+    for (size_t c = 0; c < levels[depth].size (); c++) {
+      const TreeClassQueue::ClassStats& stats = levels[depth][c];
+      NS_LOG_INFO ("Level " << depth << " class " << classes[c].name << ": " << stats.packets << " packets, "
+                   << stats.bytes << " bytes, " << stats.drops << " dropped, " << stats.marks << " ECN marked, queueing delay mean/max "
+                   << (stats.packets == 0 ? 0 : stats.delay.GetSeconds () / stats.packets) << "s/"
+                   << stats.maxDelay.GetSeconds () << "s");
+    }
+  }
+}
+
+void applyQueuePlan(TreeTopology* topology, const std::vector<uint32_t>& sizes) {
+  for (size_t id = 0; id < topology->nodes.size(); id++) {
+    TreeNodeInfo& info = topology->nodes[id];
+    if (info.node == 0) continue;
+    uint32_t size = sizes[std::min<size_t> (info.depth, sizes.size () - 1)];
+
+    // Link layer, the device queues towards the parent and the leaves
+    std::vector<Ptr<CsmaNetDevice> > devices = info.downDevices;
+    if (info.upDevice != 0) devices.push_back (info.upDevice);
+    for (size_t dev = 0; dev < devices.size(); dev++) {
+      devices[dev]->GetQueue ()->SetAttribute ("MaxPackets", UintegerValue (size));
+    }
+
+    // IP layer, packets waiting for an ARP reply (interface 0 is the loopback, it has no cache)
+    Ptr<Ipv4L3Protocol> ipv4 = info.node->GetObject<Ipv4L3Protocol> ();
+    for (uint32_t interface = 1; interface < ipv4->GetNInterfaces (); interface++) {
+      Ptr<ArpCache> arp = ipv4->GetInterface (interface)->GetArpCache ();
+      if (arp != 0) arp->SetAttribute ("PendingQueueSize", UintegerValue (size));
+    }
+  }
+}
+
+std::vector<uint32_t> parseQueuePlan(std::string plan, int levels) {
+  std::vector<uint32_t> sizes;
+  std::istringstream in (plan);
+  std::string size;
+  while (std::getline (in, size, ',')) sizes.push_back (atoi (size.c_str ()));
+  if (sizes.empty ()) sizes.push_back (1000);
+  sizes.resize (levels + 1, sizes.back ());
+  return sizes;
+}
+
+// What a trajectory of splitOverflow() sends back when it ends, one record per cycle it saw.
+// Small enough for a pipe write to be atomic, so all the trajectories share one pipe.
+struct SplitRecord {
+  int64_t cycle;        // cycle of the main trajectory, -1 for the totals of the main trajectory
+  double drops;         // weighted drops of the cycle
+  double queued;        // main trajectory totals only: packets queued, cycles
+  double cycles;
+  double work;          // packets queued by this trajectory, to measure the effort
+};
+
+// State of the trajectory running in this process
+struct SplitState {
+  std::vector<uint32_t> thresholds;
+  uint32_t retrials;
+  int writeFd;
+  int tokenFds[2];                   // one byte per trajectory allowed to run besides the ones running
+  std::vector<uint32_t> occupancy;   // per queue of the level, from the queue traces
+  std::vector<uint32_t> above;       // queues at or above each threshold
+  int importance;                    // thresholds reached, 0 .. thresholds.size ()
+  int born;                          // threshold this clone was made at, 0 for the main trajectory
+  int64_t cycle;                     // cycle of the main trajectory this trajectory belongs to
+  int64_t cycles;                    // main trajectory only: cycles started so far
+  uint64_t lineage;                  // hash of the splits this trajectory comes from
+  uint64_t splits;                   // splits made by this trajectory so far
+  uint64_t queued;
+  uint64_t work;
+  std::map<int64_t, double> drops;   // weighted drops per cycle
+};
+static SplitState splitState;
+
+// Send what this trajectory saw to the collector, and let a waiting clone run in its place
+static void splitReport(bool main) {
+  SplitState& state = splitState;
+  std::map<int64_t, double>::iterator cycle;
+  bool sent = false;
+  for (cycle = state.drops.begin (); cycle != state.drops.end (); cycle++) {
+    SplitRecord record = { cycle->first, cycle->second, 0, 0, sent ? 0.0 : (double) state.work };
+    sent = write (state.writeFd, &record, sizeof (record)) == sizeof (record) || sent;
+  }
+  if (main || !sent) {
+    SplitRecord record = { main ? -1 : state.cycle, 0, (double) state.queued, (double) state.cycles,
+                           sent ? 0.0 : (double) state.work };
+    if (write (state.writeFd, &record, sizeof (record)) != sizeof (record)) _exit (1);
+  }
+  char token = 0;
+  if (write (state.tokenFds[1], &token, 1) != 1) _exit (1);
+}
+
+static void splitEnqueued(uint32_t queue, Ptr<const Packet> packet) {
+  SplitState& state = splitState;
+  state.work++;
+  if (state.born == 0) state.queued++;
+  uint32_t occupancy = ++state.occupancy[queue];
+  // Did this queue just reach a threshold?
+  for (size_t k = 0; k < state.thresholds.size (); k++) {
+    if (state.thresholds[k] != occupancy) continue;
+    if (state.above[k]++ > 0 || (int) k != state.importance) break; // not a new level of importance
+    state.importance = k + 1;
+    if (k == 0 && state.born == 0) state.cycle = state.cycles++; // the main trajectory starts a cycle
+    // Split: retrials - 1 clones, the trajectory that was here is the last of them
+    uint64_t split = state.splits++;
+    for (uint32_t r = 1; r < state.retrials; r++) {
+      pid_t pid = forkSimulation ();
+      if (pid < 0) NS_FATAL_ERROR ("fork: " << strerror (errno));
+      if (pid > 0) continue;
+      // Clone: only reports what happens from now on, with random streams of its own. They
+      // come from where it was made (FNV-1a of the parent, cycle, threshold, split and clone
+      // index), not from the process, so the same --RngRun gives the same estimate
+      state.born = k + 1;
+      state.queued = 0;
+      state.work = 0;
+      state.drops.clear ();
+      uint64_t fields[] = { (uint64_t) state.cycle, k, split, r };
+      for (size_t f = 0; f < sizeof fields / sizeof fields[0]; f++) {
+        state.lineage = (state.lineage ^ fields[f]) * 1099511628211ULL;
+      }
+      state.splits = 0;
+      for (uint32_t n = 0; n < NodeList::GetNNodes (); n++) {
+        Ptr<Node> node = NodeList::GetNode (n);
+        for (uint32_t a = 0; a < node->GetNApplications (); a++) {
+          Ptr<PatternClient> client = DynamicCast<PatternClient> (node->GetApplication (a));
+          // Streams from 2^63 up are the ones ns-3 assigns by itself
+          if (client != 0) client->Reseed (((state.lineage ^ n) * 1099511628211ULL) >> 1);
+        }
+      }
+      // Wait for a free hardware thread, the trajectories still running are never held up
+      char token;
+      ssize_t got;
+      while ((got = read (state.tokenFds[0], &token, 1)) < 0 && errno == EINTR) {}
+      if (got != 1) _exit (1);
+      break;
+    }
+    break;
+  }
+}
+
+static void splitDequeued(uint32_t queue, Ptr<const Packet> packet) {
+  SplitState& state = splitState;
+  uint32_t occupancy = state.occupancy[queue]--;
+  for (size_t k = 0; k < state.thresholds.size (); k++) {
+    if (state.thresholds[k] != occupancy) continue;
+    // Back under a threshold: the importance drops when no queue is above it anymore
+    if (--state.above[k] == 0 && state.importance > (int) k) {
+      state.importance = k;
+      if (state.born > (int) k) { // a clone leaving the region it was made for
+        splitReport (false);
+        _exit (0);
+      }
+    }
+    break;
+  }
+}
+
+static void splitDropped(Ptr<const Packet> packet) {
+  SplitState& state = splitState;
+  state.drops[state.born == 0 && state.importance == 0 ? -2 : state.cycle] += std::pow ((double) state.retrials, -state.importance);
+}
+
+int splitOverflow(TreeTopology* topology, int level, std::vector<uint32_t> thresholds, uint32_t retrials) {
+  if (thresholds.empty () || retrials < 2 || !std::is_sorted (thresholds.begin (), thresholds.end ())) {
+    NS_LOG_ERROR ("--split needs increasing thresholds and --splitRetrials of 2 or more");
+    return 1;
+  }
+  SplitState& state = splitState;
+  state.thresholds = thresholds;
+  state.retrials = retrials;
+  state.above.assign (thresholds.size (), 0);
+  state.importance = 0;
+  state.born = 0;
+  state.cycle = -2; // drops outside of any cycle, below every threshold
+  state.cycles = 0;
+  state.lineage = 14695981039346656037ULL;
+  state.splits = 0;
+  state.queued = 0;
+  state.work = 0;
+
+  // The queues of every node of the level
+  uint32_t queues = 0;
+  for (size_t id = 0; id < topology->nodes.size(); id++) {
+    TreeNodeInfo& info = topology->nodes[id];
+    if (info.node == 0 || info.depth != level) continue;
+    std::vector<Ptr<CsmaNetDevice> > devices = info.downDevices;
+    if (info.upDevice != 0) devices.push_back (info.upDevice);
+    for (size_t dev = 0; dev < devices.size(); dev++, queues++) {
+      Ptr<Queue> queue = devices[dev]->GetQueue ();
+      queue->TraceConnectWithoutContext ("Enqueue", MakeBoundCallback (&splitEnqueued, queues));
+      queue->TraceConnectWithoutContext ("Dequeue", MakeBoundCallback (&splitDequeued, queues));
+      queue->TraceConnectWithoutContext ("Drop", MakeCallback (&splitDropped));
+    }
+  }
+  state.occupancy.assign (queues, 0);
+  if (queues == 0) {
+    NS_LOG_ERROR ("No queues at level " << level);
+    return 1;
+  }
+  NS_LOG_INFO ("Splitting at " << thresholds.size () << " thresholds of " << queues << " queues at level "
+               << level << ", " << retrials << " retrials each");
+
+  // This process collects, the main trajectory and all its clones write to the pipe. The main
+  // trajectory takes one of the tokens of the hardware threads, and every trajectory gives its
+  // token back when it ends
+  int pipeFds[2];
+  if (pipe (pipeFds) < 0 || pipe (state.tokenFds) < 0) NS_FATAL_ERROR ("pipe: " << strerror (errno));
+  uint32_t threads = std::max (1u, std::thread::hardware_concurrency ());
+  std::string tokens (threads - 1, '\0');
+  if (write (state.tokenFds[1], tokens.data (), tokens.size ()) != (ssize_t) tokens.size ()) {
+    NS_FATAL_ERROR ("write: " << strerror (errno));
+  }
+  pid_t pid = forkSimulation ();
+  if (pid < 0) NS_FATAL_ERROR ("fork: " << strerror (errno));
+  if (pid == 0) {
+    close (pipeFds[0]);
+    state.writeFd = pipeFds[1];
+    LogComponentDisableAll (LOG_LEVEL_ALL);
+    Simulator::Run ();
+    // Clones still around at the end of the simulation report too
+    splitReport (state.born == 0);
+    _exit (0);
+  }
+  close (pipeFds[1]);
+  close (state.tokenFds[0]);
+  close (state.tokenFds[1]);
+
+  std::map<int64_t, double> cycleDrops;
+  double queued = 0, cycles = 0, work = 0, outside = 0;
+  uint64_t trajectories = 0;
+  SplitRecord record;
+  while (read (pipeFds[0], &record, sizeof (record)) == sizeof (record)) {
+    work += record.work;
+    if (record.cycle == -1) {
+      queued = record.queued;
+      cycles = record.cycles;
+      continue;
+    }
+    if (record.cycle == -2) outside += record.drops;
+    else cycleDrops[record.cycle] += record.drops;
+    trajectories++;
+  }
+  close (pipeFds[0]);
+  int status;
+  waitpid (pid, &status, 0);
+  if (queued == 0) {
+    NS_LOG_ERROR ("The main trajectory did not report, or queued nothing at level " << level);
+    return 1;
+  }
+
+  // Cycles are taken as independent, the ones without drops count as zeros
+  double total = outside, sum = 0, squares = 0;
+  for (std::map<int64_t, double>::iterator c = cycleDrops.begin (); c != cycleDrops.end (); c++) {
+    total += c->second;
+    sum += c->second;
+    squares += c->second * c->second;
+  }
+  double n = std::max (cycles, 2.0);
+  double variance = std::max (0.0, (squares - sum * sum / n) / (n - 1));
+  double p = total / queued;
+  double halfWidth = 1.96 * std::sqrt (n * variance) / queued;
+  NS_LOG_INFO ("Drop probability at level " << level << ": " << p << " +- " << halfWidth << " (95%), "
+               << (uint64_t) cycles << " cycles, " << trajectories << " trajectory reports, "
+               << (uint64_t) queued << " packets in the main trajectory, " << (uint64_t) work << " in all");
+  if (p > 0 && halfWidth > 0) {
+    // Packets a plain run would need for the same relative half width: 1.96^2 (1 - p) / (p r^2)
+    double relative = halfWidth / p;
+    double plain = 1.96 * 1.96 * (1 - p) / (p * relative * relative);
+    NS_LOG_INFO ("A plain run would need about " << plain << " packets for the same precision, a speedup of "
+                 << plain / work);
+  }
+  return 0;
+}
+
+// Cost of cutting an edge, see partitionGraph()
+static double cutCost(const PartitionGraph::Edge& edge, double maxDelay) {
+  return (1 + edge.traffic) * (edge.delay > 0 ? maxDelay / edge.delay : 1e6);
+}
+
+// One level of coarsening: the ends of the most expensive edges merged into one node,
+// (*coarse)[v] is the node of the coarser graph v went to. No coarse node gets heavier than maxWeight.
+static PartitionGraph coarsenGraph(const PartitionGraph& graph, double maxDelay, double maxWeight, std::vector<int>* coarse) {
+  size_t n = graph.weights.size ();
+  coarse->assign (n, -1);
+  // Light nodes pick first, so the merged nodes stay about as heavy as each other
+  std::vector<std::pair<double, int> > order;
+  for (size_t v = 0; v < n; v++) order.push_back (std::make_pair (graph.weights[v], (int) v));
+  std::sort (order.begin (), order.end ());
+  int next = 0;
+  std::vector<double> weights;
+  std::vector<int> alone;
+  for (size_t i = 0; i < n; i++) {
+    int v = order[i].second;
+    if ((*coarse)[v] >= 0) continue;
+    int best = -1;
+    double bestCost = -1;
+    for (size_t e = 0; e < graph.edges[v].size (); e++) {
+      const PartitionGraph::Edge& edge = graph.edges[v][e];
+      if ((*coarse)[edge.to] >= 0 || edge.to == v || graph.weights[v] + graph.weights[edge.to] > maxWeight) continue;
+      double cost = cutCost (edge, maxDelay);
+      if (cost > bestCost) {
+        best = edge.to;
+        bestCost = cost;
+      }
+    }
+    (*coarse)[v] = next;
+    if (best >= 0) (*coarse)[best] = next;
+    weights.push_back (graph.weights[v] + (best >= 0 ? graph.weights[best] : 0));
+    if (best < 0) alone.push_back (v);
+    next++;
+  }
+  // Nodes left alone (the leaves of a star only match one at a time) join the node their most
+  // expensive edge went to, so trees shrink as fast as meshes
+  for (size_t a = 0; a < alone.size (); a++) {
+    int v = alone[a];
+    int best = -1;
+    double bestCost = -1;
+    for (size_t e = 0; e < graph.edges[v].size (); e++) {
+      const PartitionGraph::Edge& edge = graph.edges[v][e];
+      int to = (*coarse)[edge.to];
+      if (to == (*coarse)[v] || weights[to] + graph.weights[v] > maxWeight) continue;
+      double cost = cutCost (edge, maxDelay);
+      if (cost > bestCost) {
+        best = to;
+        bestCost = cost;
+      }
+    }
+    if (best < 0) continue;
+    weights[(*coarse)[v]] -= graph.weights[v];
+    weights[best] += graph.weights[v];
+    (*coarse)[v] = best;
+  }
+  // Number the coarse nodes again, without the ones emptied above
+  std::vector<int> number (next, -1);
+  int used = 0;
+  for (size_t v = 0; v < n; v++) {
+    int& c = number[(*coarse)[v]];
+    if (c < 0) c = used++;
+    (*coarse)[v] = c;
+  }
+  next = used;
+
+  PartitionGraph result;
+  result.weights.assign (next, 0);
+  result.edges.resize (next);
+  std::vector<std::vector<int> > members (next);
+  for (size_t v = 0; v < n; v++) {
+    result.weights[(*coarse)[v]] += graph.weights[v];
+    members[(*coarse)[v]].push_back (v);
+  }
+  // Edges to the same coarse node are merged: their traffic added up, the shortest delay kept
+  std::vector<int> slot (next, -1);
+  for (int c = 0; c < next; c++) {
+    std::vector<PartitionGraph::Edge>& edges = result.edges[c];
+    for (size_t m = 0; m < members[c].size (); m++) {
+      const std::vector<PartitionGraph::Edge>& fine = graph.edges[members[c][m]];
+      for (size_t e = 0; e < fine.size (); e++) {
+        int to = (*coarse)[fine[e].to];
+        if (to == c) continue;
+        if (slot[to] < 0) {
+          slot[to] = edges.size ();
+          PartitionGraph::Edge edge = { to, fine[e].traffic, fine[e].delay };
+          edges.push_back (edge);
+        } else {
+          edges[slot[to]].traffic += fine[e].traffic;
+          edges[slot[to]].delay = std::min (edges[slot[to]].delay, fine[e].delay);
+        }
+      }
+    }
+    for (size_t e = 0; e < edges.size (); e++) slot[edges[e].to] = -1;
+  }
+  return result;
+}
+
+// First split of the coarsest graph: every part but the last grown from the heaviest node left,
+// adding the node of the best gain until it has its share of the weight
+static std::vector<uint32_t> growParts(const PartitionGraph& graph, uint32_t parts, double maxDelay) {
+  size_t n = graph.weights.size ();
+  double total = 0;
+  for (size_t v = 0; v < n; v++) total += graph.weights[v];
+  std::vector<uint32_t> part (n, parts); // parts = not assigned yet
+  // Cost of all the edges of a node: the gain of adding a node to the part is what it is
+  // connected to the part by, less what it is connected to the rest by
+  std::vector<double> cost (n, 0);
+  for (size_t v = 0; v < n; v++) {
+    for (size_t e = 0; e < graph.edges[v].size (); e++) cost[v] += cutCost (graph.edges[v][e], maxDelay);
+  }
+  double assigned = 0;
+  for (uint32_t p = 0; p + 1 < parts; p++) {
+    double target = (total - assigned) / (parts - p);
+    double weight = 0;
+    std::vector<double> connection (n, 0);
+    std::vector<int> frontier;
+    while (weight < target) {
+      int best = -1;
+      for (size_t f = 0; f < frontier.size (); f++) {
+        int v = frontier[f];
+        if (part[v] == parts && (best < 0 || 2 * connection[v] - cost[v] > 2 * connection[best] - cost[best])) best = v;
+      }
+      // Nothing connected left (the part is a whole component), start again somewhere else
+      if (best < 0) {
+        for (size_t v = 0; v < n; v++) {
+          if (part[v] == parts && (best < 0 || graph.weights[v] > graph.weights[best])) best = v;
+        }
+      }
+      if (best < 0) break;
+      // Stop when the node would take the part further past its share than it is below it
+      if (weight > 0 && weight + graph.weights[best] - target > target - weight) break;
+      part[best] = p;
+      weight += graph.weights[best];
+      for (size_t e = 0; e < graph.edges[best].size (); e++) {
+        const PartitionGraph::Edge& edge = graph.edges[best][e];
+        if (part[edge.to] != parts) continue;
+        if (connection[edge.to] == 0) frontier.push_back (edge.to);
+        connection[edge.to] += cutCost (edge, maxDelay);
+      }
+    }
+    assigned += weight;
+  }
+  for (size_t v = 0; v < n; v++) {
+    if (part[v] == parts) part[v] = parts - 1;
+  }
+  return part;
+}
+
+// Passes over the nodes moving each one to the part it is most connected to, when that cuts
+// less without making the part heavier than maxPart, or when its own part is too heavy
+static void refineParts(const PartitionGraph& graph, uint32_t parts, double maxPart, double maxDelay,
+                        std::vector<uint32_t>* part) {
+  size_t n = graph.weights.size ();
+  std::vector<double> load (parts, 0);
+  for (size_t v = 0; v < n; v++) load[(*part)[v]] += graph.weights[v];
+  std::vector<double> connection (parts, 0);
+  std::vector<uint32_t> touched;
+  for (int pass = 0; pass < 8; pass++) {
+    uint64_t moves = 0;
+    for (size_t v = 0; v < n; v++) {
+      uint32_t from = (*part)[v];
+      double weight = graph.weights[v];
+      touched.clear ();
+      for (size_t e = 0; e < graph.edges[v].size (); e++) {
+        const PartitionGraph::Edge& edge = graph.edges[v][e];
+        uint32_t p = (*part)[edge.to];
+        if (connection[p] == 0) touched.push_back (p);
+        connection[p] += cutCost (edge, maxDelay);
+      }
+      uint32_t best = from;
+      double bestGain = 0;
+      for (size_t t = 0; t < touched.size (); t++) {
+        uint32_t to = touched[t];
+        if (to == from) continue;
+        double gain = connection[to] - connection[from];
+        bool fits = load[to] + weight <= maxPart;
+        bool balances = load[to] + weight < load[from];
+        bool allowed = (fits && (gain > 0 || (gain == 0 && balances))) || (load[from] > maxPart && balances);
+        if (allowed && (best == from || gain > bestGain)) {
+          best = to;
+          bestGain = gain;
+        }
+      }
+      for (size_t t = 0; t < touched.size (); t++) connection[touched[t]] = 0;
+      if (best == from) continue;
+      (*part)[v] = best;
+      load[from] -= weight;
+      load[best] += weight;
+      moves++;
+    }
+    if (moves == 0) break;
+  }
+}
+
+std::vector<uint32_t> partitionGraph(const PartitionGraph& graph, uint32_t parts, double tolerance) {
+  double total = 0, maxDelay = 0;
+  for (size_t v = 0; v < graph.weights.size (); v++) {
+    total += graph.weights[v];
+    for (size_t e = 0; e < graph.edges[v].size (); e++) maxDelay = std::max (maxDelay, graph.edges[v][e].delay);
+  }
+  if (parts <= 1) return std::vector<uint32_t> (graph.weights.size (), 0);
+
+  // Coarsen until the graph is small, or until hardly anything can be merged anymore
+  std::vector<PartitionGraph> levels (1, graph);
+  std::vector<std::vector<int> > maps;
+  size_t small = std::max<size_t> (20 * parts, 64);
+  while (levels.back ().weights.size () > small) {
+    std::vector<int> coarse;
+    PartitionGraph next = coarsenGraph (levels.back (), maxDelay, total / (4 * parts), &coarse);
+    if (next.weights.size () > 0.9 * levels.back ().weights.size ()) break;
+    maps.push_back (coarse);
+    levels.push_back (next);
+  }
+
+  // Split the coarsest graph, then project the parts back and refine them at every level
+  double maxPart = (1 + tolerance) * total / parts;
+  std::vector<uint32_t> part = growParts (levels.back (), parts, maxDelay);
+  refineParts (levels.back (), parts, maxPart, maxDelay, &part);
+  for (int level = (int) maps.size () - 1; level >= 0; level--) {
+    std::vector<uint32_t> finer (maps[level].size ());
+    for (size_t v = 0; v < finer.size (); v++) finer[v] = part[maps[level][v]];
+    part.swap (finer);
+    refineParts (levels[level], parts, maxPart, maxDelay, &part);
+  }
+  return part;
+}
+
+// Load counted by the profiling run of partitionTree(): packets of every node, then of every link
+// (the link of a node to its parent, by the id of the node)
+static std::vector<double> profileLoad;
+
+static void profileSent(int node, int link, Ptr<const Packet> packet) {
+  profileLoad[node]++;
+  profileLoad[profileLoad.size () / 2 + link]++;
+}
+
+static void profileReceived(int node, Ptr<const Packet> packet) {
+  profileLoad[node]++;
+}
+
+// Add packets to every node and link on the path between two nodes of the tree
+static void addTreePath(TreeTopology* topology, int from, int to, double packets, std::vector<double>* load) {
+  size_t n = topology->nodes.size ();
+  while (from != to) {
+    int& deeper = topology->nodes[from].depth >= topology->nodes[to].depth ? from : to;
+    (*load)[deeper] += packets;
+    (*load)[n + deeper] += packets;
+    deeper = topology->nodes[deeper].parent;
+  }
+  (*load)[from] += packets;
+}
+
+int partitionTree(TreeTopology* topology, const TrafficPattern* pattern, Ipv4InterfaceContainer* ipInterfaces,
+                  uint32_t systems, std::string weights, double profileSeconds, std::string file) {
+  if (weights != "traffic" && weights != "profile") {
+    NS_LOG_ERROR ("Unknown partition weights " << weights << ", use traffic or profile");
+    return 1;
+  }
+  size_t n = topology->nodes.size ();
+  std::vector<double> load (2 * n, 0);
+
+  if (weights == "traffic") {
+    // Servers in the order of the pattern, see installPatternClients()
+    std::vector<int> servers;
+    for (uint32_t ip = 1; ip < ipInterfaces->GetN(); ip+=2) {
+      servers.push_back (ipInterfaces->Get(ip).first->GetObject<Node> ()->GetId ());
+    }
+    // One round of echo requests and their replies: the root to every server, or every server
+    // following the pattern (hotspot destinations are random, they are sampled)
+    if (pattern == 0) {
+      for (size_t s = 0; s < servers.size (); s++) addTreePath (topology, 0, servers[s], 2, &load);
+    } else if (pattern->servers.size () >= 2) {
+      uint32_t samples = pattern->kind == TrafficPattern::HOTSPOT ? 16 : pattern->PacketsPerRound ();
+      double packets = 2.0 * pattern->PacketsPerRound () / samples;
+      for (size_t s = 0; s < servers.size (); s++) {
+        for (uint32_t k = 0; k < samples; k++) {
+          uint32_t destination = pattern->Destination (s, k, (k + 0.5) / samples);
+          if (destination < servers.size ()) addTreePath (topology, servers[s], servers[destination], packets, &load);
+        }
+      }
+    }
+  } else {
+    int pipeFds[2];
+    if (pipe (pipeFds) < 0) NS_FATAL_ERROR ("pipe: " << strerror (errno));
+    pid_t pid = forkSimulation ();
+    if (pid < 0) NS_FATAL_ERROR ("fork: " << strerror (errno));
+    if (pid == 0) {
+      close (pipeFds[0]);
+      LogComponentDisableAll (LOG_LEVEL_ALL);
+      profileLoad = load;
+      for (size_t id = 0; id < n; id++) {
+        TreeNodeInfo& info = topology->nodes[id];
+        if (info.node == 0) continue;
+        for (size_t dev = 0; dev <= info.downDevices.size (); dev++) {
+          bool up = dev == info.downDevices.size ();
+          Ptr<CsmaNetDevice> device = up ? info.upDevice : info.downDevices[dev];
+          if (device == 0) continue;
+          int link = up ? id : info.children[dev];
+          device->TraceConnectWithoutContext ("MacTx", MakeBoundCallback (&profileSent, (int) id, link));
+          device->TraceConnectWithoutContext ("MacRx", MakeBoundCallback (&profileReceived, (int) id));
+        }
+      }
+      Simulator::Stop (Seconds (profileSeconds));
+      Simulator::Run ();
+      const char* data = (const char*) &profileLoad[0];
+      size_t size = profileLoad.size () * sizeof (double);
+      for (ssize_t written = 0; size > 0; data += written, size -= written) {
+        written = write (pipeFds[1], data, size);
+        if (written <= 0) _exit (1);
+      }
+      _exit (0);
+    }
+    close (pipeFds[1]);
+    char* data = (char*) &load[0];
+    size_t size = load.size () * sizeof (double);
+    for (ssize_t got = 0; size > 0; data += got, size -= got) {
+      got = read (pipeFds[0], data, size);
+      if (got <= 0) break;
+    }
+    close (pipeFds[0]);
+    int status;
+    waitpid (pid, &status, 0);
+    if (size > 0) {
+      NS_LOG_ERROR ("The profiling run did not report its load");
+      return 1;
+    }
+  }
+
+  // Every node weighs 1 plus its packets, every link to a parent is an edge
+  PartitionGraph graph;
+  graph.weights.assign (n, 1);
+  graph.edges.resize (n);
+  for (size_t id = 0; id < n; id++) {
+    TreeNodeInfo& info = topology->nodes[id];
+    graph.weights[id] += load[id];
+    if (info.node == 0 || info.parent < 0) continue;
+    double delay = DynamicCast<CsmaChannel> (info.upDevice->GetChannel ())->GetDelay ().GetSeconds ();
+    PartitionGraph::Edge up = { info.parent, load[n + id], delay };
+    PartitionGraph::Edge down = { (int) id, load[n + id], delay };
+    graph.edges[id].push_back (up);
+    graph.edges[info.parent].push_back (down);
+  }
+  std::vector<uint32_t> part = partitionGraph (graph, systems, 0.03);
+
+  double total = 0, cutTraffic = 0, lookahead = -1;
+  uint64_t cutLinks = 0;
+  std::vector<double> systemLoad (systems, 0);
+  for (size_t v = 0; v < n; v++) {
+    total += graph.weights[v];
+    systemLoad[part[v]] += graph.weights[v];
+    for (size_t e = 0; e < graph.edges[v].size (); e++) {
+      const PartitionGraph::Edge& edge = graph.edges[v][e];
+      if (edge.to < (int) v || part[edge.to] == part[v]) continue;
+      cutLinks++;
+      cutTraffic += edge.traffic;
+      lookahead = lookahead < 0 ? edge.delay : std::min (lookahead, edge.delay);
+    }
+  }
+  double mean = total / systems;
+  double imbalance = *std::max_element (systemLoad.begin (), systemLoad.end ()) / mean;
+
+  // What cutting by subtrees would give: the subtrees below the root dealt out heaviest first,
+  // each to the lightest system so far, the root on system 0
+  std::vector<double> subtreeLoad (graph.weights);
+  for (size_t id = n; id-- > 1;) {
+    if (topology->nodes[id].parent >= 0) subtreeLoad[topology->nodes[id].parent] += subtreeLoad[id];
+  }
+  std::vector<std::pair<double, int> > subtrees;
+  for (size_t c = 0; c < topology->nodes[0].children.size (); c++) {
+    int child = topology->nodes[0].children[c];
+    subtrees.push_back (std::make_pair (subtreeLoad[child], child));
+  }
+  std::sort (subtrees.rbegin (), subtrees.rend ());
+  std::vector<double> subtreeSystems (systems, 0);
+  subtreeSystems[0] = graph.weights[0];
+  for (size_t t = 0; t < subtrees.size (); t++) {
+    *std::min_element (subtreeSystems.begin (), subtreeSystems.end ()) += subtrees[t].first;
+  }
+  double subtreeImbalance = *std::max_element (subtreeSystems.begin (), subtreeSystems.end ()) / mean;
+
+  std::ofstream out (file.c_str ());
+  for (size_t id = 0; id < n; id++) {
+    if (topology->nodes[id].node != 0) out << id << " " << part[id] << "\n";
+  }
+  out.close ();
+  if (!out) {
+    NS_LOG_ERROR ("Could not write the partition to " << file);
+    return 1;
+  }
+  NS_LOG_INFO ("Partition of " << n << " nodes into " << systems << " systems (" << weights << " weights) written to "
+               << file << ": predicted load imbalance " << imbalance << " (heaviest system over the mean, "
+               << subtreeImbalance << " by subtrees), " << cutLinks << " links cut carrying " << cutTraffic
+               << " packets, lookahead " << (lookahead < 0 ? 0 : lookahead) << "s");
+  for (uint32_t system = 0; system < systems; system++) {
+    NS_LOG_INFO ("  system " << system << ": load " << systemLoad[system] << " (" << systemLoad[system] / mean << " of the mean)");
+  }
+  return 0;
+}
+
+// One run of the queue size search: the plan tried and what came out of it
+struct QueueTrial {
+  int level;                   // level being searched, -1 for the run checking the whole plan
+  std::vector<uint32_t> plan;  // queue size of every level
+  double dropRate;             // echo requests without a reply
+  double rttP99;               // seconds
+  bool done;
+};
+
+// Run the trials not done yet, each in its own forked copy of the simulation, workers at a time
+static void runQueueTrials(TreeTopology* topology, std::vector<QueueTrial>& trials, int workers) {
+  std::map<pid_t, std::pair<size_t, int> > running; // pid -> trial, read end of its pipe
+  size_t next = 0;
+  while (next < trials.size () || !running.empty ()) {
+    if (next < trials.size () && (int) running.size () < workers) {
+      if (trials[next].done) { next++; continue; }
+      int results[2];
+      if (pipe (results) < 0) NS_FATAL_ERROR ("pipe: " << strerror (errno));
+      pid_t pid = forkSimulation ();
+      if (pid < 0) NS_FATAL_ERROR ("fork: " << strerror (errno));
+      if (pid == 0) {
+        // Child: run the whole simulation with this plan and send back the two numbers we need
+        close (results[0]);
+        LogComponentDisableAll (LOG_LEVEL_ALL);
+        applyQueuePlan (topology, trials[next].plan);
+        Simulator::Run ();
+        uint64_t requests = counters.echoRequests;
+        double outcome[2];
+        outcome[0] = requests == 0 ? 0 : 1.0 - (double) counters.rtt.GetCount () / requests;
+        outcome[1] = counters.rtt.Quantile (0.99);
+        ssize_t written = write (results[1], outcome, sizeof (outcome));
+        _exit (written == sizeof (outcome) ? 0 : 1);
+      }
+      close (results[1]);
+      running[pid] = std::make_pair (next++, results[0]);
+      continue;
+    }
+
+    // As many runs as workers are going, wait for one of them
+    int status;
+    pid_t pid = wait (&status);
+    if (pid < 0) NS_FATAL_ERROR ("wait: " << strerror (errno));
+    if (running.count (pid) == 0) continue;
+    QueueTrial& trial = trials[running[pid].first];
+    double outcome[2];
+    if (read (running[pid].second, outcome, sizeof (outcome)) != sizeof (outcome)) {
+      NS_FATAL_ERROR ("Simulation with queue size " << trial.plan[std::max (trial.level, 0)] << " failed");
+    }
+    close (running[pid].second);
+    running.erase (pid);
+    trial.dropRate = outcome[0];
+    trial.rttP99 = outcome[1];
+    trial.done = true;
+  }
+}
+
+int searchQueuePlan(TreeTopology* topology, std::string target, double targetValue, uint32_t maxSize,
+                    int workers, std::string curvesFile) {
+  if (target != "drop" && target != "rtt") {
+    NS_LOG_ERROR ("searchQueues must be drop or rtt, not " << target);
+    return 1;
+  }
+  int levels = topology->levels + 1; // the servers have a queue too
+  // For every level, the size known to meet the target (hi) and the size known not to (lo)
+  std::vector<uint32_t> lo (levels, 0), hi (levels, maxSize);
+  std::vector<bool> feasible (levels, true);
+  std::vector<QueueTrial> trials;
+
+  NS_LOG_INFO ("Searching queue sizes for " << levels << " levels, " << workers << " runs at a time");
+  for (int round = 0; ; round++) {
+    // Probes of this round, spread evenly over what is left to search of each level
+    std::vector<int> active;
+    for (int level = 0; level < levels; level++) {
+      if (feasible[level] && hi[level] - lo[level] > 1) active.push_back (level);
+    }
+    if (active.empty ()) break;
+    size_t first = trials.size ();
+    int probes = std::max<int> (1, workers / active.size ());
+    for (size_t a = 0; a < active.size (); a++) {
+      int level = active[a];
+      std::vector<uint32_t> sizes;
+      if (round == 0) sizes.push_back (maxSize); // make sure the largest size is good enough
+      for (int probe = 1; probe <= probes; probe++) {
+        uint32_t size = lo[level] + (uint64_t) (hi[level] - lo[level]) * probe / (probes + 1);
+        if (size > lo[level] && size < hi[level] && (sizes.empty () || size != sizes.back ())) sizes.push_back (size);
+      }
+      if (sizes.empty ()) sizes.push_back (lo[level] + 1);
+      for (size_t i = 0; i < sizes.size (); i++) {
+        QueueTrial trial;
+        trial.level = level;
+        trial.plan.assign (levels, maxSize);
+        trial.plan[level] = sizes[i];
+        trial.done = false;
+        trials.push_back (trial);
+      }
+    }
+    runQueueTrials (topology, trials, workers);
+
+    // Narrow down every level, assuming a bigger queue is never worse
+    for (size_t t = first; t < trials.size (); t++) {
+      QueueTrial& trial = trials[t];
+      uint32_t size = trial.plan[trial.level];
+      bool met = target == "drop" ? trial.dropRate <= targetValue : trial.rttP99 <= targetValue;
+      NS_LOG_INFO ("  level " << trial.level << " size " << size << ": drop rate " << trial.dropRate
+                   << ", p99 RTT " << trial.rttP99 << "s" << (met ? "" : " (missed)"));
+      if (met && size < hi[trial.level]) hi[trial.level] = size;
+      if (!met && size == maxSize) feasible[trial.level] = false;
+      if (!met && size > lo[trial.level] && size < hi[trial.level]) lo[trial.level] = size;
+    }
+  }
+
+  // Check the plan with every level at its size, the levels were searched one at a time
+  QueueTrial check;
+  check.level = -1;
+  check.plan = hi;
+  check.done = false;
+  trials.push_back (check);
+  runQueueTrials (topology, trials, 1);
+  QueueTrial& result = trials.back ();
+
+  std::ofstream curves (curvesFile.c_str ());
+  curves << "level,size,drop_rate,rtt_p99" << std::endl;
+  for (size_t t = 0; t < trials.size () - 1; t++) {
+    curves << trials[t].level << "," << trials[t].plan[trials[t].level] << "," << trials[t].dropRate
+           << "," << trials[t].rttP99 << std::endl;
+  }
+
+  std::ostringstream plan;
+  for (int level = 0; level < levels; level++) {
+    plan << (level > 0 ? "," : "") << hi[level];
+    if (!feasible[level]) NS_LOG_INFO ("Level " << level << " misses the target even with " << maxSize << " packets");
+  }
+  bool met = target == "drop" ? result.dropRate <= targetValue : result.rttP99 <= targetValue;
+  NS_LOG_INFO ("Recommended plan: --queueSizes=" << plan.str () << " (" << trials.size ()
+               << " runs, curves in " << curvesFile << ")");
+  NS_LOG_INFO ("All levels together: drop rate " << result.dropRate << ", p99 RTT " << result.rttP99
+               << "s, target " << (met ? "met" : "missed, the levels interact, try larger sizes"));
+  return met ? 0 : 2;
+}
+
+TreeEstimate estimateTree(int levels, int numLeaves, bool treeRoutes) {
+  // Per-object costs, measured on trees of up to a few thousand nodes (ns-3 optimized build).
+  // Keep them up to date with the "Setup took" line every run prints.
+  const double processBytes = 40e6;       // ns-3 itself, before creating anything
+  const double nodeBytes = 24e3;          // node with its Internet stack, loopback and routing
+  const double deviceBytes = 6e3;         // CSMA device, its queue, IPv4 interface, ARP cache, queue disc
+  const double channelBytes = 1e3;
+  const double routeBytes = 120;          // routing table entry
+  const double applicationBytes = 1.5e3;
+  const double nodeSeconds = 150e-6;      // creating a node and installing its stack
+  const double deviceSeconds = 60e-6;     // installing a device and assigning its address
+  const double applicationSeconds = 10e-6;
+  // The global routing SPF looks up every vertex in the node list, making it cubic in the number
+  // of nodes: 2 levels of 32 leaves (1057 nodes) take about 30 minutes
+  const double routingSeconds = 1800.0 / (1057.0 * 1057.0 * 1057.0);
+
+  TreeEstimate estimate;
+  uint64_t levelNodes = 1;
+  estimate.nodes = 1; // the client
+  for (int level = 1; level <= levels; level++) {
+    levelNodes *= numLeaves;
+    estimate.nodes += levelNodes;
+  }
+  uint64_t servers = levelNodes;
+  estimate.channels = estimate.nodes - 1;
+  estimate.devices = 2 * estimate.channels;
+  estimate.interfaces = estimate.devices + estimate.nodes;
+  estimate.routes = estimate.nodes * estimate.channels;
+  if (treeRoutes) { // a default route per node, and every subnet has a route on each node above it
+    estimate.routes = estimate.nodes - 1;
+    uint64_t depthNodes = 1;
+    for (int depth = 0; depth < levels; depth++) {
+      estimate.routes += depthNodes * (subtreeNodes (numLeaves, levels - depth) - numLeaves);
+      depthNodes *= numLeaves;
+    }
+  }
+  estimate.applications = 2 * servers;
+
+  double nodes = estimate.nodes;
+  estimate.memory = processBytes + nodes * nodeBytes + estimate.devices * deviceBytes
+    + estimate.channels * channelBytes + estimate.routes * routeBytes
+    + estimate.applications * applicationBytes;
+  estimate.buildSeconds = nodes * nodeSeconds + estimate.devices * deviceSeconds
+    + estimate.applications * applicationSeconds;
+  estimate.routingSeconds = treeRoutes ? 0 : nodes * nodes * nodes * routingSeconds;
+  return estimate;
+}
+
+uint64_t availableMemory() {
+  std::ifstream meminfo ("/proc/meminfo");
+  std::string line;
+  while (std::getline (meminfo, line)) {
+    if (line.compare (0, 13, "MemAvailable:") == 0) return strtoull (line.c_str () + 13, 0, 10) * 1024;
+  }
+  return 0;
+}
@@ -0,0 +1,188 @@
+/**
+ *  Command line tool to filter and aggregate the runs stored in results files written by
+ *  networkTree --results (see resultsStore.h), without going through any text log.
+ *
+ *    resultsQuery [options] file...
+ *      --where name=value     keep runs whose parameter or metric equals value (name!=value,
+ *                             name<value and name>value also work, numerically for < and >)
+ *      --group name           aggregate the runs by the value of a parameter or metric
+ *      --metric name          metric to print or aggregate (repeatable, default all of them)
+ *      --series name          summary of a time series of every run: points, mean, max, last
+ *      --dump                 with --series, print every point instead
+ *
+ *  Without --group every matching run is printed on a line, with --group every group gets a
+ *  line with the number of runs and the mean, min and max of each metric.
+ */
+#include "resultsStore.h"
+
+#include <cstdlib>
+#include <iostream>
+#include <map>
+
+// One --where condition
+struct ResultsFilter {
+  std::string name;
+  std::string op;
+  std::string value;
+};
+
+static bool parseFilter(std::string text, ResultsFilter* filter) {
+  const char* ops[] = {"!=", "=", "<", ">"};
+  for (int o = 0; o < 4; o++) {
+    size_t at = text.find (ops[o]);
+    if (at == std::string::npos || at == 0) continue;
+    filter->name = text.substr (0, at);
+    filter->op = ops[o];
+    filter->value = text.substr (at + filter->op.size ());
+    return true;
+  }
+  return false;
+}
+
+// Whole text as a number, so "1000" and "1e3" are the same value
+static bool number(const std::string& text, double* value) {
+  char* end;
+  *value = strtod (text.c_str (), &end);
+  return !text.empty () && *end == '\0';
+}
+
+static bool matches(const ResultsRun& run, const std::vector<ResultsFilter>& filters) {
+  for (size_t f = 0; f < filters.size (); f++) {
+    std::string value;
+    if (!run.Get (filters[f].name, &value)) return false;
+    double have, want;
+    bool numeric = number (value, &have) && number (filters[f].value, &want);
+    bool equal = value == filters[f].value || (numeric && have == want);
+    const std::string& op = filters[f].op;
+    if (op == "=" && !equal) return false;
+    if (op == "!=" && equal) return false;
+    if (op == "<" && !(numeric && have < want)) return false;
+    if (op == ">" && !(numeric && have > want)) return false;
+  }
+  return true;
+}
+
+// Mean, min and max of a metric over the runs of a group
+struct ResultsAggregate {
+  uint64_t runs;
+  double sum;
+  double min;
+  double max;
+  ResultsAggregate () : runs (0), sum (0), min (0), max (0) {}
+  void Add (double value) {
+    min = runs == 0 ? value : std::min (min, value);
+    max = runs == 0 ? value : std::max (max, value);
+    sum += value;
+    runs++;
+  }
+};
+
+int main(int argc, char* argv[]) {
+  std::vector<ResultsFilter> filters;
+  std::vector<std::string> metrics;
+  std::vector<std::string> files;
+  std::string group, series;
+  bool dump = false;
+  for (int arg = 1; arg < argc; arg++) {
+    std::string option = argv[arg];
+    bool hasValue = arg + 1 < argc;
+    if (option == "--where" && hasValue) {
+      ResultsFilter filter;
+      if (!parseFilter (argv[++arg], &filter)) {
+        std::cerr << "resultsQuery: bad condition " << argv[arg] << "\n";
+        return 1;
+      }
+      filters.push_back (filter);
+    } else if (option == "--group" && hasValue) group = argv[++arg];
+    else if (option == "--metric" && hasValue) metrics.push_back (argv[++arg]);
+    else if (option == "--series" && hasValue) series = argv[++arg];
+    else if (option == "--dump") dump = true;
+    else if (option.compare (0, 2, "--") == 0) {
+      std::cerr << "usage: resultsQuery [--where name=value] [--group name] [--metric name] "
+                << "[--series name [--dump]] file...\n";
+      return 1;
+    } else files.push_back (option);
+  }
+
+  uint64_t read = 0, matched = 0;
+  std::map<std::string, std::map<std::string, ResultsAggregate> > groups;
+  std::vector<std::string> groupMetrics; // in the order they were first seen
+  for (size_t f = 0; f < files.size (); f++) {
+    ResultsReader reader (files[f]);
+    if (!reader.IsOpen ()) {
+      std::cerr << "resultsQuery: cannot open " << files[f] << "\n";
+      return 1;
+    }
+    ResultsRun run;
+    uint64_t index = 0;   // run number within this file, which is what the rows are labelled with
+    // Series are only kept (not decompressed yet) when one of them is asked for
+    while (reader.Next (&run, !series.empty ())) {
+      read++;
+      index++;
+      if (!matches (run, filters)) continue;
+      matched++;
+
+      std::vector<std::string> names = metrics;
+      if (names.empty ()) {
+        for (size_t m = 0; m < run.metrics.size (); m++) names.push_back (run.metrics[m].first);
+      }
+      if (!group.empty ()) {
+        std::string key;
+        if (!run.Get (group, &key)) key = "(none)";
+        for (size_t n = 0; n < names.size (); n++) {
+          double value;
+          if (!run.GetMetric (names[n], &value)) continue;
+          if (std::find (groupMetrics.begin (), groupMetrics.end (), names[n]) == groupMetrics.end ()) {
+            groupMetrics.push_back (names[n]);
+          }
+          groups[key][names[n]].Add (value);
+        }
+        continue;
+      }
+
+      std::cout << files[f] << ":" << index;
+      for (size_t p = 0; p < run.parameters.size (); p++) {
+        std::cout << " " << run.parameters[p].first << "=" << run.parameters[p].second;
+      }
+      for (size_t n = 0; n < names.size (); n++) {
+        double value;
+        if (run.GetMetric (names[n], &value)) std::cout << " " << names[n] << "=" << value;
+      }
+      std::cout << "\n";
+      if (series.empty ()) continue;
+
+      std::vector<std::pair<int64_t, double> > points;
+      if (!run.GetSeries (series, &points)) {
+        std::cout << "  no series " << series << "\n";
+      } else if (dump) {
+        for (size_t p = 0; p < points.size (); p++) {
+          std::cout << "  " << points[p].first * 1e-9 << " " << points[p].second << "\n";
+        }
+      } else {
+        ResultsAggregate aggregate;
+        for (size_t p = 0; p < points.size (); p++) aggregate.Add (points[p].second);
+        std::cout << "  " << series << ": " << points.size () << " points, mean "
+                  << (points.empty () ? 0 : aggregate.sum / points.size ()) << ", max " << aggregate.max
+                  << ", last " << (points.empty () ? 0 : points.back ().second) << "\n";
+      }
+    }
+  }
+
+  std::map<std::string, std::map<std::string, ResultsAggregate> >::iterator g;
+  for (g = groups.begin (); g != groups.end (); g++) {
+    uint64_t runs = 0;
+    for (std::map<std::string, ResultsAggregate>::iterator a = g->second.begin (); a != g->second.end (); a++) {
+      runs = std::max (runs, a->second.runs);
+    }
+    std::cout << group << "=" << g->first << " runs=" << runs;
+    for (size_t n = 0; n < groupMetrics.size (); n++) {
+      if (g->second.count (groupMetrics[n]) == 0) continue;
+      const ResultsAggregate& aggregate = g->second[groupMetrics[n]];
+      std::cout << " " << groupMetrics[n] << "=" << aggregate.sum / aggregate.runs
+                << "[" << aggregate.min << "," << aggregate.max << "]";
+    }
+    std::cout << "\n";
+  }
+  std::cerr << matched << " of " << read << " runs matched\n";
+  return 0;
+}
@@ -0,0 +1,399 @@
+/**
+ *  Compact binary store of the results of networkTree runs: a summary per run (its parameters
+ *  and final metrics) and the time series sampled while it ran (queue depth, RTT quantiles,
+ *  link utilisation...), so thousands of runs can be filtered and aggregated without parsing
+ *  logs. Used by networkTree.cc to write and by resultsQuery.cc to read, and only needs the
+ *  standard library.
+ *
+ *  A results file is a sequence of run blocks, a run appends its block at the end so many runs
+ *  can share a file. A block is
+ *
+ *    "NTRS" magic, format version, length of the rest of the block       (3 x u32)
+ *    parameters: count, then name and value strings                      (u32, strings)
+ *    metrics: count, then name strings, then the values                  (u32, strings, f64s)
+ *    series: count, then for each one its name, its number of points,
+ *            the length of its data and the data                         (string, u32, u32, bytes)
+ *
+ *  Strings are a u32 length and the bytes, numbers are little endian. The summary comes first
+ *  and every series says how long it is, so a query only decompresses the columns it needs
+ *  and skips over the rest of a block. Each series is compressed the way Gorilla (Facebook's
+ *  time series store) does it: timestamps as delta of deltas, which is a single bit for a
+ *  series sampled at a fixed interval, and values XORed with the previous value, where slowly
+ *  changing values share most of their bits.
+ */
+#ifndef RESULTS_STORE_H
+#define RESULTS_STORE_H
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <string>
+#include <utility>
+#include <vector>
+
+static const uint32_t RESULTS_MAGIC = 0x5352544e; // "NTRS"
+static const uint32_t RESULTS_VERSION = 1;
+
+/**
+ *  Bits written most significant first into a byte vector.
+ */
+class ResultsBitWriter {
+public:
+  ResultsBitWriter () : m_bits (0) {}
+
+  void Write (uint64_t value, int bits) {
+    for (int bit = bits - 1; bit >= 0; bit--) {
+      if (m_bits % 8 == 0) m_bytes.push_back (0);
+      if ((value >> bit) & 1) m_bytes.back () |= 0x80 >> (m_bits % 8);
+      m_bits++;
+    }
+  }
+  const std::vector<uint8_t>& GetBytes () const { return m_bytes; }
+
+private:
+  std::vector<uint8_t> m_bytes;
+  uint64_t m_bits;
+};
+
+/**
+ *  Reads what ResultsBitWriter wrote, reading past the end gives zeros.
+ */
+class ResultsBitReader {
+public:
+  ResultsBitReader (const uint8_t* bytes, size_t size) : m_bytes (bytes), m_size (size), m_bit (0) {}
+
+  uint64_t Read (int bits) {
+    uint64_t value = 0;
+    for (int bit = 0; bit < bits; bit++, m_bit++) {
+      size_t byte = m_bit / 8;
+      value = (value << 1) | (byte < m_size ? (m_bytes[byte] >> (7 - m_bit % 8)) & 1 : 0);
+    }
+    return value;
+  }
+
+private:
+  const uint8_t* m_bytes;
+  size_t m_size;
+  uint64_t m_bit;
+};
+
+static inline uint64_t resultsDoubleBits (double value) {
+  uint64_t bits;
+  memcpy (&bits, &value, sizeof (bits));
+  return bits;
+}
+
+static inline double resultsBitsDouble (uint64_t bits) {
+  double value;
+  memcpy (&value, &bits, sizeof (value));
+  return value;
+}
+
+static inline int resultsLeadingZeros (uint64_t x) { return x == 0 ? 64 : __builtin_clzll (x); }
+static inline int resultsTrailingZeros (uint64_t x) { return x == 0 ? 64 : __builtin_ctzll (x); }
+
+/**
+ *  A time series being recorded: (timestamp in ns, value) points compressed as they come.
+ *
+ *  Timestamps: the first one in 64 bits, then the difference between consecutive deltas
+ *  '0' for 0, '10' + 7 bits, '110' + 9 bits, '1110' + 12 bits (two's complement) or '1111' +
+ *  64 bits. Values: the first one in 64 bits, then the XOR with the previous value, '0' if it
+ *  is 0, '10' + the meaningful bits if they fit in the previous leading/trailing zeros window,
+ *  otherwise '11' + 5 bits of leading zeros + 6 bits of length (0 for 64) + the meaningful bits.
+ */
+class ResultsSeries {
+public:
+  ResultsSeries (std::string name = "")
+    : m_name (name), m_count (0), m_time (0), m_delta (0), m_value (0), m_leading (-1), m_trailing (0) {}
+
+  void Add (int64_t time, double value) {
+    uint64_t bits = resultsDoubleBits (value);
+    if (m_count == 0) {
+      m_data.Write ((uint64_t) time, 64);
+      m_data.Write (bits, 64);
+    } else {
+      int64_t delta = time - m_time;
+      WriteDeltaOfDelta (delta - m_delta);
+      m_delta = delta;
+      WriteXor (bits ^ m_value);
+    }
+    m_time = time;
+    m_value = bits;
+    m_count++;
+  }
+
+  const std::string& GetName () const { return m_name; }
+  uint32_t GetCount () const { return m_count; }
+  const std::vector<uint8_t>& GetBytes () const { return m_data.GetBytes (); }
+
+  // Decode count points of a series compressed by Add ()
+  static void Decode (const uint8_t* bytes, size_t size, uint32_t count,
+                      std::vector<std::pair<int64_t, double> >* points) {
+    ResultsBitReader in (bytes, size);
+    points->clear ();
+    if (count == 0) return;
+    int64_t time = (int64_t) in.Read (64);
+    uint64_t value = in.Read (64);
+    int64_t delta = 0;
+    int leading = 0, length = 0;
+    points->push_back (std::make_pair (time, resultsBitsDouble (value)));
+    for (uint32_t point = 1; point < count; point++) {
+      delta += ReadDeltaOfDelta (in);
+      time += delta;
+      if (in.Read (1)) {
+        if (in.Read (1)) {
+          leading = (int) in.Read (5);
+          length = (int) in.Read (6);
+          if (length == 0) length = 64;
+        }
+        value ^= in.Read (length) << (64 - leading - length);
+      }
+      points->push_back (std::make_pair (time, resultsBitsDouble (value)));
+    }
+  }
+
+private:
+  void WriteDeltaOfDelta (int64_t dod) {
+    if (dod == 0) m_data.Write (0, 1);
+    else if (dod >= -64 && dod < 64) { m_data.Write (2, 2); m_data.Write ((uint64_t) dod, 7); }
+    else if (dod >= -256 && dod < 256) { m_data.Write (6, 3); m_data.Write ((uint64_t) dod, 9); }
+    else if (dod >= -2048 && dod < 2048) { m_data.Write (14, 4); m_data.Write ((uint64_t) dod, 12); }
+    else { m_data.Write (15, 4); m_data.Write ((uint64_t) dod, 64); }
+  }
+
+  static int64_t ReadDeltaOfDelta (ResultsBitReader& in) {
+    int bits;
+    if (in.Read (1) == 0) return 0;
+    else if (in.Read (1) == 0) bits = 7;
+    else if (in.Read (1) == 0) bits = 9;
+    else if (in.Read (1) == 0) bits = 12;
+    else return (int64_t) in.Read (64);
+    uint64_t raw = in.Read (bits);
+    return raw >> (bits - 1) ? (int64_t) (raw | (~(uint64_t) 0 << bits)) : (int64_t) raw;
+  }
+
+  void WriteXor (uint64_t x) {
+    if (x == 0) {
+      m_data.Write (0, 1);
+      return;
+    }
+    int leading = std::min (resultsLeadingZeros (x), 31);
+    int trailing = resultsTrailingZeros (x);
+    if (m_leading >= 0 && leading >= m_leading && trailing >= m_trailing) {
+      m_data.Write (2, 2);
+      int length = 64 - m_leading - m_trailing;
+      m_data.Write (x >> m_trailing, length);
+      return;
+    }
+    int length = 64 - leading - trailing;
+    m_data.Write (3, 2);
+    m_data.Write (leading, 5);
+    m_data.Write (length == 64 ? 0 : length, 6);
+    m_data.Write (x >> trailing, length);
+    m_leading = leading;
+    m_trailing = trailing;
+  }
+
+  std::string m_name;
+  ResultsBitWriter m_data;
+  uint32_t m_count;
+  int64_t m_time;
+  int64_t m_delta;
+  uint64_t m_value;
+  int m_leading;   // zeros window of the last XOR written in full, -1 before the first one
+  int m_trailing;
+};
+
+/**
+ *  Everything a run stores, built up while it runs and appended to a results file at the end.
+ */
+class ResultsWriter {
+public:
+  void SetParameter (std::string name, std::string value) { m_parameters.push_back (std::make_pair (name, value)); }
+  void SetMetric (std::string name, double value) { m_metrics.push_back (std::make_pair (name, value)); }
+
+  // Series name, created empty the first time, the pointer stays valid until Append ()
+  ResultsSeries* Series (std::string name) {
+    for (size_t s = 0; s < m_series.size (); s++) {
+      if (m_series[s].GetName () == name) return &m_series[s];
+    }
+    m_series.push_back (ResultsSeries (name));
+    return &m_series.back ();
+  }
+
+  // Append the block of this run to the file, false if it could not be written
+  bool Append (std::string path) const {
+    std::string block;
+    PutU32 (&block, m_parameters.size ());
+    for (size_t p = 0; p < m_parameters.size (); p++) {
+      PutString (&block, m_parameters[p].first);
+      PutString (&block, m_parameters[p].second);
+    }
+    PutU32 (&block, m_metrics.size ());
+    for (size_t m = 0; m < m_metrics.size (); m++) PutString (&block, m_metrics[m].first);
+    for (size_t m = 0; m < m_metrics.size (); m++) PutU64 (&block, resultsDoubleBits (m_metrics[m].second));
+    PutU32 (&block, m_series.size ());
+    for (size_t s = 0; s < m_series.size (); s++) {
+      const std::vector<uint8_t>& bytes = m_series[s].GetBytes ();
+      PutString (&block, m_series[s].GetName ());
+      PutU32 (&block, m_series[s].GetCount ());
+      PutU32 (&block, bytes.size ());
+      block.append (bytes.begin (), bytes.end ());
+    }
+
+    std::string header;
+    PutU32 (&header, RESULTS_MAGIC);
+    PutU32 (&header, RESULTS_VERSION);
+    PutU32 (&header, block.size ());
+    std::ofstream out (path.c_str (), std::ios::binary | std::ios::app);
+    out << header << block;
+    return out.good ();
+  }
+
+  static void PutU32 (std::string* out, uint32_t value) {
+    for (int byte = 0; byte < 4; byte++) out->push_back ((char) (value >> (8 * byte)));
+  }
+  static void PutU64 (std::string* out, uint64_t value) {
+    for (int byte = 0; byte < 8; byte++) out->push_back ((char) (value >> (8 * byte)));
+  }
+  static void PutString (std::string* out, const std::string& value) {
+    PutU32 (out, value.size ());
+    out->append (value);
+  }
+
+private:
+  std::vector<std::pair<std::string, std::string> > m_parameters;
+  std::vector<std::pair<std::string, double> > m_metrics;
+  std::deque<ResultsSeries> m_series; // a deque, so Series () pointers stay valid
+};
+
+/**
+ *  One run read back from a results file. The series stay compressed until GetSeries () is
+ *  asked for one of them.
+ */
+class ResultsRun {
+public:
+  std::vector<std::pair<std::string, std::string> > parameters;
+  std::vector<std::pair<std::string, double> > metrics;
+
+  struct SeriesData {
+    std::string name;
+    uint32_t count;
+    std::string bytes;
+  };
+  std::vector<SeriesData> series;
+
+  // Parameter or metric by name (metrics printed as numbers), false if the run has neither
+  bool Get (const std::string& name, std::string* value) const;
+  bool GetMetric (const std::string& name, double* value) const {
+    for (size_t m = 0; m < metrics.size (); m++) {
+      if (metrics[m].first == name) { *value = metrics[m].second; return true; }
+    }
+    return false;
+  }
+  bool GetSeries (const std::string& name, std::vector<std::pair<int64_t, double> >* points) const {
+    for (size_t s = 0; s < series.size (); s++) {
+      if (series[s].name != name) continue;
+      ResultsSeries::Decode ((const uint8_t*) series[s].bytes.data (), series[s].bytes.size (), series[s].count, points);
+      return true;
+    }
+    return false;
+  }
+};
+
+inline bool ResultsRun::Get (const std::string& name, std::string* value) const {
+  for (size_t p = 0; p < parameters.size (); p++) {
+    if (parameters[p].first == name) { *value = parameters[p].second; return true; }
+  }
+  double metric;
+  if (!GetMetric (name, &metric)) return false;
+  char text[32];
+  snprintf (text, sizeof (text), "%.17g", metric);
+  *value = text;
+  return true;
+}
+
+/**
+ *  Reads the run blocks of a results file one after the other.
+ */
+class ResultsReader {
+public:
+  ResultsReader (std::string path) : m_in (path.c_str (), std::ios::binary) {}
+  bool IsOpen () const { return m_in.is_open (); }
+
+  // Next run of the file, false at the end (or on a damaged block). The compressed series are
+  // only kept if withSeries is set, otherwise they are skipped over.
+  bool Next (ResultsRun* run, bool withSeries) {
+    uint32_t magic, version, length;
+    if (!GetU32 (&magic) || !GetU32 (&version) || !GetU32 (&length)) return false;
+    if (magic != RESULTS_MAGIC || version != RESULTS_VERSION) return false;
+    m_end = m_in.tellg () + (std::streamoff) length;
+
+    run->parameters.clear ();
+    run->metrics.clear ();
+    run->series.clear ();
+    uint32_t count;
+    if (!GetU32 (&count)) return false;
+    for (uint32_t p = 0; p < count; p++) {
+      std::string name, value;
+      if (!GetString (&name) || !GetString (&value)) return false;
+      run->parameters.push_back (std::make_pair (name, value));
+    }
+    if (!GetU32 (&count)) return false;
+    for (uint32_t m = 0; m < count; m++) {
+      std::string name;
+      if (!GetString (&name)) return false;
+      run->metrics.push_back (std::make_pair (name, 0.0));
+    }
+    for (uint32_t m = 0; m < count; m++) {
+      unsigned char bytes[8];
+      if (!Fits (8) || !m_in.read ((char*) bytes, 8)) return false;
+      uint64_t bits = 0;
+      for (int byte = 7; byte >= 0; byte--) bits = (bits << 8) | bytes[byte];
+      run->metrics[m].second = resultsBitsDouble (bits);
+    }
+    if (!GetU32 (&count)) return false;
+    for (uint32_t s = 0; s < count; s++) {
+      ResultsRun::SeriesData series;
+      uint32_t size;
+      if (!GetString (&series.name) || !GetU32 (&series.count) || !GetU32 (&size) || !Fits (size)) return false;
+      // Skipped over without reading them unless they are wanted
+      if (withSeries) {
+        series.bytes.resize (size);
+        if (size > 0 && !m_in.read (&series.bytes[0], size)) return false;
+      } else {
+        m_in.seekg (size, std::ios::cur);
+      }
+      run->series.push_back (series);
+    }
+    m_in.seekg (m_end);
+    return (bool) m_in;
+  }
+
+private:
+  bool GetU32 (uint32_t* value) {
+    unsigned char bytes[4];
+    if (!m_in.read ((char*) bytes, 4)) return false;
+    *value = bytes[0] | (bytes[1] << 8) | (bytes[2] << 16) | ((uint32_t) bytes[3] << 24);
+    return true;
+  }
+  // Whether size more bytes are still in the run being read, so a damaged length is not followed
+  bool Fits (uint32_t size) {
+    std::streampos at = m_in.tellg ();
+    return at != std::streampos (-1) && at + (std::streamoff) size <= m_end;
+  }
+  bool GetString (std::string* value) {
+    uint32_t size;
+    if (!GetU32 (&size) || !Fits (size)) return false;
+    value->resize (size);
+    return size == 0 || (bool) m_in.read (&(*value)[0], size);
+  }
+
+  std::ifstream m_in;
+  std::streampos m_end;   // end of the run being read
+};
+
+#endif /* RESULTS_STORE_H */